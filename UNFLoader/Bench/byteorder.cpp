@@ -0,0 +1,107 @@
+/***************************************************************
+                      Bench/byteorder.cpp
+
+Compares the speed of the byteswap kernels on a 64MB ROM image.
+Build and run it with "make bench".
+***************************************************************/
+
+#include "../byteorder.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+
+/*********************************
+              Macros
+*********************************/
+
+#define BENCH_SIZE   (64*1024*1024)
+#define BENCH_PASSES 8
+
+
+/*==============================
+    bench_kernel
+    Times a byteswap function, and checks
+    that it gives the same result as the
+    scalar version
+    @param  The function to time
+    @param  The buffer to swap
+    @param  The expected result after one swap
+    @return The throughput in MB/s
+==============================*/
+
+static double bench_kernel(ByteSwapFunc func, byte* data, const byte* expected)
+{
+    std::chrono::steady_clock::time_point start;
+    double seconds;
+
+    // Check the kernel is correct first
+    func(data, BENCH_SIZE);
+    if (memcmp(data, expected, BENCH_SIZE) != 0)
+        return -1;
+    func(data, BENCH_SIZE);
+
+    // Time it
+    start = std::chrono::steady_clock::now();
+    for (int i=0; i<BENCH_PASSES; i++)
+        func(data, BENCH_SIZE);
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return (((double)BENCH_SIZE)*BENCH_PASSES/(1024.0*1024.0))/seconds;
+}
+
+
+/*==============================
+    main
+    Runs the benchmark
+==============================*/
+
+int main()
+{
+    uint32_t count;
+    const ByteSwapKernel* kernels = byteorder_getkernels(&count);
+    byte* data = (byte*) malloc(BENCH_SIZE);
+    byte* expected16 = (byte*) malloc(BENCH_SIZE);
+    byte* expected32 = (byte*) malloc(BENCH_SIZE);
+    if (data == NULL || expected16 == NULL || expected32 == NULL)
+    {
+        printf("Unable to allocate memory.\n");
+        return 1;
+    }
+
+    // Generate the test image and what it should look like after swapping
+    srand(64);
+    for (uint32_t i=0; i<BENCH_SIZE; i++)
+        data[i] = (byte)rand();
+    memcpy(expected16, data, BENCH_SIZE);
+    memcpy(expected32, data, BENCH_SIZE);
+    kernels[0].swap16(expected16, BENCH_SIZE);
+    kernels[0].swap32(expected32, BENCH_SIZE);
+
+    // Time every kernel the CPU supports
+    printf("Swapping %d MB images, best kernel is %s.\n", BENCH_SIZE/(1024*1024), byteorder_getbestkernel()->name);
+    printf("%-8s %12s %12s\n", "Kernel", "v64 (MB/s)", "n64 (MB/s)");
+    for (uint32_t i=0; i<count; i++)
+    {
+        double speed16, speed32;
+        if (!kernels[i].supported)
+        {
+            printf("%-8s %12s %12s\n", kernels[i].name, "n/a", "n/a");
+            continue;
+        }
+        speed16 = bench_kernel(kernels[i].swap16, data, expected16);
+        speed32 = bench_kernel(kernels[i].swap32, data, expected32);
+        if (speed16 < 0 || speed32 < 0)
+        {
+            printf("%-8s produced the wrong result!\n", kernels[i].name);
+            return 1;
+        }
+        printf("%-8s %12.0lf %12.0lf\n", kernels[i].name, speed16, speed32);
+    }
+
+    // Cleanup
+    free(data);
+    free(expected16);
+    free(expected32);
+    return 0;
+}
@@ -0,0 +1,455 @@
+/***************************************************************
+                          autotune.cpp
+
+Picks the USB settings that move data to a cart the fastest.
+The FTDI latency timer, the USB transfer size and the size of
+the chunks that ROMs are sent in are tried one after the other,
+by writing a test pattern to the cart's SDRAM and timing it.
+The winning settings are kept in a small text file, one line
+per cart and computer, so that this only needs doing once.
+***************************************************************/
+
+#include "autotune.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef LINUX
+    #include <windows.h>
+#else
+    #include <unistd.h>
+#endif
+#include <chrono>
+#include <string>
+#include <vector>
+
+
+/*********************************
+              Macros
+*********************************/
+
+#define PROFILE_HEADER "UNFLoader tuning 1"
+
+#define PROBE_SIZE     (4*1024*1024)
+#define PROBE_READSIZE (256*1024)
+#define PROBE_REPEATS  2
+#define PROBE_CHUNK    (1024*1024) // What to measure with until the chunk size is tuned
+#define PROBE_MARGIN   0.05        // How much faster a setting must be to replace the current one
+
+
+/*********************************
+        Function Prototypes
+*********************************/
+
+static DeviceError autotune_pick(CartDevice* cart, const TuneTarget* target, uint32_t* setting, const uint32_t* candidates, uint32_t count, byte* buff, uint64_t* besttime);
+static DeviceError autotune_measure(CartDevice* cart, const TuneTarget* target, byte* buff, uint64_t* time);
+static bool        autotune_parsesize(const char* value, uint32_t* size);
+static void        autotune_gethost(char* host, size_t size);
+static bool        autotune_readline(const char* line, char* host, CartType* carttype, USBTuning* tuning, char* identity);
+
+
+/*********************************
+             Globals
+*********************************/
+
+static const uint32_t local_latencies[] = {16, 8, 4, 2};
+static const uint32_t local_transfersizes[] = {4096, 16384, 65536};
+static const uint32_t local_chunksizes[] = {32*1024, 128*1024, 512*1024, 1024*1024, 2*1024*1024, 4*1024*1024};
+
+
+/*==============================
+    autotune_run
+    Tries different USB settings on a cart,
+    and leaves it using the fastest ones.
+    This overwrites the start of the cart's
+    SDRAM.
+    @param  A pointer to the cart context
+    @param  The functions to talk to the cart with
+    @return The device error, or OK
+==============================*/
+
+DeviceError autotune_run(CartDevice* cart, const TuneTarget* target)
+{
+    DeviceError err;
+    uint64_t besttime;
+    uint32_t seed = 0x1234567;
+    byte* buff = (byte*) malloc(PROBE_SIZE);
+    if (buff == NULL)
+        return DEVICEERR_MALLOCFAIL;
+
+    // Fill the test pattern with noise, so nothing along the way can compress it
+    for (uint32_t i=0; i<PROBE_SIZE; i++)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        buff[i] = (byte)seed;
+    }
+
+    // Measure the current settings. Carts that pick the chunk size themselves are measured with a fixed one
+    if (cart->tuning.romchunk == 0)
+        cart->tuning.romchunk = PROBE_CHUNK;
+    err = target->apply(cart);
+    if (err == DEVICEERR_OK)
+        err = autotune_measure(cart, target, buff, &besttime);
+
+    // Then tune each setting in turn, keeping the best of the previous ones
+    if (err == DEVICEERR_OK)
+        err = autotune_pick(cart, target, &cart->tuning.latency, local_latencies, sizeof(local_latencies)/sizeof(local_latencies[0]), buff, &besttime);
+    if (err == DEVICEERR_OK)
+        err = autotune_pick(cart, target, &cart->tuning.transfersize, local_transfersizes, sizeof(local_transfersizes)/sizeof(local_transfersizes[0]), buff, &besttime);
+    if (err == DEVICEERR_OK)
+        err = autotune_pick(cart, target, &cart->tuning.romchunk, local_chunksizes, sizeof(local_chunksizes)/sizeof(local_chunksizes[0]), buff, &besttime);
+
+    // Carts that split debug data into several writes use the best write size found for uploads
+    if (err == DEVICEERR_OK && cart->tuning.datachunk != 0)
+        cart->tuning.datachunk = cart->tuning.romchunk;
+    free(buff);
+    return err;
+}
+
+
+/*==============================
+    autotune_pick
+    Tries every value of a setting, and keeps
+    the fastest one
+    @param  A pointer to the cart context
+    @param  The functions to talk to the cart with
+    @param  A pointer to the setting to tune
+    @param  The values to try
+    @param  The number of values to try
+    @param  The test pattern
+    @param  A pointer to the time taken with
+            the current settings, which is
+            updated if a faster value is found
+    @return The device error, or OK
+==============================*/
+
+static DeviceError autotune_pick(CartDevice* cart, const TuneTarget* target, uint32_t* setting, const uint32_t* candidates, uint32_t count, byte* buff, uint64_t* besttime)
+{
+    DeviceError err;
+    uint32_t best = *setting;
+    for (uint32_t i=0; i<count; i++)
+    {
+        uint64_t time;
+        if (candidates[i] == best)
+            continue;
+        *setting = candidates[i];
+        err = target->apply(cart);
+        if (err == DEVICEERR_OK)
+            err = autotune_measure(cart, target, buff, &time);
+        if (err != DEVICEERR_OK)
+        {
+            *setting = best;
+            return err;
+        }
+        if (time < (*besttime)*(1.0 - PROBE_MARGIN))
+        {
+            best = candidates[i];
+            *besttime = time;
+        }
+    }
+    *setting = best;
+    return target->apply(cart);
+}
+
+
+/*==============================
+    autotune_measure
+    Times how long it takes to write the test
+    pattern to the cart, and to read part of
+    it back if the cart can do that
+    @param  A pointer to the cart context
+    @param  The functions to talk to the cart with
+    @param  The test pattern
+    @param  A pointer to store the best time of
+            a few tries in, in microseconds
+    @return The device error, or OK
+==============================*/
+
+static DeviceError autotune_measure(CartDevice* cart, const TuneTarget* target, byte* buff, uint64_t* time)
+{
+    std::vector<byte> readback(target->readram != NULL ? PROBE_READSIZE : 0);
+    *time = UINT64_MAX;
+    for (int i=0; i<PROBE_REPEATS; i++)
+    {
+        DeviceError err;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        uint64_t elapsed;
+        for (uint32_t offset=0; offset<PROBE_SIZE; offset+=cart->tuning.romchunk)
+        {
+            uint32_t size = PROBE_SIZE - offset;
+            if (size > cart->tuning.romchunk)
+                size = cart->tuning.romchunk;
+            err = target->writeram(cart, offset, buff+offset, size);
+            if (err != DEVICEERR_OK)
+                return err;
+        }
+        if (target->readram != NULL)
+        {
+            err = target->readram(cart, 0, PROBE_READSIZE, readback.data());
+            if (err != DEVICEERR_OK)
+                return err;
+        }
+        elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        if (elapsed < *time)
+            *time = elapsed;
+    }
+    return DEVICEERR_OK;
+}
+
+
+/*==============================
+    autotune_parse
+    Reads USB settings given by the user, as
+    a comma separated list of key=value pairs.
+    Settings that are not given are left as 0.
+    @param  The settings string
+    @param  A pointer to store the settings in
+    @return Whether the string was valid
+==============================*/
+
+bool autotune_parse(const char* spec, USBTuning* tuning)
+{
+    std::string list = spec;
+    size_t start = 0;
+
+    memset(tuning, 0, sizeof(USBTuning));
+    while (start <= list.length())
+    {
+        size_t end = list.find(',', start);
+        std::string entry = list.substr(start, end == std::string::npos ? std::string::npos : end-start);
+        size_t equals = entry.find('=');
+        std::string key = entry.substr(0, equals);
+        uint32_t value;
+
+        if (equals == std::string::npos || !autotune_parsesize(entry.c_str() + equals + 1, &value))
+            return false;
+        if (key == "latency" && value >= 1 && value <= 255)
+            tuning->latency = value;
+        else if (key == "transfer" && value >= 64 && value <= 64*1024 && value%64 == 0)
+            tuning->transfersize = value;
+        else if (key == "chunk" && value >= 512 && value%512 == 0)
+            tuning->romchunk = value;
+        else if (key == "datachunk" && value > 0)
+            tuning->datachunk = value;
+        else
+            return false;
+
+        if (end == std::string::npos)
+            break;
+        start = end+1;
+    }
+    return true;
+}
+
+
+/*==============================
+    autotune_parsesize
+    Reads a number, which can end in K or M
+    @param  The string to read
+    @param  A pointer to store the number in
+    @return Whether the string was valid
+==============================*/
+
+static bool autotune_parsesize(const char* value, uint32_t* size)
+{
+    char* end;
+    unsigned long number = strtoul(value, &end, 10);
+    if (end == value)
+        return false;
+    if (*end == 'K' || *end == 'k')
+    {
+        number *= 1024;
+        end++;
+    }
+    else if (*end == 'M' || *end == 'm')
+    {
+        number *= 1024*1024;
+        end++;
+    }
+    if (*end != '\0' || number > UINT32_MAX)
+        return false;
+    *size = (uint32_t)number;
+    return true;
+}
+
+
+/*==============================
+    autotune_getprofilepath
+    Gets where the tuning profiles are kept
+    @param  The buffer to store the path in
+    @param  The size of the buffer
+    @return Whether there is somewhere to
+            keep them
+==============================*/
+
+bool autotune_getprofilepath(char* path, size_t size)
+{
+    #ifndef LINUX
+        const char* dir = getenv("APPDATA");
+        if (dir == NULL || dir[0] == '\0')
+            return false;
+        snprintf(path, size, "%s\\UNFLoader_tuning.txt", dir);
+    #else
+        const char* dir = getenv("HOME");
+        if (dir == NULL || dir[0] == '\0')
+            return false;
+        snprintf(path, size, "%s/.unfloader_tuning", dir);
+    #endif
+    return true;
+}
+
+
+/*==============================
+    autotune_load
+    Finds the profile for a cart on this
+    computer
+    @param  The path of the profile file
+    @param  A pointer to the cart context
+    @param  A pointer to store the settings in
+    @return Whether a profile was found
+==============================*/
+
+bool autotune_load(const char* path, CartDevice* cart, USBTuning* tuning)
+{
+    char line[256];
+    char host[64];
+    char thishost[64];
+    char identity[64];
+    CartType carttype;
+    bool found = false;
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL)
+        return false;
+
+    // Check it's a profile file
+    if (fgets(line, sizeof(line), fp) == NULL || strncmp(line, PROFILE_HEADER, strlen(PROFILE_HEADER)) != 0)
+    {
+        fclose(fp);
+        return false;
+    }
+
+    // Look for this cart
+    autotune_gethost(thishost, sizeof(thishost));
+    while (!found && fgets(line, sizeof(line), fp) != NULL)
+        if (autotune_readline(line, host, &carttype, tuning, identity))
+            found = carttype == cart->carttype && !strcmp(host, thishost) && !strcmp(identity, cart->identity);
+    fclose(fp);
+    return found;
+}
+
+
+/*==============================
+    autotune_save
+    Stores a cart's current settings in the
+    profile file, replacing the ones it had
+    @param  The path of the profile file
+    @param  A pointer to the cart context
+    @return Whether the profile was written
+==============================*/
+
+bool autotune_save(const char* path, CartDevice* cart)
+{
+    std::vector<std::string> others;
+    char line[256];
+    char host[64];
+    char thishost[64];
+    char identity[64];
+    CartType carttype;
+    USBTuning tuning;
+    FILE* fp;
+
+    // Keep the profiles of every other cart
+    autotune_gethost(thishost, sizeof(thishost));
+    fp = fopen(path, "r");
+    if (fp != NULL)
+    {
+        if (fgets(line, sizeof(line), fp) != NULL && strncmp(line, PROFILE_HEADER, strlen(PROFILE_HEADER)) == 0)
+            while (fgets(line, sizeof(line), fp) != NULL)
+                if (autotune_readline(line, host, &carttype, &tuning, identity))
+                    if (carttype != cart->carttype || strcmp(host, thishost) || strcmp(identity, cart->identity))
+                        others.push_back(line);
+        fclose(fp);
+    }
+
+    // Rewrite the file with this cart at the end
+    fp = fopen(path, "w");
+    if (fp == NULL)
+        return false;
+    fprintf(fp, "%s\n", PROFILE_HEADER);
+    for (size_t i=0; i<others.size(); i++)
+        fputs(others[i].c_str(), fp);
+    fprintf(fp, "%s %d %u %u %u %u %s\n", thishost, (int)cart->carttype, cart->tuning.latency, cart->tuning.transfersize,
+            cart->tuning.romchunk, cart->tuning.datachunk, cart->identity);
+    if (ferror(fp))
+    {
+        fclose(fp);
+        return false;
+    }
+    return fclose(fp) == 0;
+}
+
+
+/*==============================
+    autotune_readline
+    Reads a profile line, which looks like
+    "host cart latency transfer chunk
+    datachunk identity"
+    @param  The line to read
+    @param  A buffer of 64 bytes to store the
+            computer's name in
+    @param  A pointer to store the cart type in
+    @param  A pointer to store the settings in
+    @param  A buffer of 64 bytes to store the
+            cart's identity in
+    @return Whether the line was valid
+==============================*/
+
+static bool autotune_readline(const char* line, char* host, CartType* carttype, USBTuning* tuning, char* identity)
+{
+    int type;
+    int pos = 0;
+    size_t len;
+    if (sscanf(line, "%63s %d %u %u %u %u %n", host, &type, &tuning->latency, &tuning->transfersize, &tuning->romchunk, &tuning->datachunk, &pos) < 6 || pos == 0)
+        return false;
+    if (tuning->latency == 0 || tuning->transfersize == 0 || tuning->romchunk == 0)
+        return false;
+    *carttype = (CartType)type;
+
+    // The identity is the rest of the line, and can have spaces in it
+    len = strcspn(line+pos, "\r\n");
+    if (len >= 64)
+        return false;
+    memcpy(identity, line+pos, len);
+    identity[len] = '\0';
+    return true;
+}
+
+
+/*==============================
+    autotune_gethost
+    Gets the name of this computer, as the
+    best settings depend on its USB ports
+    @param  The buffer to store the name in
+    @param  The size of the buffer
+==============================*/
+
+static void autotune_gethost(char* host, size_t size)
+{
+    #ifndef LINUX
+        DWORD len = (DWORD)size;
+        if (!GetComputerNameA(host, &len))
+            snprintf(host, size, "unknown");
+    #else
+        if (gethostname(host, size) != 0)
+            snprintf(host, size, "unknown");
+        host[size-1] = '\0';
+    #endif
+
+    // Profile lines are split by spaces
+    for (size_t i=0; host[i] != '\0'; i++)
+        if (host[i] == ' ')
+            host[i] = '_';
+    if (host[0] == '\0')
+        snprintf(host, size, "unknown");
+}
@@ -0,0 +1,28 @@
+#ifndef __AUTOTUNE_HEADER
+#define __AUTOTUNE_HEADER
+
+    #include "device.h"
+
+
+    /*********************************
+                 Typedefs
+    *********************************/
+
+    typedef struct {
+        DeviceError (*apply)(CartDevice* cart);
+        DeviceError (*writeram)(CartDevice* cart, uint32_t offset, byte* data, uint32_t size);
+        DeviceError (*readram)(CartDevice* cart, uint32_t offset, uint32_t size, byte* buff);
+    } TuneTarget;
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    DeviceError autotune_run(CartDevice* cart, const TuneTarget* target);
+    bool        autotune_parse(const char* spec, USBTuning* tuning);
+    bool        autotune_getprofilepath(char* path, size_t size);
+    bool        autotune_load(const char* path, CartDevice* cart, USBTuning* tuning);
+    bool        autotune_save(const char* path, CartDevice* cart);
+
+#endif
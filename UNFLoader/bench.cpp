@@ -0,0 +1,494 @@
+/***************************************************************
+                            bench.cpp
+
+Benchmark mode. Runs a fixed set of workloads against the first
+flashcart that is found: ROM uploads of a few sizes, bursts of
+debug data from 4 bytes to 8MB, and floods of small text
+packets coming from the console. Each workload is reported on a
+single line of key=value pairs, with the throughput, latency
+percentiles, D2XX calls and CPU time it took, so that runs can
+be compared. Only virtual carts can be asked to send data from
+the console, so the receive workloads are skipped on hardware.
+***************************************************************/
+
+#include "main.h"
+#include "helper.h"
+#include "term.h"
+#include "device.h"
+#include "debug.h"
+#include "bench.h"
+#include "packetpool.h"
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#ifdef LINUX
+    #include <sys/resource.h>
+#endif
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+
+
+/*********************************
+              Macros
+*********************************/
+
+#define UPLOAD_REPEATS  3
+#define SEND_TOTAL      (16*1024*1024) // Roughly how much data each burst size sends in total
+#define SEND_MINREPEATS 3
+#define SEND_MAXREPEATS 200
+#define PACKET_SIZE     32
+#define FLOOD_PACKETS   2000
+#define PING_PACKETS    100
+#define PING_MAXDELAY   20    // In milliseconds
+#define RECEIVE_TIMEOUT 30000 // In milliseconds
+#define SETTLE_POLLS    5
+
+
+/*********************************
+            Structures
+*********************************/
+
+typedef struct {
+    std::chrono::steady_clock::time_point time;
+    uint64_t cputime;
+    USBStats usb;
+} BenchMark;
+
+
+/*********************************
+        Function Prototypes
+*********************************/
+
+static void     bench_upload(uint32_t size);
+static void     bench_send(uint32_t size);
+static void     bench_receive(const char* workload, uint32_t count, uint32_t maxdelay);
+static void     bench_inject(std::vector<std::chrono::steady_clock::time_point>* sent, uint32_t maxdelay);
+static bool     bench_drain();
+static void     bench_settle();
+static void     bench_mark(BenchMark* mark);
+static void     bench_report(const char* workload, uint32_t size, uint32_t count, uint64_t bytes, BenchMark* start, std::vector<uint64_t>* latencies);
+static uint64_t bench_percentile(std::vector<uint64_t>* sorted, uint32_t percent);
+static uint64_t bench_cputime();
+static uint64_t bench_elapsed(std::chrono::steady_clock::time_point start);
+static void     bench_print(const char* format, ...);
+
+
+/*********************************
+             Globals
+*********************************/
+
+static FILE* local_report = NULL;
+static char  local_rompath[512];
+
+static const uint32_t local_uploadsizes[] = {1*1024*1024, 8*1024*1024, 32*1024*1024};
+static const uint32_t local_sendsizes[] = {4, 64, 512, 4*1024, 64*1024, 512*1024, 1024*1024, 8*1024*1024};
+
+
+/*==============================
+    bench_main
+    Runs every benchmark on the first
+    flashcart that is found
+    @param The file to also write the report
+           to, or NULL
+==============================*/
+
+void bench_main(const char* reportpath)
+{
+    USBTuning tuning;
+
+    // Find and open the flashcart
+    if (device_getcart() == CART_NONE)
+        log_simple("Attempting flashcart autodetection\n");
+    handle_deviceerror(device_find());
+    handle_deviceerror(device_open());
+    if (reportpath != NULL)
+    {
+        local_report = fopen(reportpath, "w");
+        if (local_report == NULL)
+            terminate("Unable to open report file '%s'.", reportpath);
+    }
+    if (device_needstuning())
+    {
+        log_simple("Tuning the USB connection.\n");
+        handle_deviceerror(device_autotune());
+    }
+    device_gettuning(&tuning);
+    log_simple("Benchmarking the %s%s.\n", cart_typetostr(device_getcart()), device_isvirtual() ? " (virtual)" : "");
+    bench_print("bench cart=%d name=\"%s\" virtual=%d\n", (int)device_getcart(), cart_typetostr(device_getcart()), (int)device_isvirtual());
+    bench_print("tuning latency=%u transfer=%u romchunk=%u datachunk=%u\n", tuning.latency, tuning.transfersize, tuning.romchunk, tuning.datachunk);
+
+    // The ROMs are generated in a temporary file
+    #ifndef LINUX
+        char tempdir[MAX_PATH];
+        GetTempPathA(MAX_PATH, tempdir);
+        snprintf(local_rompath, sizeof(local_rompath), "%sunfloader-bench.z64", tempdir);
+    #else
+        snprintf(local_rompath, sizeof(local_rompath), "/tmp/unfloader-bench-%d.z64", (int)getpid());
+    #endif
+
+    // Run the workloads
+    for (uint32_t i=0; i<sizeof(local_uploadsizes)/sizeof(local_uploadsizes[0]); i++)
+        if (local_uploadsizes[i] <= device_getmaxromsize())
+            bench_upload(local_uploadsizes[i]);
+    for (uint32_t i=0; i<sizeof(local_sendsizes)/sizeof(local_sendsizes[0]); i++)
+        bench_send(local_sendsizes[i]);
+    bench_receive("flood", FLOOD_PACKETS, 0);
+    bench_receive("ping", PING_PACKETS, PING_MAXDELAY);
+
+    // Cleanup
+    device_setromimage(NULL);
+    remove(local_rompath);
+    if (local_report != NULL)
+        fclose(local_report);
+    handle_deviceerror(device_close());
+    log_simple("\nUSB connection closed.\n");
+}
+
+
+/*==============================
+    bench_upload
+    Uploads a generated ROM a few times
+    @param The size of the ROM
+==============================*/
+
+static void bench_upload(uint32_t size)
+{
+    FILE* fp;
+    uint32_t seed = size;
+    std::vector<byte> block(1024*1024);
+    std::vector<uint64_t> latencies;
+    BenchMark start;
+
+    // Write a ROM with a valid header, followed by noise
+    fp = fopen(local_rompath, "wb");
+    if (fp == NULL)
+        terminate("Unable to create '%s'.", local_rompath);
+    for (uint32_t done=0; done<size; done+=block.size())
+    {
+        for (uint32_t i=0; i<block.size(); i++)
+        {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            block[i] = (byte)seed;
+        }
+        if (done == 0)
+        {
+            block[0] = 0x80;
+            block[1] = 0x37;
+            block[2] = 0x12;
+            block[3] = 0x40;
+        }
+        fwrite(block.data(), 1, std::min((uint32_t)block.size(), size-done), fp);
+    }
+    fclose(fp);
+    if (!device_setrom(local_rompath))
+        terminate("Unable to open file '%s'.", local_rompath);
+    handle_deviceerror(device_loadrom());
+    device_explicitcic();
+
+    // Upload the whole thing every time
+    bench_mark(&start);
+    for (uint32_t i=0; i<UPLOAD_REPEATS; i++)
+    {
+        std::chrono::steady_clock::time_point time = std::chrono::steady_clock::now();
+        device_forcefullupload();
+        handle_deviceerror(device_sendrom());
+        latencies.push_back(bench_elapsed(time));
+    }
+    bench_report("upload", size, UPLOAD_REPEATS, (uint64_t)device_rompadding(size)*UPLOAD_REPEATS, &start, &latencies);
+
+    // The console boots the ROM, so wait for it to say hello
+    bench_settle();
+}
+
+
+/*==============================
+    bench_send
+    Sends bursts of debug data to the console
+    @param The size of each burst
+==============================*/
+
+static void bench_send(uint32_t size)
+{
+    std::vector<byte> data(size);
+    std::vector<uint64_t> latencies;
+    DataSegment segment;
+    uint32_t repeats = std::min(std::max(SEND_TOTAL/size, (uint32_t)SEND_MINREPEATS), (uint32_t)SEND_MAXREPEATS);
+    BenchMark start;
+
+    for (uint32_t i=0; i<size; i++)
+        data[i] = 'a' + i%26;
+    segment.data = data.data();
+    segment.size = size;
+    bench_mark(&start);
+    for (uint32_t i=0; i<repeats; i++)
+    {
+        std::chrono::steady_clock::time_point time = std::chrono::steady_clock::now();
+        handle_deviceerror(device_senddata(DATATYPE_RAWBINARY, &segment, 1));
+        latencies.push_back(bench_elapsed(time));
+    }
+    bench_report("send", size, repeats, (uint64_t)size*repeats, &start, &latencies);
+
+    // Throw away anything the console sent back
+    bench_settle();
+}
+
+
+/*==============================
+    bench_receive
+    Makes the console send small text packets,
+    and receives them the same way that debug
+    mode does
+    @param The name of the workload
+    @param The number of packets to send
+    @param The most time to wait between packets,
+           in milliseconds, or 0 to send them
+           all at once
+==============================*/
+
+static void bench_receive(const char* workload, uint32_t count, uint32_t maxdelay)
+{
+    std::vector<std::chrono::steady_clock::time_point> sent(count);
+    std::vector<uint64_t> latencies;
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    uint32_t received = 0;
+    std::thread injector;
+    BenchMark start;
+
+    if (!device_isvirtual())
+    {
+        bench_print("workload=%s skipped=not_virtual\n", workload);
+        return;
+    }
+
+    // The console sends from its own thread, while this one receives
+    bench_mark(&start);
+    injector = std::thread(bench_inject, &sent, maxdelay);
+    while (received < count && bench_elapsed(begin) < RECEIVE_TIMEOUT*1000ULL)
+    {
+        uint32_t header;
+        byte* buff;
+        do
+        {
+            handle_deviceerror(device_receivedata(&header, &buff));
+            if (buff == NULL)
+                continue;
+            if ((header >> 24) == DATATYPE_TEXT && (header & 0xFFFFFF) == PACKET_SIZE)
+            {
+                uint32_t index = strtoul((char*)buff, NULL, 10);
+                if (index < count)
+                {
+                    latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - sent[index]).count());
+                    received++;
+                }
+            }
+            packetpool_release(buff);
+        }
+        while (header != 0);
+        if (received < count)
+            handle_deviceerror(device_waitdata(DEBUG_WAIT_TIMEOUT));
+    }
+    injector.join();
+    bench_report(workload, PACKET_SIZE, received, (uint64_t)received*PACKET_SIZE, &start, &latencies);
+    if (received < count)
+        bench_print("workload=%s lost=%d\n", workload, count - received);
+}
+
+
+/*==============================
+    bench_inject
+    Makes the virtual console send numbered
+    text packets to the host
+    @param A vector to store the time each
+           packet was sent in
+    @param The most time to wait between packets,
+           in milliseconds
+==============================*/
+
+static void bench_inject(std::vector<std::chrono::steady_clock::time_point>* sent, uint32_t maxdelay)
+{
+    char packet[PACKET_SIZE];
+    uint32_t seed = 1;
+    for (uint32_t i=0; i<sent->size(); i++)
+    {
+        if (maxdelay > 0)
+        {
+            seed = seed*1103515245 + 12345;
+            std::this_thread::sleep_for(std::chrono::milliseconds((seed >> 16) % (maxdelay+1)));
+        }
+        memset(packet, 0, sizeof(packet));
+        snprintf(packet, sizeof(packet), "%08d benchmark packet", (int)i);
+        (*sent)[i] = std::chrono::steady_clock::now();
+        device_simulateconsole(DATATYPE_TEXT, (byte*)packet, sizeof(packet));
+    }
+}
+
+
+/*==============================
+    bench_drain
+    Receives everything the flashcart has
+    for us. Heartbeats are handled, so that
+    the protocol version stays in sync.
+    @return Whether anything was received
+==============================*/
+
+static bool bench_drain()
+{
+    bool received = false;
+    uint32_t header;
+    byte* buff;
+    do
+    {
+        handle_deviceerror(device_receivedata(&header, &buff));
+        if (buff == NULL)
+            continue;
+        if ((header >> 24) == DATATYPE_HEARTBEAT && (header & 0xFFFFFF) >= 4)
+            device_setprotocol((ProtocolVer)((buff[0] << 8) | buff[1]));
+        received = true;
+        packetpool_release(buff);
+    }
+    while (header != 0);
+    return received;
+}
+
+
+/*==============================
+    bench_settle
+    Receives until the flashcart has been
+    quiet for a few polls
+==============================*/
+
+static void bench_settle()
+{
+    for (uint32_t quiet=0; quiet<SETTLE_POLLS; quiet++)
+    {
+        if (bench_drain())
+            quiet = 0;
+        handle_deviceerror(device_waitdata(DEBUG_POLL_INTERVAL));
+    }
+}
+
+
+/*==============================
+    bench_mark
+    Takes a snapshot of the clocks and
+    the USB counters
+    @param A pointer to store the snapshot in
+==============================*/
+
+static void bench_mark(BenchMark* mark)
+{
+    mark->time = std::chrono::steady_clock::now();
+    mark->cputime = bench_cputime();
+    device_getusbstats(&mark->usb);
+}
+
+
+/*==============================
+    bench_report
+    Prints the results of a workload
+    @param The name of the workload
+    @param The size of each operation
+    @param The number of operations
+    @param The number of bytes moved
+    @param The snapshot from the start
+           of the workload
+    @param The latency of each operation,
+           in microseconds
+==============================*/
+
+static void bench_report(const char* workload, uint32_t size, uint32_t count, uint64_t bytes, BenchMark* start, std::vector<uint64_t>* latencies)
+{
+    BenchMark end;
+    uint64_t wall;
+    bench_mark(&end);
+    wall = std::chrono::duration_cast<std::chrono::microseconds>(end.time - start->time).count();
+    std::sort(latencies->begin(), latencies->end());
+    bench_print("workload=%s size=%u count=%u bytes=%llu wall_us=%llu mb_per_s=%.2f p50_us=%llu p99_us=%llu cpu_us=%llu ftdi_calls=%llu ftdi_reads=%llu ftdi_writes=%llu ftdi_polls=%llu\n",
+        workload, size, count, (unsigned long long)bytes, (unsigned long long)wall, wall > 0 ? ((double)bytes)/wall : 0.0,
+        (unsigned long long)bench_percentile(latencies, 50), (unsigned long long)bench_percentile(latencies, 99),
+        (unsigned long long)(end.cputime - start->cputime),
+        (unsigned long long)(end.usb.calls - start->usb.calls), (unsigned long long)(end.usb.reads - start->usb.reads),
+        (unsigned long long)(end.usb.writes - start->usb.writes), (unsigned long long)(end.usb.polls - start->usb.polls)
+    );
+}
+
+
+/*==============================
+    bench_percentile
+    Gets a percentile, using the nearest rank
+    @param  The sorted samples
+    @param  The percentile to get
+    @return The percentile, or 0 if there
+            are no samples
+==============================*/
+
+static uint64_t bench_percentile(std::vector<uint64_t>* sorted, uint32_t percent)
+{
+    size_t rank;
+    if (sorted->empty())
+        return 0;
+    rank = (sorted->size()*percent + 99)/100;
+    return (*sorted)[rank > 0 ? rank-1 : 0];
+}
+
+
+/*==============================
+    bench_cputime
+    Gets the CPU time used by the program
+    @return The user and kernel time,
+            in microseconds
+==============================*/
+
+static uint64_t bench_cputime()
+{
+    #ifndef LINUX
+        FILETIME creation, exit, kernel, user;
+        GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+        return ((((uint64_t)kernel.dwHighDateTime) << 32 | kernel.dwLowDateTime) + (((uint64_t)user.dwHighDateTime) << 32 | user.dwLowDateTime))/10;
+    #else
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)*1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+    #endif
+}
+
+
+/*==============================
+    bench_elapsed
+    Gets the time since a given point
+    @param  The starting point
+    @return The elapsed time, in microseconds
+==============================*/
+
+static uint64_t bench_elapsed(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+/*==============================
+    bench_print
+    Prints a line of the report, and writes
+    it to the report file if there is one
+    @param The format string
+    @param Variadic arguments to print
+==============================*/
+
+static void bench_print(const char* format, ...)
+{
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    log_simple("%s", line);
+    if (local_report != NULL)
+    {
+        fputs(line, local_report);
+        fflush(local_report);
+    }
+}
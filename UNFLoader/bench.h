@@ -0,0 +1,11 @@
+#ifndef __BENCH_HEADER
+#define __BENCH_HEADER
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    void bench_main(const char* reportpath);
+
+#endif
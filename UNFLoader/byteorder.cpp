@@ -0,0 +1,425 @@
+/***************************************************************
+                          byteorder.cpp
+
+Detects the byte order of a ROM image (z64, v64 or n64) and 
+converts it to big endian. The conversion picks the fastest 
+SIMD kernel that the CPU supports at runtime.
+***************************************************************/
+
+#include "byteorder.h"
+#include <string.h>
+#include <mutex>
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    #define BYTEORDER_X86
+    #include <immintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+        #define TARGET(x)
+    #else
+        #define TARGET(x) __attribute__((target(x)))
+    #endif
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+    #define BYTEORDER_NEON
+    #include <arm_neon.h>
+#endif
+
+
+/*********************************
+        Function Prototypes
+*********************************/
+
+static void byteorder_swap16_scalar(byte* data, uint32_t size);
+static void byteorder_swap32_scalar(byte* data, uint32_t size);
+#ifdef BYTEORDER_X86
+    static void byteorder_swap16_sse2(byte* data, uint32_t size);
+    static void byteorder_swap32_sse2(byte* data, uint32_t size);
+    static void byteorder_swap16_ssse3(byte* data, uint32_t size);
+    static void byteorder_swap32_ssse3(byte* data, uint32_t size);
+    static void byteorder_swap16_avx2(byte* data, uint32_t size);
+    static void byteorder_swap32_avx2(byte* data, uint32_t size);
+    static void byteorder_cpufeatures(bool* sse2, bool* ssse3, bool* avx2);
+#endif
+#ifdef BYTEORDER_NEON
+    static void byteorder_swap16_neon(byte* data, uint32_t size);
+    static void byteorder_swap32_neon(byte* data, uint32_t size);
+#endif
+static void byteorder_initialize();
+
+
+/*********************************
+             Globals
+*********************************/
+
+// Kernels, from slowest to fastest
+static ByteSwapKernel local_kernels[] = {
+    {"Scalar", true, &byteorder_swap16_scalar, &byteorder_swap32_scalar},
+    #ifdef BYTEORDER_X86
+        {"SSE2",  false, &byteorder_swap16_sse2,  &byteorder_swap32_sse2},
+        {"SSSE3", false, &byteorder_swap16_ssse3, &byteorder_swap32_ssse3},
+        {"AVX2",  false, &byteorder_swap16_avx2,  &byteorder_swap32_avx2},
+    #endif
+    #ifdef BYTEORDER_NEON
+        {"NEON",  true,  &byteorder_swap16_neon,  &byteorder_swap32_neon},
+    #endif
+};
+static const uint32_t local_kernelcount = sizeof(local_kernels)/sizeof(local_kernels[0]);
+static const ByteSwapKernel* local_bestkernel = NULL;
+static std::once_flag        local_initialized;
+
+
+/*==============================
+    byteorder_detect
+    Detects the byte order of a ROM from 
+    the first word of its header, which
+    always starts with 0x80
+    @param  The first 4 bytes of the ROM
+    @return The ROM's byte order
+==============================*/
+
+ByteOrder byteorder_detect(const byte* header)
+{
+    if (header[0] == 0x80)
+        return BYTEORDER_Z64;
+    if (header[1] == 0x80)
+        return BYTEORDER_V64;
+    if (header[3] == 0x80)
+        return BYTEORDER_N64;
+
+    // Not a recognizable header (could be homebrew), so send it as is
+    return BYTEORDER_Z64;
+}
+
+
+/*==============================
+    byteorder_normalize
+    Converts a block of ROM data to big
+    endian, in place. The block must start
+    at a 4 byte aligned offset in the ROM.
+    @param The byte order of the data
+    @param The data to convert
+    @param The size of the data
+==============================*/
+
+void byteorder_normalize(ByteOrder order, byte* data, uint32_t size)
+{
+    const ByteSwapKernel* kernel = byteorder_getbestkernel();
+    switch (order)
+    {
+        case BYTEORDER_V64: kernel->swap16(data, size); break;
+        case BYTEORDER_N64: kernel->swap32(data, size); break;
+        default: break;
+    }
+}
+
+
+/*==============================
+    byteorder_typetostr
+    Gets the name of a byte order
+    @param  The byte order
+    @return The name of the byte order
+==============================*/
+
+const char* byteorder_typetostr(ByteOrder order)
+{
+    switch (order)
+    {
+        case BYTEORDER_V64: return "v64";
+        case BYTEORDER_N64: return "n64";
+        default:            return "z64";
+    }
+}
+
+
+/*==============================
+    byteorder_getkernels
+    Gets the list of every byteswap kernel
+    built into the program
+    @param  A pointer to store the number
+            of kernels in
+    @return The list of kernels
+==============================*/
+
+const ByteSwapKernel* byteorder_getkernels(uint32_t* count)
+{
+    byteorder_initialize();
+    (*count) = local_kernelcount;
+    return local_kernels;
+}
+
+
+/*==============================
+    byteorder_getbestkernel
+    Gets the fastest byteswap kernel that
+    this CPU supports
+    @return The kernel
+==============================*/
+
+const ByteSwapKernel* byteorder_getbestkernel()
+{
+    byteorder_initialize();
+    return local_bestkernel;
+}
+
+
+/*==============================
+    byteorder_initialize
+    Checks which kernels the CPU supports.
+    Only does work the first time it's called,
+    and is safe to call from any thread.
+==============================*/
+
+static void byteorder_initialize()
+{
+    std::call_once(local_initialized, []() {
+        // Ask the CPU what it supports
+        #ifdef BYTEORDER_X86
+            byteorder_cpufeatures(&local_kernels[1].supported, &local_kernels[2].supported, &local_kernels[3].supported);
+        #endif
+
+        // Pick the fastest supported kernel
+        for (uint32_t i=0; i<local_kernelcount; i++)
+            if (local_kernels[i].supported)
+                local_bestkernel = &local_kernels[i];
+    });
+}
+
+
+/*==============================
+    byteorder_swap16_scalar
+    Swaps the bytes of every 16-bit word
+    @param The data to swap
+    @param The size of the data
+==============================*/
+
+static void byteorder_swap16_scalar(byte* data, uint32_t size)
+{
+    for (uint32_t i=0; i+1<size; i+=2)
+    {
+        byte temp = data[i];
+        data[i] = data[i+1];
+        data[i+1] = temp;
+    }
+}
+
+
+/*==============================
+    byteorder_swap32_scalar
+    Reverses the bytes of every 32-bit word
+    @param The data to swap
+    @param The size of the data
+==============================*/
+
+static void byteorder_swap32_scalar(byte* data, uint32_t size)
+{
+    for (uint32_t i=0; i+3<size; i+=4)
+    {
+        byte temp = data[i];
+        data[i] = data[i+3];
+        data[i+3] = temp;
+        temp = data[i+1];
+        data[i+1] = data[i+2];
+        data[i+2] = temp;
+    }
+}
+
+#ifdef BYTEORDER_X86
+
+/*==============================
+    byteorder_cpufeatures
+    Checks which x86 SIMD extensions the
+    CPU and OS support
+    @param A pointer to store SSE2 support in
+    @param A pointer to store SSSE3 support in
+    @param A pointer to store AVX2 support in
+==============================*/
+
+static void byteorder_cpufeatures(bool* sse2, bool* ssse3, bool* avx2)
+{
+    #ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 1);
+        (*sse2) = (info[3] & (1 << 26)) != 0;
+        (*ssse3) = (info[2] & (1 << 9)) != 0;
+        (*avx2) = false;
+
+        // AVX2 also needs the OS to save the YMM registers
+        if ((info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6)
+        {
+            __cpuidex(info, 7, 0);
+            (*avx2) = (info[1] & (1 << 5)) != 0;
+        }
+    #else
+        __builtin_cpu_init();
+        (*sse2) = __builtin_cpu_supports("sse2") != 0;
+        (*ssse3) = __builtin_cpu_supports("ssse3") != 0;
+        (*avx2) = __builtin_cpu_supports("avx2") != 0;
+    #endif
+}
+
+
+/*==============================
+    byteorder_swap16_sse2
+    Swaps the bytes of every 16-bit word,
+    16 bytes at a time, using shifts
+    @param The data to swap
+    @param The size of the data
+==============================*/
+
+TARGET("sse2") static void byteorder_swap16_sse2(byte* data, uint32_t size)
+{
+    uint32_t i = 0;
+    for (; i+16<=size; i+=16)
+    {
+        __m128i v = _mm_loadu_si128((__m128i*)(data+i));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i*)(data+i), v);
+    }
+    byteorder_swap16_scalar(data+i, size-i);
+}
+
+
+/*==============================
+    byteorder_swap32_sse2
+    Reverses the bytes of every 32-bit word,
+    16 bytes at a time, by swapping the bytes
+    and then the 16-bit halves of each word
+    @param The data to swap
+    @param The size of the data
+==============================*/
+
+TARGET("sse2") static void byteorder_swap32_sse2(byte* data, uint32_t size)
+{
+    uint32_t i = 0;
+    for (; i+16<=size; i+=16)
+    {
+        __m128i v = _mm_loadu_si128((__m128i*)(data+i));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);
+        _mm_storeu_si128((__m128i*)(data+i), v);
+    }
+    byteorder_swap32_scalar(data+i, size-i);
+}
+
+
+/*==============================
+    byteorder_swap16_ssse3
+    Swaps the bytes of every 16-bit word,
+    16 bytes at a time, with a byte shuffle
+    @param The data to swap
+    @param The size of the data
+==============================*/
+
+TARGET("ssse3") static void byteorder_swap16_ssse3(byte* data, uint32_t size)
+{
+    uint32_t i = 0;
+    const __m128i mask = _mm_set_epi8(14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+    for (; i+16<=size; i+=16)
+    {
+        __m128i v = _mm_loadu_si128((__m128i*)(data+i));
+        _mm_storeu_si128((__m128i*)(data+i), _mm_shuffle_epi8(v, mask));
+    }
+    byteorder_swap16_scalar(data+i, size-i);
+}
+
+
+/*==============================
+    byteorder_swap32_ssse3
+    Reverses the bytes of every 32-bit word,
+    16 bytes at a time, with a byte shuffle
+    @param The data to swap
+    @param The size of the data
+==============================*/
+
+TARGET("ssse3") static void byteorder_swap32_ssse3(byte* data, uint32_t size)
+{
+    uint32_t i = 0;
+    const __m128i mask = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    for (; i+16<=size; i+=16)
+    {
+        __m128i v = _mm_loadu_si128((__m128i*)(data+i));
+        _mm_storeu_si128((__m128i*)(data+i), _mm_shuffle_epi8(v, mask));
+    }
+    byteorder_swap32_scalar(data+i, size-i);
+}
+
+
+/*==============================
+    byteorder_swap16_avx2
+    Swaps the bytes of every 16-bit word,
+    32 bytes at a time, with a byte shuffle
+    @param The data to swap
+    @param The size of the data
+==============================*/
+
+TARGET("avx2") static void byteorder_swap16_avx2(byte* data, uint32_t size)
+{
+    uint32_t i = 0;
+    const __m256i mask = _mm256_set_epi8(14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1, 
+                                         14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+    for (; i+32<=size; i+=32)
+    {
+        __m256i v = _mm256_loadu_si256((__m256i*)(data+i));
+        _mm256_storeu_si256((__m256i*)(data+i), _mm256_shuffle_epi8(v, mask));
+    }
+    byteorder_swap16_scalar(data+i, size-i);
+}
+
+
+/*==============================
+    byteorder_swap32_avx2
+    Reverses the bytes of every 32-bit word,
+    32 bytes at a time, with a byte shuffle
+    @param The data to swap
+    @param The size of the data
+==============================*/
+
+TARGET("avx2") static void byteorder_swap32_avx2(byte* data, uint32_t size)
+{
+    uint32_t i = 0;
+    const __m256i mask = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3, 
+                                         12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    for (; i+32<=size; i+=32)
+    {
+        __m256i v = _mm256_loadu_si256((__m256i*)(data+i));
+        _mm256_storeu_si256((__m256i*)(data+i), _mm256_shuffle_epi8(v, mask));
+    }
+    byteorder_swap32_scalar(data+i, size-i);
+}
+
+#endif
+#ifdef BYTEORDER_NEON
+
+/*==============================
+    byteorder_swap16_neon
+    Swaps the bytes of every 16-bit word,
+    16 bytes at a time
+    @param The data to swap
+    @param The size of the data
+==============================*/
+
+static void byteorder_swap16_neon(byte* data, uint32_t size)
+{
+    uint32_t i = 0;
+    for (; i+16<=size; i+=16)
+        vst1q_u8(data+i, vrev16q_u8(vld1q_u8(data+i)));
+    byteorder_swap16_scalar(data+i, size-i);
+}
+
+
+/*==============================
+    byteorder_swap32_neon
+    Reverses the bytes of every 32-bit word,
+    16 bytes at a time
+    @param The data to swap
+    @param The size of the data
+==============================*/
+
+static void byteorder_swap32_neon(byte* data, uint32_t size)
+{
+    uint32_t i = 0;
+    for (; i+16<=size; i+=16)
+        vst1q_u8(data+i, vrev32q_u8(vld1q_u8(data+i)));
+    byteorder_swap32_scalar(data+i, size-i);
+}
+
+#endif
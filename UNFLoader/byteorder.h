@@ -0,0 +1,42 @@
+#ifndef __BYTEORDER_HEADER
+#define __BYTEORDER_HEADER
+
+    #include "device.h"
+
+
+    /*********************************
+               Enumerations
+    *********************************/
+
+    typedef enum {
+        BYTEORDER_Z64 = 0, // Big endian, what the N64 expects
+        BYTEORDER_V64 = 1, // Byteswapped 16-bit words
+        BYTEORDER_N64 = 2, // Little endian 32-bit words
+    } ByteOrder;
+
+
+    /*********************************
+                 Typedefs
+    *********************************/
+
+    typedef void (*ByteSwapFunc)(byte* data, uint32_t size);
+
+    typedef struct {
+        const char*  name;
+        bool         supported;
+        ByteSwapFunc swap16;
+        ByteSwapFunc swap32;
+    } ByteSwapKernel;
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    ByteOrder             byteorder_detect(const byte* header);
+    void                  byteorder_normalize(ByteOrder order, byte* data, uint32_t size);
+    const char*           byteorder_typetostr(ByteOrder order);
+    const ByteSwapKernel* byteorder_getkernels(uint32_t* count);
+    const ByteSwapKernel* byteorder_getbestkernel();
+
+#endif
@@ -2,6 +2,8 @@
 #include "main.h"
 #include "term.h"
 #include "helper.h"
+#include "packetring.h"
+#include "packetpool.h"
 #pragma warning(push, 0)
     #include "Include/lodepng.h"
 #pragma warning(pop)
@@ -14,7 +16,12 @@
 #include <list>
 #include <queue>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <iterator>
+#include <algorithm>
+#include <vector>
 
 
 /*********************************
@@ -26,20 +33,18 @@
 
 // Max supported protocol versions
 #define USBPROTOCOL_VERSION PROTOCOL_VERSION2
-#define HEARTBEAT_VERSION   1
+#define HEARTBEAT_VERSION   2
+
+// Fragmented transfers
+#define FRAGMENT_HEADER_SIZE 16         // Datatype, total size, offset and transfer ID, before the fragment's data
+#define FRAGMENT_REPLY_SIZE  8          // Transfer ID and how far the console has read
+#define FRAGMENT_CANCEL      0xFFFFFFFF // Sent by either side instead of an offset to stop the transfer
 
 
 /*********************************
             Structures
 *********************************/
 
-typedef struct {
-    char*       original;
-    byte*       data;
-    USBDataType type;
-    int32_t     size;
-} SendData;
-
 typedef struct {
     char*    str;
     uint32_t strsize;
@@ -48,6 +53,15 @@ typedef struct {
     bool     ispath;
 } ParseHelper;
 
+// A parsed command, shared by every cart's queue. The parts are sent as they are, without being joined together
+typedef struct {
+    char*                    original;
+    USBDataType              type;
+    std::list<ParseHelper*>  parts;
+    std::vector<DataSegment> segments;
+    std::atomic<uint32_t>    refs;
+} SendData;
+
 
 /*********************************
         Function Prototypes
@@ -58,96 +72,531 @@ static void debug_handle_rawbinary(uint32_t size, byte* buffer);
 static void debug_handle_header(uint32_t size, byte* buffer);
 static void debug_handle_screenshot(uint32_t size, byte* buffer);
 static void debug_handle_heartbeat(uint32_t size, byte* buffer);
+static void debug_handle_fragment(uint32_t size, byte* buffer);
+static void debug_readerthread(uint32_t cart);
+static DeviceError debug_senddata(uint32_t cart, SendData* msg);
+static DeviceError debug_sendpacket(uint32_t cart, USBDataType type, const DataSegment* segments, uint32_t count);
+static DeviceError debug_sendfragments(uint32_t cart, SendData* msg, uint32_t total, uint32_t fragsize);
+static void debug_freeparts(std::list<ParseHelper*>* parts);
+static void debug_releasemessage(SendData* msg);
 
 
 /*********************************
              Globals
 *********************************/
 
-// Output file paths
-static FILE* local_debugoutfile = NULL;
+// Output file paths, each cart gets its own debug log
+static char* local_debugoutpath = NULL;
+static FILE* local_debugoutfile[MAX_CARTS];
 static char* local_binaryoutfolderpath = NULL;
 
-// Other
-static int debug_headerdata[HEADER_SIZE];
-static std::queue<SendData*> local_mesgqueue;
+// Other, per cart
+static int debug_headerdata[MAX_CARTS][HEADER_SIZE];
+static std::queue<SendData*> local_mesgqueue[MAX_CARTS];
+static std::mutex            local_mesgmutex;
+static uint64_t              local_dropsreported[MAX_CARTS];
+
+// USB reader threads, which receive packets from the carts for debug_main to handle
+static PacketRing*             local_rings[MAX_CARTS];
+static std::thread             local_readers[MAX_CARTS];
+static std::atomic<bool>       local_readersrunning (false);
+static std::mutex              local_usbmutex[MAX_CARTS]; // Keeps sending and receiving apart
+static std::mutex              local_waitmutex;
+static std::condition_variable local_waitcond;
+static bool                    local_woken[MAX_CARTS];
+static std::mutex              local_roommutex;
+static std::condition_variable local_roomcond;  // Signalled when debug_main makes room in a ring
+
+// Fragmented transfers, for data too big for the cart or the console to take in one go
+static std::atomic<uint32_t>   local_fragwindow[MAX_CARTS]; // The console's debug area size, or 0 if it can't take fragments
+static std::atomic<uint32_t>   local_fragread[MAX_CARTS];   // How far into the transfer the console has read
+static uint32_t                local_fragid[MAX_CARTS];     // The transfer being sent, so replies about older ones are ignored
+static std::mutex              local_fragmutex;
+static std::condition_variable local_fragcond;
 
 
 /*==============================
     debug_main
-    Handles debug I/O
+    Sends queued commands to the selected
+    cart, and handles the packets that its
+    reader thread received
 ==============================*/
 
 void debug_main()
 {
-    byte*    outbuff = NULL;
-    uint32_t dataheader = 0;
-
-    // If no ROM was uploaded, assume async, and switch to latest protocol
-    if (device_getrom() == NULL)
-        device_setprotocol(USBPROTOCOL_LATEST);
+    DebugPacket packet;
+    PacketRingStats stats;
+    bool popped = false;
+    uint32_t cart = device_getselectedcart();
 
     // Send data to USB if it exists
-    while (!local_mesgqueue.empty())
+    while (true)
     {
-        SendData* msg = local_mesgqueue.front();
+        SendData* msg;
+        DeviceError err;
+        {
+            std::lock_guard<std::mutex> lock(local_mesgmutex);
+            if (local_mesgqueue[cart].empty())
+                break;
+            msg = local_mesgqueue[cart].front();
+            local_mesgqueue[cart].pop();
+        }
+
+        // With several carts, each one sends on its own thread, so don't bother with the progress bar
+        if (device_getcartcount() > 1)
+        {
+            err = debug_senddata(cart, msg);
+            handle_deviceerror(err);
+            if (err == DEVICEERR_OK)
+                log_colored("Sent command '%s'\n", CRDEF_INFO, msg->original);
+            debug_releasemessage(msg);
+            continue;
+        }
+
+        // A command that was cancelled before mustn't cancel this one too
+        device_resetupload();
         increment_escapelevel();
         if (term_isusingcurses())
         {
             std::thread t;
             log_colored("Uploading command (ESC to cancel)\n", CRDEF_INPUT);
             t = std::thread(progressthread, "Uploading command (ESC to cancel)");
-            handle_deviceerror(device_senddata(msg->type, msg->data, msg->size));
+            err = debug_senddata(cart, msg);
+            device_setuploadprogress(100.0f); // So the progress bar stops even if the command didn't make it
             t.join();
         }
         else
         {
             log_simple("Uploading command (type 'cancel' to cancel).\n");
-            handle_deviceerror(device_senddata(msg->type, msg->data, msg->size));
+            err = debug_senddata(cart, msg);
         }
+        handle_deviceerror(err);
 
         // Print success?
         if (!device_uploadcancelled())
         {
-            log_replace("Sent command '%s'\n", CRDEF_INFO, msg->original);
+            if (err == DEVICEERR_OK)
+                log_replace("Sent command '%s'\n", CRDEF_INFO, msg->original);
             decrement_escapelevel();
         }
         else
             log_replace("Upload cancelled by the user.\n", CRDEF_ERROR);
 
         // Cleanup
-        local_mesgqueue.pop();
-        free(msg->original);
-        free(msg->data);
-        free(msg);
+        debug_releasemessage(msg);
     }
 
-    // Read from USB
-    do
+    // Handle what the reader thread received
+    if (local_rings[cart] == NULL)
+        return;
+    while (packetring_pop(local_rings[cart], &packet))
     {
-        handle_deviceerror(device_receivedata(&dataheader, &outbuff));
-        if (dataheader != 0 && outbuff != NULL)
+        uint32_t size = packet.header & 0xFFFFFF;
+        USBDataType command = (USBDataType)((packet.header >> 24) & 0xFF);
+
+        // Decide what to do with the data based off the command type
+        switch (command)
         {
-            uint32_t size = dataheader & 0xFFFFFF;
-            USBDataType command = (USBDataType)((dataheader >> 24) & 0xFF);
+            case DATATYPE_TEXT:       debug_handle_text(size, packet.data); break;
+            case DATATYPE_RAWBINARY:  debug_handle_rawbinary(size, packet.data); break;
+            case DATATYPE_HEADER:     debug_handle_header(size, packet.data); break;
+            case DATATYPE_SCREENSHOT: debug_handle_screenshot(size, packet.data); break;
+            default:                  terminate("Unknown data type '%x'.", (uint32_t)command);
+        }
+
+        // Cleanup
+        packetpool_release(packet.data);
+        popped = true;
+    }
 
-            // Decide what to do with the data based off the command type
-            switch (command)
+    // The reader thread might be waiting for room to queue a packet it can't throw away
+    if (popped)
+    {
+        std::lock_guard<std::mutex> lock(local_roommutex);
+        local_roomcond.notify_all();
+    }
+
+    // Let the user know if we fell so far behind that text was lost
+    packetring_getstats(local_rings[cart], &stats);
+    if (stats.dropped > local_dropsreported[cart])
+    {
+        log_colored("Dropped %d text packets because they arrived faster than they could be handled.\n", CRDEF_ERROR, (int)(stats.dropped - local_dropsreported[cart]));
+        local_dropsreported[cart] = stats.dropped;
+    }
+}
+
+
+/*==============================
+    debug_wait
+    Sleeps until the selected cart's reader
+    thread has received something, or until
+    debug_wakeup is called
+    @param The most time to wait, in milliseconds
+==============================*/
+
+void debug_wait(uint32_t timeout)
+{
+    uint32_t cart = device_getselectedcart();
+    std::unique_lock<std::mutex> lock(local_waitmutex);
+    local_waitcond.wait_for(lock, std::chrono::milliseconds(timeout), [cart]{
+        return local_woken[cart] || (local_rings[cart] != NULL && !packetring_isempty(local_rings[cart]));
+    });
+    local_woken[cart] = false;
+}
+
+
+/*==============================
+    debug_wakeup
+    Wakes up every thread sleeping in
+    debug_wait, along with the reader threads
+==============================*/
+
+void debug_wakeup()
+{
+    {
+        std::lock_guard<std::mutex> lock(local_waitmutex);
+        for (uint32_t i=0; i<MAX_CARTS; i++)
+            local_woken[i] = true;
+        local_waitcond.notify_all();
+    }
+    device_wakeup();
+}
+
+
+/*==============================
+    debug_startreaders
+    Starts a thread for each cart, which
+    receives its packets
+==============================*/
+
+void debug_startreaders()
+{
+    if (local_readersrunning)
+        return;
+    local_readersrunning = true;
+    for (uint32_t i=0; i<device_getcartcount(); i++)
+    {
+        if (local_rings[i] == NULL)
+        {
+            local_rings[i] = packetring_create(PACKETRING_DEFAULT_SIZE);
+            if (local_rings[i] == NULL)
+                terminate("Unable to allocate memory for the debug packet queue.");
+        }
+        local_readers[i] = std::thread(debug_readerthread, i);
+    }
+}
+
+
+/*==============================
+    debug_stopreaders
+    Stops the reader threads, and waits
+    for them to finish. Packets they already
+    received are kept for debug_main.
+==============================*/
+
+void debug_stopreaders()
+{
+    if (!local_readersrunning)
+        return;
+    local_readersrunning = false;
+    device_wakeup();
+    {
+        std::lock_guard<std::mutex> lock(local_roommutex);
+        local_roomcond.notify_all();
+    }
+    for (uint32_t i=0; i<device_getcartcount(); i++)
+    {
+        // A reader can end up here itself if it hits an error
+        if (local_readers[i].get_id() == std::this_thread::get_id())
+            local_readers[i].detach();
+        else
+            local_readers[i].join();
+    }
+}
+
+
+/*==============================
+    debug_getreaderstats
+    Gets the selected cart's packet queue
+    counters
+    @param A pointer to store the stats in
+==============================*/
+
+void debug_getreaderstats(PacketRingStats* stats)
+{
+    uint32_t cart = device_getselectedcart();
+    if (local_rings[cart] == NULL)
+    {
+        memset(stats, 0, sizeof(PacketRingStats));
+        return;
+    }
+    packetring_getstats(local_rings[cart], stats);
+}
+
+
+/*==============================
+    debug_readerthread
+    Pulls packets off a cart and queues them
+    for debug_main, until debug_stopreaders
+    is called
+    @param The index of the cart
+==============================*/
+
+static void debug_readerthread(uint32_t cart)
+{
+    device_selectcart(cart);
+
+    // If no ROM was uploaded, assume async, and switch to latest protocol
+    if (device_getrom() == NULL)
+        device_setprotocol(USBPROTOCOL_LATEST);
+
+    while (local_readersrunning)
+    {
+        bool received = false;
+        uint32_t dataheader;
+        byte* outbuff;
+        byte* pending = NULL;
+
+        // Read from USB
+        {
+            std::lock_guard<std::mutex> lock(local_usbmutex[cart]);
+            do
             {
-                case DATATYPE_TEXT:       debug_handle_text(size, outbuff); break;
-                case DATATYPE_RAWBINARY:  debug_handle_rawbinary(size, outbuff); break;
-                case DATATYPE_HEADER:     debug_handle_header(size, outbuff); break;
-                case DATATYPE_SCREENSHOT: debug_handle_screenshot(size, outbuff); break;
-                case DATATYPE_HEARTBEAT:  debug_handle_heartbeat(size, outbuff); break;
-                default:                  terminate("Unknown data type '%x'.", (uint32_t)command);
+                handle_deviceerror(device_receivedata(&dataheader, &outbuff));
+                if (dataheader == 0 || outbuff == NULL)
+                    continue;
+
+                // The heartbeat changes how the packets after it are read, so it can't wait in the queue
+                if ((USBDataType)((dataheader >> 24) & 0xFF) == DATATYPE_HEARTBEAT)
+                {
+                    debug_handle_heartbeat(dataheader & 0xFFFFFF, outbuff);
+                    packetpool_release(outbuff);
+                }
+
+                // Neither can fragment replies, as the sending thread is waiting on them
+                else if ((USBDataType)((dataheader >> 24) & 0xFF) == DATATYPE_FRAGMENT)
+                {
+                    debug_handle_fragment(dataheader & 0xFFFFFF, outbuff);
+                    packetpool_release(outbuff);
+                }
+                else if (packetring_push(local_rings[cart], dataheader, outbuff))
+                    received = true;
+
+                // Losing some text is better than falling behind, but anything else has to wait until there's room
+                else if ((USBDataType)((dataheader >> 24) & 0xFF) == DATATYPE_TEXT)
+                {
+                    packetring_drop(local_rings[cart]);
+                    packetpool_release(outbuff);
+                }
+                else
+                {
+                    pending = outbuff;
+                    break;
+                }
             }
+            while (dataheader > 0);
+        }
 
-            // Cleanup
-            free(outbuff);
-            outbuff = NULL;
+        // Wake up the thread handling this cart's packets
+        if (received || pending != NULL)
+        {
+            std::lock_guard<std::mutex> lock(local_waitmutex);
+            local_waitcond.notify_all();
+        }
+
+        // If a packet didn't fit, stop reading USB until debug_main makes room for it
+        if (pending != NULL)
+        {
+            std::unique_lock<std::mutex> lock(local_roommutex);
+            local_roomcond.wait(lock, [cart]{
+                return !local_readersrunning || !packetring_isfull(local_rings[cart]);
+            });
+            if (!packetring_push(local_rings[cart], dataheader, pending))
+                packetpool_release(pending);
+            continue;
         }
+        handle_deviceerror(device_waitdata(DEBUG_WAIT_TIMEOUT));
+    }
+}
+
+
+/*==============================
+    debug_senddata
+    Sends a command to a cart, splitting it
+    into fragments if it's too big for the
+    cart or the console to take in one go
+    @param  The index of the cart
+    @param  The data to send
+    @return The device error, or OK
+==============================*/
+
+static DeviceError debug_senddata(uint32_t cart, SendData* msg)
+{
+    uint32_t total = device_segmentsize(msg->segments.data(), msg->segments.size());
+    uint32_t window = local_fragwindow[cart];
+    uint32_t limit = device_getmaxdatasize();
+
+    if (window != 0 && window < limit)
+        limit = window;
+    if (total <= limit)
+        return debug_sendpacket(cart, msg->type, msg->segments.data(), msg->segments.size());
+
+    // Too big, so it needs to be fragmented, which old ROMs can't handle
+    if (window == 0)
+        return DEVICEERR_DATATOOBIG;
+    return debug_sendfragments(cart, msg, total, limit - FRAGMENT_HEADER_SIZE);
+}
+
+
+/*==============================
+    debug_sendpacket
+    Sends a single packet to a cart, without
+    getting in the way of its reader thread
+    @param  The index of the cart
+    @param  The datatype of the packet
+    @param  The segments that make up the data
+    @param  The number of segments
+    @return The device error, or OK
+==============================*/
+
+static DeviceError debug_sendpacket(uint32_t cart, USBDataType type, const DataSegment* segments, uint32_t count)
+{
+    DeviceError err;
+    {
+        std::lock_guard<std::mutex> lock(local_usbmutex[cart]);
+        err = device_senddata(type, segments, count);
     }
-    while (dataheader > 0);
+
+    // The cart might have replied while we were busy sending, so have the reader look
+    device_wakeup();
+    return err;
+}
+
+
+/*==============================
+    debug_sendfragments
+    Sends a command to a cart in fragments,
+    waiting for the console to finish reading
+    each one before sending the next
+    @param  The index of the cart
+    @param  The data to send
+    @param  The total size of the data
+    @param  The most data to put in a fragment
+    @return The device error, or OK
+==============================*/
+
+static DeviceError debug_sendfragments(uint32_t cart, SendData* msg, uint32_t total, uint32_t fragsize)
+{
+    std::vector<DataSegment> fragment;
+    uint32_t header[FRAGMENT_HEADER_SIZE/4];
+    uint32_t offset = 0;
+    uint32_t segment = 0;
+    uint32_t segoffset = 0;
+    DeviceError err = DEVICEERR_OK;
+
+    // Start a new transfer, so that late replies about the last one can't be mistaken for this one's
+    {
+        std::lock_guard<std::mutex> lock(local_fragmutex);
+        local_fragid[cart]++;
+        local_fragread[cart] = 0;
+        header[3] = swap_endian(local_fragid[cart]);
+    }
+    header[0] = swap_endian(msg->type);
+    header[1] = swap_endian(total);
+    while (offset < total && err == DEVICEERR_OK)
+    {
+        uint32_t size = std::min(fragsize, total-offset);
+
+        // Each fragment starts with a header that says where it goes
+        header[2] = swap_endian(offset);
+        fragment.clear();
+        fragment.push_back({(byte*)header, sizeof(header)});
+
+        // Followed by its slice of the command's segments
+        for (uint32_t left = size; left > 0;)
+        {
+            const DataSegment* seg = &msg->segments[segment];
+            uint32_t amount = std::min(seg->size - segoffset, left);
+            fragment.push_back({seg->data != NULL ? seg->data + segoffset : NULL, amount});
+            segoffset += amount;
+            left -= amount;
+            if (segoffset == seg->size)
+            {
+                segment++;
+                segoffset = 0;
+            }
+        }
+
+        // Send it, with the progress bar covering the whole transfer
+        device_setuploadrange((100.0f*offset)/total, (100.0f*(offset+size))/total);
+        err = debug_sendpacket(cart, DATATYPE_FRAGMENT, fragment.data(), fragment.size());
+        offset += size;
+        if (err != DEVICEERR_OK || offset == total)
+            break;
+
+        // The next fragment overwrites this one, so wait for the console to be done with it
+        {
+            std::unique_lock<std::mutex> lock(local_fragmutex);
+            while (local_fragread[cart] < offset)
+            {
+                if (device_uploadcancelled() || !local_readersrunning)
+                {
+                    err = DEVICEERR_UPLOADCANCELLED;
+                    break;
+                }
+                local_fragcond.wait_for(lock, std::chrono::milliseconds(DEBUG_WAIT_TIMEOUT));
+            }
+        }
+        if (local_fragread[cart] == FRAGMENT_CANCEL)
+            err = DEVICEERR_CONSOLECANCELLED;
+    }
+    device_setuploadrange(0.0f, 100.0f);
+
+    // If we gave up on the transfer, tell the console so it stops waiting for the rest
+    if (err == DEVICEERR_UPLOADCANCELLED)
+    {
+        DataSegment cancel = {(byte*)header, sizeof(header)};
+        header[2] = swap_endian(FRAGMENT_CANCEL);
+        debug_sendpacket(cart, DATATYPE_FRAGMENT, &cancel, 1);
+    }
+    return err;
+}
+
+
+/*==============================
+    debug_freeparts
+    Frees the pieces of a parsed command
+    @param  The list of pieces to free
+==============================*/
+
+static void debug_freeparts(std::list<ParseHelper*>* parts)
+{
+    for (std::list<ParseHelper*>::iterator it = parts->begin(); it != parts->end(); ++it)
+    {
+        ParseHelper* help = *it;
+        if (help->data != NULL)
+            free(help->data);
+        free(help->str);
+        free(help);
+    }
+    parts->clear();
+}
+
+
+/*==============================
+    debug_releasemessage
+    Lets go of a queued command, freeing it
+    once every cart is done with it
+    @param  The command to release
+==============================*/
+
+static void debug_releasemessage(SendData* msg)
+{
+    if (msg->refs.fetch_sub(1) != 1)
+        return;
+    debug_freeparts(&msg->parts);
+    free(msg->original);
+    delete msg;
 }
 
 
@@ -160,14 +609,8 @@ void debug_main()
 
 static void debug_handle_text(uint32_t size, byte* buffer)
 {
-    char* text;
-    text = (char*)malloc(size+1);
-    if (text == NULL)
-        terminate("Failed to allocate memory for incoming string.");
-    memset(text, 0, size+1);
-    strncpy(text, (char*)buffer, size);
-    log_stackable("%s", CRDEF_PRINT, text);
-    free(text);
+    // The text isn't null terminated, so print it straight from the packet with an explicit length
+    log_stackable("%.*s", CRDEF_PRINT, (int)size, (char*)buffer);
 }
 
 
@@ -219,7 +662,7 @@ static void debug_handle_header(uint32_t size, byte* buffer)
 
     // Read bytes until we finished
     for (uint32_t i=0; i<size; i+=4)
-        debug_headerdata[i/4] = swap_endian(buffer[i + 3] << 24 | buffer[i + 2] << 16 | buffer[i + 1] << 8 | buffer[i]);
+        debug_headerdata[device_getselectedcart()][i/4] = swap_endian(buffer[i + 3] << 24 | buffer[i + 2] << 16 | buffer[i + 1] << 8 | buffer[i]);
 }
 
 
@@ -234,12 +677,13 @@ static void debug_handle_screenshot(uint32_t size, byte* buffer)
 {
     byte*    image = NULL;
     uint32_t written = 0;
-    uint32_t w = debug_headerdata[2];
-    uint32_t h = debug_headerdata[3];
+    int*     header = debug_headerdata[device_getselectedcart()];
+    uint32_t w = header[2];
+    uint32_t h = header[3];
     char*    filename = gen_filename("screenshot", "png");
 
     // Ensure we got a data header of type screenshot
-    if (debug_headerdata[0] != (uint8_t)DATATYPE_SCREENSHOT)
+    if (header[0] != (uint8_t)DATATYPE_SCREENSHOT)
         terminate("Unexpected data header for screenshot.");
 
     // Allocate space for the image
@@ -253,7 +697,7 @@ static void debug_handle_screenshot(uint32_t size, byte* buffer)
     for (uint32_t i=0; i<size; i+=4)
     {
         int texel = swap_endian(((buffer[i+3]<<24)&0xFF000000) | ((buffer[i+2]<<16)&0xFF0000) | ((buffer[i+1]<<8)&0xFF00) | (buffer[i]&0xFF));
-        if (debug_headerdata[1] == 2) 
+        if (header[1] == 2) 
         {
             short pixel1 = (texel&0xFFFF0000)>>16;
             short pixel2 = (texel&0x0000FFFF);
@@ -310,10 +754,16 @@ void debug_handle_heartbeat(uint32_t size, byte* buffer)
         terminate("USB protocol %d unsupported. Your UNFLoader is probably out of date.", device_getprotocol());
 
     // Handle the heartbeat by reading more stuff based on the version
-    // Currently, nothing here.
     switch(heartbeat_version)
     {
-        case 0x01: break;
+        case 0x01: 
+            local_fragwindow[device_getselectedcart()] = 0;
+            break;
+        case 0x02:
+            if (size < 8)
+                terminate("Error: Malformed heartbeat received");
+            local_fragwindow[device_getselectedcart()] = swap_endian((buffer[7] << 24) | (buffer[6] << 16) | (buffer[5] << 8) | (buffer[4]));
+            break;
         default:
             terminate("Heartbeat version %d unsupported. Your UNFLoader is probably out of date.", heartbeat_version);
             break;
@@ -321,6 +771,33 @@ void debug_handle_heartbeat(uint32_t size, byte* buffer)
 }
 
 
+/*==============================
+    debug_handle_fragment
+    Handles DATATYPE_FRAGMENT, which the console 
+    sends once it's done with a fragment
+    @param The size of the incoming data
+    @param The buffer to read from
+==============================*/
+
+static void debug_handle_fragment(uint32_t size, byte* buffer)
+{
+    uint32_t cart = device_getselectedcart();
+    uint32_t id;
+    if (size < FRAGMENT_REPLY_SIZE)
+        return;
+    id = swap_endian((buffer[3] << 24) | (buffer[2] << 16) | (buffer[1] << 8) | (buffer[0]));
+
+    // The console tells us how far into the transfer it has read
+    {
+        std::lock_guard<std::mutex> lock(local_fragmutex);
+        if (id != local_fragid[cart])
+            return;
+        local_fragread[cart] = swap_endian((buffer[7] << 24) | (buffer[6] << 16) | (buffer[5] << 8) | (buffer[4]));
+    }
+    local_fragcond.notify_all();
+}
+
+
 /*==============================
     debug_send
     Sends data to the flashcart
@@ -333,14 +810,11 @@ void debug_handle_heartbeat(uint32_t size, byte* buffer)
 
 void debug_send(char* data)
 {
-    byte*     copy;
     char*     token;
     SendData* mesg;
     uint32_t  datasize;
-    uint32_t  padbytes = 0;
     uint32_t  tokcount = 0;
     bool      ispath = false;
-    std::list<ParseHelper*> datasplit;
 
     // Start by removing trailing whitespace
     data = trimwhitespace(data);
@@ -359,11 +833,9 @@ void debug_send(char* data)
     }
 
     // Initialize the message to send
-    mesg = (SendData*)malloc(sizeof(SendData));
-    if (mesg == NULL)
-        terminate("Unable to malloc message for debug send.");
+    mesg = new SendData();
     mesg->type = DATATYPE_TEXT;
-    mesg->original = (char*)malloc(datasize);
+    mesg->original = (char*)malloc(datasize+1);
     if (mesg->original == NULL)
         terminate("Unable to malloc message for debug send.");
     strcpy(mesg->original, data);
@@ -376,7 +848,6 @@ void debug_send(char* data)
 
     // Parse the text and append data as needed
     token = strtok(data, "@");
-    datasize = 0;
     while (token != NULL)
     {
         ParseHelper* help = (ParseHelper*)calloc(sizeof(ParseHelper), 1);
@@ -399,16 +870,10 @@ void debug_send(char* data)
             if (fp == NULL)
             {
                 log_colored("Error: Unable to open file '%s'.\n", CRDEF_ERROR, token);
-                for (std::list<ParseHelper*>::iterator it = datasplit.begin(); it != datasplit.end(); ++it)
-                {
-                    ParseHelper* destroy = *it;
-                    if (destroy->data != NULL)
-                        free(destroy->data);
-                    free(destroy->str);
-                    free(destroy);
-                }
+                free(help);
+                debug_freeparts(&mesg->parts);
                 free(mesg->original);
-                free(mesg);
+                delete mesg;
                 return;
             }
 
@@ -428,70 +893,47 @@ void debug_send(char* data)
             if (fread(help->data, 1, size, fp) != size)
             {
                 log_colored("Error: Unable to read file '%s'.\n", CRDEF_ERROR, token);
-                for (std::list<ParseHelper*>::iterator it = datasplit.begin(); it != datasplit.end(); ++it)
-                {
-                    ParseHelper* destroy = *it;
-                    if (destroy->data != NULL)
-                        free(destroy->data);
-                    free(destroy->str);
-                    free(destroy);
-                }
+                fclose(fp);
+                free(help->data);
+                free(help->str);
+                free(help);
+                debug_freeparts(&mesg->parts);
                 free(mesg->original);
-                free(mesg);
+                delete mesg;
                 return;
             }
 
             // Cleanup
             fclose(fp);
         }
-        datasplit.push_back(help);
-        if (mesg->type == DATATYPE_TEXT)
-            datasize += help->strsize;
         help->ispath = ispath;
-        if (ispath)
-            datasize += help->datasize;
+        mesg->parts.push_back(help);
 
         // Get the next token
         token = strtok(NULL, "@");
         ispath = !ispath;
     }
 
-    // Now we have a list of strings and data blocks, we combine all into one
-    // We can already assign these values to the mesg
-    if (mesg->type == DATATYPE_TEXT)
-        padbytes = 1;
-    copy = (byte*)calloc(datasize+padbytes, 1);
-    if (copy == NULL)
-        terminate("Unable to malloc data for debug send.");
-    mesg->size = datasize+padbytes;
-    mesg->data = copy;
-
-    // Iterate the list, copy onto the copy buffer, and free the allocated memory
-    for (std::list<ParseHelper*>::iterator it = datasplit.begin(); it != datasplit.end(); ++it)
+    // Now we have a list of strings and data blocks, which get sent back to back straight from where they are
+    for (std::list<ParseHelper*>::iterator it = mesg->parts.begin(); it != mesg->parts.end(); ++it)
     {
         ParseHelper* help = *it;
         if (mesg->type == DATATYPE_TEXT)
-        {
-            strcpy((char*)copy, help->str);
-            copy += help->strsize;
-        }
+            mesg->segments.push_back({(byte*)help->str, help->strsize});
         if (help->ispath)
-        {
-            memcpy(copy, help->data, help->datasize);
-            copy += help->datasize;
-        }
+            mesg->segments.push_back({help->data, help->datasize});
     }
-    
-    // Done!
-    local_mesgqueue.push(mesg);
-    for (std::list<ParseHelper*>::iterator it = datasplit.begin(); it != datasplit.end(); ++it)
+    if (mesg->type == DATATYPE_TEXT)
+        mesg->segments.push_back({NULL, 1});
+
+    // Done! Every cart shares the same message, and the last one to send it frees it
+    mesg->refs = device_getcartcount();
     {
-        ParseHelper* help = *it;
-        if (help->data != NULL)
-            free(help->data);
-        free(help->str);
-        free(help);
+        std::lock_guard<std::mutex> lock(local_mesgmutex);
+        for (uint32_t i=0; i<device_getcartcount(); i++)
+            local_mesgqueue[i].push(mesg);
     }
+    debug_wakeup();
 }
 
 
@@ -504,7 +946,8 @@ void debug_send(char* data)
 
 void debug_setdebugout(char* path)
 {
-    local_debugoutfile = fopen(path, "w+");
+    local_debugoutpath = path;
+    local_debugoutfile[0] = fopen(path, "w+");
 }
 
 
@@ -523,14 +966,23 @@ void debug_setbinaryout(char* path)
 
 /*==============================
     debug_getdebugout
-    Gets the file where debug logs are
-    written to.
+    Gets the file where the selected cart's
+    debug logs are written to.
     @param The file pointer to the debug log file
 ==============================*/
 
 FILE* debug_getdebugout()
 {
-    return local_debugoutfile;
+    uint32_t cart = device_getselectedcart();
+
+    // The log for the carts after the first are only created once they have something to say
+    if (local_debugoutpath != NULL && local_debugoutfile[cart] == NULL && cart > 0)
+    {
+        char path[PATH_SIZE];
+        snprintf(path, PATH_SIZE, "%s.%d", local_debugoutpath, cart);
+        local_debugoutfile[cart] = fopen(path, "w+");
+    }
+    return local_debugoutfile[cart];
 }
 
 
@@ -549,11 +1001,16 @@ char* debug_getbinaryout()
 
 /*==============================
     debug_closedebugout
-    Closes the debug log file
+    Closes the debug log files
 ==============================*/
 
 void debug_closedebugout()
 {
-    fclose(local_debugoutfile);
-    local_debugoutfile = NULL;
+    for (int i=0; i<MAX_CARTS; i++)
+    {
+        if (local_debugoutfile[i] != NULL)
+            fclose(local_debugoutfile[i]);
+        local_debugoutfile[i] = NULL;
+    }
+    local_debugoutpath = NULL;
 }
\ No newline at end of file
@@ -2,9 +2,21 @@
 #define __DEBUGMODE_HEADER
 
     #include "device.h"
+    #include "packetring.h"
     #include <stdlib.h>
 
+    // How often debug mode checks the flashcart for data, in milliseconds
+    #define DEBUG_POLL_INTERVAL 10
+
+    // How long debug mode sleeps waiting for the flashcart to send data, in milliseconds
+    #define DEBUG_WAIT_TIMEOUT 100
+
     void  debug_main();
+    void  debug_wait(uint32_t timeout);
+    void  debug_wakeup();
+    void  debug_startreaders();
+    void  debug_stopreaders();
+    void  debug_getreaderstats(PacketRingStats* stats);
     void  debug_send(char* data);
     void  debug_setdebugout(char* path);
     void  debug_setbinaryout(char* path);
@@ -8,6 +8,12 @@ Passes flashcart communication to more specific functions
 #include "device_64drive.h"
 #include "device_everdrive.h"
 #include "device_sc64.h"
+#include "rom.h"
+#include "manifest.h"
+#include "autotune.h"
+#include "verify.h"
+#include "ftdi.h"
+#include "virtualcart.h"
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -15,47 +21,138 @@ Passes flashcart communication to more specific functions
     #include <shlwapi.h>
 #endif
 #include <atomic>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <algorithm>
 #pragma comment(lib, "Include/FTD2XX.lib")
 
 
 /*********************************
-        Function Pointers
+            Structures
 *********************************/
 
-DeviceError (*funcPointer_open)(CartDevice*);
-DeviceError (*funcPointer_sendrom)(CartDevice*, byte* rom, uint32_t size);
-DeviceError (*funcPointer_testdebug)(CartDevice*);
-uint32_t    (*funcPointer_rompadding)(uint32_t romsize);
-bool        (*funcPointer_explicitcic)(byte* bootcode);
-uint32_t    (*funcPointer_maxromsize)();
-DeviceError (*funcPointer_senddata)(CartDevice*, USBDataType datatype, byte* data, uint32_t size);
-DeviceError (*funcPointer_receivedata)(CartDevice*, uint32_t* dataheader, byte** buff);
-DeviceError (*funcPointer_close)(CartDevice*);
+typedef struct {
+    DeviceError (*open)(CartDevice*);
+    DeviceError (*applytuning)(CartDevice*);
+    DeviceError (*sendrom)(CartDevice*, RomStream* rom, uint32_t size);
+    DeviceError (*writeram)(CartDevice*, uint32_t offset, byte* data, uint32_t size);
+    DeviceError (*readrom)(CartDevice*, uint32_t offset, uint32_t size, byte* buff);
+    DeviceError (*testdebug)(CartDevice*);
+    uint32_t    (*rompadding)(uint32_t romsize);
+    bool        (*explicitcic)(RomImage* rom);
+    uint32_t    (*maxromsize)();
+    uint32_t    (*maxdatasize)();
+    DeviceError (*senddata)(CartDevice*, USBDataType datatype, const DataSegment* segments, uint32_t count);
+    DeviceError (*receivedata)(CartDevice*, uint32_t* dataheader, byte** buff);
+    DeviceError (*waitdata)(CartDevice*, uint32_t timeout);
+    DeviceError (*close)(CartDevice*);
+} CartDriver;
+
+typedef struct {
+    CartType          carttype;
+    bool              (*matches)(FTDIDevice* device);
+    DeviceError       (*probe)(FTDIDevice* device);
+    DeviceError       (*claim)(CartDevice* cart, FTDIDevice* device);
+    const CartDriver* driver;
+} CartMatcher;
+
+typedef enum {
+    TUNE_AUTO,
+    TUNE_FORCE,
+    TUNE_MANUAL,
+    TUNE_OFF
+} TuneMode;
+
+typedef struct {
+    CartDevice         cart;
+    const CartDriver*  driver;
+    uint32_t           usbindex;
+    bool               tuned;
+
+    // Upload
+    std::atomic<float> uploadprogress;
+    float              progressstart; // Where device_setuploadprogress's 0 to 100 lands in the overall progress
+    float              progressend;
+    UploadStats        uploadstats;
+    DeviceError        uploaderr;
+
+    // Last upload, for only sending what changed
+    uint64_t* lasthashes;
+    uint32_t  lasthashcount;
+    uint32_t  lastsize;
+    CICType   lastcic;
+    SaveType  lastsave;
+    bool      forcefullupload;
+} CartSession;
 
 
 /*********************************
         Function Prototypes
 *********************************/
 
-static void device_set_64drive1(CartDevice* cart);
-static void device_set_64drive2(CartDevice* cart);
-static void device_set_everdrive(CartDevice* cart);
-static void device_set_sc64(CartDevice* cart);
+static void device_runprobe(FTDIDevice* device, ProbeStats* stats, DeviceError (*probe)(FTDIDevice*));
+static bool device_comparerank(const FTDIDevice& a, const FTDIDevice& b);
+static DeviceError device_uploadrom();
+static void device_sendromthread(uint32_t index);
+static bool device_lastuploadvalid(uint32_t size);
+static void device_forgetupload();
+static void device_loadmanifest();
+static void device_savemanifest();
+static void device_getmanifestpath(char* path, size_t size);
+static DeviceError device_loadtuning();
 
 
 /*********************************
              Globals
 *********************************/
 
+// Drivers
+static const CartDriver local_driver_64drive = {
+    &device_open_64drive, &device_applytuning_64drive, &device_sendrom_64drive, &device_writeram_64drive, &device_readrom_64drive, &device_testdebug_64drive,
+    &device_rompadding_64drive, &device_explicitcic_64drive, &device_maxromsize_64drive, &device_maxdatasize_64drive,
+    &device_senddata_64drive, &device_receivedata_64drive, &device_waitdata_64drive, &device_close_64drive
+};
+static const CartDriver local_driver_everdrive = {
+    &device_open_everdrive, &device_applytuning_everdrive, &device_sendrom_everdrive, &device_writeram_everdrive, NULL, &device_testdebug_everdrive,
+    &device_rompadding_everdrive, &device_explicitcic_everdrive, &device_maxromsize_everdrive, &device_maxdatasize_everdrive,
+    &device_senddata_everdrive, &device_receivedata_everdrive, &device_waitdata_everdrive, &device_close_everdrive
+};
+static const CartDriver local_driver_sc64 = {
+    &device_open_sc64, &device_applytuning_sc64, &device_sendrom_sc64, &device_writeram_sc64, &device_readrom_sc64, &device_testdebug_sc64,
+    &device_rompadding_sc64, &device_explicitcic_sc64, &device_maxromsize_sc64, &device_maxdatasize_sc64,
+    &device_senddata_sc64, &device_receivedata_sc64, &device_waitdata_sc64, &device_close_sc64
+};
+
+// Detection, in order of priority. Matchers with a probe need to talk to the device to be sure
+static const CartMatcher local_matchers[] = {
+    {CART_64DRIVE1,  &device_matches_64drive1,  NULL,                    &device_claim_64drive1,  &local_driver_64drive},
+    {CART_64DRIVE2,  &device_matches_64drive2,  NULL,                    &device_claim_64drive2,  &local_driver_64drive},
+    {CART_EVERDRIVE, &device_matches_everdrive, &device_probe_everdrive, &device_claim_everdrive, &local_driver_everdrive},
+    {CART_SC64,      &device_matches_sc64,      NULL,                    &device_claim_sc64,      &local_driver_sc64},
+};
+static std::atomic<uint32_t>   local_bestrank (UINT32_MAX);
+static uint64_t                local_enumtime = 0;
+static std::vector<ProbeStats> local_probestats;
+static bool                    local_multicart = false;
+
 // File
 static char* local_rompath  = NULL;
+static RomImage* local_romimage = NULL;
+static char*     local_manifestpath = NULL;
+static bool      local_rememberuploads = false;
+
+// USB tuning
+static TuneMode  local_tunemode = TUNE_AUTO;
+static USBTuning local_tuneoverride;
 
-// Cart
-static CartDevice local_cart;
+// Carts. Each thread talks to the cart selected with device_selectcart, the first one by default
+static CartSession                     local_sessions[MAX_CARTS];
+static uint32_t                        local_sessioncount = 1;
+static thread_local CartSession*       local_session = &local_sessions[0];
 
 // Upload
 std::atomic<bool> local_uploadcancelled (false);
-std::atomic<float> local_uploadprogress (0.0f);
 
 
 /*==============================
@@ -65,168 +162,307 @@ std::atomic<float> local_uploadprogress (0.0f);
 
 void device_initialize()
 {
-    memset(&local_cart, 0, sizeof(CartDevice));
-    local_cart.carttype = CART_NONE;
-    local_cart.cictype  = CIC_NONE;
-    local_cart.savetype = SAVE_NONE;
-    local_cart.protocol = PROTOCOL_VERSION1;
+    for (uint32_t i=0; i<MAX_CARTS; i++)
+    {
+        CartSession* session = &local_sessions[i];
+        memset(&session->cart, 0, sizeof(CartDevice));
+        session->cart.carttype = CART_NONE;
+        session->cart.cictype  = CIC_NONE;
+        session->cart.savetype = SAVE_NONE;
+        session->cart.protocol = PROTOCOL_VERSION1;
+        session->driver = NULL;
+        session->uploadprogress = 0.0f;
+        session->progressstart = 0.0f;
+        session->progressend = 100.0f;
+        memset(&session->uploadstats, 0, sizeof(UploadStats));
+        session->uploaderr = DEVICEERR_OK;
+        session->lasthashes = NULL;
+        session->lasthashcount = 0;
+        session->lastsize = 0;
+        session->lastcic = CIC_NONE;
+        session->lastsave = SAVE_NONE;
+        session->forcefullupload = false;
+        session->tuned = false;
+    }
+    local_sessioncount = 1;
 }
 
 
 /*==============================
     device_find
-    Finds the flashcart plugged in to USB
+    Finds the flashcart plugged in to USB.
+    In multi-cart mode, every flashcart
+    that is found gets its own session.
     @return The DeviceError enum
 ==============================*/
 
 DeviceError device_find()
 {
-    // Look for 64drive HW1 (FT2232H Asynchronous FIFO mode)
-    if ((local_cart.carttype == CART_NONE || local_cart.carttype == CART_64DRIVE1))
+    DWORD device_count;
+    FT_DEVICE_LIST_INFO_NODE* device_info;
+    std::vector<FTDIDevice> found;
+    std::vector<FTDIDevice> candidates;
+    std::vector<std::thread> threads;
+    const uint32_t matchercount = sizeof(local_matchers)/sizeof(local_matchers[0]);
+    CartDevice settings = local_sessions[0].cart;
+    size_t first;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    local_probestats.clear();
+
+    // Enumerate the USB devices once, every matcher works from the same list
+    if (ftdi_createdeviceinfolist(&device_count) != FT_OK)
+        return DEVICEERR_USBBUSY;
+    if (device_count == 0)
+        return DEVICEERR_NODEVICES;
+    device_info = (FT_DEVICE_LIST_INFO_NODE*) malloc(sizeof(FT_DEVICE_LIST_INFO_NODE)*device_count);
+    if (device_info == NULL)
+        return DEVICEERR_MALLOCFAIL;
+    ftdi_getdeviceinfolist(device_info, &device_count);
+    local_enumtime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+    // Go through the matchers in order of priority. The first match that needs no probing wins, 
+    // unless a device that needs probing and comes before it turns out to be a cart
+    for (uint32_t m=0; m<matchercount && (local_multicart || found.empty()); m++)
     {
-        DeviceError err = device_test_64drive1(&local_cart);
-        if (err == DEVICEERR_OK)
-            device_set_64drive1(&local_cart);
-        else if (err != DEVICEERR_NOTCART)
-            return err;
+        if (settings.carttype != CART_NONE && settings.carttype != local_matchers[m].carttype)
+            continue;
+        for (uint32_t i=0; i<device_count; i++)
+        {
+            FTDIDevice device;
+            device.index = i;
+            device.id = device_info[i].ID;
+            device.rank = m*device_count + i;
+            snprintf(device.description, sizeof(device.description), "%s", device_info[i].Description);
+            snprintf(device.serial, sizeof(device.serial), "%s", device_info[i].SerialNumber);
+            if (!local_matchers[m].matches(&device))
+                continue;
+            if (local_matchers[m].probe != NULL)
+            {
+                candidates.push_back(device);
+                continue;
+            }
+            ProbeStats stats = {local_matchers[m].carttype, i, 0, DEVICEERR_OK, false};
+            local_probestats.push_back(stats);
+            found.push_back(device);
+            if (!local_multicart)
+                break;
+        }
     }
+    free(device_info);
 
-    // Look for 64drive HW2 (FT2232H Asynchronous FIFO mode)
-    if ((local_cart.carttype == CART_NONE || local_cart.carttype == CART_64DRIVE2))
+    // Probe the remaining candidates all at once, as each probe can take a while to time out.
+    // When looking for every cart, no probe can be cancelled
+    local_bestrank = (local_multicart || found.empty()) ? UINT32_MAX : found[0].rank;
+    first = local_probestats.size();
+    for (size_t c=0; c<candidates.size(); c++)
     {
-        DeviceError err = device_test_64drive2(&local_cart);
-        if (err == DEVICEERR_OK)
-            device_set_64drive2(&local_cart);
-        else if (err != DEVICEERR_NOTCART)
-            return err;
+        ProbeStats stats = {local_matchers[candidates[c].rank/device_count].carttype, candidates[c].index, 0, DEVICEERR_NOTCART, false};
+        local_probestats.push_back(stats);
     }
-
-    // Look for an EverDrive
-    if ((local_cart.carttype == CART_NONE || local_cart.carttype == CART_EVERDRIVE))
+    for (size_t c=0; c<candidates.size(); c++)
+        threads.push_back(std::thread(device_runprobe, &candidates[c], &local_probestats[first+c], local_matchers[candidates[c].rank/device_count].probe));
+    for (size_t c=0; c<threads.size(); c++)
+        threads[c].join();
+
+    // Collect the probes that found a cart. With a single cart, stop at the result 
+    // that a probe-by-probe search would have stopped at, which beats any match found earlier
+    for (size_t c=0; c<candidates.size(); c++)
     {
-        DeviceError err = device_test_everdrive(&local_cart);
+        DeviceError err = local_probestats[first+c].result;
         if (err == DEVICEERR_OK)
-            device_set_everdrive(&local_cart);
-        else if (err != DEVICEERR_NOTCART)
+        {
+            if (!local_multicart)
+            {
+                found.clear();
+                found.push_back(candidates[c]);
+                break;
+            }
+            found.push_back(candidates[c]);
+        }
+        else if (err != DEVICEERR_NOTCART && !local_multicart)
             return err;
     }
+    if (found.empty())
+        return DEVICEERR_CARTFINDFAIL;
+    std::sort(found.begin(), found.end(), device_comparerank);
+    if (found.size() > MAX_CARTS)
+        found.resize(MAX_CARTS);
 
-    // Look for SC64
-    if ((local_cart.carttype == CART_NONE || local_cart.carttype == CART_SC64))
+    // Give each cart that was found its own session, with the settings that were given for the first one
+    for (size_t k=0; k<found.size(); k++)
     {
-        DeviceError err = device_test_sc64(&local_cart);
-        if (err == DEVICEERR_OK)
-            device_set_sc64(&local_cart);
-        else if (err != DEVICEERR_NOTCART)
+        CartSession* session = &local_sessions[k];
+        const CartMatcher* matcher = &local_matchers[found[k].rank/device_count];
+        DeviceError err;
+        session->cart = settings;
+        session->cart.carttype = matcher->carttype;
+        session->cart.identity[0] = '\0';
+        session->cart.structure = NULL;
+        session->cart.tuning.latency = FTDI_DEFAULT_LATENCY;
+        session->cart.tuning.transfersize = FTDI_DEFAULT_TRANSFERSIZE;
+        session->cart.tuning.romchunk = 0;
+        session->cart.tuning.datachunk = 0;
+        err = matcher->claim(&session->cart, &found[k]);
+        if (err != DEVICEERR_OK)
             return err;
+        session->driver = matcher->driver;
+        session->usbindex = found[k].index;
     }
-
-    // Finish
-    if (local_cart.carttype == CART_NONE)
-        return DEVICEERR_CARTFINDFAIL;
+    local_sessioncount = (uint32_t)found.size();
     return DEVICEERR_OK;
 }
 
 
 /*==============================
-    device_set_64drive1
-    Marks the cart as being 64Drive HW1
-    @param A pointer to the cart context
-    @param The index of the cart
+    device_comparerank
+    Sorts USB devices by priority
+    @param  The first USB device
+    @param  The second USB device
+    @return Whether the first device comes 
+            before the second
 ==============================*/
 
-static void device_set_64drive1(CartDevice* cart)
+static bool device_comparerank(const FTDIDevice& a, const FTDIDevice& b)
 {
-    // Set cart settings
-    cart->carttype = CART_64DRIVE1;
-
-    // Set function pointers
-    funcPointer_open = &device_open_64drive;
-    funcPointer_maxromsize = &device_maxromsize_64drive;
-    funcPointer_rompadding = &device_rompadding_64drive;
-    funcPointer_explicitcic = &device_explicitcic_64drive;
-    funcPointer_sendrom = &device_sendrom_64drive;
-    funcPointer_testdebug = &device_testdebug_64drive;
-    funcPointer_senddata = &device_senddata_64drive;
-    funcPointer_receivedata = &device_receivedata_64drive;
-    funcPointer_close = &device_close_64drive;
+    return a.rank < b.rank;
 }
 
 
 /*==============================
-    device_set_64drive2
-    Marks the cart as being 64Drive HW2
-    @param A pointer to the cart context
-    @param The index of the cart
+    device_runprobe
+    Runs a probe on its own thread, timing it
+    @param A pointer to the USB device info
+    @param A pointer to store the results in
+    @param The probe function to run
 ==============================*/
 
-static void device_set_64drive2(CartDevice* cart)
+static void device_runprobe(FTDIDevice* device, ProbeStats* stats, DeviceError (*probe)(FTDIDevice*))
 {
-    // Do exactly the same as device_set_64drive1
-    device_set_64drive1(cart);
-    cart->carttype = CART_64DRIVE2;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // Skip the probe entirely if a better match was already found
+    if (device_probecancelled(device))
+    {
+        stats->result = DEVICEERR_NOTCART;
+        stats->cancelled = true;
+        return;
+    }
+    stats->result = probe(device);
+    stats->cancelled = (stats->result == DEVICEERR_NOTCART && device_probecancelled(device));
+
+    // Let the probes that can no longer win know that they can stop
+    if (stats->result == DEVICEERR_OK && !local_multicart)
+    {
+        uint32_t current = local_bestrank.load();
+        while (device->rank < current && !local_bestrank.compare_exchange_weak(current, device->rank))
+            ;
+    }
+    stats->time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
 }
 
 
 /*==============================
-    device_set_everdrive
-    Marks the cart as being EverDrive
-    @param A pointer to the cart context
-    @param The index of the cart
+    device_probecancelled
+    Checks whether a probe can stop early
+    because a cart with a higher priority
+    was already found
+    @param  A pointer to the USB device info
+    @return Whether the probe can stop
 ==============================*/
 
-static void device_set_everdrive(CartDevice* cart)
+bool device_probecancelled(FTDIDevice* device)
 {
-    // Set cart settings
-    cart->carttype = CART_EVERDRIVE;
-
-    // Set function pointers
-    funcPointer_open = &device_open_everdrive;
-    funcPointer_maxromsize = &device_maxromsize_everdrive;
-    funcPointer_rompadding = &device_rompadding_everdrive;
-    funcPointer_explicitcic = &device_explicitcic_everdrive;
-    funcPointer_sendrom = &device_sendrom_everdrive;
-    funcPointer_testdebug = &device_testdebug_everdrive;
-    funcPointer_senddata = &device_senddata_everdrive;
-    funcPointer_receivedata = &device_receivedata_everdrive;
-    funcPointer_close = &device_close_everdrive;
+    return device->rank > local_bestrank.load();
 }
 
 
 /*==============================
-    device_set_sc64
-    Marks the cart as being SC64
-    @param A pointer to the cart context
-    @param The index of the cart
+    device_getdetectstats
+    Gets how long the last cart detection
+    took, probe by probe
+    @param A pointer to store the USB 
+           enumeration time in, in microseconds
+    @param A pointer to store the probe 
+           results in
+    @param A pointer to store the number
+           of probes in
 ==============================*/
 
-static void device_set_sc64(CartDevice* cart)
+void device_getdetectstats(uint64_t* enumtime, const ProbeStats** probes, uint32_t* count)
 {
-    // Set cart settings
-    cart->carttype = CART_SC64;
-
-    // Set function pointers
-    funcPointer_open = &device_open_sc64;
-    funcPointer_maxromsize = &device_maxromsize_sc64;
-    funcPointer_rompadding = &device_rompadding_sc64;
-    funcPointer_explicitcic = &device_explicitcic_sc64;
-    funcPointer_sendrom = &device_sendrom_sc64;
-    funcPointer_testdebug = &device_testdebug_sc64;
-    funcPointer_senddata = &device_senddata_sc64;
-    funcPointer_receivedata = &device_receivedata_sc64;
-    funcPointer_close = &device_close_sc64;
+    (*enumtime) = local_enumtime;
+    (*probes) = local_probestats.empty() ? NULL : &local_probestats[0];
+    (*count) = (uint32_t)local_probestats.size();
 }
 
 
 /*==============================
     device_open
-    Calls the function to open the flashcart
+    Calls the function to open every
+    flashcart that was found
     @param The device error, or OK
 ==============================*/
 
 DeviceError device_open()
 {
-    return funcPointer_open(&local_cart);
+    CartSession* selected = local_session;
+    for (uint32_t i=0; i<local_sessioncount; i++)
+    {
+        DeviceError err;
+        local_session = &local_sessions[i];
+        err = local_session->driver->open(&local_session->cart);
+        if (err == DEVICEERR_OK)
+            err = device_loadtuning();
+        if (err != DEVICEERR_OK)
+        {
+            local_session = selected;
+            return err;
+        }
+    }
+    local_session = selected;
+    return DEVICEERR_OK;
+}
+
+
+/*==============================
+    device_loadtuning
+    Sets up the selected cart's USB settings,
+    from its saved profile or the ones given
+    by the user
+    @return The device error, or OK
+==============================*/
+
+static DeviceError device_loadtuning()
+{
+    CartDevice* cart = &local_session->cart;
+    USBTuning profile;
+    char path[512];
+
+    // Turning tuning off leaves the USB settings alone entirely
+    local_session->tuned = (local_tunemode == TUNE_OFF || local_tunemode == TUNE_MANUAL);
+    if (local_tunemode == TUNE_OFF)
+        return DEVICEERR_OK;
+
+    // Virtual carts are tuned every time, as their speed is whatever they were told to be
+    if (local_tunemode != TUNE_FORCE && !device_isvirtual() && autotune_getprofilepath(path, sizeof(path)) && autotune_load(path, cart, &profile))
+    {
+        cart->tuning = profile;
+        local_session->tuned = true;
+    }
+
+    // Settings given by the user win over the profile
+    if (local_tunemode == TUNE_MANUAL)
+    {
+        if (local_tuneoverride.latency != 0)
+            cart->tuning.latency = local_tuneoverride.latency;
+        if (local_tuneoverride.transfersize != 0)
+            cart->tuning.transfersize = local_tuneoverride.transfersize;
+        if (local_tuneoverride.romchunk != 0)
+            cart->tuning.romchunk = local_tuneoverride.romchunk;
+        if (local_tuneoverride.datachunk != 0)
+            cart->tuning.datachunk = local_tuneoverride.datachunk;
+    }
+    return local_session->driver->applytuning(cart);
 }
 
 
@@ -238,7 +474,7 @@ DeviceError device_open()
 
 bool device_isopen()
 {
-    return (local_cart.structure != NULL);
+    return (local_session->cart.structure != NULL);
 }
 
 
@@ -251,7 +487,20 @@ bool device_isopen()
 
 uint32_t device_getmaxromsize()
 {
-    return funcPointer_maxromsize();
+    return local_session->driver->maxromsize();
+}
+
+
+/*==============================
+    device_getmaxdatasize
+    Gets the most data that the flashcart
+    can send to the console in one go
+    @return The max data size
+==============================*/
+
+uint32_t device_getmaxdatasize()
+{
+    return local_session->driver->maxdatasize();
 }
 
 
@@ -264,7 +513,7 @@ uint32_t device_getmaxromsize()
 
 uint32_t device_rompadding(uint32_t romsize)
 {
-    return funcPointer_rompadding(romsize);
+    return local_session->driver->rompadding(romsize);
 }
 
 
@@ -278,77 +527,388 @@ uint32_t device_rompadding(uint32_t romsize)
 
 bool device_explicitcic()
 {
-    CICType oldcic = local_cart.cictype;
-    FILE* fp = fopen(local_rompath, "rb");
-    byte* bootcode = (byte*) malloc(4032);
-
-    // Check fopen/malloc worked
-    if (fp == NULL || bootcode == NULL)
+    CICType oldcic = local_session->cart.cictype;
+    if (local_romimage == NULL)
         return false;
+    local_session->driver->explicitcic(local_romimage);
+    return oldcic != local_session->cart.cictype;
+}
 
-    // Read the bootcode
-    fseek(fp, 0x40, SEEK_SET);
-    if (fread(bootcode, 1, 4032, fp) != 4032)
-        return false;
-    fseek(fp, 0, SEEK_SET);
 
-    // Check the CIC
-    funcPointer_explicitcic(bootcode);
-    free(bootcode);
-    fclose(fp);
-    return oldcic != local_cart.cictype;
+/*==============================
+    device_loadrom
+    Opens the ROM file set with device_setrom,
+    replacing the previously loaded one
+    @return The device error, or OK
+==============================*/
+
+DeviceError device_loadrom()
+{
+    RomImage* image;
+    DeviceError err = romimage_open(&image, local_rompath);
+    if (err != DEVICEERR_OK)
+        return err;
+    device_setromimage(image);
+    return DEVICEERR_OK;
+}
+
+
+/*==============================
+    device_setromimage
+    Replaces the loaded ROM with one that was
+    opened elsewhere, such as one prepared in
+    the background. The device takes ownership
+    of the image.
+    @param A pointer to the ROM image
+==============================*/
+
+void device_setromimage(RomImage* image)
+{
+    if (image == local_romimage)
+        return;
+    romimage_close(local_romimage);
+    local_romimage = image;
+}
+
+
+/*==============================
+    device_getromimage
+    Gets the ROM loaded with device_loadrom
+    @return A pointer to the ROM image, or 
+            NULL if none was loaded
+==============================*/
+
+RomImage* device_getromimage()
+{
+    return local_romimage;
 }
 
 /*==============================
     device_sendrom
-    Opens the ROM and calls the function to send it to the flashcart
-    @param The ROM FILE pointer
-    @param The size of the ROM in bytes
+    Streams the ROM to the flashcart in chunks.
+    If the cart can be read from, only the 
+    parts that changed since the last upload
+    are sent.
+    @return The device error, or OK
 ==============================*/
 
-DeviceError device_sendrom(FILE* rom, uint32_t filesize)
+DeviceError device_sendrom()
+{
+    device_resetupload();
+    return device_uploadrom();
+}
+
+
+/*==============================
+    device_resetupload
+    Clears the cancel upload flag, and the
+    selected cart's upload progress, before
+    something new is uploaded
+==============================*/
+
+void device_resetupload()
 {
-    bool is_v64 = false;
-    uint32_t originalsize = filesize;
-    byte* rom_buffer;
-    DeviceError err;
-    
-    // Initialize upload checker globals
     local_uploadcancelled = false;
-    local_uploadprogress = 0.0f;
+    local_session->uploadprogress = 0.0f;
+}
 
-    // Pad the ROM if necessary
-    filesize = funcPointer_rompadding(filesize);
 
-    // Check we managed to malloc
-    rom_buffer = (byte*) malloc(sizeof(byte)*filesize);
-    if (rom_buffer == NULL)
-        return DEVICEERR_MALLOCFAIL;
+/*==============================
+    device_uploadrom
+    Does the work of device_sendrom for the
+    selected cart, without resetting the
+    upload checker globals
+    @return The device error, or OK
+==============================*/
 
-    // Read the ROM into a buffer
-    fseek(rom, 0, SEEK_SET);
-    if (fread(rom_buffer, 1, originalsize, rom) != originalsize)
-        return DEVICEERR_FILEREADFAIL;
-    fseek(rom, 0, SEEK_SET);
+static DeviceError device_uploadrom()
+{
+    RomStream* stream;
+    DeviceError err;
+    uint32_t size = local_session->driver->rompadding(romimage_getsize(local_romimage));
 
-    // Check if we have a V64 ROM
-    if (!(rom_buffer[0] == 0x80 && rom_buffer[1] == 0x37 && rom_buffer[2] == 0x12 && rom_buffer[3] == 0x40))
-        is_v64 = true;
+    // Prepare the ROM for streaming, padding it if necessary
+    err = romstream_open(&stream, local_romimage, size);
+    if (err != DEVICEERR_OK)
+        return err;
 
-    // Byteswap if it's a V64 ROM
-    if (is_v64)
-        for (uint32_t i=0; i<filesize; i+=2)
-            SWAP(rom_buffer[i], rom_buffer[i+1]);
+    // Work out which parts of the ROM changed since the last upload
+    if (local_session->driver->readrom != NULL)
+    {
+        if (local_session->lasthashes == NULL && !local_session->forcefullupload)
+            device_loadmanifest();
+        if (!local_session->forcefullupload && device_lastuploadvalid(size))
+            err = romstream_compare(stream, local_session->lasthashes, local_session->lasthashcount);
+        else
+            err = romstream_compare(stream, NULL, 0);
+        if (err != DEVICEERR_OK)
+        {
+            romstream_close(stream);
+            return err;
+        }
+    }
+    local_session->forcefullupload = false;
+
+    // Forget the last upload, as the cart contents won't match it if this one fails
+    device_forgetupload();
+    if (local_manifestpath != NULL && local_session->driver->readrom != NULL)
+    {
+        char path[512];
+        device_getmanifestpath(path, sizeof(path));
+        remove(path);
+    }
 
     // Upload the ROM
-    err = funcPointer_sendrom(&local_cart, rom_buffer, filesize);
-    free(rom_buffer);
+    err = local_session->driver->sendrom(&local_session->cart, stream, size);
+    romstream_getstats(stream, &local_session->uploadstats);
+    local_session->uploadstats.romsize = size;
+
+    // Remember what was uploaded, if anything is going to compare against it
+    if (err == DEVICEERR_OK && !device_uploadcancelled() && local_session->driver->readrom != NULL && (local_rememberuploads || local_manifestpath != NULL))
+    {
+        uint32_t count;
+        const uint64_t* hashes;
+        if (romimage_gethashes(local_romimage, size, &hashes, &count) == DEVICEERR_OK)
+            local_session->lasthashes = (uint64_t*) malloc(sizeof(uint64_t)*count);
+        if (local_session->lasthashes != NULL)
+        {
+            memcpy(local_session->lasthashes, hashes, sizeof(uint64_t)*count);
+            local_session->lasthashcount = count;
+            local_session->lastsize = size;
+            local_session->lastcic = local_session->cart.cictype;
+            local_session->lastsave = local_session->cart.savetype;
+            device_savemanifest();
+        }
+    }
+
+    // Cleanup
+    romstream_close(stream);
     if (err != DEVICEERR_OK)
         device_cancelupload();
     return err;
 }
 
 
+/*==============================
+    device_forcefullupload
+    Makes the next ROM upload send the
+    entire ROM to every cart, even if parts
+    of it did not change
+==============================*/
+
+void device_forcefullupload()
+{
+    for (uint32_t i=0; i<local_sessioncount; i++)
+        local_sessions[i].forcefullupload = true;
+}
+
+
+/*==============================
+    device_canverify
+    Checks whether the selected cart can read
+    the ROM back to verify it
+    @return Whether the cart can be verified
+==============================*/
+
+bool device_canverify()
+{
+    return local_session->driver->readrom != NULL;
+}
+
+
+/*==============================
+    device_verifyrom
+    Reads the ROM back from the selected cart
+    and checks that it matches the file.
+    If it doesn't, the next upload sends the
+    entire ROM again.
+    @param  A pointer to store the result in
+    @return The device error, or OK
+==============================*/
+
+DeviceError device_verifyrom(VerifyResult* result)
+{
+    DeviceError err;
+    uint32_t size = local_session->driver->rompadding(romimage_getsize(local_romimage));
+
+    local_session->uploadprogress = 0.0f;
+    err = verify_run(&local_session->cart, local_session->driver->readrom, local_romimage, size, result);
+    if (err == DEVICEERR_OK && !result->matched)
+    {
+        device_forgetupload();
+        if (local_manifestpath != NULL)
+        {
+            char path[512];
+            device_getmanifestpath(path, sizeof(path));
+            remove(path);
+        }
+    }
+    return err;
+}
+
+
+/*==============================
+    device_lastuploadvalid
+    Checks whether the cart still holds the
+    last uploaded ROM, by reading back a 
+    couple of the blocks that did not change
+    and comparing their hashes. If the cart
+    was power cycled or loaded by something
+    else, these will not match.
+    @param  The padded size of the ROM in bytes
+    @return Whether only the changes need 
+            to be uploaded
+==============================*/
+
+static bool device_lastuploadvalid(uint32_t size)
+{
+    byte* buff;
+    uint32_t count;
+    uint32_t wholeblocks = romimage_getsize(local_romimage)/ROM_HASHBLOCK_SIZE;
+    int32_t canaries[2] = {-1, -1};
+    const uint64_t* hashes;
+
+    // Check the last upload matches this one's settings before hashing anything
+    if (local_session->lasthashes == NULL || local_session->lastsize != size)
+        return false;
+    if (local_session->lastcic != local_session->cart.cictype || local_session->lastsave != local_session->cart.savetype)
+        return false;
+    if (romimage_gethashes(local_romimage, size, &hashes, &count) != DEVICEERR_OK || local_session->lasthashcount != count)
+        return false;
+
+    // Pick the first and last blocks that are the same as the last upload.
+    // Blocks that reach into the padding are skipped, as the 64Drive corrupts the end of an upload
+    for (uint32_t i=0; i<count && i<wholeblocks; i++)
+    {
+        if (hashes[i] != local_session->lasthashes[i])
+            continue;
+        if (canaries[0] == -1)
+            canaries[0] = i;
+        canaries[1] = i;
+    }
+
+    // If everything changed, then there's nothing to skip
+    if (canaries[0] == -1)
+        return false;
+
+    // Read them back from the cart and compare
+    buff = (byte*) malloc(ROM_HASHBLOCK_SIZE);
+    if (buff == NULL)
+        return false;
+    for (int i=0; i<2; i++)
+    {
+        uint32_t offset = canaries[i]*ROM_HASHBLOCK_SIZE;
+        if (local_session->driver->readrom(&local_session->cart, offset, ROM_HASHBLOCK_SIZE, buff) != DEVICEERR_OK || romimage_hashblock(buff, ROM_HASHBLOCK_SIZE) != local_session->lasthashes[canaries[i]])
+        {
+            free(buff);
+            return false;
+        }
+    }
+    free(buff);
+    return true;
+}
+
+
+/*==============================
+    device_loadmanifest
+    Loads the last upload from the manifest
+    file, if it was made for this cart
+==============================*/
+
+static void device_loadmanifest()
+{
+    Manifest manifest;
+    char path[512];
+    if (local_manifestpath == NULL)
+        return;
+    device_getmanifestpath(path, sizeof(path));
+    if (!manifest_load(path, &manifest))
+        return;
+
+    // The manifest is only useful if it describes this exact cart. 
+    // The ROM path is not checked, as different ROMs often share most of their data
+    if (manifest.carttype == local_session->cart.carttype && local_session->cart.identity[0] != '\0' && 
+        !strcmp(manifest.identity, local_session->cart.identity) && manifest.blocksize == ROM_HASHBLOCK_SIZE)
+    {
+        local_session->lasthashes = manifest.hashes;
+        local_session->lasthashcount = manifest.hashcount;
+        local_session->lastsize = manifest.romsize;
+        local_session->lastcic = manifest.cictype;
+        local_session->lastsave = manifest.savetype;
+        return;
+    }
+    manifest_free(&manifest);
+}
+
+
+/*==============================
+    device_savemanifest
+    Writes the last upload to the manifest 
+    file, so that the next run of the program 
+    can skip what is already on the cart
+==============================*/
+
+static void device_savemanifest()
+{
+    Manifest manifest;
+    char path[512];
+    if (local_manifestpath == NULL || local_session->lasthashes == NULL || local_session->cart.identity[0] == '\0')
+        return;
+
+    // Describe the last upload
+    memset(&manifest, 0, sizeof(Manifest));
+    manifest.carttype = local_session->cart.carttype;
+    snprintf(manifest.identity, sizeof(manifest.identity), "%s", local_session->cart.identity);
+    if (local_rompath != NULL)
+        snprintf(manifest.rompath, sizeof(manifest.rompath), "%s", local_rompath);
+    manifest.blocksize = ROM_HASHBLOCK_SIZE;
+    manifest.romsize = local_session->lastsize;
+    manifest.cictype = local_session->lastcic;
+    manifest.savetype = local_session->lastsave;
+    manifest.hashcount = local_session->lasthashcount;
+    manifest.hashes = local_session->lasthashes;
+
+    // Write it, it's not a problem if this fails as the next upload will just send everything
+    device_getmanifestpath(path, sizeof(path));
+    manifest_save(path, &manifest);
+}
+
+
+/*==============================
+    device_getmanifestpath
+    Gets the path of the selected cart's
+    manifest file. With several carts, each
+    one after the first gets its own file
+    with the cart number appended.
+    @param The buffer to store the path in
+    @param The size of the buffer
+==============================*/
+
+static void device_getmanifestpath(char* path, size_t size)
+{
+    uint32_t index = device_getselectedcart();
+    if (index == 0)
+        snprintf(path, size, "%s", local_manifestpath);
+    else
+        snprintf(path, size, "%s.%d", local_manifestpath, index);
+}
+
+
+/*==============================
+    device_forgetupload
+    Forgets the last uploaded ROM, so that
+    the next upload sends the entire ROM
+==============================*/
+
+static void device_forgetupload()
+{
+    free(local_session->lasthashes);
+    local_session->lasthashes = NULL;
+    local_session->lasthashcount = 0;
+    local_session->lastsize = 0;
+}
+
+
 /*==============================
     device_testdebug
     Checks whether this cart can use debug mode
@@ -357,22 +917,25 @@ DeviceError device_sendrom(FILE* rom, uint32_t filesize)
 
 DeviceError device_testdebug()
 {
-    return funcPointer_testdebug(&local_cart);
+    return local_session->driver->testdebug(&local_session->cart);
 }
 
 
 /*==============================
     device_senddata
-    Sends data to the connected flashcart
+    Sends data to the connected flashcart. The
+    data can be split across several buffers,
+    which are sent one after the other as if
+    they were a single one.
     @param  The datatype that is being sent
-    @param  A buffer containing said data
-    @param  The size of the data
+    @param  The segments that make up the data
+    @param  The number of segments
     @return The device error, or OK
 ==============================*/
 
-DeviceError device_senddata(USBDataType datatype, byte* data, uint32_t size)
+DeviceError device_senddata(USBDataType datatype, const DataSegment* segments, uint32_t count)
 {
-    return funcPointer_senddata(&local_cart, datatype, data, size);
+    return local_session->driver->senddata(&local_session->cart, datatype, segments, count);
 }
 
 
@@ -383,37 +946,172 @@ DeviceError device_senddata(USBDataType datatype, byte* data, uint32_t size)
             the received data header will be
             stored.
     @param  A pointer to a byte buffer pointer
-            where the data will be malloc'ed into.
+            where the data will be stored. It
+            comes from the packet pool, so it
+            must be freed with packetpool_release.
     @return The device error, or OK
 ==============================*/
 
 DeviceError device_receivedata(uint32_t* dataheader, byte** buff)
 {
-    return funcPointer_receivedata(&local_cart, dataheader, buff);
+    return local_session->driver->receivedata(&local_session->cart, dataheader, buff);
+}
+
+
+/*==============================
+    device_waitdata
+    Sleeps until the connected flashcart has
+    data for us, or until device_wakeup is called
+    @param  The most time to wait, in milliseconds
+    @return The device error, or OK
+==============================*/
+
+DeviceError device_waitdata(uint32_t timeout)
+{
+    return local_session->driver->waitdata(&local_session->cart, timeout);
+}
+
+
+/*==============================
+    device_wakeup
+    Wakes up every thread sleeping
+    in device_waitdata
+==============================*/
+
+void device_wakeup()
+{
+    ftdi_wakeall();
 }
 
 
 /*==============================
     device_close
-    Calls the function to close the flashcart
+    Calls the function to close every
+    flashcart that is open
     @param The device error, or OK
 ==============================*/
 
 DeviceError device_close()
 {
-    DeviceError err;
+    DeviceError err = DEVICEERR_OK;
+    CartSession* selected = local_session;
 
-    // Should never happen, but just in case...
-    if (local_cart.structure == NULL)
-        return DEVICEERR_OK;
+    // We're done with the ROM too
+    romimage_close(local_romimage);
+    local_romimage = NULL;
 
-    // Close the device
-    err = funcPointer_close(&local_cart);
-    local_cart.structure = NULL;
+    // Close the devices
+    for (uint32_t i=0; i<local_sessioncount; i++)
+    {
+        DeviceError closeerr;
+        local_session = &local_sessions[i];
+        if (local_session->cart.structure == NULL) // Should never happen, but just in case...
+            continue;
+        closeerr = local_session->driver->close(&local_session->cart);
+        local_session->cart.structure = NULL;
+        device_forgetupload();
+        if (err == DEVICEERR_OK)
+            err = closeerr;
+    }
+    local_session = selected;
     return err;
 }
 
 
+/*==============================
+    device_broadcastrom
+    Uploads the ROM to every cart at the
+    same time, each one on its own thread
+    @return The first device error, or OK
+==============================*/
+
+DeviceError device_broadcastrom()
+{
+    std::vector<std::thread> threads;
+    if (local_sessioncount == 1)
+        return device_sendrom();
+
+    // Upload to all the carts, and wait for them to finish
+    local_uploadcancelled = false;
+    for (uint32_t i=0; i<local_sessioncount; i++)
+        local_sessions[i].uploadprogress = 0.0f;
+    for (uint32_t i=0; i<local_sessioncount; i++)
+        threads.push_back(std::thread(device_sendromthread, i));
+    for (uint32_t i=0; i<local_sessioncount; i++)
+        threads[i].join();
+    for (uint32_t i=0; i<local_sessioncount; i++)
+        if (local_sessions[i].uploaderr != DEVICEERR_OK)
+            return local_sessions[i].uploaderr;
+    return DEVICEERR_OK;
+}
+
+
+/*==============================
+    device_sendromthread
+    Uploads the ROM to a single cart, on
+    a thread started by device_broadcastrom
+    @param The index of the cart
+==============================*/
+
+static void device_sendromthread(uint32_t index)
+{
+    device_selectcart(index);
+    local_session->uploaderr = device_uploadrom();
+}
+
+
+/*==============================
+    device_setmulticart
+    Sets whether every flashcart that is
+    plugged in should be used, rather than
+    just the first one
+    @param Whether to use every flashcart
+==============================*/
+
+void device_setmulticart(bool val)
+{
+    local_multicart = val;
+}
+
+
+/*==============================
+    device_getcartcount
+    Gets how many flashcarts were found
+    @return The number of flashcarts
+==============================*/
+
+uint32_t device_getcartcount()
+{
+    return local_sessioncount;
+}
+
+
+/*==============================
+    device_selectcart
+    Selects the flashcart that the calling 
+    thread talks to
+    @param The index of the flashcart
+==============================*/
+
+void device_selectcart(uint32_t index)
+{
+    local_session = &local_sessions[index];
+}
+
+
+/*==============================
+    device_getselectedcart
+    Gets the flashcart that the calling 
+    thread talks to
+    @return The index of the flashcart
+==============================*/
+
+uint32_t device_getselectedcart()
+{
+    return (uint32_t)(local_session - local_sessions);
+}
+
+
 /*==============================
     device_setrom
     Sets the path of the ROM to load
@@ -437,6 +1135,88 @@ bool device_setrom(char* path)
 }
 
 
+/*==============================
+    device_setmanifest
+    Sets the path of the manifest file used 
+    to remember uploads between runs
+    @param The path to the manifest file
+==============================*/
+
+void device_setmanifest(char* path)
+{
+    local_manifestpath = path;
+}
+
+
+/*==============================
+    device_rememberuploads
+    Sets whether to remember what was 
+    uploaded, so that the next upload
+    only needs to send what changed
+    @param Whether to remember uploads
+==============================*/
+
+void device_rememberuploads(bool val)
+{
+    local_rememberuploads = val;
+}
+
+
+/*==============================
+    device_setvirtual
+    Uses emulated flashcarts instead of
+    the USB devices
+    @param  The virtual cart spec
+    @return Whether the spec was valid
+==============================*/
+
+bool device_setvirtual(const char* spec)
+{
+    return ftdi_usevirtual(spec);
+}
+
+
+/*==============================
+    device_isvirtual
+    Checks whether emulated flashcarts are
+    used instead of the USB devices
+    @return Whether the carts are virtual
+==============================*/
+
+bool device_isvirtual()
+{
+    return ftdi_isvirtual();
+}
+
+
+/*==============================
+    device_settuning
+    Sets how the carts' USB settings are
+    picked: "auto" uses the saved profile or
+    tunes the cart once, "force" tunes it
+    again, "off" leaves the settings alone,
+    and anything else is a list of settings
+    to use, like "latency=2,chunk=1M"
+    @param  The tuning mode
+    @return Whether the mode was valid
+==============================*/
+
+bool device_settuning(const char* mode)
+{
+    if (!strcmp(mode, "auto"))
+        local_tunemode = TUNE_AUTO;
+    else if (!strcmp(mode, "force"))
+        local_tunemode = TUNE_FORCE;
+    else if (!strcmp(mode, "off"))
+        local_tunemode = TUNE_OFF;
+    else if (autotune_parse(mode, &local_tuneoverride))
+        local_tunemode = TUNE_MANUAL;
+    else
+        return false;
+    return true;
+}
+
+
 /*==============================
     device_setcart
     Forces a flashcart
@@ -445,7 +1225,7 @@ bool device_setrom(char* path)
 
 void device_setcart(CartType cart)
 {
-    local_cart.carttype = cart;
+    local_session->cart.carttype = cart;
 }
 
 
@@ -457,7 +1237,7 @@ void device_setcart(CartType cart)
 
 void device_setcic(CICType cic)
 {
-    local_cart.cictype = cic;
+    local_session->cart.cictype = cic;
 }
 
 
@@ -469,7 +1249,7 @@ void device_setcic(CICType cic)
 
 void device_setsave(SaveType save)
 {
-    local_cart.savetype = save;
+    local_session->cart.savetype = save;
 }
 
 
@@ -494,7 +1274,7 @@ char* device_getrom()
 
 CartType device_getcart()
 {
-    return local_cart.carttype;
+    return local_session->cart.carttype;
 }
 
 
@@ -506,7 +1286,7 @@ CartType device_getcart()
 
 CICType device_getcic()
 {
-    return local_cart.cictype;
+    return local_session->cart.cictype;
 }
 
 
@@ -518,7 +1298,7 @@ CICType device_getcic()
 
 SaveType device_getsave()
 {
-    return local_cart.savetype;
+    return local_session->cart.savetype;
 }
 
 
@@ -555,20 +1335,150 @@ bool device_uploadcancelled()
 
 void device_setuploadprogress(float progress)
 {
-    local_uploadprogress = progress;
+    local_session->uploadprogress = local_session->progressstart + (local_session->progressend - local_session->progressstart)*(progress/100.0f);
+}
+
+
+/*==============================
+    device_setuploadrange
+    Makes device_setuploadprogress only cover
+    part of the overall progress, for when an
+    upload is made of several smaller ones
+    @param The overall progress at 0
+    @param The overall progress at 100
+==============================*/
+
+void device_setuploadrange(float start, float end)
+{
+    local_session->progressstart = start;
+    local_session->progressend = end;
 }
 
 
 /*==============================
     device_getuploadprogress
-    Returns the current upload progress
+    Returns the current upload progress.
+    With several carts, this is the progress
+    of the one that is furthest behind.
     @return The upload progress from 0
             to 100.
 ==============================*/
 
 float device_getuploadprogress()
 {
-    return local_uploadprogress.load();
+    float progress = local_sessions[0].uploadprogress.load();
+    for (uint32_t i=1; i<local_sessioncount; i++)
+        if (local_sessions[i].uploadprogress.load() < progress)
+            progress = local_sessions[i].uploadprogress.load();
+    return progress;
+}
+
+
+/*==============================
+    device_getuploadstats
+    Gets the timing statistics of the
+    last ROM upload
+    @param A pointer to the stats to fill
+==============================*/
+
+void device_getuploadstats(UploadStats* stats)
+{
+    (*stats) = local_session->uploadstats;
+}
+
+
+/*==============================
+    device_getusbstats
+    Gets the number of USB calls made and
+    bytes moved so far, across all carts
+    @param A pointer to store the stats in
+==============================*/
+
+void device_getusbstats(USBStats* stats)
+{
+    ftdi_getstats(stats);
+}
+
+
+/*==============================
+    device_simulateconsole
+    Makes the console on the selected cart
+    send data to the host. Only virtual
+    carts can do this.
+    @param  The datatype to send
+    @param  The data to send
+    @param  The size of the data
+    @return Whether the data was sent
+==============================*/
+
+bool device_simulateconsole(USBDataType datatype, byte* data, uint32_t size)
+{
+    if (!ftdi_isvirtual())
+        return false;
+    return virtualcart_consolesend(local_session->usbindex, datatype, data, size) == FT_OK;
+}
+
+
+/*==============================
+    device_needstuning
+    Checks whether the selected cart has
+    no USB profile yet, and can be tuned
+    @return Whether device_autotune should
+            be called before uploading
+==============================*/
+
+bool device_needstuning()
+{
+    return !local_session->tuned && local_session->driver->writeram != NULL;
+}
+
+
+/*==============================
+    device_autotune
+    Finds the fastest USB settings for the
+    selected cart, and saves them for next
+    time. This overwrites the cart's SDRAM, 
+    so it should only be done right before
+    uploading a ROM.
+    @return The device error, or OK
+==============================*/
+
+DeviceError device_autotune()
+{
+    TuneTarget target;
+    DeviceError err;
+    char path[512];
+    if (!device_needstuning())
+        return DEVICEERR_OK;
+
+    // Try the settings out
+    target.apply = local_session->driver->applytuning;
+    target.writeram = local_session->driver->writeram;
+    target.readram = local_session->driver->readrom;
+    err = autotune_run(&local_session->cart, &target);
+    if (err != DEVICEERR_OK)
+        return err;
+    local_session->tuned = true;
+
+    // Whatever was on the cart is gone now
+    local_session->forcefullupload = true;
+
+    // Remember the settings, it's not a problem if this fails as the cart will just be tuned again
+    if (!device_isvirtual() && autotune_getprofilepath(path, sizeof(path)))
+        autotune_save(path, &local_session->cart);
+    return DEVICEERR_OK;
+}
+
+
+/*==============================
+    device_gettuning
+    Gets the selected cart's USB settings
+    @param A pointer to store the settings in
+==============================*/
+
+void device_gettuning(USBTuning* tuning)
+{
+    (*tuning) = local_session->cart.tuning;
 }
 
 
@@ -580,7 +1490,7 @@ float device_getuploadprogress()
 
 void device_setprotocol(ProtocolVer version)
 {
-    local_cart.protocol = version;
+    local_session->cart.protocol = version;
 }
 
 
@@ -592,7 +1502,7 @@ void device_setprotocol(ProtocolVer version)
 
 ProtocolVer device_getprotocol()
 {
-    return local_cart.protocol;
+    return local_session->cart.protocol;
 }
 
 
@@ -612,6 +1522,23 @@ uint32_t swap_endian(uint32_t val)
 }
 
 
+/*==============================
+    device_segmentsize
+    Adds up the size of a list of data segments
+    @param  The segments
+    @param  The number of segments
+    @return The total size, in bytes
+==============================*/
+
+uint32_t device_segmentsize(const DataSegment* segments, uint32_t count)
+{
+    uint32_t size = 0;
+    for (uint32_t i=0; i<count; i++)
+        size += segments[i].size;
+    return size;
+}
+
+
 /*==============================
     calc_padsize
     Returns the correct size a ROM should be. Code taken from:
@@ -12,6 +12,7 @@
     *********************************/
 
     #define USBPROTOCOL_LATEST PROTOCOL_VERSION2
+    #define MAX_CARTS 8
 
     /*********************************
                Enumerations
@@ -53,7 +54,8 @@
         DATATYPE_RAWBINARY  = 0x02,
         DATATYPE_HEADER     = 0x03,
         DATATYPE_SCREENSHOT = 0x04,
-        DATATYPE_HEARTBEAT  = 0x05
+        DATATYPE_HEARTBEAT  = 0x05,
+        DATATYPE_FRAGMENT   = 0x06
     } USBDataType;
 
     typedef enum {
@@ -72,6 +74,8 @@
         DEVICEERR_RESETFAIL,
         DEVICEERR_RESETPORTFAIL,
         DEVICEERR_TIMEOUTSETFAIL,
+        DEVICEERR_LATENCYSETFAIL,
+        DEVICEERR_USBPARAMSETFAIL,
         DEVICEERR_PURGEFAIL,
         DEVICEERR_READFAIL,
         DEVICEERR_WRITEFAIL,
@@ -91,6 +95,8 @@
         DEVICEERR_UPLOADCANCELLED,
         DEVICEERR_TIMEOUT,
         DEVICEERR_POLLFAIL,
+        DEVICEERR_DATATOOBIG,
+        DEVICEERR_CONSOLECANCELLED,
         DEVICEERR_64D_BADCMP,
         DEVICEERR_64D_8303USB,
         DEVICEERR_64D_CANTDEBUG,
@@ -111,14 +117,72 @@
 
     typedef uint8_t byte;
 
+    typedef struct {
+        uint64_t readtime;
+        uint64_t preparetime;
+        uint64_t sendtime;
+        uint64_t stalltime;
+        uint32_t chunks;
+        uint32_t bytessent;
+        uint32_t romsize;
+    } UploadStats;
+
+    typedef struct {
+        uint64_t calls;
+        uint64_t reads;
+        uint64_t writes;
+        uint64_t polls;
+        uint64_t bytesread;
+        uint64_t byteswritten;
+    } USBStats;
+
+    typedef struct {
+        uint32_t latency;      // FTDI latency timer, in milliseconds
+        uint32_t transfersize; // USB IN transfer size, in bytes
+        uint32_t romchunk;     // Bytes sent per ROM upload write, or 0 to pick by ROM size
+        uint32_t datachunk;    // Bytes per USB write when sending debug data, or 0 for a single write
+    } USBTuning;
+
+    typedef struct {
+        bool     matched;
+        uint32_t offset;  // Where the first region that didn't match starts
+        uint32_t size;    // How big that region is
+        uint32_t romsize;
+    } VerifyResult;
+
+    typedef struct {
+        const byte* data; // The bytes to send, or NULL to send zeroes
+        uint32_t    size;
+    } DataSegment;
+
     typedef struct {
         CartType    carttype;
         CICType     cictype;
         SaveType    savetype;
         ProtocolVer protocol;
+        char        identity[64];
+        USBTuning   tuning;
         void*       structure;
     } CartDevice;
 
+    typedef struct {
+        uint32_t index;
+        uint32_t id;
+        char     description[64];
+        char     serial[16];
+        uint32_t rank;
+    } FTDIDevice;
+
+    typedef struct {
+        CartType    carttype;
+        uint32_t    index;
+        uint64_t    time;
+        DeviceError result;
+        bool        cancelled;
+    } ProbeStats;
+
+    typedef struct RomImage RomImage;
+
 
     /*********************************
             Function Prototypes
@@ -127,32 +191,65 @@
     // Main device functions
     void        device_initialize();
     DeviceError device_find();
+    bool        device_probecancelled(FTDIDevice* device);
+    void        device_getdetectstats(uint64_t* enumtime, const ProbeStats** probes, uint32_t* count);
     DeviceError device_open();
     uint32_t    device_getmaxromsize();
+    uint32_t    device_getmaxdatasize();
     uint32_t    device_rompadding(uint32_t romsize);
     bool        device_explicitcic();
     bool        device_isopen();
     DeviceError device_testdebug();
-    DeviceError device_sendrom(FILE* rom, uint32_t filesize);
-    DeviceError device_senddata(USBDataType datatype, byte* data, uint32_t size);
+    DeviceError device_loadrom();
+    void        device_setromimage(RomImage* image);
+    RomImage*   device_getromimage();
+    DeviceError device_sendrom();
+    void        device_forcefullupload();
+    bool        device_canverify();
+    DeviceError device_verifyrom(VerifyResult* result);
+    DeviceError device_senddata(USBDataType datatype, const DataSegment* segments, uint32_t count);
     DeviceError device_receivedata(uint32_t* dataheader, byte** buff);
+    DeviceError device_waitdata(uint32_t timeout);
+    void        device_wakeup();
     DeviceError device_close();
 
+    // Multiple carts
+    DeviceError device_broadcastrom();
+    void        device_setmulticart(bool val);
+    uint32_t    device_getcartcount();
+    void        device_selectcart(uint32_t index);
+    uint32_t    device_getselectedcart();
+
     // Device configuration
 	bool     device_setrom(char* path);
     void     device_setcart(CartType cart);
     void     device_setcic(CICType cic);
     void     device_setsave(SaveType save);
+    void     device_setmanifest(char* path);
+    void     device_rememberuploads(bool val);
+    bool     device_setvirtual(const char* spec);
+    bool     device_isvirtual();
+    bool     device_settuning(const char* mode);
     char*    device_getrom();
     CartType device_getcart();
     CICType  device_getcic();
     SaveType device_getsave();
 
     // Upload related
+    void  device_resetupload();
     void  device_cancelupload();
     bool  device_uploadcancelled();
     void  device_setuploadprogress(float progress);
+    void  device_setuploadrange(float start, float end);
     float device_getuploadprogress();
+    void  device_getuploadstats(UploadStats* stats);
+    void  device_getusbstats(USBStats* stats);
+    bool  device_simulateconsole(USBDataType datatype, byte* data, uint32_t size);
+
+    // USB tuning
+    bool        device_needstuning();
+    DeviceError device_autotune();
+    void        device_gettuning(USBTuning* tuning);
 
     // Protocol version handling
     void        device_setprotocol(ProtocolVer version);
@@ -162,6 +259,7 @@
     #define  SWAP(a, b) (((a) ^= (b)), ((b) ^= (a)), ((a) ^= (b))) // From https://graphics.stanford.edu/~seander/bithacks.html#SwappingValuesXOR
     #define  ALIGN(s, align) (((uint32_t)(s) + ((align)-1)) & ~((align)-1))
     uint32_t swap_endian(uint32_t val);
+    uint32_t device_segmentsize(const DataSegment* segments, uint32_t count);
     uint32_t calc_padsize(uint32_t size);
     uint32_t romhash(byte* buff, uint32_t len);
     CICType  cic_from_hash(uint32_t hash);
@@ -7,10 +7,13 @@ http://krikzz.com/pub/support/everdrive-64/x-series/dev/
 ***************************************************************/
 
 #include "device_everdrive.h"
-#include "Include/ftd2xx.h"
+#include "ftdi.h"
+#include "usbstream.h"
+#include "packetpool.h"
 #include <string.h>
 #include <thread>
 #include <chrono>
+#include <vector>
 
 typedef struct 
 {
@@ -18,125 +21,147 @@ typedef struct
     FT_HANDLE handle;
     DWORD     bytes_written;
     DWORD     bytes_read;
+    USBStream stream;
 } ED64Handle;
 
 
 /*==============================
-    device_test_everdrive
-    Checks whether the device passed as an argument is EverDrive
-    @param  A pointer to the cart context
-    @param  The index of the cart
+    device_matches_everdrive
+    Checks whether a USB device could be an
+    EverDrive. The FT245R is a generic chip,
+    so device_probe_everdrive should be used
+    to make sure.
+    @param  A pointer to the USB device info
+    @return Whether the device could be an EverDrive
+==============================*/
+
+bool device_matches_everdrive(FTDIDevice* device)
+{
+    return strcmp(device->description, "FT245R USB FIFO") == 0 && device->id == 0x04036001;
+}
+
+
+/*==============================
+    device_probe_everdrive
+    Checks whether the device is an EverDrive
+    by sending it a test command. Safe to call
+    from any thread, and gives up early if
+    device_probecancelled says so.
+    @param  A pointer to the USB device info
     @return DEVICEERR_OK if the cart is an Everdive, 
             DEVICEERR_NOTCART if it isn't,
             Any other device error if problems ocurred
 ==============================*/
 
-DeviceError device_test_everdrive(CartDevice* cart)
+DeviceError device_probe_everdrive(FTDIDevice* device)
 {
-    DWORD device_count;
-    FT_DEVICE_LIST_INFO_NODE* device_info;
-
-    // Initialize FTD
-    if (FT_CreateDeviceInfoList(&device_count) != FT_OK)
-        return DEVICEERR_USBBUSY;
+    FT_HANDLE temphandle;
+    DWORD bytes_written;
+    DWORD bytes_read;
+    DWORD pending = 0;
+    char send_buff[16];
+    char recv_buff[16];
+    std::chrono::steady_clock::time_point start;
+    memset(send_buff, 0, 16);
+    memset(recv_buff, 0, 16);
+
+    // If we don't have a ROM, we probably just want debug mode, so assume that this is an ED
+    if (device_getrom() == NULL)
+        return DEVICEERR_OK;
+
+    // Define the command to send
+    send_buff[0] = 'c';
+    send_buff[1] = 'm';
+    send_buff[2] = 'd';
+    send_buff[3] = 't';
+
+    // Open the device
+    if (ftdi_open(device->index, &temphandle) != FT_OK || !temphandle)
+        return DEVICEERR_CANTOPEN;
 
-    // Check if the device exists
-    if (device_count == 0)
-        return DEVICEERR_NODEVICES;
+    // Initialize the USB
+    if (ftdi_resetdevice(temphandle) != FT_OK)
+    {
+        ftdi_close(temphandle);
+        return DEVICEERR_RESETFAIL;
+    }
+    if (ftdi_settimeouts(temphandle, 500, 500) != FT_OK)
+    {
+        ftdi_close(temphandle);
+        return DEVICEERR_TIMEOUTSETFAIL;
+    }
+    if (ftdi_purge(temphandle, FT_PURGE_RX | FT_PURGE_TX) != FT_OK)
+    {
+        ftdi_close(temphandle);
+        return DEVICEERR_PURGEFAIL;
+    }
 
-    // Allocate storage and get device info list
-    device_info = (FT_DEVICE_LIST_INFO_NODE*) malloc(sizeof(FT_DEVICE_LIST_INFO_NODE)*device_count);
-    FT_GetDeviceInfoList(device_info, &device_count);
+    // Send the test command
+    if (ftdi_write(temphandle, send_buff, 16, &bytes_written) != FT_OK)
+    {
+        ftdi_close(temphandle);
+        return DEVICEERR_WRITEFAIL;
+    }
 
-    // Search the devices
-    for (uint32_t i=0; i<device_count; i++)
+    // Wait for the reply, instead of blocking on the read, so that we can stop if another probe found the cart first
+    start = std::chrono::steady_clock::now();
+    while (pending < 16 && std::chrono::steady_clock::now() - start < std::chrono::milliseconds(500))
     {
-        // Look for an EverDrive
-        if (strcmp(device_info[i].Description, "FT245R USB FIFO") == 0 && device_info[i].ID == 0x04036001)
+        if (device_probecancelled(device))
         {
-            FT_HANDLE temphandle;
-            DWORD bytes_written;
-            DWORD bytes_read;
-            char send_buff[16];
-            char recv_buff[16];
-            memset(send_buff, 0, 16);
-            memset(recv_buff, 0, 16);
-
-            // If we don't have a ROM, we probably just want debug mode, so assume that this is an ED
-            if (device_getrom() == NULL)
-            {
-                ED64Handle* fthandle = (ED64Handle*)malloc(sizeof(ED64Handle));
-                free(device_info);
-                fthandle->device_index = i;
-                cart->structure = fthandle;
-                return DEVICEERR_OK;
-            }
-
-            // Define the command to send
-            send_buff[0] = 'c';
-            send_buff[1] = 'm';
-            send_buff[2] = 'd';
-            send_buff[3] = 't';
-
-            // Open the device
-            if (FT_Open(i, &temphandle) != FT_OK || !temphandle)
-            {
-                free(device_info);
-                return DEVICEERR_CANTOPEN;
-            }
-
-            // Initialize the USB
-            if (FT_ResetDevice(temphandle) != FT_OK)
-            {
-                free(device_info);
-                return DEVICEERR_RESETFAIL;
-            }
-            if (FT_SetTimeouts(temphandle, 500, 500) != FT_OK)
-            {
-                free(device_info);
-                return DEVICEERR_TIMEOUTSETFAIL;
-            }
-            if (FT_Purge(temphandle, FT_PURGE_RX | FT_PURGE_TX) != FT_OK)
-            {
-                free(device_info);
-                return DEVICEERR_PURGEFAIL;
-            }
-
-            // Send the test command
-            if (FT_Write(temphandle, send_buff, 16, &bytes_written) != FT_OK)
-            {
-                free(device_info);
-                return DEVICEERR_WRITEFAIL;
-            }
-            if (FT_Read(temphandle, recv_buff, 16, &bytes_read) != FT_OK)
-            {
-                free(device_info);
-                return DEVICEERR_READFAIL;
-            }
-            if (FT_Close(temphandle) != FT_OK)
-            {
-                free(device_info);
-                return DEVICEERR_CLOSEFAIL;
-            }
-
-            // Check if the EverDrive responded correctly
-            if (recv_buff[3] == 'r')
-            {
-                ED64Handle* fthandle = (ED64Handle*) malloc(sizeof(ED64Handle));
-                free(device_info);
-                fthandle->device_index = i;
-                cart->structure = fthandle;
-                return DEVICEERR_OK;
-            }
+            ftdi_close(temphandle);
+            return DEVICEERR_NOTCART;
+        }
+        if (ftdi_getqueuestatus(temphandle, &pending) != FT_OK)
+        {
+            ftdi_close(temphandle);
+            return DEVICEERR_POLLFAIL;
         }
+        if (pending < 16)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (pending < 16)
+    {
+        ftdi_close(temphandle);
+        return DEVICEERR_NOTCART;
     }
+    if (ftdi_read(temphandle, recv_buff, 16, &bytes_read) != FT_OK)
+    {
+        ftdi_close(temphandle);
+        return DEVICEERR_READFAIL;
+    }
+    if (ftdi_close(temphandle) != FT_OK)
+        return DEVICEERR_CLOSEFAIL;
 
-    // Could not find the flashcart
-    free(device_info);
+    // Check if the EverDrive responded correctly
+    if (recv_buff[3] == 'r')
+        return DEVICEERR_OK;
     return DEVICEERR_NOTCART;
 }
 
 
+/*==============================
+    device_claim_everdrive
+    Sets up the cart context for an EverDrive
+    @param  A pointer to the cart context
+    @param  A pointer to the USB device info
+    @return The device error, or OK
+==============================*/
+
+DeviceError device_claim_everdrive(CartDevice* cart, FTDIDevice* device)
+{
+    ED64Handle* fthandle = (ED64Handle*) malloc(sizeof(ED64Handle));
+    if (fthandle == NULL)
+        return DEVICEERR_MALLOCFAIL;
+    fthandle->device_index = device->index;
+    fthandle->stream.buffer = NULL;
+    cart->tuning.romchunk = 0x8000;
+    cart->tuning.datachunk = 512;
+    cart->structure = fthandle;
+    return DEVICEERR_OK;
+}
+
+
 /*==============================
     device_maxromsize_everdrive
     Gets the max ROM size that 
@@ -150,6 +175,19 @@ uint32_t device_maxromsize_everdrive()
 }
 
 
+/*==============================
+    device_maxdatasize_everdrive
+    Gets the most data that the EverDrive
+    can send to the console in one go
+    @return The max data size
+==============================*/
+
+uint32_t device_maxdatasize_everdrive()
+{
+    return 0x00FFFFFF;
+}
+
+
 /*==============================
     device_rompadding_everdrive
     Calculates the correct ROM size 
@@ -171,13 +209,13 @@ uint32_t device_rompadding_everdrive(uint32_t romsize)
     explicitly stating the CIC, and
     auto sets it based on the IPL if
     so
-    @param  The 4KB bootcode
+    @param  A pointer to the ROM image
     @return Whether the CIC was changed
 ==============================*/
 
-bool device_explicitcic_everdrive(byte* bootcode)
+bool device_explicitcic_everdrive(RomImage* rom)
 {
-    (void)(bootcode); // Ignore unused paramater warning
+    (void)(rom); // Ignore unused paramater warning
     return false;
 }
 
@@ -194,21 +232,42 @@ DeviceError device_open_everdrive(CartDevice* cart)
     ED64Handle* fthandle = (ED64Handle*) cart->structure;
 
     // Open the cart
-    if (FT_Open(fthandle->device_index, &fthandle->handle) != FT_OK || fthandle->handle == NULL)
+    if (ftdi_open(fthandle->device_index, &fthandle->handle) != FT_OK || fthandle->handle == NULL)
         return DEVICEERR_CANTOPEN;
 
     // Reset the cart
-    if (FT_ResetDevice(fthandle->handle) != FT_OK)
+    if (ftdi_resetdevice(fthandle->handle) != FT_OK)
         return DEVICEERR_RESETFAIL;
-    if (FT_SetTimeouts(fthandle->handle, 500, 500) != FT_OK)
+    if (ftdi_settimeouts(fthandle->handle, 500, 500) != FT_OK)
         return DEVICEERR_TIMEOUTSETFAIL;
-    if (FT_Purge(fthandle->handle, FT_PURGE_RX | FT_PURGE_TX) != FT_OK)
+    if (ftdi_purge(fthandle->handle, FT_PURGE_RX | FT_PURGE_TX) != FT_OK)
         return DEVICEERR_PURGEFAIL;
 
+    // Debug packets are parsed from a buffer, rather than read piece by piece
+    if (!usbstream_open(&fthandle->stream, fthandle->handle))
+        return DEVICEERR_MALLOCFAIL;
+
     // Ok
     return DEVICEERR_OK;
 }
 
+/*==============================
+    device_applytuning_everdrive
+    Applies the cart's USB tuning
+    @param  A pointer to the cart context
+    @return The device error, or OK
+==============================*/
+
+DeviceError device_applytuning_everdrive(CartDevice* cart)
+{
+    ED64Handle* fthandle = (ED64Handle*) cart->structure;
+    if (ftdi_setlatencytimer(fthandle->handle, (UCHAR)cart->tuning.latency) != FT_OK)
+        return DEVICEERR_LATENCYSETFAIL;
+    if (ftdi_setusbparameters(fthandle->handle, cart->tuning.transfersize, cart->tuning.transfersize) != FT_OK)
+        return DEVICEERR_USBPARAMSETFAIL;
+    return DEVICEERR_OK;
+}
+
 /*==============================
     device_sendcmd_everdrive
     Sends a command to the flashcart
@@ -241,7 +300,7 @@ static DeviceError device_sendcmd_everdrive(ED64Handle* cart, char command, int
     cmd_buffer[13]= (char) (arg >> 16);
     cmd_buffer[14]= (char) (arg >> 8);
     cmd_buffer[15]= (char) (arg);
-    if (FT_Write(cart->handle, cmd_buffer, 16, &cart->bytes_written) != FT_OK)
+    if (ftdi_write(cart->handle, cmd_buffer, 16, &cart->bytes_written) != FT_OK)
         return DEVICEERR_WRITEFAIL;
     return DEVICEERR_OK;
 }
@@ -252,17 +311,16 @@ static DeviceError device_sendcmd_everdrive(ED64Handle* cart, char command, int
     device_sendrom_everdrive
     Sends the ROM to the flashcart
     @param A pointer to the cart context
-    @param A pointer to the ROM to send
+    @param A pointer to the ROM stream to send
     @param The size of the ROM
     @return The device error, or OK
 ==============================*/
 
-DeviceError device_sendrom_everdrive(CartDevice* cart, byte* rom, uint32_t size)
+DeviceError device_sendrom_everdrive(CartDevice* cart, RomStream* rom, uint32_t size)
 {
     DeviceError err;
     ED64Handle* fthandle = (ED64Handle*)cart->structure;
     uint32_t    bytes_done = 0;
-    uint32_t    bytes_left = size;
     uint32_t    crc_area = 0x100000 + 4096;
 
     // Fill memory if the file is too small
@@ -275,55 +333,58 @@ DeviceError device_sendrom_everdrive(CartDevice* cart, byte* rom, uint32_t size)
         err = device_sendcmd_everdrive(fthandle, 't', 0, 0, 0);
         if (err != DEVICEERR_OK)
             return err;
-        if (FT_Read(fthandle->handle, recv_buff, 16, &fthandle->bytes_read) != FT_OK)
+        if (ftdi_read(fthandle->handle, recv_buff, 16, &fthandle->bytes_read) != FT_OK)
             return DEVICEERR_READFAIL;
     }
 
-    // Set the save type
-    if (cart->savetype != SAVE_NONE)
-    {
-        rom[0x3C] = 'E';
-        rom[0x3D] = 'D';
-        switch (cart->savetype)
-        {
-            case SAVE_EEPROM4K:     rom[0x3F] = 0x10; break;
-            case SAVE_EEPROM16K:    rom[0x3F] = 0x20; break;
-            case SAVE_SRAM256:      rom[0x3F] = 0x30; break;
-            case SAVE_FLASHRAM:     rom[0x3F] = 0x50; break;
-            case SAVE_SRAM768:      rom[0x3F] = 0x40; break;
-            case SAVE_FLASHRAMPKMN: rom[0x3F] = 0x60; break;
-            default: break;
-        }
-    }
-
     // Send a command saying we're about to write to the cart
     err = device_sendcmd_everdrive(fthandle, 'W', 0x10000000, size, 0);
     if (err != DEVICEERR_OK)
         return err;
 
     // Upload the ROM in a loop
-    while (bytes_left > 0)
+    romstream_begin(rom, 0, size, cart->tuning.romchunk, false);
+    while (true)
     {
-        uint32_t bytes_do = 0x8000;
-
-        // Decide how many bytes to send
-        if (bytes_left < bytes_do)
-            bytes_do = bytes_left;
+        RomChunk block;
 
         // Check if the upload was cancelled
         if (device_uploadcancelled())
            break;
 
+        // Get the next chunk of the ROM
+        err = romstream_next(rom, &block);
+        if (err != DEVICEERR_OK)
+            return err;
+        if (block.size == 0)
+            break;
+
+        // Set the save type in the ROM header
+        if (block.offset == 0 && cart->savetype != SAVE_NONE)
+        {
+            block.data[0x3C] = 'E';
+            block.data[0x3D] = 'D';
+            switch (cart->savetype)
+            {
+                case SAVE_EEPROM4K:     block.data[0x3F] = 0x10; break;
+                case SAVE_EEPROM16K:    block.data[0x3F] = 0x20; break;
+                case SAVE_SRAM256:      block.data[0x3F] = 0x30; break;
+                case SAVE_FLASHRAM:     block.data[0x3F] = 0x50; break;
+                case SAVE_SRAM768:      block.data[0x3F] = 0x40; break;
+                case SAVE_FLASHRAMPKMN: block.data[0x3F] = 0x60; break;
+                default: break;
+            }
+        }
+
         // Send the data to the everdrive
-        if (FT_Write(fthandle->handle, rom + bytes_done, bytes_do, &fthandle->bytes_written)  != FT_OK)
+        if (ftdi_write(fthandle->handle, block.data, block.size, &fthandle->bytes_written)  != FT_OK)
             return DEVICEERR_WRITEFAIL;
         if (fthandle->bytes_written == 0)
             return DEVICEERR_TIMEOUT;
 
         // Update the upload progress
         device_setuploadprogress((((float)bytes_done) / ((float)size)) * 100.0f);
-        bytes_left -= bytes_do;
-        bytes_done += bytes_do;
+        bytes_done += block.size;
     }
 
     // Sleep for a bit before sending the PIF command (the delay is needed)
@@ -365,7 +426,7 @@ DeviceError device_sendrom_everdrive(CartDevice* cart, byte* rom, uint32_t size)
         if (extension_start == -1)
             extension_start = pathlen;
         memcpy(filename, path+i, (extension_start-i));
-        if (FT_Write(fthandle->handle, filename, 256, &fthandle->bytes_written) != FT_OK)
+        if (ftdi_write(fthandle->handle, filename, 256, &fthandle->bytes_written) != FT_OK)
             return DEVICEERR_WRITEFAIL;
         free(filename);
     }
@@ -376,6 +437,31 @@ DeviceError device_sendrom_everdrive(CartDevice* cart, byte* rom, uint32_t size)
 }
 
 
+/*==============================
+    device_writeram_everdrive
+    Writes data to the EverDrive's SDRAM
+    @param  A pointer to the cart context
+    @param  The offset in SDRAM to write to
+    @param  The data to write, which must be
+            a multiple of 512 bytes
+    @param  The number of bytes to write
+    @return The device error, or OK
+==============================*/
+
+DeviceError device_writeram_everdrive(CartDevice* cart, uint32_t offset, byte* data, uint32_t size)
+{
+    ED64Handle* fthandle = (ED64Handle*)cart->structure;
+    DeviceError err = device_sendcmd_everdrive(fthandle, 'W', 0x10000000 + offset, size, 0);
+    if (err != DEVICEERR_OK)
+        return err;
+    if (ftdi_write(fthandle->handle, data, size, &fthandle->bytes_written) != FT_OK)
+        return DEVICEERR_WRITEFAIL;
+    if (fthandle->bytes_written == 0)
+        return DEVICEERR_TIMEOUT;
+    return DEVICEERR_OK;
+}
+
+
 /*==============================
     device_testdebug_everdrive
     Checks whether this cart can use debug mode
@@ -396,81 +482,49 @@ DeviceError device_testdebug_everdrive(CartDevice* cart)
     Sends data to the EverDrive
     @param  A pointer to the cart context
     @param  The datatype that is being sent
-    @param  A buffer containing said data
-    @param  The size of the data
+    @param  The segments that make up the data
+    @param  The number of segments
     @return The device error, or OK
 ==============================*/
 
-DeviceError device_senddata_everdrive(CartDevice* cart, USBDataType datatype, byte* data, uint32_t size)
+DeviceError device_senddata_everdrive(CartDevice* cart, USBDataType datatype, const DataSegment* segments, uint32_t count)
 {
     ED64Handle* fthandle = (ED64Handle*)cart->structure;
-    byte     buffer[16];
+    byte     dma[8];
+    byte     cmp[16] = {'C', 'M', 'P', 'H'};
     uint32_t header;
+    uint32_t size = device_segmentsize(segments, count);
     uint32_t newsize = device_getprotocol() == PROTOCOL_VERSION2 ? ALIGN(size, 2) : ALIGN(size, 512);
-    byte*    datacopy = NULL;
-    uint32_t bytes_done = 0;
-    uint32_t bytes_left = newsize;
+    bool     oldprotocol = (device_getprotocol() == PROTOCOL_VERSION1);
+    std::vector<DataSegment> outgoing;
 
     // Put in the DMA header along with length and type information in the buffer
     header = (size & 0xFFFFFF) | (((uint32_t)datatype) << 24);
-    buffer[0] = 'D';
-    buffer[1] = 'M';
-    buffer[2] = 'A';
-    buffer[3] = '@';
-    buffer[4] = (header >> 24) & 0xFF;
-    buffer[5] = (header >> 16) & 0xFF;
-    buffer[6] = (header >> 8)  & 0xFF;
-    buffer[7] = header & 0xFF;
-
-    // Send the DMA message
-    if (FT_Write(fthandle->handle, buffer, 8, &fthandle->bytes_written) != FT_OK)
-        return DEVICEERR_WRITEFAIL;
-
-    // Handle old protocol (doesn't matter what we sent, just needs to make the DMA message 16 bytes aligned)
-    if (device_getprotocol() == PROTOCOL_VERSION1)
-    {
-        if (FT_Write(fthandle->handle, buffer, 8, &fthandle->bytes_read) != FT_OK)
-            return DEVICEERR_READFAIL;
-    }
-
-    // Copy the data onto a temp variable
-    datacopy = (byte*) calloc(newsize, 1);
-    if (datacopy == NULL)
-        return DEVICEERR_MALLOCFAIL;
-    memcpy(datacopy, data, size);
-
-    // Send the data in chunks
+    dma[0] = 'D';
+    dma[1] = 'M';
+    dma[2] = 'A';
+    dma[3] = '@';
+    dma[4] = (header >> 24) & 0xFF;
+    dma[5] = (header >> 16) & 0xFF;
+    dma[6] = (header >> 8)  & 0xFF;
+    dma[7] = header & 0xFF;
+
+    // Build the whole transfer out of the header, the data, the padding and the CMP signal.
+    // The old protocol needs the DMA and CMP messages to be 16 bytes, it doesn't matter what the extra bytes are
+    outgoing.reserve(count+4);
+    outgoing.push_back({dma, 8});
+    if (oldprotocol)
+        outgoing.push_back({dma, 8});
+    outgoing.insert(outgoing.end(), segments, segments+count);
+    if (newsize > size)
+        outgoing.push_back({NULL, newsize-size});
+    outgoing.push_back({cmp, oldprotocol ? 16u : 4u});
+
+    // Send it, in chunks
     device_setuploadprogress(0.0f);
-    while (bytes_left > 0)
-    {
-        uint32_t bytes_do = 512;
-        if (bytes_left < 512)
-            bytes_do = bytes_left;
-        if (FT_Write(fthandle->handle, datacopy+bytes_done, bytes_do, &fthandle->bytes_written) != FT_OK)
-            return DEVICEERR_WRITEFAIL;
-        bytes_left -= bytes_do;
-        bytes_done += bytes_do;
-        device_setuploadprogress((((float)bytes_done)/((float)newsize))*100.0f);
-    }
-
-    // Send the CMP signal
-    buffer[0] = 'C';
-    buffer[1] = 'M';
-    buffer[2] = 'P';
-    buffer[3] = 'H';
-    if (FT_Write(fthandle->handle, buffer, 4, &fthandle->bytes_written) != FT_OK)
+    if (ftdi_writesegments(fthandle->handle, outgoing.data(), outgoing.size(), cart->tuning.datachunk) != FT_OK)
         return DEVICEERR_WRITEFAIL;
-
-    // Handle old protocol (doesn't matter what we sent, just needs to make the CMP message 16 bytes aligned)
-    if (device_getprotocol() == PROTOCOL_VERSION1)
-    {
-        if (FT_Write(fthandle->handle, buffer, 12, &fthandle->bytes_read) != FT_OK)
-            return DEVICEERR_READFAIL;
-    }
-
-    // Free used up resources
     device_setuploadprogress(100.0f);
-    free(datacopy);
     return DEVICEERR_OK;
 }
 
@@ -483,43 +537,46 @@ DeviceError device_senddata_everdrive(CartDevice* cart, USBDataType datatype, by
             the received data header will be
             stored.
     @param  A pointer to a byte buffer pointer
-            where the data will be malloc'ed into.
+            where the data will be stored. It
+            comes from the packet pool, so it
+            must be freed with packetpool_release.
     @return The device error, or OK
 ==============================*/
 
 DeviceError device_receivedata_everdrive(CartDevice* cart, uint32_t* dataheader, byte** buff)
 {
     ED64Handle* fthandle = (ED64Handle*)cart->structure;
-    DWORD size;
+    USBStream* stream = &fthandle->stream;
+    uint32_t size;
     uint32_t alignment = device_getprotocol() == PROTOCOL_VERSION2 ? 2 : 16;
 
-    // First, check if we have data to read
-    if (FT_GetQueueStatus(fthandle->handle, &size) != FT_OK)
+    // First, check if we have data to read, pulling in everything that's waiting if we've run out
+    if (usbstream_available(stream) == 0 && usbstream_fill(stream) != FT_OK)
         return DEVICEERR_POLLFAIL;
 
     // If we do
-    if (size > 0)
+    if (usbstream_available(stream) > 0)
     {
         uint32_t dataread = 0;
         uint32_t totalread = 0;
         byte     temp[4];
 
         // Ensure we have valid data by reading the header
-        if (FT_Read(fthandle->handle, temp, 4, &fthandle->bytes_read) != FT_OK)
+        if (usbstream_read(stream, temp, 4, &fthandle->bytes_read) != FT_OK)
             return DEVICEERR_READFAIL;
         if (temp[0] != 'D' || temp[1] != 'M' || temp[2] != 'A' || temp[3] != '@')
             return DEVICEERR_64D_BADDMA;
         totalread += fthandle->bytes_read;
 
         // Get information about the incoming data and store it in dataheader
-        if (FT_Read(fthandle->handle, temp, 4, &fthandle->bytes_read) != FT_OK)
+        if (usbstream_read(stream, temp, 4, &fthandle->bytes_read) != FT_OK)
             return DEVICEERR_READFAIL;
         (*dataheader) = swap_endian(temp[3] << 24 | temp[2] << 16 | temp[1] << 8 | temp[0]);
         totalread += fthandle->bytes_read;
 
         // Read the data into the buffer, in 512 byte chunks
         size = (*dataheader) & 0xFFFFFF;
-        (*buff) = (byte*)malloc(size);
+        (*buff) = packetpool_alloc(size);
         if ((*buff) == NULL)
             return DEVICEERR_MALLOCFAIL;
 
@@ -530,7 +587,7 @@ DeviceError device_receivedata_everdrive(CartDevice* cart, uint32_t* dataheader,
             uint32_t readamount = size-dataread;
             if (readamount > 512)
                 readamount = 512;
-            if (FT_Read(fthandle->handle, (*buff)+dataread, readamount, &fthandle->bytes_read) != FT_OK)
+            if (usbstream_read(stream, (*buff)+dataread, readamount, &fthandle->bytes_read) != FT_OK)
                 return DEVICEERR_READFAIL;
             totalread += fthandle->bytes_read;
             dataread += fthandle->bytes_read;
@@ -538,7 +595,7 @@ DeviceError device_receivedata_everdrive(CartDevice* cart, uint32_t* dataheader,
         }
 
         // Read the completion signal
-        if (FT_Read(fthandle->handle, temp, 4, &fthandle->bytes_read) != FT_OK)
+        if (usbstream_read(stream, temp, 4, &fthandle->bytes_read) != FT_OK)
             return DEVICEERR_READFAIL;
         if (temp[0] != 'C' || temp[1] != 'M' || temp[2] != 'P' || temp[3] != 'H')
             return DEVICEERR_64D_BADCMP;
@@ -547,11 +604,10 @@ DeviceError device_receivedata_everdrive(CartDevice* cart, uint32_t* dataheader,
         // Ensure 2 byte alignment by reading X amount of bytes needed
         if (totalread % alignment != 0)
         {
-            byte* tempbuff = (byte*)malloc(alignment*sizeof(byte));
+            byte padding[16];
             int left = alignment - (totalread % alignment);
-            if (FT_Read(fthandle->handle, tempbuff, left, &fthandle->bytes_read) != FT_OK)
+            if (usbstream_read(stream, padding, left, &fthandle->bytes_read) != FT_OK)
                 return DEVICEERR_READFAIL;
-            free(tempbuff);
         }
         device_setuploadprogress(100.0f);
     }
@@ -566,6 +622,23 @@ DeviceError device_receivedata_everdrive(CartDevice* cart, uint32_t* dataheader,
 }
 
 
+/*==============================
+    device_waitdata_everdrive
+    Sleeps until the EverDrive has data for us
+    @param  A pointer to the cart context
+    @param  The most time to wait, in milliseconds
+    @return The device error, or OK
+==============================*/
+
+DeviceError device_waitdata_everdrive(CartDevice* cart, uint32_t timeout)
+{
+    ED64Handle* fthandle = (ED64Handle*)cart->structure;
+    if (ftdi_waitrx(fthandle->handle, timeout) != FT_OK)
+        return DEVICEERR_POLLFAIL;
+    return DEVICEERR_OK;
+}
+
+
 /*==============================
     device_close_everdrive
     Closes the USB pipe
@@ -576,8 +649,9 @@ DeviceError device_receivedata_everdrive(CartDevice* cart, uint32_t* dataheader,
 DeviceError device_close_everdrive(CartDevice* cart)
 {
     ED64Handle* fthandle = (ED64Handle*) cart->structure;
-    if (FT_Close(fthandle->handle) != FT_OK)
+    if (ftdi_close(fthandle->handle) != FT_OK)
         return DEVICEERR_CLOSEFAIL;
+    usbstream_close(&fthandle->stream);
     free(fthandle);
     cart->structure = NULL;
     return DEVICEERR_OK;
@@ -2,21 +2,28 @@
 #define __DEVICE_EVERDRIVE_HEADER
 
     #include "device.h"
+    #include "rom.h"
 
 
     /*********************************
             Function Prototypes
     *********************************/
 
-    DeviceError device_test_everdrive(CartDevice* cart);
+    bool        device_matches_everdrive(FTDIDevice* device);
+    DeviceError device_probe_everdrive(FTDIDevice* device);
+    DeviceError device_claim_everdrive(CartDevice* cart, FTDIDevice* device);
     DeviceError device_open_everdrive(CartDevice* cart);
-    DeviceError device_sendrom_everdrive(CartDevice* cart, byte* rom, uint32_t size);
+    DeviceError device_applytuning_everdrive(CartDevice* cart);
+    DeviceError device_sendrom_everdrive(CartDevice* cart, RomStream* rom, uint32_t size);
+    DeviceError device_writeram_everdrive(CartDevice* cart, uint32_t offset, byte* data, uint32_t size);
     uint32_t    device_maxromsize_everdrive();
+    uint32_t    device_maxdatasize_everdrive();
     uint32_t    device_rompadding_everdrive(uint32_t romsize);
-    bool        device_explicitcic_everdrive(byte* bootcode);
+    bool        device_explicitcic_everdrive(RomImage* rom);
     DeviceError device_testdebug_everdrive(CartDevice* cart);
-    DeviceError device_senddata_everdrive(CartDevice* cart, USBDataType datatype, byte* data, uint32_t size);
+    DeviceError device_senddata_everdrive(CartDevice* cart, USBDataType datatype, const DataSegment* segments, uint32_t count);
     DeviceError device_receivedata_everdrive(CartDevice* cart, uint32_t* dataheader, byte** buff);
+    DeviceError device_waitdata_everdrive(CartDevice* cart, uint32_t timeout);
     DeviceError device_close_everdrive(CartDevice* cart);
 
 #endif
\ No newline at end of file
@@ -1,771 +1,1226 @@
-/***************************************************************
-                       device_sc64.cpp
-
-Handles SC64 USB communication.
-https://github.com/Polprzewodnikowy/SummerCart64
-***************************************************************/
-
-#include <chrono>
-#include <cstring>
-#include <deque>
-#include <thread>
-#include "device_sc64.h"
-#include "Include/ftd2xx.h"
-
-/*********************************
-              Macros
-*********************************/
-
-#define SUPPORTED_MAJOR_VERSION 2
-#define SUPPORTED_MINOR_VERSION 14
-
-#define CMD_IDENTIFIER_GET 'v'
-#define CMD_VERSION_GET 'V'
-#define CMD_STATE_RESET 'R'
-#define CMD_CIC_PARAMS_SET 'B'
-#define CMD_CONFIG_SET 'C'
-#define CMD_MEMORY_WRITE 'M'
-#define CMD_DEBUG_WRITE 'U'
-#define CMD_FLASH_WAIT_BUSY 'p'
-#define CMD_FLASH_ERASE_BLOCK 'P'
-#define SC64_V2_IDENTIFIER "SCv2"
-
-#define CFG_ID_ROM_SHADOW_ENABLE 2
-#define CFG_ID_BOOT_MODE 5
-#define CFG_ID_SAVE_TYPE 6
-#define CFG_ID_ROM_EXTENDED_ENABLE 14
-
-#define BOOT_MODE_ROM 1
-#define BOOT_MODE_DIRECT_ROM 3
-
-#define MEMORY_ADDRESS_SDRAM 0x00000000
-#define MEMORY_ADDRESS_SHADOW 0x04FE0000
-#define MEMORY_ADDRESS_EXTENDED 0x04000000
-
-#define MEMORY_SIZE_SDRAM (64 * 1024 * 1024)
-#define MEMORY_SIZE_SHADOW (128 * 1024)
-#define MEMORY_SIZE_EXTENDED (14 * 1024 * 1024)
-
-#define ROM_UPLOAD_CHUNK_SIZE (1 * 1024 * 1024)
-
-#define USB_PACKET_DEBUG 'U'
-
-#define U16(x) ((uint16_t)((x)[0] << 8 | (x)[1]))
-#define U32(x) ((uint32_t)((x)[0] << 24 | (x)[1] << 16 | (x)[2] << 8 | (x)[3]))
-
-// CIC params format:
-// arg1: [31:25] unused
-//          [24] disable CIC
-//       [23:16] CIC seed
-//        [15:0] IPL3 checksum (upper 16 bits)
-// arg2:  [31:0] IPL3 checksum (lower 32 bits)
-#define CIC_PARAMS(p, s, c)                              \
-    {                                                    \
-        (p)[0] = (((s) << 16) | (((c) >> 32) & 0xFFFF)); \
-        (p)[1] = ((c) & (0xFFFFFFFF));                   \
-    }
-
-/*********************************
-             Typedefs
-*********************************/
-
-typedef enum
-{
-    RESPONSE,
-    CMDFAIL,
-    PACKET,
-    UNKNOWN,
-} SC64DataType;
-
-typedef struct
-{
-    uint8_t id;
-    uint32_t size;
-    std::unique_ptr<uint8_t[]> data;
-} SC64Packet;
-
-typedef struct
-{
-    DWORD device_number;
-    FT_HANDLE handle;
-    std::deque<SC64Packet> packets;
-} SC64Device;
-
-/*==============================
-    device_reset_and_sync_sc64
-    Resets and syncs SC64 communication
-    @param  A pointer to the cart context
-    @return The device error, or OK
-==============================*/
-
-static DeviceError device_reset_and_sync_sc64(SC64Device *device)
-{
-    ULONG modem_status;
-
-    // Perform controller reset by setting DTR line and checking DSR line status
-    if (FT_SetDtr(device->handle) != FT_OK)
-        return DEVICEERR_SETDTRFAIL;
-    for (int i = 0; i < 100; i++)
-    {
-        // Purge USB contents
-        if (FT_Purge(device->handle, FT_PURGE_RX | FT_PURGE_TX) != FT_OK)
-            return DEVICEERR_PURGEFAIL;
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-        if (FT_GetModemStatus(device->handle, &modem_status) != FT_OK)
-            return DEVICEERR_GETMODEMSTATUSFAIL;
-        if (modem_status & 0x20)
-            break;
-    }
-    if (!(modem_status & 0x20))
-        return DEVICEERR_SC64_CTRLRESETFAIL;
-
-    // Purge USB contents again
-    if (FT_Purge(device->handle, FT_PURGE_RX | FT_PURGE_TX) != FT_OK)
-        return DEVICEERR_PURGEFAIL;
-
-    // Release reset
-    if (FT_ClrDtr(device->handle) != FT_OK)
-        return DEVICEERR_CLEARDTRFAIL;
-    for (int i = 0; i < 100; i++)
-    {
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-        if (FT_GetModemStatus(device->handle, &modem_status) != FT_OK)
-            return DEVICEERR_GETMODEMSTATUSFAIL;
-        if (!(modem_status & 0x20))
-            break;
-    }
-    if (modem_status & 0x20)
-        return DEVICEERR_SC64_CTRLRELEASEFAIL;
-
-    // Flush packet queue
-    device->packets.clear();
-
-    return DEVICEERR_OK;
-}
-
-/*==============================
-    device_send_command_sc64
-    Prepares and sends command and parameters to the SC64
-    @param  A pointer to the device handle
-    @param  Command ID
-    @param  First argument value
-    @param  Second argument value
-    @return The device error, or OK
-==============================*/
-
-static DeviceError device_send_command_sc64(SC64Device *device, uint8_t cmd, uint32_t arg1, uint32_t arg2)
-{
-    DWORD bytes;
-    uint8_t header[12];
-
-    // Prepare command header
-    header[0] = (uint8_t)'C';
-    header[1] = (uint8_t)'M';
-    header[2] = (uint8_t)'D';
-    header[3] = cmd;
-    *(uint32_t *)(&header[4]) = swap_endian(arg1);
-    *(uint32_t *)(&header[8]) = swap_endian(arg2);
-
-    // Send command and parameters
-    if (FT_Write(device->handle, header, sizeof(header), &bytes) != FT_OK)
-        return DEVICEERR_WRITEFAIL;
-    if (bytes != sizeof(header))
-        return DEVICEERR_TXREPLYMISMATCH;
-
-    return DEVICEERR_OK;
-}
-
-/*==============================
-    device_process_incoming_data_sc64
-    Tries to receive response/packet from the SC64
-    Any received packet is stored in the packet queue
-    @param  A pointer to the device handle
-    @param  A pointer to the response packet structure
-    @return Device error
-==============================*/
-
-static DeviceError device_process_incoming_data_sc64(SC64Device *device, SC64Packet *response)
-{
-    DWORD bytes;
-    uint8_t buffer[4];
-
-    // If processing data only for packets return if there's no header data yet
-    if (response == NULL)
-    {
-        if (FT_GetQueueStatus(device->handle, &bytes) != FT_OK)
-            return DEVICEERR_POLLFAIL;
-        if (bytes < 4)
-            return DEVICEERR_OK;
-    }
-
-    while (true)
-    {
-        // Read response/packet header
-        if (FT_Read(device->handle, buffer, 4, &bytes) != FT_OK)
-            return DEVICEERR_READFAIL;
-        if (bytes != 4)
-            return DEVICEERR_BADPACKSIZE;
-
-        // Decode response/packet header
-        auto datatype = SC64DataType::UNKNOWN;
-        if (memcmp(buffer, "CMP", 3) == 0)
-            datatype = SC64DataType::RESPONSE;
-        else if (memcmp(buffer, "ERR", 3) == 0)
-            datatype = SC64DataType::CMDFAIL;
-        else if (memcmp(buffer, "PKT", 3) == 0)
-            datatype = SC64DataType::PACKET;
-        else
-            return DEVICEERR_SC64_COMMFAIL;
-        uint8_t id = buffer[3];
-
-        // Read response/packet size
-        if (FT_Read(device->handle, &buffer, 4, &bytes) != FT_OK)
-            return DEVICEERR_READFAIL;
-        if (bytes != 4)
-            return DEVICEERR_BADPACKSIZE;
-        uint32_t size = U32(buffer);
-
-        // Read response/packet data
-        std::unique_ptr<uint8_t[]> data(new uint8_t[size]);
-        if (data.get() == NULL)
-            return DEVICEERR_MALLOCFAIL;
-        if (size > 0)
-        {
-            if (FT_Read(device->handle, data.get(), size, &bytes) != FT_OK)
-                return DEVICEERR_READFAIL;
-            if (bytes != size)
-                return DEVICEERR_BADPACKSIZE;
-        }
-
-        // Save response/packet
-        switch (datatype)
-        {
-        case SC64DataType::RESPONSE:
-        case SC64DataType::CMDFAIL:
-            if (response == NULL)
-                return DEVICEERR_SC64_COMMFAIL;
-            response->id = id;
-            response->size = size;
-            response->data = std::move(data);
-            return datatype == SC64DataType::CMDFAIL ? DEVICEERR_SC64_CMDFAIL : DEVICEERR_OK;
-
-        case SC64DataType::PACKET:
-            device->packets.push_back(SC64Packet{id, size, std::move(data)});
-            if (response == NULL)
-                return DEVICEERR_OK;
-            break;
-
-        default:
-            return DEVICEERR_SC64_COMMFAIL;
-        }
-    }
-}
-
-/*==============================
-    device_execute_command_sc64
-    Executes command on the SC64
-    @param  A pointer to the device handle
-    @param  Command ID
-    @param  First argument value
-    @param  Second argument value
-    @param  A pointer to TX data or NULL
-    @param  TX data size
-    @param  A pointer to the response packet structure or NULL if command does not send response
-    @return The device error, or OK
-==============================*/
-
-static DeviceError device_execute_command_sc64(SC64Device *device, uint8_t id, uint32_t arg1, uint32_t arg2, uint8_t *data, uint32_t size, SC64Packet *response)
-{
-    DeviceError err;
-
-    // Send command header and parameters
-    err = device_send_command_sc64(device, id, arg1, arg2);
-    if (err != DEVICEERR_OK)
-        return err;
-
-    // Send command data if required
-    if (data != NULL && size > 0)
-    {
-        DWORD bytes;
-        if (FT_Write(device->handle, data, size, &bytes) != FT_OK)
-            return DEVICEERR_WRITEFAIL;
-        if (bytes != size)
-            return DEVICEERR_TXREPLYMISMATCH;
-    }
-
-    // Read response if required
-    if (response != NULL)
-    {
-        err = device_process_incoming_data_sc64(device, response);
-        if (err != DEVICEERR_OK)
-            return err;
-        if (response->id != id)
-            return DEVICEERR_SC64_COMMFAIL;
-    }
-
-    return DEVICEERR_OK;
-}
-
-/*==============================
-    device_program_flash_sc64
-    Programs flash memory on the SC64
-    @param  A pointer to the device handle
-    @param  Flash memory address
-    @param  A pointer to data
-    @param  Data size
-    @param  A pointer to the progress lambda callback
-    @return The device error, or OK
-==============================*/
-
-template <typename F>
-static DeviceError device_program_flash_sc64(SC64Device *device, uint32_t address, uint8_t *data, uint32_t size, const F *progress)
-{
-    DeviceError err;
-    SC64Packet response;
-
-    // Get flash erase block size
-    err = device_execute_command_sc64(device, CMD_FLASH_WAIT_BUSY, (uint32_t)(false), 0, NULL, 0, &response);
-    if (err != DEVICEERR_OK)
-        return err;
-    uint32_t erase_block_size = U32(response.data.get());
-
-    // Erase and program flash in loop
-    for (uint32_t offset = 0; offset < size; offset += erase_block_size)
-    {
-        // Calculate block size
-        uint32_t bytes_do = erase_block_size;
-        if ((size - offset) < erase_block_size)
-            bytes_do = size - offset;
-
-        // Return an error if the upload was cancelled
-        if (device_uploadcancelled())
-            return DEVICEERR_UPLOADCANCELLED;
-
-        // Erase flash block
-        err = device_execute_command_sc64(device, CMD_FLASH_ERASE_BLOCK, address + offset, 0, NULL, 0, &response);
-        if (err != DEVICEERR_OK)
-            return err;
-
-        // Program flash block
-        err = device_execute_command_sc64(device, CMD_MEMORY_WRITE, address + offset, bytes_do, data + offset, bytes_do, &response);
-        if (err != DEVICEERR_OK)
-            return err;
-
-        // Update progress
-        if (progress != NULL)
-            (*progress)(offset + bytes_do);
-    }
-
-    // Wait for flash to finish program operation
-    err = device_execute_command_sc64(device, CMD_FLASH_WAIT_BUSY, (uint32_t)(true), 0, NULL, 0, &response);
-    if (err != DEVICEERR_OK)
-        return err;
-
-    return DEVICEERR_OK;
-}
-
-/*==============================
-    device_test_sc64
-    Attempts to find SC64 device
-    @param  A pointer to the cart context
-    @return DEVICEERR_OK if the cart is an SC64,
-            DEVICEERR_NOTCART if it isn't,
-            Any other device error if problems ocurred
-==============================*/
-
-DeviceError device_test_sc64(CartDevice *cart)
-{
-    DWORD device_count;
-
-    // Initialize FTDI
-    if (FT_CreateDeviceInfoList(&device_count) != FT_OK)
-        return DEVICEERR_USBBUSY;
-
-    // Check if the device exists
-    if (device_count == 0)
-        return DEVICEERR_NODEVICES;
-
-    // Allocate storage and get device info list
-    std::unique_ptr<FT_DEVICE_LIST_INFO_NODE[]> device_info(new FT_DEVICE_LIST_INFO_NODE[device_count]);
-    FT_GetDeviceInfoList(device_info.get(), &device_count);
-
-    // Search the devices
-    for (DWORD i = 0; i < device_count; i++)
-    {
-        // Look for SC64
-        if (device_info[i].ID == 0x04036014 && memcmp(device_info[i].Description, "SC64", 4) == 0)
-        {
-            SC64Device *device = new SC64Device;
-            if (device == NULL)
-                return DEVICEERR_MALLOCFAIL;
-            device->device_number = i;
-            device->handle = NULL;
-            device->packets = std::deque<SC64Packet>();
-            cart->structure = device;
-            return DEVICEERR_OK;
-        }
-    }
-
-    // Could not find the flashcart
-    return DEVICEERR_NOTCART;
-}
-
-/*==============================
-    device_maxromsize_sc64
-    Gets the max ROM size that
-    the SC64 supports
-    @return The max ROM size
-==============================*/
-
-uint32_t device_maxromsize_sc64()
-{
-    return MEMORY_SIZE_SDRAM + MEMORY_SIZE_EXTENDED;
-}
-
-/*==============================
-    device_rompadding_sc64
-    Calculates the correct ROM size 
-    for uploading on the SC64
-    @param  The current ROM size
-    @return The correct ROM size 
-            for uploading.
-==============================*/
-
-uint32_t device_rompadding_sc64(uint32_t romsize)
-{
-    return romsize;
-}
-
-/*==============================
-    device_explicitcic_sc64
-    Checks if the SC64 requires
-    explicitly stating the CIC, and
-    auto sets it based on the IPL if
-    so
-    @param  The 4KB bootcode
-    @return Whether the CIC was changed
-==============================*/
-
-bool device_explicitcic_sc64(byte *bootcode)
-{
-    device_setcic(cic_from_hash(romhash(bootcode, 4032)));
-    return true;
-}
-
-/*==============================
-    device_testdebug_sc64
-    Checks whether the SC64 can use debug mode
-    @param  A pointer to the cart context
-    @return DEVICEERR_OK
-==============================*/
-
-DeviceError device_testdebug_sc64(CartDevice *cart)
-{
-    (void)(cart); // Ignore unused paramater warning
-
-    // All SC64 firmware versions support debug mode
-    return DEVICEERR_OK;
-}
-
-/*==============================
-    device_open_sc64
-    Opens the USB pipe
-    @param  A pointer to the cart context
-    @return The device error, or OK
-==============================*/
-
-DeviceError device_open_sc64(CartDevice *cart)
-{
-    DeviceError err;
-    SC64Device *device = (SC64Device *)cart->structure;
-    SC64Packet response;
-
-    // Open the cart
-    if (FT_Open(device->device_number, &device->handle) != FT_OK || device->handle == NULL)
-        return DEVICEERR_CANTOPEN;
-
-    // Reset the cart and set its timeouts and latency timer
-    if (FT_ResetDevice(device->handle) != FT_OK)
-        return DEVICEERR_RESETFAIL;
-    if (FT_SetTimeouts(device->handle, 5000, 5000) != FT_OK)
-        return DEVICEERR_TIMEOUTSETFAIL;
-
-    // Reset and sync communication with SC64
-    err = device_reset_and_sync_sc64(device);
-    if (err != DEVICEERR_OK)
-        return err;
-
-    // Check SC64 identifier
-    err = device_execute_command_sc64(device, CMD_IDENTIFIER_GET, 0, 0, NULL, 0, &response);
-    if (err != DEVICEERR_OK)
-        return err;
-    if (response.size != 4 || memcmp(response.data.get(), SC64_V2_IDENTIFIER, 4) != 0)
-        return DEVICEERR_SC64_FIRMWARECHECKFAIL;
-
-    // Check firmware version
-    err = device_execute_command_sc64(device, CMD_VERSION_GET, 0, 0, NULL, 0, &response);
-    if (err != DEVICEERR_OK)
-        return err;
-    if (response.size != 8)
-        return DEVICEERR_SC64_FIRMWARECHECKFAIL;
-    auto major = U16(response.data.get() + 0);
-    auto minor = U16(response.data.get() + 2);
-    if (major != SUPPORTED_MAJOR_VERSION || minor < SUPPORTED_MINOR_VERSION)
-        return DEVICEERR_SC64_FIRMWAREUNSUPPORTED;
-
-    // Ok
-    return DEVICEERR_OK;
-}
-
-/*==============================
-    device_sendrom_sc64
-    Sends the ROM to the flashcart
-    @param  A pointer to the cart context
-    @param  A pointer to the ROM to send
-    @param  The size of the ROM
-    @return The device error, or OK
-==============================*/
-
-DeviceError device_sendrom_sc64(CartDevice *cart, byte *rom, uint32_t size)
-{
-    DeviceError err;
-    SC64Device *device = (SC64Device *)cart->structure;
-    SC64Packet response;
-    uint32_t bytes_done = 0;
-    uint32_t sdram_size = size;
-
-    // Reset SC64 state
-    err = device_execute_command_sc64(device, CMD_STATE_RESET, 0, 0, NULL, 0, &response);
-    if (err != DEVICEERR_OK)
-        return err;
-
-    // Set boot mode
-    auto boot_mode = cart->cictype == CIC_NONE ? BOOT_MODE_ROM : BOOT_MODE_DIRECT_ROM;
-    err = device_execute_command_sc64(device, CMD_CONFIG_SET, CFG_ID_BOOT_MODE, boot_mode, NULL, 0, &response);
-    if (err != DEVICEERR_OK)
-        return err;
-
-    // Set CIC parameters if necessary
-    if (cart->cictype != CIC_NONE)
-    {
-        uint32_t params[2] = {0, 0};
-        switch (cart->cictype)
-        {
-            case CIC_6101:
-                CIC_PARAMS(params, 0x3F, 0x45CC73EE317A);
-                break;
-            case CIC_7102:
-                CIC_PARAMS(params, 0x3F, 0x44160EC5D9AF);
-                break;
-            case CIC_6102:
-            case CIC_7101:
-                CIC_PARAMS(params, 0x3F, 0xA536C0F1D859);
-                break;
-            case CIC_X103:
-                CIC_PARAMS(params, 0x78, 0x586FD4709867);
-                break;
-            case CIC_X105:
-                CIC_PARAMS(params, 0x91, 0x8618A45BC2D3);
-                break;
-            case CIC_X106:
-                CIC_PARAMS(params, 0x85, 0x2BBAD4E6EB74);
-                break;
-            case CIC_5101:
-                //CIC_PARAMS(params, 0xAC, 0x000000000000); // TODO: calculate checksum
-                params[0] = 0;
-                params[1] = 0;
-                break;
-            case CIC_8303:
-                CIC_PARAMS(params, 0xDD, 0x32B294E2AB90);
-                break;
-            default:
-                break;
-        }
-        err = device_execute_command_sc64(device, CMD_CIC_PARAMS_SET, params[0], params[1], NULL, 0, &response);
-        if (err != DEVICEERR_OK)
-            return err;
-    }
-
-    // Set save type
-    auto save_type = (uint32_t)(cart->savetype == SAVE_FLASHRAMPKMN ? SAVE_FLASHRAM : cart->savetype);
-    err = device_execute_command_sc64(device, CMD_CONFIG_SET, CFG_ID_SAVE_TYPE, save_type, NULL, 0, &response);
-    if (err != DEVICEERR_OK)
-        return err;
-
-    // Decide if we need to use shadow and/or extended memory
-    auto sdram_save = cart->savetype == SAVE_SRAM256 || cart->savetype == SAVE_SRAM768 || cart->savetype == SAVE_FLASHRAM || cart->savetype == SAVE_FLASHRAMPKMN;
-    auto use_shadow_memory = sdram_save && size > (MEMORY_SIZE_SDRAM - MEMORY_SIZE_SHADOW);
-    auto use_extended_memory = size > MEMORY_SIZE_SDRAM;
-
-    // Truncate SDRAM size if shadow/extended memory is used
-    if (use_extended_memory)
-        sdram_size = MEMORY_SIZE_SDRAM;
-    if (use_shadow_memory)
-        sdram_size = (MEMORY_SIZE_SDRAM - MEMORY_SIZE_SHADOW);
-
-    // Upload the ROM in a loop
-    while (sdram_size > 0)
-    {
-        uint32_t bytes_do = ROM_UPLOAD_CHUNK_SIZE;
-        if (sdram_size < bytes_do)
-            bytes_do = sdram_size;
-
-        if (device_uploadcancelled())
-            break;
-
-        err = device_execute_command_sc64(device, CMD_MEMORY_WRITE, MEMORY_ADDRESS_SDRAM + bytes_done, bytes_do, rom + bytes_done, bytes_do, &response);
-        if (err != DEVICEERR_OK)
-            return err;
-
-        sdram_size -= bytes_do;
-        bytes_done += bytes_do;
-        device_setuploadprogress((((float)bytes_done) / ((float)size)) * 100.0f);
-    }
-
-    // Create progress callback for flash program operations
-    auto progress = [&bytes_done, size](uint32_t bytes)
-    {
-        device_setuploadprogress((((float)bytes_done + bytes) / ((float)size)) * 100.0f);
-    };
-
-    // Program shadow memory if required
-    if (use_shadow_memory && !device_uploadcancelled())
-    {
-        // Enable shadow memory
-        err = device_execute_command_sc64(device, CMD_CONFIG_SET, CFG_ID_ROM_SHADOW_ENABLE, true, NULL, 0, &response);
-        if (err != DEVICEERR_OK)
-            return err;
-
-        uint32_t shadow_size = size - (MEMORY_SIZE_SDRAM - MEMORY_SIZE_SHADOW);
-        if (shadow_size > MEMORY_SIZE_SHADOW)
-            shadow_size = MEMORY_SIZE_SHADOW;
-
-        err = device_program_flash_sc64(device, MEMORY_ADDRESS_SHADOW, rom + bytes_done, shadow_size, &progress);
-        if (err != DEVICEERR_OK)
-            return err;
-
-        bytes_done += shadow_size;
-    }
-
-    // Program extended memory if required
-    if (use_extended_memory && !device_uploadcancelled())
-    {
-        // Enable extended memory
-        err = device_execute_command_sc64(device, CMD_CONFIG_SET, CFG_ID_ROM_EXTENDED_ENABLE, true, NULL, 0, &response);
-        if (err != DEVICEERR_OK)
-            return err;
-
-        uint32_t extended_size = size - MEMORY_SIZE_SDRAM;
-
-        err = device_program_flash_sc64(device, MEMORY_ADDRESS_EXTENDED, rom + bytes_done, extended_size, &progress);
-        if (err != DEVICEERR_OK)
-            return err;
-
-        bytes_done += extended_size;
-    }
-
-    // Return an error if the upload was cancelled
-    if (device_uploadcancelled())
-        return DEVICEERR_UPLOADCANCELLED;
-
-    // Success
-    device_setuploadprogress(100.0f);
-    return DEVICEERR_OK;
-}
-
-/*==============================
-    device_senddata_sc64
-    Sends data to the SC64
-    @param  A pointer to the cart context
-    @param  The datatype that is being sent
-    @param  A buffer containing said data
-    @param  The size of the data
-    @return The device error, or OK
-==============================*/
-
-DeviceError device_senddata_sc64(CartDevice *cart, USBDataType datatype, byte *data, uint32_t size)
-{
-    DeviceError err;
-    SC64Device *device = (SC64Device *)cart->structure;
-
-    device_setuploadprogress(0.0f);
-    err = device_execute_command_sc64(device, CMD_DEBUG_WRITE, datatype, size, data, size, NULL);
-    if (err != DEVICEERR_OK)
-        return err;
-    device_setuploadprogress(100.0f);
-
-    return DEVICEERR_OK;
-}
-
-/*==============================
-    device_receivedata_sc64
-    Receives data from the SC64
-    @param  A pointer to the cart context
-    @param  A pointer to an 32-bit value where
-            the received data header will be
-            stored.
-    @param  A pointer to a byte buffer pointer
-            where the data will be malloc'ed into.
-    @return The device error, or OK
-==============================*/
-
-DeviceError device_receivedata_sc64(CartDevice *cart, uint32_t *dataheader, byte **buff)
-{
-    DeviceError err;
-    SC64Device *device = (SC64Device *)cart->structure;
-
-    *dataheader = 0;
-    *buff = NULL;
-
-    // If packet queue is empty then try to fill it
-    if (device->packets.empty())
-    {
-        err = device_process_incoming_data_sc64(device, NULL);
-        if (err != DEVICEERR_OK)
-            return err;
-    }
-
-    // If there are packets in the queue then try to read one
-    if (!device->packets.empty())
-    {
-        // Get packet from the queue
-        auto packet = std::move(device->packets.front());
-        device->packets.pop_front();
-
-        // We care only about debug packets
-        if (packet.id == USB_PACKET_DEBUG)
-        {
-            device_setuploadprogress(0.0f);
-            if (packet.size < 4)
-                return DEVICEERR_SC64_COMMFAIL;
-            *dataheader = U32(packet.data.get());
-            auto size = *dataheader & 0xFFFFFF;
-            if (size != (packet.size - 4))
-                return DEVICEERR_SC64_COMMFAIL;
-            *buff = (byte *)malloc(size);
-            if (*buff == NULL)
-                return DEVICEERR_MALLOCFAIL;
-            memcpy(*buff, packet.data.get() + 4, size);
-            device_setuploadprogress(100.0f);
-        }
-    }
-
-    return DEVICEERR_OK;
-}
-
-/*==============================
-    device_close_sc64
-    Closes the USB pipe
-    @param  A pointer to the cart context
-    @return The device error, or OK
-==============================*/
-
-DeviceError device_close_sc64(CartDevice *cart)
-{
-    SC64Device *device = (SC64Device *)cart->structure;
-    if (FT_Close(device->handle) != FT_OK)
-        return DEVICEERR_CLOSEFAIL;
-    free(device);
-    cart->structure = NULL;
-    return DEVICEERR_OK;
+/***************************************************************
+                       device_sc64.cpp
+
+Handles SC64 USB communication.
+https://github.com/Polprzewodnikowy/SummerCart64
+***************************************************************/
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <thread>
+#include <vector>
+#include "device_sc64.h"
+#include "ftdi.h"
+#include "usbstream.h"
+#include "packetpool.h"
+
+/*********************************
+              Macros
+*********************************/
+
+#define SUPPORTED_MAJOR_VERSION 2
+#define SUPPORTED_MINOR_VERSION 14
+
+#define CMD_IDENTIFIER_GET 'v'
+#define CMD_VERSION_GET 'V'
+#define CMD_STATE_RESET 'R'
+#define CMD_CIC_PARAMS_SET 'B'
+#define CMD_CONFIG_SET 'C'
+#define CMD_MEMORY_READ 'm'
+#define CMD_MEMORY_WRITE 'M'
+#define CMD_DEBUG_WRITE 'U'
+#define CMD_FLASH_WAIT_BUSY 'p'
+#define CMD_FLASH_ERASE_BLOCK 'P'
+#define SC64_V2_IDENTIFIER "SCv2"
+#define SC64_CMD_HEADER_SIZE 12
+
+#define CFG_ID_ROM_SHADOW_ENABLE 2
+#define CFG_ID_BOOT_MODE 5
+#define CFG_ID_SAVE_TYPE 6
+#define CFG_ID_ROM_EXTENDED_ENABLE 14
+
+#define BOOT_MODE_ROM 1
+#define BOOT_MODE_DIRECT_ROM 3
+
+#define MEMORY_ADDRESS_SDRAM 0x00000000
+#define MEMORY_ADDRESS_SHADOW 0x04FE0000
+#define MEMORY_ADDRESS_EXTENDED 0x04000000
+
+#define MEMORY_SIZE_SDRAM (64 * 1024 * 1024)
+#define MEMORY_SIZE_SHADOW (128 * 1024)
+#define MEMORY_SIZE_EXTENDED (14 * 1024 * 1024)
+
+#define ROM_UPLOAD_CHUNK_SIZE (1 * 1024 * 1024)
+#define COMMAND_QUEUE_DEPTH 4
+
+#define USB_PACKET_DEBUG 'U'
+
+#define U16(x) ((uint16_t)((x)[0] << 8 | (x)[1]))
+#define U32(x) ((uint32_t)((x)[0] << 24 | (x)[1] << 16 | (x)[2] << 8 | (x)[3]))
+
+// CIC params format:
+// arg1: [31:25] unused
+//          [24] disable CIC
+//       [23:16] CIC seed
+//        [15:0] IPL3 checksum (upper 16 bits)
+// arg2:  [31:0] IPL3 checksum (lower 32 bits)
+#define CIC_PARAMS(p, s, c)                              \
+    {                                                    \
+        (p)[0] = (((s) << 16) | (((c) >> 32) & 0xFFFF)); \
+        (p)[1] = ((c) & (0xFFFFFFFF));                   \
+    }
+
+/*********************************
+             Typedefs
+*********************************/
+
+typedef enum
+{
+    RESPONSE,
+    CMDFAIL,
+    PACKET,
+    UNKNOWN,
+} SC64DataType;
+
+typedef struct
+{
+    void operator()(byte *data) const { packetpool_release(data); }
+} SC64PoolDeleter;
+
+typedef struct
+{
+    uint8_t id;
+    uint32_t size;
+    std::unique_ptr<uint8_t[]> data;
+
+    // Debug packets are kept in a pooled buffer instead, without their header
+    uint32_t header;
+    std::unique_ptr<byte, SC64PoolDeleter> payload;
+} SC64Packet;
+
+typedef struct
+{
+    DWORD device_number;
+    FT_HANDLE handle;
+    USBStream stream;
+    std::deque<SC64Packet> packets;
+    std::deque<uint8_t> inflight; // IDs of commands that were sent, whose response hasn't been read yet
+} SC64Device;
+
+/*==============================
+    device_reset_and_sync_sc64
+    Resets and syncs SC64 communication
+    @param  A pointer to the cart context
+    @return The device error, or OK
+==============================*/
+
+static DeviceError device_reset_and_sync_sc64(SC64Device *device)
+{
+    ULONG modem_status;
+
+    // Perform controller reset by setting DTR line and checking DSR line status
+    if (ftdi_setdtr(device->handle) != FT_OK)
+        return DEVICEERR_SETDTRFAIL;
+    for (int i = 0; i < 100; i++)
+    {
+        // Purge USB contents
+        if (ftdi_purge(device->handle, FT_PURGE_RX | FT_PURGE_TX) != FT_OK)
+            return DEVICEERR_PURGEFAIL;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        if (ftdi_getmodemstatus(device->handle, &modem_status) != FT_OK)
+            return DEVICEERR_GETMODEMSTATUSFAIL;
+        if (modem_status & 0x20)
+            break;
+    }
+    if (!(modem_status & 0x20))
+        return DEVICEERR_SC64_CTRLRESETFAIL;
+
+    // Purge USB contents again
+    if (ftdi_purge(device->handle, FT_PURGE_RX | FT_PURGE_TX) != FT_OK)
+        return DEVICEERR_PURGEFAIL;
+
+    // Release reset
+    if (ftdi_clrdtr(device->handle) != FT_OK)
+        return DEVICEERR_CLEARDTRFAIL;
+    for (int i = 0; i < 100; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        if (ftdi_getmodemstatus(device->handle, &modem_status) != FT_OK)
+            return DEVICEERR_GETMODEMSTATUSFAIL;
+        if (!(modem_status & 0x20))
+            break;
+    }
+    if (modem_status & 0x20)
+        return DEVICEERR_SC64_CTRLRELEASEFAIL;
+
+    // Flush packet and command queues, along with anything received but not yet parsed
+    device->packets.clear();
+    device->inflight.clear();
+    usbstream_clear(&device->stream);
+
+    return DEVICEERR_OK;
+}
+
+/*==============================
+    device_build_command_sc64
+    Fills in a command header for the SC64
+    @param  The 12 byte buffer to fill
+    @param  Command ID
+    @param  First argument value
+    @param  Second argument value
+==============================*/
+
+static void device_build_command_sc64(uint8_t *header, uint8_t cmd, uint32_t arg1, uint32_t arg2)
+{
+    header[0] = (uint8_t)'C';
+    header[1] = (uint8_t)'M';
+    header[2] = (uint8_t)'D';
+    header[3] = cmd;
+    *(uint32_t *)(&header[4]) = swap_endian(arg1);
+    *(uint32_t *)(&header[8]) = swap_endian(arg2);
+}
+
+/*==============================
+    device_send_command_sc64
+    Prepares and sends command and parameters to the SC64
+    @param  A pointer to the device handle
+    @param  Command ID
+    @param  First argument value
+    @param  Second argument value
+    @return The device error, or OK
+==============================*/
+
+static DeviceError device_send_command_sc64(SC64Device *device, uint8_t cmd, uint32_t arg1, uint32_t arg2)
+{
+    DWORD bytes;
+    uint8_t header[SC64_CMD_HEADER_SIZE];
+
+    // Prepare command header
+    device_build_command_sc64(header, cmd, arg1, arg2);
+
+    // Send command and parameters
+    if (ftdi_write(device->handle, header, sizeof(header), &bytes) != FT_OK)
+        return DEVICEERR_WRITEFAIL;
+    if (bytes != sizeof(header))
+        return DEVICEERR_TXREPLYMISMATCH;
+
+    return DEVICEERR_OK;
+}
+
+/*==============================
+    device_process_incoming_data_sc64
+    Tries to receive response/packet from the SC64
+    Any received packet is stored in the packet queue
+    @param  A pointer to the device handle
+    @param  A pointer to the response packet structure
+    @return Device error
+==============================*/
+
+static DeviceError device_process_incoming_data_sc64(SC64Device *device, SC64Packet *response)
+{
+    DWORD bytes;
+    uint8_t buffer[4];
+
+    // If processing data only for packets return if there's no header data yet
+    if (response == NULL)
+    {
+        if (usbstream_available(&device->stream) < 4 && usbstream_fill(&device->stream) != FT_OK)
+            return DEVICEERR_POLLFAIL;
+        if (usbstream_available(&device->stream) < 4)
+            return DEVICEERR_OK;
+    }
+
+    while (true)
+    {
+        // Read response/packet header
+        if (usbstream_read(&device->stream, buffer, 4, &bytes) != FT_OK)
+            return DEVICEERR_READFAIL;
+        if (bytes != 4)
+            return DEVICEERR_BADPACKSIZE;
+
+        // Decode response/packet header
+        auto datatype = SC64DataType::UNKNOWN;
+        if (memcmp(buffer, "CMP", 3) == 0)
+            datatype = SC64DataType::RESPONSE;
+        else if (memcmp(buffer, "ERR", 3) == 0)
+            datatype = SC64DataType::CMDFAIL;
+        else if (memcmp(buffer, "PKT", 3) == 0)
+            datatype = SC64DataType::PACKET;
+        else
+            return DEVICEERR_SC64_COMMFAIL;
+        uint8_t id = buffer[3];
+
+        // Read response/packet size
+        if (usbstream_read(&device->stream, buffer, 4, &bytes) != FT_OK)
+            return DEVICEERR_READFAIL;
+        if (bytes != 4)
+            return DEVICEERR_BADPACKSIZE;
+        uint32_t size = U32(buffer);
+
+        // Debug packets are read straight into a pooled buffer, so they can be handed over as they are
+        if (datatype == SC64DataType::PACKET && id == USB_PACKET_DEBUG && size >= 4)
+        {
+            if (usbstream_read(&device->stream, buffer, 4, &bytes) != FT_OK)
+                return DEVICEERR_READFAIL;
+            if (bytes != 4)
+                return DEVICEERR_BADPACKSIZE;
+            std::unique_ptr<byte, SC64PoolDeleter> payload(packetpool_alloc(size - 4));
+            if (payload.get() == NULL)
+                return DEVICEERR_MALLOCFAIL;
+            if (size > 4)
+            {
+                if (usbstream_read(&device->stream, payload.get(), size - 4, &bytes) != FT_OK)
+                    return DEVICEERR_READFAIL;
+                if (bytes != size - 4)
+                    return DEVICEERR_BADPACKSIZE;
+            }
+            device->packets.push_back(SC64Packet{id, size - 4, nullptr, U32(buffer), std::move(payload)});
+            if (response == NULL)
+                return DEVICEERR_OK;
+            continue;
+        }
+
+        // Read response/packet data
+        std::unique_ptr<uint8_t[]> data(new uint8_t[size]);
+        if (data.get() == NULL)
+            return DEVICEERR_MALLOCFAIL;
+        if (size > 0)
+        {
+            if (usbstream_read(&device->stream, data.get(), size, &bytes) != FT_OK)
+                return DEVICEERR_READFAIL;
+            if (bytes != size)
+                return DEVICEERR_BADPACKSIZE;
+        }
+
+        // Save response/packet
+        switch (datatype)
+        {
+        case SC64DataType::RESPONSE:
+        case SC64DataType::CMDFAIL:
+            if (response == NULL)
+                return DEVICEERR_SC64_COMMFAIL;
+            response->id = id;
+            response->size = size;
+            response->data = std::move(data);
+            return datatype == SC64DataType::CMDFAIL ? DEVICEERR_SC64_CMDFAIL : DEVICEERR_OK;
+
+        case SC64DataType::PACKET:
+            device->packets.push_back(SC64Packet{id, size, std::move(data), 0, nullptr});
+            if (response == NULL)
+                return DEVICEERR_OK;
+            break;
+
+        default:
+            return DEVICEERR_SC64_COMMFAIL;
+        }
+    }
+}
+
+/*==============================
+    device_submit_command_sc64
+    Sends a command to the SC64 without
+    waiting for its response. The response
+    must be collected later, in order, with
+    device_collect_response_sc64.
+    @param  A pointer to the device handle
+    @param  Command ID
+    @param  First argument value
+    @param  Second argument value
+    @param  A pointer to TX data or NULL
+    @param  TX data size
+    @return The device error, or OK
+==============================*/
+
+static DeviceError device_submit_command_sc64(SC64Device *device, uint8_t id, uint32_t arg1, uint32_t arg2, uint8_t *data, uint32_t size)
+{
+    DeviceError err;
+
+    // Send command header and parameters
+    err = device_send_command_sc64(device, id, arg1, arg2);
+    if (err != DEVICEERR_OK)
+        return err;
+
+    // Send command data if required
+    if (data != NULL && size > 0)
+    {
+        DWORD bytes;
+        if (ftdi_write(device->handle, data, size, &bytes) != FT_OK)
+            return DEVICEERR_WRITEFAIL;
+        if (bytes != size)
+            return DEVICEERR_TXREPLYMISMATCH;
+    }
+
+    device->inflight.push_back(id);
+    return DEVICEERR_OK;
+}
+
+/*==============================
+    device_collect_response_sc64
+    Reads the response to the oldest command
+    still in flight. The SC64 answers commands
+    in the order it got them, so the response
+    must match that command's ID. Any packets
+    that arrive first go to the packet queue.
+    Any error other than a failed command
+    leaves the stream in an unknown state, so
+    the rest of the commands are forgotten.
+    @param  A pointer to the device handle
+    @param  A pointer to the response packet structure
+    @return The device error, or OK
+==============================*/
+
+static DeviceError device_collect_response_sc64(SC64Device *device, SC64Packet *response)
+{
+    DeviceError err;
+    uint8_t id;
+
+    if (device->inflight.empty())
+        return DEVICEERR_SC64_COMMFAIL;
+    id = device->inflight.front();
+    device->inflight.pop_front();
+
+    // An ERR response still belongs to this command, so check the ID before reporting it
+    err = device_process_incoming_data_sc64(device, response);
+    if (err == DEVICEERR_OK || err == DEVICEERR_SC64_CMDFAIL)
+    {
+        if (response->id == id)
+            return err;
+        err = DEVICEERR_SC64_COMMFAIL;
+    }
+    device->inflight.clear();
+    return err;
+}
+
+/*==============================
+    device_drain_commands_sc64
+    Reads the responses to every command
+    still in flight
+    @param  A pointer to the device handle
+    @return The first device error, or OK
+==============================*/
+
+static DeviceError device_drain_commands_sc64(SC64Device *device)
+{
+    DeviceError first = DEVICEERR_OK;
+    while (!device->inflight.empty())
+    {
+        SC64Packet response;
+        DeviceError err = device_collect_response_sc64(device, &response);
+        if (err == DEVICEERR_SC64_CMDFAIL)
+        {
+            // The stream is still in sync after a failed command, so keep reading
+            if (first == DEVICEERR_OK)
+                first = err;
+        }
+        else if (err != DEVICEERR_OK)
+            return err;
+    }
+    return first;
+}
+
+/*==============================
+    device_reserve_commands_sc64
+    Reads responses until there is room in
+    the queue for more commands
+    @param  A pointer to the device handle
+    @param  The number of commands to make room for
+    @return The device error, or OK
+==============================*/
+
+static DeviceError device_reserve_commands_sc64(SC64Device *device, uint32_t count)
+{
+    while (!device->inflight.empty() && device->inflight.size() + count > COMMAND_QUEUE_DEPTH)
+    {
+        SC64Packet response;
+        DeviceError err = device_collect_response_sc64(device, &response);
+        if (err != DEVICEERR_OK)
+            return err;
+    }
+    return DEVICEERR_OK;
+}
+
+/*==============================
+    device_execute_command_sc64
+    Executes command on the SC64
+    @param  A pointer to the device handle
+    @param  Command ID
+    @param  First argument value
+    @param  Second argument value
+    @param  A pointer to TX data or NULL
+    @param  TX data size
+    @param  A pointer to the response packet structure or NULL if command does not send response
+    @return The device error, or OK
+==============================*/
+
+static DeviceError device_execute_command_sc64(SC64Device *device, uint8_t id, uint32_t arg1, uint32_t arg2, uint8_t *data, uint32_t size, SC64Packet *response)
+{
+    DeviceError err;
+
+    // Commands that were queued earlier must be answered first
+    err = device_drain_commands_sc64(device);
+    if (err != DEVICEERR_OK)
+        return err;
+
+    // Send the command, then wait for its response if it has one
+    err = device_submit_command_sc64(device, id, arg1, arg2, data, size);
+    if (err != DEVICEERR_OK)
+        return err;
+    if (response == NULL)
+    {
+        device->inflight.pop_back();
+        return DEVICEERR_OK;
+    }
+    return device_collect_response_sc64(device, response);
+}
+
+/*==============================
+    device_savesinsdram_sc64
+    Checks whether the save type keeps its
+    data at the end of SDRAM, in which case
+    the end of the ROM goes in shadow memory
+    @param  A pointer to the cart context
+    @return Whether the save is kept in SDRAM
+==============================*/
+
+static bool device_savesinsdram_sc64(CartDevice *cart)
+{
+    return cart->savetype == SAVE_SRAM256 || cart->savetype == SAVE_SRAM768 || cart->savetype == SAVE_FLASHRAM || cart->savetype == SAVE_FLASHRAMPKMN;
+}
+
+/*==============================
+    device_romaddress_sc64
+    Works out where part of the ROM is kept
+    on the SC64
+    @param  A pointer to the cart context
+    @param  The offset in the ROM
+    @param  A pointer to store the memory address in
+    @return How many bytes from there are kept
+            in the same memory, or 0 if the offset
+            is past the end of the cart's memory
+==============================*/
+
+static uint32_t device_romaddress_sc64(CartDevice *cart, uint32_t offset, uint32_t *address)
+{
+    uint32_t sdram_end = device_savesinsdram_sc64(cart) ? (MEMORY_SIZE_SDRAM - MEMORY_SIZE_SHADOW) : MEMORY_SIZE_SDRAM;
+
+    if (offset < sdram_end)
+    {
+        (*address) = MEMORY_ADDRESS_SDRAM + offset;
+        return sdram_end - offset;
+    }
+    if (offset < MEMORY_SIZE_SDRAM)
+    {
+        (*address) = MEMORY_ADDRESS_SHADOW + (offset - sdram_end);
+        return MEMORY_SIZE_SDRAM - offset;
+    }
+    if (offset < MEMORY_SIZE_SDRAM + MEMORY_SIZE_EXTENDED)
+    {
+        (*address) = MEMORY_ADDRESS_EXTENDED + (offset - MEMORY_SIZE_SDRAM);
+        return MEMORY_SIZE_SDRAM + MEMORY_SIZE_EXTENDED - offset;
+    }
+    return 0;
+}
+
+/*==============================
+    device_compare_flash_sc64
+    Works out which flash erase blocks need
+    to be programmed. Blocks that the last
+    upload left unchanged are skipped, and the
+    rest are read back and compared with the
+    ROM, so that flash which already holds the
+    right data (for instance, after the cart
+    was power cycled) isn't erased again.
+    @param  A pointer to the device handle
+    @param  Flash memory address
+    @param  A pointer to the ROM stream
+    @param  Offset of the data in the ROM
+    @param  Data size
+    @param  The flash erase block size
+    @param  A vector to fill with whether each
+            erase block needs to be programmed
+    @return The device error, or OK
+==============================*/
+
+static DeviceError device_compare_flash_sc64(SC64Device *device, uint32_t address, RomStream *rom, uint32_t romoffset, uint32_t size, uint32_t blocksize, std::vector<bool> *program)
+{
+    DeviceError err;
+    const uint64_t *hashes;
+    uint32_t count;
+    std::deque<uint32_t> reads;
+    uint32_t blocks = (size + blocksize - 1) / blocksize;
+
+    // Erase blocks can only be compared if they're made of whole hash blocks
+    program->assign(blocks, true);
+    if (blocksize % ROM_HASHBLOCK_SIZE != 0 || romoffset % ROM_HASHBLOCK_SIZE != 0)
+        return DEVICEERR_OK;
+    err = romstream_gethashes(rom, &hashes, &count);
+    if (err != DEVICEERR_OK)
+        return err;
+
+    // Keep a few reads in flight, and compare each block as it comes back
+    uint32_t next = 0;
+    while (next < blocks || !reads.empty())
+    {
+        if (device_uploadcancelled())
+            return DEVICEERR_UPLOADCANCELLED;
+
+        // Queue up a read of the next block, unless the last upload says it didn't change
+        if (next < blocks && device->inflight.size() < COMMAND_QUEUE_DEPTH)
+        {
+            uint32_t offset = next * blocksize;
+            uint32_t length = std::min(blocksize, size - offset);
+            if (!romstream_ischanged(rom, romoffset + offset, length))
+                (*program)[next] = false;
+            else
+            {
+                err = device_submit_command_sc64(device, CMD_MEMORY_READ, address + offset, length, NULL, 0);
+                if (err != DEVICEERR_OK)
+                    return err;
+                reads.push_back(next);
+            }
+            next++;
+            continue;
+        }
+
+        // Compare the oldest block that was read with the ROM's hashes
+        SC64Packet response;
+        uint32_t block = reads.front();
+        uint32_t offset = block * blocksize;
+        uint32_t length = std::min(blocksize, size - offset);
+        reads.pop_front();
+        err = device_collect_response_sc64(device, &response);
+        if (err != DEVICEERR_OK)
+            return err;
+        if (response.size != length)
+            return DEVICEERR_BADPACKSIZE;
+        (*program)[block] = false;
+        for (uint32_t i = 0; i < length; i += ROM_HASHBLOCK_SIZE)
+        {
+            uint32_t hash = (romoffset + offset + i) / ROM_HASHBLOCK_SIZE;
+            if (hash >= count || romimage_hashblock(response.data.get() + i, std::min((uint32_t)ROM_HASHBLOCK_SIZE, length - i)) != hashes[hash])
+            {
+                (*program)[block] = true;
+                break;
+            }
+        }
+    }
+
+    return DEVICEERR_OK;
+}
+
+/*==============================
+    device_program_flash_sc64
+    Programs flash memory on the SC64,
+    skipping erase blocks that already hold
+    the right data
+    @param  A pointer to the device handle
+    @param  Flash memory address
+    @param  A pointer to the ROM stream
+    @param  Offset of the data in the ROM
+    @param  Data size
+    @param  A pointer to the progress lambda callback
+    @return The device error, or OK
+==============================*/
+
+template <typename F>
+static DeviceError device_program_flash_sc64(SC64Device *device, uint32_t address, RomStream *rom, uint32_t romoffset, uint32_t size, const F *progress)
+{
+    DeviceError err;
+    SC64Packet response;
+    std::vector<bool> program;
+
+    // Get flash erase block size
+    err = device_execute_command_sc64(device, CMD_FLASH_WAIT_BUSY, (uint32_t)(false), 0, NULL, 0, &response);
+    if (err != DEVICEERR_OK)
+        return err;
+    uint32_t erase_block_size = U32(response.data.get());
+    if (erase_block_size == 0)
+        return DEVICEERR_SC64_COMMFAIL;
+
+    // Find out which blocks changed
+    err = device_compare_flash_sc64(device, address, rom, romoffset, size, erase_block_size, &program);
+    if (err != DEVICEERR_OK)
+        return err;
+
+    // Erase and program each run of changed blocks
+    // The erase and program commands are queued, so the next block is sent while the SC64 works on the last one
+    uint32_t blocks = program.size();
+    for (uint32_t first = 0; first < blocks;)
+    {
+        uint32_t last = first;
+        if (!program[first])
+        {
+            first++;
+            if (progress != NULL)
+                (*progress)(std::min(first * erase_block_size, size));
+            continue;
+        }
+        while (last < blocks && program[last])
+            last++;
+
+        romstream_begin(rom, romoffset + first * erase_block_size, romoffset + std::min(last * erase_block_size, size), erase_block_size, false);
+        while (true)
+        {
+            RomChunk block;
+
+            // Return an error if the upload was cancelled
+            if (device_uploadcancelled())
+                return DEVICEERR_UPLOADCANCELLED;
+
+            // Get the next block of the ROM
+            err = romstream_next(rom, &block);
+            if (err != DEVICEERR_OK)
+                return err;
+            if (block.size == 0)
+                break;
+            uint32_t offset = block.offset - romoffset;
+
+            // Erase and program flash block
+            err = device_reserve_commands_sc64(device, 2);
+            if (err != DEVICEERR_OK)
+                return err;
+            err = device_submit_command_sc64(device, CMD_FLASH_ERASE_BLOCK, address + offset, 0, NULL, 0);
+            if (err != DEVICEERR_OK)
+                return err;
+            err = device_submit_command_sc64(device, CMD_MEMORY_WRITE, address + offset, block.size, block.data, block.size);
+            if (err != DEVICEERR_OK)
+                return err;
+
+            // Update progress
+            if (progress != NULL)
+                (*progress)(offset + block.size);
+        }
+        first = last;
+    }
+
+    // Wait for flash to finish program operation
+    err = device_execute_command_sc64(device, CMD_FLASH_WAIT_BUSY, (uint32_t)(true), 0, NULL, 0, &response);
+    if (err != DEVICEERR_OK)
+        return err;
+
+    return DEVICEERR_OK;
+}
+
+/*==============================
+    device_matches_sc64
+    Checks whether a USB device is an SC64
+    @param  A pointer to the USB device info
+    @return Whether the device is an SC64
+==============================*/
+
+bool device_matches_sc64(FTDIDevice* device)
+{
+    return device->id == 0x04036014 && memcmp(device->description, "SC64", 4) == 0;
+}
+
+
+/*==============================
+    device_claim_sc64
+    Sets up the cart context for an SC64
+    @param  A pointer to the cart context
+    @param  A pointer to the USB device info
+    @return The device error, or OK
+==============================*/
+
+DeviceError device_claim_sc64(CartDevice* cart, FTDIDevice* info)
+{
+    SC64Device *device = new SC64Device;
+    device->device_number = info->index;
+    device->handle = NULL;
+    device->stream.buffer = NULL;
+    device->packets = std::deque<SC64Packet>();
+    snprintf(cart->identity, sizeof(cart->identity), "%s", info->serial);
+    cart->tuning.romchunk = ROM_UPLOAD_CHUNK_SIZE;
+    cart->structure = device;
+    return DEVICEERR_OK;
+}
+
+
+/*==============================
+    device_maxromsize_sc64
+    Gets the max ROM size that
+    the SC64 supports
+    @return The max ROM size
+==============================*/
+
+uint32_t device_maxromsize_sc64()
+{
+    return MEMORY_SIZE_SDRAM + MEMORY_SIZE_EXTENDED;
+}
+
+/*==============================
+    device_maxdatasize_sc64
+    Gets the most data that the SC64
+    can send to the console in one go
+    @return The max data size
+==============================*/
+
+uint32_t device_maxdatasize_sc64()
+{
+    return 0x00FFFFFF;
+}
+
+/*==============================
+    device_rompadding_sc64
+    Calculates the correct ROM size 
+    for uploading on the SC64
+    @param  The current ROM size
+    @return The correct ROM size 
+            for uploading.
+==============================*/
+
+uint32_t device_rompadding_sc64(uint32_t romsize)
+{
+    return romsize;
+}
+
+/*==============================
+    device_explicitcic_sc64
+    Checks if the SC64 requires
+    explicitly stating the CIC, and
+    auto sets it based on the IPL if
+    so
+    @param  A pointer to the ROM image
+    @return Whether the CIC was changed
+==============================*/
+
+bool device_explicitcic_sc64(RomImage *rom)
+{
+    device_setcic(romimage_getcic(rom));
+    return true;
+}
+
+/*==============================
+    device_testdebug_sc64
+    Checks whether the SC64 can use debug mode
+    @param  A pointer to the cart context
+    @return DEVICEERR_OK
+==============================*/
+
+DeviceError device_testdebug_sc64(CartDevice *cart)
+{
+    (void)(cart); // Ignore unused paramater warning
+
+    // All SC64 firmware versions support debug mode
+    return DEVICEERR_OK;
+}
+
+/*==============================
+    device_open_sc64
+    Opens the USB pipe
+    @param  A pointer to the cart context
+    @return The device error, or OK
+==============================*/
+
+DeviceError device_open_sc64(CartDevice *cart)
+{
+    DeviceError err;
+    SC64Device *device = (SC64Device *)cart->structure;
+    SC64Packet response;
+
+    // Open the cart
+    if (ftdi_open(device->device_number, &device->handle) != FT_OK || device->handle == NULL)
+        return DEVICEERR_CANTOPEN;
+    if (!usbstream_open(&device->stream, device->handle))
+        return DEVICEERR_MALLOCFAIL;
+
+    // Reset the cart and set its timeouts and latency timer
+    if (ftdi_resetdevice(device->handle) != FT_OK)
+        return DEVICEERR_RESETFAIL;
+    if (ftdi_settimeouts(device->handle, 5000, 5000) != FT_OK)
+        return DEVICEERR_TIMEOUTSETFAIL;
+
+    // Reset and sync communication with SC64
+    err = device_reset_and_sync_sc64(device);
+    if (err != DEVICEERR_OK)
+        return err;
+
+    // Check SC64 identifier
+    err = device_execute_command_sc64(device, CMD_IDENTIFIER_GET, 0, 0, NULL, 0, &response);
+    if (err != DEVICEERR_OK)
+        return err;
+    if (response.size != 4 || memcmp(response.data.get(), SC64_V2_IDENTIFIER, 4) != 0)
+        return DEVICEERR_SC64_FIRMWARECHECKFAIL;
+
+    // Check firmware version
+    err = device_execute_command_sc64(device, CMD_VERSION_GET, 0, 0, NULL, 0, &response);
+    if (err != DEVICEERR_OK)
+        return err;
+    if (response.size != 8)
+        return DEVICEERR_SC64_FIRMWARECHECKFAIL;
+    auto major = U16(response.data.get() + 0);
+    auto minor = U16(response.data.get() + 2);
+    if (major != SUPPORTED_MAJOR_VERSION || minor < SUPPORTED_MINOR_VERSION)
+        return DEVICEERR_SC64_FIRMWAREUNSUPPORTED;
+
+    // Remember the firmware as part of the cart's identity
+    size_t len = strlen(cart->identity);
+    snprintf(cart->identity + len, sizeof(cart->identity) - len, " %s %d.%d.%d", SC64_V2_IDENTIFIER, major, minor, (int)U32(response.data.get() + 4));
+
+    // Ok
+    return DEVICEERR_OK;
+}
+
+/*==============================
+    device_applytuning_sc64
+    Applies the cart's USB tuning
+    @param  A pointer to the cart context
+    @return The device error, or OK
+==============================*/
+
+DeviceError device_applytuning_sc64(CartDevice *cart)
+{
+    SC64Device *device = (SC64Device *)cart->structure;
+    if (ftdi_setlatencytimer(device->handle, (UCHAR)cart->tuning.latency) != FT_OK)
+        return DEVICEERR_LATENCYSETFAIL;
+    if (ftdi_setusbparameters(device->handle, cart->tuning.transfersize, cart->tuning.transfersize) != FT_OK)
+        return DEVICEERR_USBPARAMSETFAIL;
+    return DEVICEERR_OK;
+}
+
+/*==============================
+    device_sendrom_sc64
+    Sends the ROM to the flashcart
+    @param  A pointer to the cart context
+    @param  A pointer to the ROM stream to send
+    @param  The size of the ROM
+    @return The device error, or OK
+==============================*/
+
+DeviceError device_sendrom_sc64(CartDevice *cart, RomStream *rom, uint32_t size)
+{
+    DeviceError err;
+    SC64Device *device = (SC64Device *)cart->structure;
+    SC64Packet response;
+    uint32_t bytes_done = 0;
+    uint32_t sdram_size = size;
+
+    // Reset SC64 state
+    // The setup commands are queued ahead of the ROM chunks, and their responses are checked as they come in
+    err = device_submit_command_sc64(device, CMD_STATE_RESET, 0, 0, NULL, 0);
+    if (err != DEVICEERR_OK)
+        return err;
+
+    // Set boot mode
+    auto boot_mode = cart->cictype == CIC_NONE ? BOOT_MODE_ROM : BOOT_MODE_DIRECT_ROM;
+    err = device_submit_command_sc64(device, CMD_CONFIG_SET, CFG_ID_BOOT_MODE, boot_mode, NULL, 0);
+    if (err != DEVICEERR_OK)
+        return err;
+
+    // Set CIC parameters if necessary
+    if (cart->cictype != CIC_NONE)
+    {
+        uint32_t params[2] = {0, 0};
+        switch (cart->cictype)
+        {
+            case CIC_6101:
+                CIC_PARAMS(params, 0x3F, 0x45CC73EE317A);
+                break;
+            case CIC_7102:
+                CIC_PARAMS(params, 0x3F, 0x44160EC5D9AF);
+                break;
+            case CIC_6102:
+            case CIC_7101:
+                CIC_PARAMS(params, 0x3F, 0xA536C0F1D859);
+                break;
+            case CIC_X103:
+                CIC_PARAMS(params, 0x78, 0x586FD4709867);
+                break;
+            case CIC_X105:
+                CIC_PARAMS(params, 0x91, 0x8618A45BC2D3);
+                break;
+            case CIC_X106:
+                CIC_PARAMS(params, 0x85, 0x2BBAD4E6EB74);
+                break;
+            case CIC_5101:
+                //CIC_PARAMS(params, 0xAC, 0x000000000000); // TODO: calculate checksum
+                params[0] = 0;
+                params[1] = 0;
+                break;
+            case CIC_8303:
+                CIC_PARAMS(params, 0xDD, 0x32B294E2AB90);
+                break;
+            default:
+                break;
+        }
+        err = device_submit_command_sc64(device, CMD_CIC_PARAMS_SET, params[0], params[1], NULL, 0);
+        if (err != DEVICEERR_OK)
+            return err;
+    }
+
+    // Set save type
+    auto save_type = (uint32_t)(cart->savetype == SAVE_FLASHRAMPKMN ? SAVE_FLASHRAM : cart->savetype);
+    err = device_submit_command_sc64(device, CMD_CONFIG_SET, CFG_ID_SAVE_TYPE, save_type, NULL, 0);
+    if (err != DEVICEERR_OK)
+        return err;
+
+    // Decide if we need to use shadow and/or extended memory
+    auto sdram_save = device_savesinsdram_sc64(cart);
+    auto use_shadow_memory = sdram_save && size > (MEMORY_SIZE_SDRAM - MEMORY_SIZE_SHADOW);
+    auto use_extended_memory = size > MEMORY_SIZE_SDRAM;
+
+    // Truncate SDRAM size if shadow/extended memory is used
+    if (use_extended_memory)
+        sdram_size = MEMORY_SIZE_SDRAM;
+    if (use_shadow_memory)
+        sdram_size = (MEMORY_SIZE_SDRAM - MEMORY_SIZE_SHADOW);
+
+    // Upload the ROM in a loop, skipping anything that is already in SDRAM
+    romstream_begin(rom, 0, sdram_size, cart->tuning.romchunk, true);
+    while (true)
+    {
+        RomChunk block;
+
+        if (device_uploadcancelled())
+            break;
+
+        err = romstream_next(rom, &block);
+        if (err != DEVICEERR_OK)
+            return err;
+        if (block.size == 0)
+            break;
+
+        // Keep a few chunks in flight, so the link isn't left idle waiting for each response
+        err = device_reserve_commands_sc64(device, 1);
+        if (err != DEVICEERR_OK)
+            return err;
+        err = device_submit_command_sc64(device, CMD_MEMORY_WRITE, MEMORY_ADDRESS_SDRAM + block.offset, block.size, block.data, block.size);
+        if (err != DEVICEERR_OK)
+            return err;
+
+        device_setuploadprogress((((float)block.offset + block.size) / ((float)size)) * 100.0f);
+    }
+    err = device_drain_commands_sc64(device);
+    if (err != DEVICEERR_OK)
+        return err;
+    bytes_done = sdram_size;
+
+    // Create progress callback for flash program operations
+    auto progress = [&bytes_done, size](uint32_t bytes)
+    {
+        device_setuploadprogress((((float)bytes_done + bytes) / ((float)size)) * 100.0f);
+    };
+
+    // Program shadow memory if required
+    if (use_shadow_memory && !device_uploadcancelled())
+    {
+        // Enable shadow memory
+        err = device_execute_command_sc64(device, CMD_CONFIG_SET, CFG_ID_ROM_SHADOW_ENABLE, true, NULL, 0, &response);
+        if (err != DEVICEERR_OK)
+            return err;
+
+        uint32_t shadow_size = size - (MEMORY_SIZE_SDRAM - MEMORY_SIZE_SHADOW);
+        if (shadow_size > MEMORY_SIZE_SHADOW)
+            shadow_size = MEMORY_SIZE_SHADOW;
+
+        err = device_program_flash_sc64(device, MEMORY_ADDRESS_SHADOW, rom, bytes_done, shadow_size, &progress);
+        if (err != DEVICEERR_OK)
+            return err;
+
+        bytes_done += shadow_size;
+    }
+
+    // Program extended memory if required
+    if (use_extended_memory && !device_uploadcancelled())
+    {
+        // Enable extended memory
+        err = device_execute_command_sc64(device, CMD_CONFIG_SET, CFG_ID_ROM_EXTENDED_ENABLE, true, NULL, 0, &response);
+        if (err != DEVICEERR_OK)
+            return err;
+
+        uint32_t extended_size = size - MEMORY_SIZE_SDRAM;
+
+        err = device_program_flash_sc64(device, MEMORY_ADDRESS_EXTENDED, rom, bytes_done, extended_size, &progress);
+        if (err != DEVICEERR_OK)
+            return err;
+
+        bytes_done += extended_size;
+    }
+
+    // Return an error if the upload was cancelled
+    if (device_uploadcancelled())
+        return DEVICEERR_UPLOADCANCELLED;
+
+    // Success
+    device_setuploadprogress(100.0f);
+    return DEVICEERR_OK;
+}
+
+/*==============================
+    device_writeram_sc64
+    Writes data to the SC64's SDRAM
+    @param  A pointer to the cart context
+    @param  The offset in SDRAM to write to
+    @param  The data to write
+    @param  The number of bytes to write
+    @return The device error, or OK
+==============================*/
+
+DeviceError device_writeram_sc64(CartDevice *cart, uint32_t offset, byte *data, uint32_t size)
+{
+    SC64Device *device = (SC64Device *)cart->structure;
+    SC64Packet response;
+    return device_execute_command_sc64(device, CMD_MEMORY_WRITE, MEMORY_ADDRESS_SDRAM + offset, size, data, size, &response);
+}
+
+/*==============================
+    device_readrom_sc64
+    Reads back part of the ROM from the SC64
+    @param  A pointer to the cart context
+    @param  The offset in the ROM to read from
+    @param  The number of bytes to read
+    @param  A buffer to store the data in
+    @return The device error, or OK
+==============================*/
+
+DeviceError device_readrom_sc64(CartDevice *cart, uint32_t offset, uint32_t size, byte *buff)
+{
+    DeviceError err;
+    SC64Device *device = (SC64Device *)cart->structure;
+    SC64Packet response;
+
+    // Read each part of the ROM from the memory it was put in
+    while (size > 0)
+    {
+        uint32_t address;
+        uint32_t length = device_romaddress_sc64(cart, offset, &address);
+        if (length == 0)
+            return DEVICEERR_SC64_CMDFAIL;
+        if (length > size)
+            length = size;
+
+        err = device_execute_command_sc64(device, CMD_MEMORY_READ, address, length, NULL, 0, &response);
+        if (err != DEVICEERR_OK)
+            return err;
+        if (response.size != length)
+            return DEVICEERR_BADPACKSIZE;
+        memcpy(buff, response.data.get(), length);
+        offset += length;
+        size -= length;
+        buff += length;
+    }
+
+    return DEVICEERR_OK;
+}
+
+/*==============================
+    device_senddata_sc64
+    Sends data to the SC64
+    @param  A pointer to the cart context
+    @param  The datatype that is being sent
+    @param  The segments that make up the data
+    @param  The number of segments
+    @return The device error, or OK
+==============================*/
+
+DeviceError device_senddata_sc64(CartDevice *cart, USBDataType datatype, const DataSegment *segments, uint32_t count)
+{
+    SC64Device *device = (SC64Device *)cart->structure;
+    uint8_t header[SC64_CMD_HEADER_SIZE];
+    std::vector<DataSegment> outgoing;
+
+    // The command header goes out in front of the data, in the same stream of writes
+    device_build_command_sc64(header, CMD_DEBUG_WRITE, datatype, device_segmentsize(segments, count));
+    outgoing.reserve(count+1);
+    outgoing.push_back({header, sizeof(header)});
+    outgoing.insert(outgoing.end(), segments, segments+count);
+
+    device_setuploadprogress(0.0f);
+    if (ftdi_writesegments(device->handle, outgoing.data(), outgoing.size(), 0) != FT_OK)
+        return DEVICEERR_WRITEFAIL;
+    device_setuploadprogress(100.0f);
+
+    return DEVICEERR_OK;
+}
+
+/*==============================
+    device_receivedata_sc64
+    Receives data from the SC64
+    @param  A pointer to the cart context
+    @param  A pointer to an 32-bit value where
+            the received data header will be
+            stored.
+    @param  A pointer to a byte buffer pointer
+            where the data will be stored. It
+            comes from the packet pool, so it
+            must be freed with packetpool_release.
+    @return The device error, or OK
+==============================*/
+
+DeviceError device_receivedata_sc64(CartDevice *cart, uint32_t *dataheader, byte **buff)
+{
+    DeviceError err;
+    SC64Device *device = (SC64Device *)cart->structure;
+
+    *dataheader = 0;
+    *buff = NULL;
+
+    // If packet queue is empty then try to fill it
+    if (device->packets.empty())
+    {
+        err = device_process_incoming_data_sc64(device, NULL);
+        if (err != DEVICEERR_OK)
+            return err;
+    }
+
+    // If there are packets in the queue then try to read one. Other packets are skipped,
+    // so that nothing is left in the queue when no debug packet is returned
+    while (!device->packets.empty())
+    {
+        // Get packet from the queue
+        auto packet = std::move(device->packets.front());
+        device->packets.pop_front();
+
+        // We care only about debug packets
+        if (packet.id == USB_PACKET_DEBUG)
+        {
+            device_setuploadprogress(0.0f);
+            if (packet.payload == NULL)
+                return DEVICEERR_SC64_COMMFAIL;
+            *dataheader = packet.header;
+            if ((*dataheader & 0xFFFFFF) != packet.size)
+                return DEVICEERR_SC64_COMMFAIL;
+            *buff = packet.payload.release();
+            device_setuploadprogress(100.0f);
+            break;
+        }
+    }
+
+    return DEVICEERR_OK;
+}
+
+/*==============================
+    device_waitdata_sc64
+    Sleeps until the SC64 has data for us
+    @param  A pointer to the cart context
+    @param  The most time to wait, in milliseconds
+    @return The device error, or OK
+==============================*/
+
+DeviceError device_waitdata_sc64(CartDevice *cart, uint32_t timeout)
+{
+    SC64Device *device = (SC64Device *)cart->structure;
+    if (ftdi_waitrx(device->handle, timeout) != FT_OK)
+        return DEVICEERR_POLLFAIL;
+    return DEVICEERR_OK;
+}
+
+/*==============================
+    device_close_sc64
+    Closes the USB pipe
+    @param  A pointer to the cart context
+    @return The device error, or OK
+==============================*/
+
+DeviceError device_close_sc64(CartDevice *cart)
+{
+    SC64Device *device = (SC64Device *)cart->structure;
+    if (ftdi_close(device->handle) != FT_OK)
+        return DEVICEERR_CLOSEFAIL;
+    usbstream_close(&device->stream);
+    delete device;
+    cart->structure = NULL;
+    return DEVICEERR_OK;
 }
\ No newline at end of file
@@ -1,22 +1,29 @@
-#ifndef __DEVICE_SC64_HEADER
-#define __DEVICE_SC64_HEADER
-
-    #include "device.h"
-
-
-    /*********************************
-            Function Prototypes
-    *********************************/
-
-    DeviceError device_test_sc64(CartDevice* cart);
-    DeviceError device_open_sc64(CartDevice* cart);
-    uint32_t    device_maxromsize_sc64();
-    uint32_t    device_rompadding_sc64(uint32_t romsize);
-    bool        device_explicitcic_sc64(byte* bootcode);
-    DeviceError device_sendrom_sc64(CartDevice* cart, byte* rom, uint32_t size);
-    DeviceError device_testdebug_sc64(CartDevice* cart);
-    DeviceError device_senddata_sc64(CartDevice* cart, USBDataType datatype, byte* data, uint32_t size);
-    DeviceError device_receivedata_sc64(CartDevice* cart, uint32_t* dataheader, byte** buff);
-    DeviceError device_close_sc64(CartDevice* cart);
-
-#endif
+#ifndef __DEVICE_SC64_HEADER
+#define __DEVICE_SC64_HEADER
+
+    #include "device.h"
+    #include "rom.h"
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    bool        device_matches_sc64(FTDIDevice* device);
+    DeviceError device_claim_sc64(CartDevice* cart, FTDIDevice* info);
+    DeviceError device_open_sc64(CartDevice* cart);
+    DeviceError device_applytuning_sc64(CartDevice* cart);
+    uint32_t    device_maxromsize_sc64();
+    uint32_t    device_maxdatasize_sc64();
+    uint32_t    device_rompadding_sc64(uint32_t romsize);
+    bool        device_explicitcic_sc64(RomImage* rom);
+    DeviceError device_sendrom_sc64(CartDevice* cart, RomStream* rom, uint32_t size);
+    DeviceError device_writeram_sc64(CartDevice* cart, uint32_t offset, byte* data, uint32_t size);
+    DeviceError device_readrom_sc64(CartDevice* cart, uint32_t offset, uint32_t size, byte* buff);
+    DeviceError device_testdebug_sc64(CartDevice* cart);
+    DeviceError device_senddata_sc64(CartDevice* cart, USBDataType datatype, const DataSegment* segments, uint32_t count);
+    DeviceError device_receivedata_sc64(CartDevice* cart, uint32_t* dataheader, byte** buff);
+    DeviceError device_waitdata_sc64(CartDevice* cart, uint32_t timeout);
+    DeviceError device_close_sc64(CartDevice* cart);
+
+#endif
@@ -0,0 +1,683 @@
+/***************************************************************
+                            ftdi.cpp
+
+Every flashcart driver talks to its cart through these wrappers
+instead of calling the D2XX library directly. By default they
+go straight to the FTDI driver, but they can be pointed at the
+virtual carts in virtualcart.cpp instead, so that uploads and
+the debug channel can be exercised without any hardware.
+The wrappers also count the calls made, for benchmarking.
+***************************************************************/
+
+#include "ftdi.h"
+#include "virtualcart.h"
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string.h>
+#ifdef LINUX
+    #include <time.h>
+    #include <errno.h>
+#endif
+
+
+/*********************************
+              Macros
+*********************************/
+
+// Segments smaller than this are gathered into one write
+#define GATHER_SIZE 4096
+
+
+/*********************************
+            Structures
+*********************************/
+
+// A receive notification registered with the FTDI driver
+typedef struct {
+    #ifndef LINUX
+        HANDLE event;
+    #else
+        EVENT_HANDLE event;
+        bool woken;
+    #endif
+} RXEvent;
+
+
+/*********************************
+             Globals
+*********************************/
+
+static bool local_virtual = false;
+
+// Statistics
+static std::atomic<uint64_t> local_calls (0);
+static std::atomic<uint64_t> local_reads (0);
+static std::atomic<uint64_t> local_writes (0);
+static std::atomic<uint64_t> local_polls (0);
+static std::atomic<uint64_t> local_bytesread (0);
+static std::atomic<uint64_t> local_byteswritten (0);
+
+// Receive notifications, per device
+static std::mutex local_eventmutex;
+static std::map<FT_HANDLE, RXEvent*> local_events;
+
+
+/*==============================
+    ftdi_getrxevent
+    Gets the receive notification of a device,
+    registering one with the driver the first time
+    @param  The device handle
+    @param  A pointer to store the event in
+    @return The FTDI status
+==============================*/
+
+static FT_STATUS ftdi_getrxevent(FT_HANDLE handle, RXEvent** out)
+{
+    FT_STATUS status;
+    RXEvent* rx;
+    std::lock_guard<std::mutex> lock(local_eventmutex);
+    std::map<FT_HANDLE, RXEvent*>::iterator it = local_events.find(handle);
+
+    if (it != local_events.end())
+    {
+        *out = it->second;
+        return FT_OK;
+    }
+
+    // Create the event and hand it to the driver
+    rx = new RXEvent();
+    #ifndef LINUX
+        rx->event = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if (rx->event == NULL)
+        {
+            delete rx;
+            return FT_INSUFFICIENT_RESOURCES;
+        }
+        status = FT_SetEventNotification(handle, FT_EVENT_RXCHAR, rx->event);
+        if (status != FT_OK)
+        {
+            CloseHandle(rx->event);
+            delete rx;
+            return status;
+        }
+    #else
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&rx->event.eCondVar, &attr);
+        pthread_condattr_destroy(&attr);
+        pthread_mutex_init(&rx->event.eMutex, NULL);
+        rx->event.iVar = 0;
+        rx->woken = false;
+        status = FT_SetEventNotification(handle, FT_EVENT_RXCHAR, (PVOID)&rx->event);
+        if (status != FT_OK)
+        {
+            pthread_cond_destroy(&rx->event.eCondVar);
+            pthread_mutex_destroy(&rx->event.eMutex);
+            delete rx;
+            return status;
+        }
+    #endif
+    local_events[handle] = rx;
+    *out = rx;
+    return FT_OK;
+}
+
+
+/*==============================
+    ftdi_freerxevent
+    Frees the receive notification of a device
+    @param  The device handle
+==============================*/
+
+static void ftdi_freerxevent(FT_HANDLE handle)
+{
+    RXEvent* rx;
+    std::lock_guard<std::mutex> lock(local_eventmutex);
+    std::map<FT_HANDLE, RXEvent*>::iterator it = local_events.find(handle);
+
+    if (it == local_events.end())
+        return;
+    rx = it->second;
+    local_events.erase(it);
+    #ifndef LINUX
+        CloseHandle(rx->event);
+    #else
+        pthread_cond_destroy(&rx->event.eCondVar);
+        pthread_mutex_destroy(&rx->event.eMutex);
+    #endif
+    delete rx;
+}
+
+
+/*==============================
+    ftdi_usevirtual
+    Replaces the USB devices with virtual
+    carts, as described by the given spec
+    @param  The virtual cart spec
+    @return Whether the spec was valid
+==============================*/
+
+bool ftdi_usevirtual(const char* spec)
+{
+    if (!virtualcart_create(spec))
+        return false;
+    local_virtual = true;
+    return true;
+}
+
+
+/*==============================
+    ftdi_isvirtual
+    Checks whether virtual carts are used
+    instead of the USB devices
+    @return Whether the carts are virtual
+==============================*/
+
+bool ftdi_isvirtual()
+{
+    return local_virtual;
+}
+
+
+/*==============================
+    ftdi_getstats
+    Gets the number of calls made and
+    bytes moved so far
+    @param  A pointer to store the stats in
+==============================*/
+
+void ftdi_getstats(USBStats* stats)
+{
+    stats->calls = local_calls;
+    stats->reads = local_reads;
+    stats->writes = local_writes;
+    stats->polls = local_polls;
+    stats->bytesread = local_bytesread;
+    stats->byteswritten = local_byteswritten;
+}
+
+
+/*==============================
+    ftdi_createdeviceinfolist
+    Builds the list of USB devices
+    @param  A pointer to store the device count in
+    @return The FTDI status
+==============================*/
+
+FT_STATUS ftdi_createdeviceinfolist(LPDWORD count)
+{
+    local_calls++;
+    if (local_virtual)
+        return virtualcart_createdeviceinfolist(count);
+    return FT_CreateDeviceInfoList(count);
+}
+
+
+/*==============================
+    ftdi_getdeviceinfolist
+    Gets the list of USB devices
+    @param  The array to fill in
+    @param  A pointer to the device count
+    @return The FTDI status
+==============================*/
+
+FT_STATUS ftdi_getdeviceinfolist(FT_DEVICE_LIST_INFO_NODE* dest, LPDWORD count)
+{
+    local_calls++;
+    if (local_virtual)
+        return virtualcart_getdeviceinfolist(dest, count);
+    return FT_GetDeviceInfoList(dest, count);
+}
+
+
+/*==============================
+    ftdi_open
+    Opens a USB device
+    @param  The index of the device
+    @param  A pointer to store the handle in
+    @return The FTDI status
+==============================*/
+
+FT_STATUS ftdi_open(int index, FT_HANDLE* handle)
+{
+    local_calls++;
+    if (local_virtual)
+        return virtualcart_open(index, handle);
+    return FT_Open(index, handle);
+}
+
+
+/*==============================
+    ftdi_close
+    Closes a USB device
+    @param  The device handle
+    @return The FTDI status
+==============================*/
+
+FT_STATUS ftdi_close(FT_HANDLE handle)
+{
+    FT_STATUS status;
+    local_calls++;
+    if (local_virtual)
+        return virtualcart_close(handle);
+    status = FT_Close(handle);
+    ftdi_freerxevent(handle);
+    return status;
+}
+
+
+/*==============================
+    ftdi_read
+    Reads data from a USB device
+    @param  The device handle
+    @param  The buffer to read into
+    @param  The number of bytes to read
+    @param  A pointer to store the number
+            of bytes read in
+    @return The FTDI status
+==============================*/
+
+FT_STATUS ftdi_read(FT_HANDLE handle, LPVOID buffer, DWORD size, LPDWORD bytesread)
+{
+    FT_STATUS status;
+    local_calls++;
+    local_reads++;
+    if (local_virtual)
+        status = virtualcart_read(handle, buffer, size, bytesread);
+    else
+        status = FT_Read(handle, buffer, size, bytesread);
+    if (status == FT_OK)
+        local_bytesread += *bytesread;
+    return status;
+}
+
+
+/*==============================
+    ftdi_write
+    Writes data to a USB device
+    @param  The device handle
+    @param  The data to write
+    @param  The number of bytes to write
+    @param  A pointer to store the number
+            of bytes written in
+    @return The FTDI status
+==============================*/
+
+FT_STATUS ftdi_write(FT_HANDLE handle, LPVOID buffer, DWORD size, LPDWORD byteswritten)
+{
+    FT_STATUS status;
+    local_calls++;
+    local_writes++;
+    if (local_virtual)
+        status = virtualcart_write(handle, buffer, size, byteswritten);
+    else
+        status = FT_Write(handle, buffer, size, byteswritten);
+    if (status == FT_OK)
+        local_byteswritten += *byteswritten;
+    return status;
+}
+
+
+/*==============================
+    ftdi_getqueuestatus
+    Gets how many bytes are waiting to be read
+    @param  The device handle
+    @param  A pointer to store the byte count in
+    @return The FTDI status
+==============================*/
+
+FT_STATUS ftdi_getqueuestatus(FT_HANDLE handle, DWORD* size)
+{
+    local_calls++;
+    local_polls++;
+    if (local_virtual)
+        return virtualcart_getqueuestatus(handle, size);
+    return FT_GetQueueStatus(handle, size);
+}
+
+
+/*==============================
+    ftdi_resetdevice
+    Resets a USB device
+    @param  The device handle
+    @return The FTDI status
+==============================*/
+
+FT_STATUS ftdi_resetdevice(FT_HANDLE handle)
+{
+    local_calls++;
+    if (local_virtual)
+        return virtualcart_resetdevice(handle);
+    return FT_ResetDevice(handle);
+}
+
+
+/*==============================
+    ftdi_purge
+    Throws away buffered USB data
+    @param  The device handle
+    @param  Which buffers to purge
+    @return The FTDI status
+==============================*/
+
+FT_STATUS ftdi_purge(FT_HANDLE handle, ULONG mask)
+{
+    local_calls++;
+    if (local_virtual)
+        return virtualcart_purge(handle, mask);
+    return FT_Purge(handle, mask);
+}
+
+
+/*==============================
+    ftdi_settimeouts
+    Sets the read and write timeouts
+    @param  The device handle
+    @param  The read timeout, in milliseconds
+    @param  The write timeout, in milliseconds
+    @return The FTDI status
+==============================*/
+
+FT_STATUS ftdi_settimeouts(FT_HANDLE handle, ULONG readtimeout, ULONG writetimeout)
+{
+    local_calls++;
+    if (local_virtual)
+        return virtualcart_settimeouts(handle, readtimeout, writetimeout);
+    return FT_SetTimeouts(handle, readtimeout, writetimeout);
+}
+
+
+/*==============================
+    ftdi_setbitmode
+    Sets the bit mode of a USB device
+    @param  The device handle
+    @param  The pin mask
+    @param  The bit mode
+    @return The FTDI status
+==============================*/
+
+FT_STATUS ftdi_setbitmode(FT_HANDLE handle, UCHAR mask, UCHAR mode)
+{
+    local_calls++;
+    if (local_virtual)
+        return virtualcart_setbitmode(handle, mask, mode);
+    return FT_SetBitMode(handle, mask, mode);
+}
+
+
+/*==============================
+    ftdi_setdtr
+    Sets the DTR line
+    @param  The device handle
+    @return The FTDI status
+==============================*/
+
+FT_STATUS ftdi_setdtr(FT_HANDLE handle)
+{
+    local_calls++;
+    if (local_virtual)
+        return virtualcart_setdtr(handle);
+    return FT_SetDtr(handle);
+}
+
+
+/*==============================
+    ftdi_clrdtr
+    Clears the DTR line
+    @param  The device handle
+    @return The FTDI status
+==============================*/
+
+FT_STATUS ftdi_clrdtr(FT_HANDLE handle)
+{
+    local_calls++;
+    if (local_virtual)
+        return virtualcart_clrdtr(handle);
+    return FT_ClrDtr(handle);
+}
+
+
+/*==============================
+    ftdi_getmodemstatus
+    Gets the modem status lines
+    @param  The device handle
+    @param  A pointer to store the status in
+    @return The FTDI status
+==============================*/
+
+FT_STATUS ftdi_getmodemstatus(FT_HANDLE handle, ULONG* status)
+{
+    local_calls++;
+    if (local_virtual)
+        return virtualcart_getmodemstatus(handle, status);
+    return FT_GetModemStatus(handle, status);
+}
+
+
+/*==============================
+    ftdi_setlatencytimer
+    Sets how long the USB chip holds on to
+    a partial packet before sending it
+    @param  The device handle
+    @param  The latency, in milliseconds
+    @return The FTDI status
+==============================*/
+
+FT_STATUS ftdi_setlatencytimer(FT_HANDLE handle, UCHAR latency)
+{
+    local_calls++;
+    if (local_virtual)
+        return virtualcart_setlatencytimer(handle, latency);
+    return FT_SetLatencyTimer(handle, latency);
+}
+
+
+/*==============================
+    ftdi_setusbparameters
+    Sets the USB transfer sizes
+    @param  The device handle
+    @param  The IN transfer size, in bytes
+    @param  The OUT transfer size, in bytes
+    @return The FTDI status
+==============================*/
+
+FT_STATUS ftdi_setusbparameters(FT_HANDLE handle, ULONG insize, ULONG outsize)
+{
+    local_calls++;
+    if (local_virtual)
+        return virtualcart_setusbparameters(handle, insize, outsize);
+    return FT_SetUSBParameters(handle, insize, outsize);
+}
+
+
+/*==============================
+    ftdi_waitrx
+    Sleeps until data arrives from a USB device,
+    the timeout passes, or ftdi_wakeall is called
+    @param  The device handle
+    @param  The most time to wait, in milliseconds
+    @return The FTDI status
+==============================*/
+
+FT_STATUS ftdi_waitrx(FT_HANDLE handle, uint32_t timeout)
+{
+    FT_STATUS status;
+    DWORD size = 0;
+    RXEvent* rx;
+    local_calls++;
+    local_polls++;
+    if (local_virtual)
+        return virtualcart_waitrx(handle, timeout);
+
+    status = ftdi_getrxevent(handle, &rx);
+    if (status != FT_OK)
+        return status;
+    #ifndef LINUX
+        // Don't wait if there's already something to read. The event stays
+        // set until it's waited on, so data that lands after the check isn't missed
+        status = FT_GetQueueStatus(handle, &size);
+        if (status != FT_OK || size > 0)
+            return status;
+        WaitForSingleObject(rx->event, timeout);
+        return FT_OK;
+    #else
+        timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout/1000;
+        deadline.tv_nsec += (timeout%1000)*1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        // The driver takes the mutex before signalling, so holding it while checking
+        // for data means anything that lands after the check still wakes the wait up
+        pthread_mutex_lock(&rx->event.eMutex);
+        status = FT_GetQueueStatus(handle, &size);
+        while (status == FT_OK && size == 0 && !rx->woken)
+        {
+            if (pthread_cond_timedwait(&rx->event.eCondVar, &rx->event.eMutex, &deadline) == ETIMEDOUT)
+                break;
+            status = FT_GetQueueStatus(handle, &size);
+        }
+        rx->woken = false;
+        pthread_mutex_unlock(&rx->event.eMutex);
+        return status;
+    #endif
+}
+
+
+/*==============================
+    ftdi_wakeall
+    Wakes up anything sleeping in ftdi_waitrx
+==============================*/
+
+void ftdi_wakeall()
+{
+    if (local_virtual)
+    {
+        virtualcart_wakeall();
+        return;
+    }
+    std::lock_guard<std::mutex> lock(local_eventmutex);
+    for (std::map<FT_HANDLE, RXEvent*>::iterator it = local_events.begin(); it != local_events.end(); ++it)
+    {
+        #ifndef LINUX
+            SetEvent(it->second->event);
+        #else
+            pthread_mutex_lock(&it->second->event.eMutex);
+            it->second->woken = true;
+            pthread_cond_broadcast(&it->second->event.eCondVar);
+            pthread_mutex_unlock(&it->second->event.eMutex);
+        #endif
+    }
+}
+
+
+/*==============================
+    ftdi_writepiece
+    Writes one piece of a gathered write, and
+    updates the upload progress
+    @param  The device handle
+    @param  The data to write
+    @param  The number of bytes to write
+    @param  A pointer to the bytes written so far
+    @param  The total bytes being written
+    @return The FTDI status
+==============================*/
+
+static FT_STATUS ftdi_writepiece(FT_HANDLE handle, const byte* data, uint32_t size, uint64_t* done, uint64_t total)
+{
+    DWORD written;
+    FT_STATUS status = ftdi_write(handle, (LPVOID)data, size, &written);
+    if (status != FT_OK)
+        return status;
+    if (written != size)
+        return FT_IO_ERROR;
+    *done += size;
+    device_setuploadprogress((((float)*done)/((float)total))*100.0f);
+    return FT_OK;
+}
+
+
+/*==============================
+    ftdi_writesegments
+    Writes a list of segments to a USB device
+    back to back. Small segments are gathered
+    up so they go out together, and large ones
+    are written straight from their memory.
+    @param  The device handle
+    @param  The segments to write
+    @param  The number of segments
+    @param  The most bytes to send in a single
+            write, or 0 for no limit
+    @return The FTDI status
+==============================*/
+
+FT_STATUS ftdi_writesegments(FT_HANDLE handle, const DataSegment* segments, uint32_t count, uint32_t chunksize)
+{
+    static const byte zeroes[GATHER_SIZE] = {0};
+    byte      gather[GATHER_SIZE];
+    uint32_t  gathered = 0;
+    uint32_t  gathermax = (chunksize != 0 && chunksize < GATHER_SIZE) ? chunksize : GATHER_SIZE;
+    uint64_t  total = 0;
+    uint64_t  done = 0;
+    FT_STATUS status;
+
+    for (uint32_t i=0; i<count; i++)
+        total += segments[i].size;
+
+    for (uint32_t i=0; i<count; i++)
+    {
+        const byte* data = segments[i].data;
+        uint32_t left = segments[i].size;
+        while (left > 0)
+        {
+            uint32_t amount;
+
+            // Small pieces, and whatever follows them, go into the gather buffer until it's full
+            if (gathered > 0 || left < gathermax)
+            {
+                amount = (left < gathermax-gathered) ? left : gathermax-gathered;
+                if (data != NULL)
+                {
+                    memcpy(gather+gathered, data, amount);
+                    data += amount;
+                }
+                else
+                    memset(gather+gathered, 0, amount);
+                gathered += amount;
+                left -= amount;
+                if (gathered == gathermax)
+                {
+                    status = ftdi_writepiece(handle, gather, gathered, &done, total);
+                    if (status != FT_OK)
+                        return status;
+                    gathered = 0;
+                }
+                continue;
+            }
+
+            // Large segments are written directly
+            amount = left;
+            if (chunksize != 0 && amount > chunksize)
+                amount = chunksize;
+            if (data == NULL && amount > GATHER_SIZE)
+                amount = GATHER_SIZE;
+            status = ftdi_writepiece(handle, (data != NULL) ? data : zeroes, amount, &done, total);
+            if (status != FT_OK)
+                return status;
+            if (data != NULL)
+                data += amount;
+            left -= amount;
+        }
+    }
+
+    // Send whatever is left in the gather buffer
+    if (gathered > 0)
+        return ftdi_writepiece(handle, gather, gathered, &done, total);
+    return FT_OK;
+}
@@ -0,0 +1,51 @@
+#ifndef __FTDI_HEADER
+#define __FTDI_HEADER
+
+    #include "device.h"
+    #include "Include/ftd2xx.h"
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    // What the FTDI chips use until told otherwise
+    #define FTDI_DEFAULT_LATENCY      16
+    #define FTDI_DEFAULT_TRANSFERSIZE 4096
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    // Backend selection
+    bool      ftdi_usevirtual(const char* spec);
+    bool      ftdi_isvirtual();
+    void      ftdi_getstats(USBStats* stats);
+
+    // Receive notification
+    FT_STATUS ftdi_waitrx(FT_HANDLE handle, uint32_t timeout);
+    void      ftdi_wakeall();
+
+    // D2XX API, routed to the selected backend
+    FT_STATUS ftdi_createdeviceinfolist(LPDWORD count);
+    FT_STATUS ftdi_getdeviceinfolist(FT_DEVICE_LIST_INFO_NODE* dest, LPDWORD count);
+    FT_STATUS ftdi_open(int index, FT_HANDLE* handle);
+    FT_STATUS ftdi_close(FT_HANDLE handle);
+    FT_STATUS ftdi_read(FT_HANDLE handle, LPVOID buffer, DWORD size, LPDWORD bytesread);
+    FT_STATUS ftdi_write(FT_HANDLE handle, LPVOID buffer, DWORD size, LPDWORD byteswritten);
+    FT_STATUS ftdi_getqueuestatus(FT_HANDLE handle, DWORD* size);
+    FT_STATUS ftdi_resetdevice(FT_HANDLE handle);
+    FT_STATUS ftdi_purge(FT_HANDLE handle, ULONG mask);
+    FT_STATUS ftdi_settimeouts(FT_HANDLE handle, ULONG readtimeout, ULONG writetimeout);
+    FT_STATUS ftdi_setbitmode(FT_HANDLE handle, UCHAR mask, UCHAR mode);
+    FT_STATUS ftdi_setdtr(FT_HANDLE handle);
+    FT_STATUS ftdi_clrdtr(FT_HANDLE handle);
+    FT_STATUS ftdi_getmodemstatus(FT_HANDLE handle, ULONG* status);
+    FT_STATUS ftdi_setlatencytimer(FT_HANDLE handle, UCHAR latency);
+    FT_STATUS ftdi_setusbparameters(FT_HANDLE handle, ULONG insize, ULONG outsize);
+
+    // Gathered writes
+    FT_STATUS ftdi_writesegments(FT_HANDLE handle, const DataSegment* segments, uint32_t count, uint32_t chunksize);
+
+#endif
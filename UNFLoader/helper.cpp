@@ -68,6 +68,7 @@ void terminate(const char* reason, ...)
         debug_closedebugout();
 
     // Close the flashcart if it's open
+    debug_stopreaders();
     if (device_isopen())
         device_close();
 
@@ -356,34 +357,6 @@ const char* save_typetostr(SaveType saveenum)
 }
 
 
-/*==============================
-    file_lastmodtime
-    Gets the last modification time of
-    a file. This is usually done via stat,
-    but it is broken on WinXP:
-    https://stackoverflow.com/questions/32452777/visual-c-2015-express-stat-not-working-on-windows-xp
-    @param  Path to the file to check the 
-            timestamp of
-    @return The file modification time
-==============================*/
-
-time_t file_lastmodtime(const char* path)
-{
-    struct stat finfo;
-    #ifndef LINUX
-        LARGE_INTEGER lt;
-        WIN32_FILE_ATTRIBUTE_DATA fdata;
-        GetFileAttributesExA(path, GetFileExInfoStandard, &fdata);
-        lt.LowPart = fdata.ftLastWriteTime.dwLowDateTime;
-        lt.HighPart = (long)fdata.ftLastWriteTime.dwHighDateTime;
-        finfo.st_mtime = (time_t)(lt.QuadPart*1e-7);
-    #else
-        stat(path, &finfo);
-    #endif
-    return finfo.st_mtime;
-}
-
-
 /*==============================
     gen_filename
     Generates a unique ending for a filename
@@ -519,6 +492,12 @@ void handle_deviceerror(DeviceError err)
         case DEVICEERR_TIMEOUTSETFAIL:
             terminate("Unable to set flashcart timeouts.");
             break;
+        case DEVICEERR_LATENCYSETFAIL:
+            terminate("Unable to set flashcart latency timer.");
+            break;
+        case DEVICEERR_USBPARAMSETFAIL:
+            terminate("Unable to set flashcart USB transfer size.");
+            break;
         case DEVICEERR_PURGEFAIL:
             terminate("Unable to purge USB contents.");
             break;
@@ -576,6 +555,12 @@ void handle_deviceerror(DeviceError err)
         case DEVICEERR_POLLFAIL:
             SHOULDIE("Flashcart polling failed.");
             break;
+        case DEVICEERR_DATATOOBIG:
+            log_colored("Data must be under %d bytes, unless the ROM's USB library is updated to receive it in fragments.\n", CRDEF_ERROR, device_getmaxdatasize());
+            return;
+        case DEVICEERR_CONSOLECANCELLED:
+            log_colored("The console stopped reading the command before all of it was sent.\n", CRDEF_ERROR);
+            return;
         case DEVICEERR_64D_8303USB:
             terminate("The 8303 CIC is not supported through USB.");
             break;
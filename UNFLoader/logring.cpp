@@ -0,0 +1,230 @@
+/***************************************************************
+                           logring.cpp
+
+A bounded, lock-free queue of terminal messages, which any
+number of threads can push to and one thread pops from. The
+program, progress and cart threads all print while the terminal
+thread draws, so pushing a message never waits on the terminal
+or on another thread. Each slot has a sequence number that says
+whether it is free, being written, or ready to be read. If the
+terminal falls too far behind, messages are dropped and counted
+so that it can say how many were lost.
+***************************************************************/
+
+#include "logring.h"
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+
+
+/*********************************
+              Macros
+*********************************/
+
+// Keeps the producers' and the consumer's counters on separate cache lines
+#define CACHELINE_SIZE 64
+
+
+/*********************************
+            Structures
+*********************************/
+
+typedef struct {
+    std::atomic<uint32_t> sequence;
+    short    col;
+    int32_t  y;
+    bool     stack;
+    uint32_t length;
+    char*    heap;
+    char     text[LOGRING_TEXT_SIZE];
+} LogSlot;
+
+struct LogRing {
+    LogSlot* slots;
+    uint32_t mask;
+
+    // Written by every producer
+    std::atomic<uint32_t> head;
+    std::atomic<uint64_t> dropped;
+    char pad[CACHELINE_SIZE];
+
+    // Only written by the consumer
+    uint32_t tail;
+};
+
+
+/*==============================
+    logring_create
+    Creates an empty log ring
+    @param  The number of messages the ring
+            holds, which must be a power of two
+    @return The new ring, or NULL
+==============================*/
+
+LogRing* logring_create(uint32_t size)
+{
+    LogRing* ring;
+    if (size == 0 || (size & (size-1)) != 0)
+        return NULL;
+    ring = new LogRing();
+    ring->slots = new LogSlot[size];
+    ring->mask = size-1;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->dropped = 0;
+
+    // A slot is free to be written when its sequence matches the position that will use it
+    for (uint32_t i=0; i<size; i++)
+    {
+        ring->slots[i].sequence.store(i, std::memory_order_relaxed);
+        ring->slots[i].heap = NULL;
+    }
+    return ring;
+}
+
+
+/*==============================
+    logring_push
+    Adds a message to the ring. Can be called
+    from any thread, and never blocks.
+    @param  The log ring
+    @param  The color of the message
+    @param  The Y offset to replace
+    @param  Whether the message can be stacked
+    @param  The message
+    @param  The length of the message
+    @return Whether there was room for the message
+==============================*/
+
+bool logring_push(LogRing* ring, short col, int32_t y, bool stack, const char* str, size_t length)
+{
+    LogSlot* slot;
+    uint32_t pos = ring->head.load(std::memory_order_relaxed);
+
+    // Claim a slot
+    while (true)
+    {
+        slot = &ring->slots[pos & ring->mask];
+        int32_t diff = (int32_t)(slot->sequence.load(std::memory_order_acquire) - pos);
+        if (diff == 0)
+        {
+            if (ring->head.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // The consumer hasn't gotten to this slot since the last time around
+            ring->dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        else
+            pos = ring->head.load(std::memory_order_relaxed);
+    }
+
+    // Fill it in, and let the consumer have it
+    slot->col = col;
+    slot->y = y;
+    slot->stack = stack;
+    slot->length = (uint32_t)length;
+    slot->heap = NULL;
+    if (length < LOGRING_TEXT_SIZE)
+        memcpy(slot->text, str, length+1);
+    else
+    {
+        slot->heap = (char*)malloc(length+1);
+        if (slot->heap != NULL)
+            memcpy(slot->heap, str, length+1);
+        else
+        {
+            // Couldn't allocate, so pass on an empty message instead
+            slot->length = 0;
+            slot->text[0] = '\0';
+        }
+    }
+    slot->sequence.store(pos+1, std::memory_order_release);
+    return true;
+}
+
+
+/*==============================
+    logring_pop
+    Takes the oldest message out of the ring.
+    Must only be called from the consumer thread.
+    @param  The log ring
+    @param  A pointer to store the message in.
+            It must be released with
+            logring_release afterwards.
+    @return Whether there was a message
+==============================*/
+
+bool logring_pop(LogRing* ring, LogMessage* msg)
+{
+    LogSlot* slot = &ring->slots[ring->tail & ring->mask];
+
+    // Stop at a slot that's still being written, even if the ones after it are ready, to keep the order
+    if (slot->sequence.load(std::memory_order_acquire) != ring->tail+1)
+        return false;
+    msg->col = slot->col;
+    msg->y = slot->y;
+    msg->stack = slot->stack;
+    msg->heap = slot->heap;
+    if (msg->heap != NULL)
+        msg->str = msg->heap;
+    else
+    {
+        memcpy(msg->text, slot->text, slot->length+1);
+        msg->str = msg->text;
+    }
+
+    // Hand the slot back to the producers, for when they come around again
+    slot->sequence.store(ring->tail + ring->mask + 1, std::memory_order_release);
+    ring->tail++;
+    return true;
+}
+
+
+/*==============================
+    logring_release
+    Frees a message that was popped from
+    the ring
+    @param  The message
+==============================*/
+
+void logring_release(LogMessage* msg)
+{
+    free(msg->heap);
+    msg->heap = NULL;
+}
+
+
+/*==============================
+    logring_takedropped
+    Gets how many messages were dropped since
+    the last time this was called
+    @param  The log ring
+    @return The number of dropped messages
+==============================*/
+
+uint64_t logring_takedropped(LogRing* ring)
+{
+    return ring->dropped.exchange(0, std::memory_order_relaxed);
+}
+
+
+/*==============================
+    logring_destroy
+    Frees a log ring, along with any
+    messages left in it
+    @param  The log ring
+==============================*/
+
+void logring_destroy(LogRing* ring)
+{
+    LogMessage msg;
+    if (ring == NULL)
+        return;
+    while (logring_pop(ring, &msg))
+        logring_release(&msg);
+    delete[] ring->slots;
+    delete ring;
+}
@@ -0,0 +1,48 @@
+#ifndef __LOGRING_HEADER
+#define __LOGRING_HEADER
+
+    #include <stdint.h>
+    #include <stddef.h>
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    // How many messages a ring holds by default. Must be a power of two
+    #define LOGRING_DEFAULT_SIZE 1024
+
+    // Messages up to this size are kept in the ring itself, longer ones are allocated
+    #define LOGRING_TEXT_SIZE 240
+
+
+    /*********************************
+                 Typedefs
+    *********************************/
+
+    typedef struct LogRing LogRing;
+
+    typedef struct {
+        const char* str;
+        short       col;
+        int32_t     y;
+        bool        stack;
+
+        // Where the string is kept
+        char        text[LOGRING_TEXT_SIZE];
+        char*       heap;
+    } LogMessage;
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    LogRing* logring_create(uint32_t size);
+    bool     logring_push(LogRing* ring, short col, int32_t y, bool stack, const char* str, size_t length);
+    bool     logring_pop(LogRing* ring, LogMessage* msg);
+    void     logring_release(LogMessage* msg);
+    uint64_t logring_takedropped(LogRing* ring);
+    void     logring_destroy(LogRing* ring);
+
+#endif
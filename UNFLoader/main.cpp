@@ -9,6 +9,10 @@ UNFLoader Entrypoint
 #include "term.h"
 #include "device.h"
 #include "debug.h"
+#include "rom.h"
+#include "watcher.h"
+#include "bench.h"
+#include "packetpool.h"
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -33,7 +37,20 @@ UNFLoader Entrypoint
 static void parse_args_priority(std::list<char*>* args);
 static void parse_args(std::list<char*>* args);
 static void program_loop();
+static void load_rom();
+static void prepare_rom();
+static void switch_rom();
+static void select_cart(uint32_t index);
+static void deselect_cart();
+static void start_cartthreads();
+static void stop_cartthreads();
+static void cartthread(uint32_t index);
 static void autodetect_romheader();
+static void verify_rom();
+static void verify_cartthread(uint32_t index, VerifyResult* result, DeviceError* err);
+static void show_uploadstats();
+static void show_detectstats();
+static void show_debugstats();
 static void show_title();
 static void show_args();
 static void show_help();
@@ -53,10 +70,23 @@ std::atomic<bool> global_terminating (false);
 static bool     local_autodetect = true;
 static bool     local_debugmode  = false;
 static bool     local_listenmode = false;
+static bool     local_showstats  = false;
 static int      local_timeout = -1;
 static std::list<char*>  local_args;
 static std::atomic<int>  local_esclevel (0);
 static std::atomic<bool> local_reupload (false);
+static bool              local_romchanged = false;
+static RomPrepare*       local_nextrom = NULL;
+static bool              local_nextromstale = false;
+static uint32_t          local_debounce = DEFAULT_DEBOUNCE;
+static bool              local_bench = false;
+static char*             local_benchreport = NULL;
+static bool              local_verify = false;
+
+// Multiple carts
+static char              local_carttags[MAX_CARTS][32];
+static std::thread       local_cartthreads[MAX_CARTS];
+static std::atomic<bool> local_cartthreadsrunning (false);
 
 
 /*==============================
@@ -84,6 +114,13 @@ int main(int argc, char* argv[])
     // Read program arguments
     parse_args(&local_args);
 
+    // Benchmark mode replaces the rest of the program
+    if (local_bench)
+    {
+        bench_main(local_benchreport);
+        terminate(NULL);
+    }
+
     // Show the program arguments if the program can't do much else
     if (!local_debugmode && !local_listenmode && device_getrom() == NULL)
     {
@@ -160,6 +197,28 @@ static void parse_args_priority(std::list<char*>* args)
         }
     }
 
+    // Check for the history size, as the terminal needs it before it's initialized
+    for (it = args->begin(); it != args->end(); ++it)
+    {
+        char* command = (*it);
+        if (!strcmp(command, "-h"))
+        {
+            if (nextarg_isvalid(it, args))
+            {
+                int size = atoi((*it));
+                if (size <= 0)
+                    terminate("History size must be larger than zero.");
+                term_sethistorysize(size);
+                it = args->erase(it);
+                --it;
+                args->erase(it);
+            }
+            else
+                terminate("Missing parameter(s) for command '%s'.", command);
+            break;
+        }
+    }
+
     // Check if the help argument was requested
     for (it = args->begin(); it != args->end(); ++it)
     {
@@ -257,6 +316,7 @@ static void parse_args(std::list<char*>* args)
                 break;
             case 'l': // Set listen mode
                 local_listenmode = true;
+                device_rememberuploads(true);
                 break;
             case 'a': // Disable ED ROM header autodetection
                 local_autodetect = false;
@@ -281,18 +341,71 @@ static void parse_args(std::list<char*>* args)
                 else
                     terminate("Missing parameter(s) for command '%s'.", command);
                 break;
-            case 'h': // Set history size
-                if (nextarg_isvalid(it, args))
-                    term_sethistorysize(atoi(*it));
-                else
-                    terminate("Missing parameter(s) for command '%s'.", command);
-                break;
             case 'm': // Allow message stacking
                 term_allowinput(false);
                 break;
             case 'p':
                 global_badpackets = false;
                 break;
+            case '-': // Long commands
+                if (!strcmp(command, "--stats"))
+                {
+                    local_showstats = true;
+                    term_showrenderstats(true);
+                }
+                else if (!strcmp(command, "--fps"))
+                {
+                    int fps;
+                    if (!nextarg_isvalid(it, args))
+                        terminate("Missing parameter(s) for command '%s'.", command);
+                    fps = atoi(*it);
+                    if (fps < 1 || fps > MAX_FRAMERATE)
+                        terminate("Frame rate must be between 1 and %d.", MAX_FRAMERATE);
+                    term_setframerate(fps);
+                }
+                else if (!strcmp(command, "--debounce"))
+                {
+                    if (nextarg_isvalid(it, args))
+                        local_debounce = atoi(*it);
+                    else
+                        terminate("Missing parameter(s) for command '%s'.", command);
+                }
+                else if (!strcmp(command, "--multicart"))
+                    device_setmulticart(true);
+                else if (!strcmp(command, "--virtual"))
+                {
+                    if (!nextarg_isvalid(it, args))
+                        terminate("Missing parameter(s) for command '%s'.", command);
+                    if (!device_setvirtual(*it))
+                        terminate("Invalid virtual cart '%s'.", *it);
+                }
+                else if (!strcmp(command, "--tune"))
+                {
+                    if (!nextarg_isvalid(it, args))
+                        terminate("Missing parameter(s) for command '%s'.", command);
+                    if (!device_settuning(*it))
+                        terminate("Invalid tuning mode '%s'.", *it);
+                }
+                else if (!strcmp(command, "--bench"))
+                {
+                    local_bench = true;
+                    if (nextarg_isvalid(it, args))
+                        local_benchreport = *it;
+                    else
+                        --it;
+                }
+                else if (!strcmp(command, "--verify"))
+                    local_verify = true;
+                else if (!strcmp(command, "--manifest"))
+                {
+                    if (nextarg_isvalid(it, args))
+                        device_setmanifest(*it);
+                    else
+                        terminate("Missing parameter(s) for command '%s'.", command);
+                }
+                else
+                    terminate("Unknown command '%s'", command);
+                break;
             default:
                 if (device_getrom() == NULL)
                 {
@@ -344,84 +457,129 @@ static void program_loop()
 {
     bool firstupload = true;
     bool autocart = (device_getcart() == CART_NONE);
-    time_t lastmodtime = 0;
+    bool waited;
+    FileWatcher* watcher = NULL;
 
     // Check if we have a flashcart
     if (autocart)
         log_simple("Attempting flashcart autodetection\n");
     handle_deviceerror(device_find());
-    if (autocart)
+    if (device_getcartcount() > 1)
+    {
+        log_replace("%d flashcarts found\n", CRDEF_PROGRAM, device_getcartcount());
+        for (uint32_t i=0; i<device_getcartcount(); i++)
+        {
+            device_selectcart(i);
+            snprintf(local_carttags[i], sizeof(local_carttags[i]), "[%d:%s] ", i, cart_typetostr(device_getcart()));
+            log_simple("  %d: %s\n", i, cart_typetostr(device_getcart()));
+        }
+        device_selectcart(0);
+    }
+    else if (autocart)
         log_replace("%s autodetected\n", CRDEF_PROGRAM, cart_typetostr(device_getcart()));
+    if (local_showstats)
+        show_detectstats();
 
-    // Explicit CIC checking
-    if (device_getrom() != NULL && device_explicitcic())
-        log_simple("CIC set automatically to '%s'.\n", cic_typetostr(device_getcic()));
+    // Load the ROM, so that the header can be checked
+    if (device_getrom() != NULL)
+        load_rom();
 
-    // Autodetect ROM header
-    if (local_autodetect)
-        autodetect_romheader();
+    // Explicit CIC checking and ROM header autodetection, for every cart
+    for (uint32_t i=0; i<device_getcartcount(); i++)
+    {
+        select_cart(i);
+        if (device_getrom() != NULL && device_explicitcic())
+            log_simple("CIC set automatically to '%s'.\n", cic_typetostr(device_getcic()));
+        if (local_autodetect)
+            autodetect_romheader();
+    }
+    deselect_cart();
 
-    // Open the flashcart
+    // Open the flashcarts
     handle_deviceerror(device_open());
     log_simple("USB connection opened.\n");
 
+    // Carts without a USB profile get tuned. This overwrites their SDRAM, so only do it if a ROM is going to be uploaded
+    for (uint32_t i=0; i<device_getcartcount() && device_getrom() != NULL; i++)
+    {
+        select_cart(i);
+        if (device_needstuning())
+        {
+            USBTuning tuning;
+            log_simple("Tuning the USB connection to the %s, this is only done once.\n", cart_typetostr(device_getcart()));
+            handle_deviceerror(device_autotune());
+            device_gettuning(&tuning);
+            log_simple("Using a %dms latency timer, %d byte USB transfers, and %dKB upload chunks.\n", tuning.latency, tuning.transfersize, tuning.romchunk/1024);
+        }
+    }
+    deselect_cart();
+
     // Check if debug mode is possible
-    if (local_debugmode)
+    for (uint32_t i=0; i<device_getcartcount() && local_debugmode; i++)
+    {
+        select_cart(i);
         handle_deviceerror(device_testdebug());
+    }
+    deselect_cart();
 
     // If listen or debug mode is enabled, increment escape level so that
     // The user must press esc to exit
     if (local_listenmode || local_debugmode)
         increment_escapelevel();
 
+    // Start watching the ROM for changes before it's uploaded, so that no change is missed
+    if (local_listenmode && device_getrom() != NULL)
+    {
+        watcher = watcher_open(device_getrom(), local_debounce);
+        if (watcher == NULL)
+            terminate("Unable to watch file '%s'", device_getrom());
+    }
+
     // Loop if debug mode or listen mode is enabled, and esc hasn't been pressed
     do 
     {
-        time_t newmodtime = 0;
-        if (device_getrom() != NULL)
-            newmodtime = file_lastmodtime(device_getrom());
+        // Once the changed ROM is ready, switch over to it
+        if (local_nextrom != NULL && romprepare_isdone(local_nextrom))
+            switch_rom();
 
         // Listen mode
-        if (!firstupload && local_listenmode && lastmodtime != newmodtime)
-        {
+        if (local_romchanged)
             log_simple("ROM change detected. Reuploading.\n");
-            local_reupload = true;
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        }
 
         // If we have a ROM, upload it
-        if (device_getrom() != NULL && (firstupload || local_reupload))
+        if (device_getrom() != NULL && (firstupload || local_reupload || local_romchanged))
         {
-            FILE* fp = NULL;
             uint64_t uploadtime;
-            uint32_t filesize = 0; // I could use stat, but it doesn't work in WinXP (more info below)
-            local_reupload = false;
+            uint32_t filesize;
+            UploadStats stats;
 
-            // Try multiple times to open the file, because sometimes does not work the first time in Listen mode
-            for (int i=0; i<5; i++) 
-            {
-                fp = fopen(device_getrom(), "rb");
-                if (fp != NULL)
-                    break;
-                else
-                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            }
-            if (fp == NULL)
-                terminate("Unable to open file '%s'", device_getrom());
-            
-            // Get the filesize and reset the seek position
-            // Workaround for https://stackoverflow.com/questions/32452777/visual-c-2015-express-stat-not-working-on-windows-xp
-            fseek(fp, 0, SEEK_END);
-            filesize = ftell(fp);
-            fseek(fp, 0, SEEK_SET);
+            // The carts' I/O threads can't talk to them while they're being uploaded to
+            stop_cartthreads();
+            debug_stopreaders();
+
+            // A forced reupload sends the entire ROM, otherwise only what changed is sent
+            if (local_reupload)
+                device_forcefullupload();
+
+            // A changed ROM was already prepared in the background, but a forced reupload reads the file again
+            if (!firstupload && !local_romchanged)
+                load_rom();
+            local_reupload = false;
+            local_romchanged = false;
+            filesize = romimage_getsize(device_getromimage());
 
             // File size checks
             if (filesize < 1*1024*1024)
                 log_simple("ROM is smaller than 1MB, it might not boot properly.\n");
-            if (filesize > device_getmaxromsize())
-                terminate("The %s only supports ROMs up to %d bytes.", cart_typetostr(device_getcart()), device_getmaxromsize());
-            if (device_rompadding(filesize) != filesize)
-                log_simple("ROM will be padded by %d bytes to %dMB\n", device_rompadding(filesize) - filesize, device_rompadding(filesize)/(1024*1024));
+            for (uint32_t i=0; i<device_getcartcount(); i++)
+            {
+                select_cart(i);
+                if (filesize > device_getmaxromsize())
+                    terminate("The %s only supports ROMs up to %d bytes.", cart_typetostr(device_getcart()), device_getmaxromsize());
+                if (device_rompadding(filesize) != filesize)
+                    log_simple("ROM will be padded by %d bytes to %dMB\n", device_rompadding(filesize) - filesize, device_rompadding(filesize)/(1024*1024));
+            }
+            deselect_cart();
 
             // Upload the ROM
             increment_escapelevel();
@@ -431,27 +589,48 @@ static void program_loop()
                 std::thread t;
                 log_colored("Uploading ROM (ESC to cancel)\n", CRDEF_INPUT);
                 t = std::thread(progressthread, "Uploading ROM (ESC to cancel)");
-                handle_deviceerror(device_sendrom(fp, filesize));
+                handle_deviceerror(device_broadcastrom());
                 t.join();
             }
             else
             {
                 log_simple("Uploading ROM (Type 'cancel' to stop).\n");
-                handle_deviceerror(device_sendrom(fp, filesize));
+                handle_deviceerror(device_broadcastrom());
             }
 
             // Success?
-            if (!device_uploadcancelled())
+            if (!device_uploadcancelled() && device_getcartcount() > 1)
             {
                 decrement_escapelevel();
-                log_replace("ROM successfully uploaded in %.02lf seconds!\n", CRDEF_PROGRAM, ((double)(time_miliseconds() - uploadtime)) / 1000.0f);
+                log_replace("ROM successfully uploaded to %d carts in %.02lf seconds!\n", CRDEF_PROGRAM, device_getcartcount(), ((double)(time_miliseconds() - uploadtime)) / 1000.0f);
+                for (uint32_t i=0; i<device_getcartcount(); i++)
+                {
+                    select_cart(i);
+                    device_getuploadstats(&stats);
+                    if (stats.bytessent < stats.romsize)
+                        log_simple("%d of %d KB changed.\n", stats.bytessent/1024, stats.romsize/1024);
+                    if (local_showstats)
+                        show_uploadstats();
+                }
+                deselect_cart();
+            }
+            else if (!device_uploadcancelled())
+            {
+                decrement_escapelevel();
+                device_getuploadstats(&stats);
+                if (stats.bytessent < stats.romsize)
+                    log_replace("ROM successfully uploaded in %.02lf seconds (%d of %d KB changed)!\n", CRDEF_PROGRAM, ((double)(time_miliseconds() - uploadtime)) / 1000.0f, stats.bytessent/1024, stats.romsize/1024);
+                else
+                    log_replace("ROM successfully uploaded in %.02lf seconds!\n", CRDEF_PROGRAM, ((double)(time_miliseconds() - uploadtime)) / 1000.0f);
+                if (local_showstats)
+                    show_uploadstats();
             }
             else
                 log_replace("ROM upload cancelled by the user.\n", CRDEF_ERROR);
-            
-            // Update variables and close the file
-            lastmodtime = newmodtime;
-            fclose(fp);
+
+            // Check the ROM arrived intact
+            if (local_verify && !device_uploadcancelled())
+                verify_rom();
         }
 
         // If this was the first run through the loop, initialize some stuff
@@ -488,17 +667,40 @@ static void program_loop()
             firstupload = false;
         }
 
-        // Handle debug mode
-        debug_main();
+        // Handle debug mode. Packets are received on their own threads, and with several carts, each one is handled by its own thread
+        debug_startreaders();
+        if (device_getcartcount() > 1)
+            start_cartthreads();
+        else
+            debug_main();
 
-        // Sleep to be kind to the CPU
+        // Sleep until the cart has data for us, or the ROM changes, while being kind to the CPU
+        waited = false;
         if (local_debugmode)
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
-        else if (local_listenmode)
-            std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+        {
+            if (device_getcartcount() == 1)
+                debug_wait(DEBUG_WAIT_TIMEOUT);
+            else
+                std::this_thread::sleep_for(std::chrono::milliseconds(DEBUG_POLL_INTERVAL));
+            waited = true;
+        }
+        if (watcher != NULL && watcher_wait(watcher, waited ? 0 : 100))
+            prepare_rom();
     }
     while ((local_debugmode || local_listenmode) && get_escapelevel() > 0);
+    stop_cartthreads();
+    debug_stopreaders();
+    if (local_showstats && local_debugmode)
+        show_debugstats();
     term_allowinput(false);
+    watcher_close(watcher);
+    if (local_nextrom != NULL)
+    {
+        RomImage* image;
+        romprepare_finish(local_nextrom, &image);
+        romimage_close(image);
+        local_nextrom = NULL;
+    }
 
     // Close the flashcart
     handle_deviceerror(device_close());
@@ -524,6 +726,9 @@ void program_event(ProgEvent key)
             local_reupload = true;
             break;
     }
+
+    // Don't leave the event waiting on a sleeping debug loop
+    debug_wakeup();
 }
 
 
@@ -579,46 +784,304 @@ int get_timeout()
 
 
 /*==============================
-    autodetect_romheader
-    Reads the ROM header and sets the save/RTC value
-    using the ED format.
+    load_rom
+    Opens the ROM file, retrying a few times
+    as it can fail while the file is still
+    being written in Listen mode
 ==============================*/
 
-static void autodetect_romheader()
+static void load_rom()
 {
-    FILE* fp;
-    byte* buff;
-    if (!local_autodetect || device_getsave() != SAVE_NONE || device_getrom() == NULL)
+    for (int i=0; i<5; i++) 
+    {
+        if (device_loadrom() == DEVICEERR_OK)
+            return;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    terminate("Unable to open file '%s'", device_getrom());
+}
+
+
+/*==============================
+    prepare_rom
+    Starts preparing the changed ROM in the
+    background. If one is already being
+    prepared, it's redone once it finishes
+==============================*/
+
+static void prepare_rom()
+{
+    if (local_nextrom != NULL)
+    {
+        local_nextromstale = true;
         return;
+    }
+    local_nextromstale = false;
+    handle_deviceerror(romprepare_start(&local_nextrom, device_getrom(), device_rompadding));
+}
+
 
-    // Open the file
-    buff = (byte*) malloc(0x40);
-    fp = fopen(device_getrom(), "rb");
-    if (buff == NULL || fp == NULL)
-        terminate("Unable to open file '%s'.\n", device_getrom());
+/*==============================
+    switch_rom
+    Hands a ROM that finished being prepared
+    over to the uploader
+==============================*/
 
-    // Check for a valid header
-    if (fread(buff, 1, 0x40, fp) != 0x40)
+static void switch_rom()
+{
+    RomImage* image;
+    DeviceError err = romprepare_finish(local_nextrom, &image);
+    local_nextrom = NULL;
+
+    // The file changed again while it was being prepared, so start over
+    if (local_nextromstale)
+    {
+        romimage_close(image);
+        prepare_rom();
         return;
-    if (buff[0x3C] != 'E' || buff[0x3D] != 'D')
+    }
+    if (err == DEVICEERR_FILEREADFAIL)
+        terminate("Unable to open file '%s'", device_getrom());
+    handle_deviceerror(err);
+
+    // Use the new ROM, which might need a different CIC
+    device_setromimage(image);
+    for (uint32_t i=0; i<device_getcartcount(); i++)
+    {
+        select_cart(i);
+        if (device_explicitcic())
+            log_simple("CIC set automatically to '%s'.\n", cic_typetostr(device_getcic()));
+    }
+    deselect_cart();
+    local_romchanged = true;
+}
+
+
+/*==============================
+    select_cart
+    Selects the cart that the main thread 
+    talks to, and tags the output with it
+    if there is more than one
+    @param The index of the cart
+==============================*/
+
+static void select_cart(uint32_t index)
+{
+    device_selectcart(index);
+    term_setoutputtag(device_getcartcount() > 1 ? local_carttags[index] : NULL);
+}
+
+
+/*==============================
+    deselect_cart
+    Goes back to the main thread talking 
+    to the first cart, without tagging
+    the output
+==============================*/
+
+static void deselect_cart()
+{
+    device_selectcart(0);
+    term_setoutputtag(NULL);
+}
+
+
+/*==============================
+    start_cartthreads
+    Starts a thread for each cart, which
+    handles its debug I/O
+==============================*/
+
+static void start_cartthreads()
+{
+    if (local_cartthreadsrunning)
         return;
-    fseek(fp, 0, SEEK_SET);
+    local_cartthreadsrunning = true;
+    for (uint32_t i=0; i<device_getcartcount(); i++)
+        local_cartthreads[i] = std::thread(cartthread, i);
+}
 
-    // If the savetype hasn't been forced
-    switch (buff[0x3F])
+
+/*==============================
+    stop_cartthreads
+    Stops the carts' threads, and waits 
+    for them to finish
+==============================*/
+
+static void stop_cartthreads()
+{
+    if (!local_cartthreadsrunning)
+        return;
+    local_cartthreadsrunning = false;
+    for (uint32_t i=0; i<device_getcartcount(); i++)
+        local_cartthreads[i].join();
+}
+
+
+/*==============================
+    cartthread
+    Handles a single cart's debug I/O
+    until stop_cartthreads is called
+    @param The index of the cart
+==============================*/
+
+static void cartthread(uint32_t index)
+{
+    device_selectcart(index);
+    term_setoutputtag(local_carttags[index]);
+    while (local_cartthreadsrunning)
     {
-        case 0x10: device_setsave(SAVE_EEPROM4K); break;
-        case 0x20: device_setsave(SAVE_EEPROM16K); break;
-        case 0x30: device_setsave(SAVE_SRAM256); break;
-        case 0x50: device_setsave(SAVE_FLASHRAM); break;
-        case 0x40: device_setsave(SAVE_SRAM768); break;
-        case 0x60: device_setsave(SAVE_FLASHRAMPKMN); break;
+        debug_main();
+        debug_wait(DEBUG_WAIT_TIMEOUT);
     }
+}
+
+
+/*==============================
+    autodetect_romheader
+    Reads the ROM header and sets the save/RTC value
+    using the ED format.
+==============================*/
+
+static void autodetect_romheader()
+{
+    if (!local_autodetect || device_getsave() != SAVE_NONE || device_getromimage() == NULL)
+        return;
+
+    // If the savetype hasn't been forced
+    device_setsave(romimage_getsave(device_getromimage()));
     if (device_getsave() != SAVE_NONE)
         log_simple("Auto set save type to '%s' from ED header.\n", save_typetostr(device_getsave()));
+}
+
+
+/*==============================
+    verify_rom
+    Reads the ROM back from every cart
+    and checks that it arrived intact
+==============================*/
+
+static void verify_rom()
+{
+    std::thread  threads[MAX_CARTS];
+    VerifyResult results[MAX_CARTS];
+    DeviceError  errors[MAX_CARTS];
+    uint64_t     verifytime = time_miliseconds();
+
+    // Read the ROM back from all the carts at the same time
+    for (uint32_t i=0; i<device_getcartcount(); i++)
+        threads[i] = std::thread(verify_cartthread, i, &results[i], &errors[i]);
+    for (uint32_t i=0; i<device_getcartcount(); i++)
+        threads[i].join();
+    verifytime = time_miliseconds() - verifytime;
+
+    // Show the results
+    for (uint32_t i=0; i<device_getcartcount(); i++)
+    {
+        select_cart(i);
+        if (!device_canverify())
+            log_simple("The %s can't read ROMs back, so it can't be verified.\n", cart_typetostr(device_getcart()));
+        else if (errors[i] != DEVICEERR_OK)
+        {
+            handle_deviceerror(errors[i]);
+            break;
+        }
+        else if (results[i].matched)
+            log_colored("ROM verified in %.02lf seconds.\n", CRDEF_PROGRAM, ((double)verifytime) / 1000.0f);
+        else
+            log_colored("ROM verification failed, %d bytes from 0x%08X don't match. The next upload will send the entire ROM.\n", CRDEF_ERROR, results[i].size, results[i].offset);
+    }
+    deselect_cart();
+}
+
+
+/*==============================
+    verify_cartthread
+    Reads the ROM back from a single cart,
+    on a thread started by verify_rom
+    @param The index of the cart
+    @param A pointer to store the result in
+    @param A pointer to store the device error in
+==============================*/
 
-    // Cleanup
-    free(buff);
+static void verify_cartthread(uint32_t index, VerifyResult* result, DeviceError* err)
+{
+    device_selectcart(index);
+    (*err) = device_canverify() ? device_verifyrom(result) : DEVICEERR_OK;
+}
+
+
+/*==============================
+    show_uploadstats
+    Prints how long each stage of the 
+    last ROM upload took
+==============================*/
+
+static void show_uploadstats()
+{
+    UploadStats stats;
+    device_getuploadstats(&stats);
+    log_colored("Disk read %.03lfs, prepare %.03lfs, USB send %.03lfs, waited %.03lfs for data (%d chunks).\n", CRDEF_INFO, 
+        ((double)stats.readtime)/1000000.0, ((double)stats.preparetime)/1000000.0, ((double)stats.sendtime)/1000000.0, 
+        ((double)stats.stalltime)/1000000.0, stats.chunks
+    );
+    if (stats.readtime + stats.preparetime > stats.sendtime)
+        log_colored("The upload was limited by disk/CPU speed.\n", CRDEF_INFO);
+    else
+        log_colored("The upload was limited by USB speed.\n", CRDEF_INFO);
+}
+
+
+/*==============================
+    show_debugstats
+    Prints how well debug mode kept up
+    with what the carts sent
+==============================*/
+
+static void show_debugstats()
+{
+    PacketRingStats stats;
+    PacketPoolStats pool;
+    for (uint32_t i=0; i<device_getcartcount(); i++)
+    {
+        select_cart(i);
+        debug_getreaderstats(&stats);
+        log_colored("Received %llu debug packets, %llu dropped, at most %d waiting to be handled.\n", CRDEF_INFO, 
+            (unsigned long long)(stats.pushed + stats.dropped), (unsigned long long)stats.dropped, stats.maxdepth
+        );
+    }
+    deselect_cart();
+    packetpool_getstats(&pool);
+    log_colored("%llu packet buffers were handed out, %llu of them had to be allocated.\n", CRDEF_INFO, 
+        (unsigned long long)pool.allocs, (unsigned long long)pool.heapallocs
+    );
+}
+
+
+/*==============================
+    show_detectstats
+    Prints how long each step of the 
+    flashcart autodetection took
+==============================*/
+
+static void show_detectstats()
+{
+    uint32_t count;
+    uint64_t enumtime;
+    const ProbeStats* probes;
+    device_getdetectstats(&enumtime, &probes, &count);
+    log_colored("USB enumeration %.03lfms.\n", CRDEF_INFO, ((double)enumtime)/1000.0);
+    for (uint32_t i=0; i<count; i++)
+    {
+        const char* result = "error";
+        if (probes[i].result == DEVICEERR_OK)
+            result = "match";
+        else if (probes[i].cancelled)
+            result = "cancelled";
+        else if (probes[i].result == DEVICEERR_NOTCART)
+            result = "no match";
+        log_colored("%s on device %d: %.03lfms, %s.\n", CRDEF_INFO, cart_typetostr(probes[i].carttype), probes[i].index, ((double)probes[i].time)/1000.0, result);
+    }
 }
 
 
@@ -667,6 +1130,26 @@ static void show_args()
     log_simple("  -m\t\t\t   Always show duplicate prints in debug mode.\n");
     log_simple("  -p\t\t\t   Do not terminate on bad USB packets.\n");
     log_simple("  -b\t\t\t   Disable ncurses.\n");
+    log_simple("  --stats\t\t   Show detection, upload, debug mode and terminal drawing statistics.\n");
+    log_simple("  --fps <hz>\t\t   How many times a second the terminal output is drawn (default %d).\n", DEFAULT_FRAMERATE);
+    log_simple("  --debounce <ms>\t   Time the ROM must be untouched for in Listen mode (default %d).\n", DEFAULT_DEBOUNCE);
+    log_simple("  --manifest <file>\t   Remember uploads in a file, to only send changes next run.\n");
+    log_simple("  --verify\t\t   Read the ROM back after uploading it, to check it arrived intact.\n");
+    log_simple("  --multicart\t\t   Use every flashcart that is plugged in, rather than the first.\n");
+    log_simple("  --virtual <carts>\t   Use emulated flashcarts instead of USB devices, for testing.\n");
+    log_simple(            "\t\t\t   Carts are separated by commas, and each one is written as\n");
+    log_simple(            "\t\t\t   type[:option=value:option=value...], where type is 64drive1,\n");
+    log_simple(            "\t\t\t   64drive2, everdrive or sc64, and the options are bw (MB/s),\n");
+    log_simple(            "\t\t\t   lat (us), corrupt, drop, stall, fail (fault rates from 0 to 1),\n");
+    log_simple(            "\t\t\t   seed, proto (1 or 2), window (the console's debug area size in\n");
+    log_simple(            "\t\t\t   bytes, at least 1024, so bigger data is sent in fragments) and\n");
+    log_simple(            "\t\t\t   echo. For example, sc64:bw=20:window=4096,64drive2:drop=0.01\n");
+    log_simple("  --tune <mode>\t\t   How to pick the USB settings of each cart. auto (default) tunes\n");
+    log_simple(            "\t\t\t   a cart the first time a ROM is uploaded to it and saves the\n");
+    log_simple(            "\t\t\t   result, force tunes it again, off keeps the driver defaults,\n");
+    log_simple(            "\t\t\t   or give the settings, like latency=2,transfer=64K,chunk=1M.\n");
+    log_simple("  --bench [file]\t\t   Benchmark uploads and the debug channel on the flashcart, optionally\n");
+    log_simple(            "\t\t\t   writing the report to a file. Receive tests need --virtual.\n");
 }
 
 
@@ -0,0 +1,199 @@
+/***************************************************************
+                          manifest.cpp
+
+Reads and writes the upload manifest, a small text file that
+remembers what was last uploaded to a cart, so that a new run
+of the program only needs to send the parts that changed.
+***************************************************************/
+
+#include "manifest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+
+/*********************************
+              Macros
+*********************************/
+
+#define MANIFEST_HEADER "UNFLoader manifest 1"
+
+
+/*********************************
+        Function Prototypes
+*********************************/
+
+static bool manifest_parse(FILE* fp, Manifest* manifest);
+static bool manifest_readline(FILE* fp, const char* key, char* value, size_t size);
+
+
+/*==============================
+    manifest_load
+    Loads an upload manifest from disk
+    @param  The path of the manifest file
+    @param  A pointer to the manifest to fill.
+            Free it with manifest_free.
+    @return Whether the manifest was loaded
+==============================*/
+
+bool manifest_load(const char* path, Manifest* manifest)
+{
+    FILE* fp;
+    bool  success;
+
+    // Open the file and parse it
+    memset(manifest, 0, sizeof(Manifest));
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return false;
+    success = manifest_parse(fp, manifest);
+    fclose(fp);
+
+    // Cleanup if the manifest was bad
+    if (!success)
+        manifest_free(manifest);
+    return success;
+}
+
+
+/*==============================
+    manifest_save
+    Writes an upload manifest to disk
+    @param  The path of the manifest file
+    @param  A pointer to the manifest to write
+    @return Whether the manifest was written
+==============================*/
+
+bool manifest_save(const char* path, Manifest* manifest)
+{
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL)
+        return false;
+
+    // Write the cart and ROM information
+    fprintf(fp, "%s\n", MANIFEST_HEADER);
+    fprintf(fp, "cart %d\n", (int)manifest->carttype);
+    fprintf(fp, "identity %s\n", manifest->identity);
+    fprintf(fp, "rom %s\n", manifest->rompath);
+    fprintf(fp, "romsize %" PRIu32 "\n", manifest->romsize);
+    fprintf(fp, "cic %d\n", (int)manifest->cictype);
+    fprintf(fp, "save %d\n", (int)manifest->savetype);
+    fprintf(fp, "blocksize %" PRIu32 "\n", manifest->blocksize);
+    fprintf(fp, "hashes %" PRIu32 "\n", manifest->hashcount);
+
+    // Write the block hashes, four per line
+    for (uint32_t i=0; i<manifest->hashcount; i++)
+        fprintf(fp, "%016" PRIx64 "%c", manifest->hashes[i], ((i%4) == 3 || i == manifest->hashcount-1) ? '\n' : ' ');
+
+    // Make sure everything was written
+    if (ferror(fp))
+    {
+        fclose(fp);
+        return false;
+    }
+    return fclose(fp) == 0;
+}
+
+
+/*==============================
+    manifest_free
+    Frees the memory used by a manifest
+    @param A pointer to the manifest
+==============================*/
+
+void manifest_free(Manifest* manifest)
+{
+    free(manifest->hashes);
+    manifest->hashes = NULL;
+    manifest->hashcount = 0;
+}
+
+
+/*==============================
+    manifest_parse
+    Parses the contents of a manifest file
+    @param  The manifest file
+    @param  A pointer to the manifest to fill
+    @return Whether the manifest was valid
+==============================*/
+
+static bool manifest_parse(FILE* fp, Manifest* manifest)
+{
+    char line[300];
+
+    // Check it's a manifest
+    if (fgets(line, sizeof(line), fp) == NULL || strncmp(line, MANIFEST_HEADER, strlen(MANIFEST_HEADER)) != 0)
+        return false;
+
+    // Read the cart and ROM information
+    if (!manifest_readline(fp, "cart", line, sizeof(line)))
+        return false;
+    manifest->carttype = (CartType)atoi(line);
+    if (!manifest_readline(fp, "identity", manifest->identity, sizeof(manifest->identity)))
+        return false;
+    if (!manifest_readline(fp, "rom", manifest->rompath, sizeof(manifest->rompath)))
+        return false;
+    if (!manifest_readline(fp, "romsize", line, sizeof(line)))
+        return false;
+    manifest->romsize = strtoul(line, NULL, 10);
+    if (!manifest_readline(fp, "cic", line, sizeof(line)))
+        return false;
+    manifest->cictype = (CICType)atoi(line);
+    if (!manifest_readline(fp, "save", line, sizeof(line)))
+        return false;
+    manifest->savetype = (SaveType)atoi(line);
+    if (!manifest_readline(fp, "blocksize", line, sizeof(line)))
+        return false;
+    manifest->blocksize = strtoul(line, NULL, 10);
+    if (!manifest_readline(fp, "hashes", line, sizeof(line)))
+        return false;
+    manifest->hashcount = strtoul(line, NULL, 10);
+
+    // Sanity check what was read before allocating anything
+    if (manifest->blocksize == 0 || manifest->hashcount == 0)
+        return false;
+    if (manifest->hashcount != (manifest->romsize + manifest->blocksize - 1)/manifest->blocksize)
+        return false;
+
+    // Read the block hashes
+    manifest->hashes = (uint64_t*) malloc(sizeof(uint64_t)*manifest->hashcount);
+    if (manifest->hashes == NULL)
+        return false;
+    for (uint32_t i=0; i<manifest->hashcount; i++)
+        if (fscanf(fp, "%" SCNx64, &manifest->hashes[i]) != 1)
+            return false;
+    return true;
+}
+
+
+/*==============================
+    manifest_readline
+    Reads a "key value" line from the manifest
+    @param  The manifest file
+    @param  The key that the line should have
+    @param  A buffer to store the value in
+    @param  The size of the buffer
+    @return Whether the line was read
+==============================*/
+
+static bool manifest_readline(FILE* fp, const char* key, char* value, size_t size)
+{
+    char   line[300];
+    size_t keylen = strlen(key);
+    size_t len;
+
+    // Read the line and check the key
+    if (fgets(line, sizeof(line), fp) == NULL)
+        return false;
+    if (strncmp(line, key, keylen) != 0 || line[keylen] != ' ')
+        return false;
+
+    // Copy the value without the trailing newline
+    len = strcspn(line+keylen+1, "\r\n");
+    if (len >= size)
+        return false;
+    memcpy(value, line+keylen+1, len);
+    value[len] = '\0';
+    return true;
+}
@@ -0,0 +1,32 @@
+#ifndef __MANIFEST_HEADER
+#define __MANIFEST_HEADER
+
+    #include "device.h"
+
+
+    /*********************************
+                 Typedefs
+    *********************************/
+
+    typedef struct {
+        CartType  carttype;
+        char      identity[64];
+        char      rompath[260];
+        uint32_t  blocksize;
+        uint32_t  romsize;
+        CICType   cictype;
+        SaveType  savetype;
+        uint32_t  hashcount;
+        uint64_t* hashes;
+    } Manifest;
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    bool manifest_load(const char* path, Manifest* manifest);
+    bool manifest_save(const char* path, Manifest* manifest);
+    void manifest_free(Manifest* manifest);
+
+#endif
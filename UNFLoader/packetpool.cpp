@@ -0,0 +1,185 @@
+/***************************************************************
+                          packetpool.cpp
+
+Buffers for received debug packets. Rather than going through
+malloc and free for every packet, buffers are rounded up to a
+power of two size class and put on a free list when released,
+so that a steady stream of prints reuses the same few buffers.
+Each buffer is reference counted, so that whoever handles a
+packet can read it in place, and keep it for longer if needed.
+***************************************************************/
+
+#include "packetpool.h"
+#include <stdlib.h>
+#include <atomic>
+#include <mutex>
+#include <new>
+
+
+/*********************************
+              Macros
+*********************************/
+
+#define POOL_MINSHIFT 6  // The smallest size class is 64 bytes
+#define POOL_MAXSHIFT 20 // The largest size class is 1MB
+#define POOL_CLASSES  (POOL_MAXSHIFT - POOL_MINSHIFT + 1)
+#define POOL_UNPOOLED POOL_CLASSES // For buffers too big for any class
+
+// How much memory each size class is allowed to keep around for reuse
+#define POOL_CLASSBYTES (4*1024*1024)
+#define POOL_MINKEPT    4
+
+
+/*********************************
+            Structures
+*********************************/
+
+// Sits right before the data that is handed out
+typedef struct PoolBlock {
+    std::atomic<uint32_t> refs;
+    uint32_t              sizeclass;
+    struct PoolBlock*     next;
+} PoolBlock;
+
+
+/*********************************
+             Globals
+*********************************/
+
+static std::mutex local_poolmutex;
+static PoolBlock* local_freelist[POOL_CLASSES];
+static uint32_t   local_freecount[POOL_CLASSES];
+
+// Statistics
+static std::atomic<uint64_t> local_allocs (0);
+static std::atomic<uint64_t> local_heapallocs (0);
+
+
+/*==============================
+    packetpool_sizeclass
+    Gets the size class that fits a buffer
+    @param  The size of the buffer
+    @return The size class, or POOL_UNPOOLED
+==============================*/
+
+static uint32_t packetpool_sizeclass(uint32_t size)
+{
+    uint32_t sizeclass = 0;
+    if (size > (1U << POOL_MAXSHIFT))
+        return POOL_UNPOOLED;
+    while ((1U << (sizeclass + POOL_MINSHIFT)) < size)
+        sizeclass++;
+    return sizeclass;
+}
+
+
+/*==============================
+    packetpool_alloc
+    Gets a buffer for a packet, with a
+    single reference to it
+    @param  The size of the buffer
+    @return The buffer, or NULL
+==============================*/
+
+byte* packetpool_alloc(uint32_t size)
+{
+    PoolBlock* block = NULL;
+    uint32_t sizeclass = packetpool_sizeclass(size);
+
+    // Reuse a buffer if we have one
+    local_allocs++;
+    if (sizeclass != POOL_UNPOOLED)
+    {
+        std::lock_guard<std::mutex> lock(local_poolmutex);
+        block = local_freelist[sizeclass];
+        if (block != NULL)
+        {
+            local_freelist[sizeclass] = block->next;
+            local_freecount[sizeclass]--;
+        }
+    }
+
+    // Otherwise, get a new one
+    if (block == NULL)
+    {
+        size_t blocksize = (sizeclass != POOL_UNPOOLED) ? (1U << (sizeclass + POOL_MINSHIFT)) : size;
+        void* mem = malloc(sizeof(PoolBlock) + blocksize);
+        if (mem == NULL)
+            return NULL;
+        local_heapallocs++;
+        block = new (mem) PoolBlock();
+        block->sizeclass = sizeclass;
+    }
+    block->refs = 1;
+    block->next = NULL;
+    return (byte*)(block + 1);
+}
+
+
+/*==============================
+    packetpool_retain
+    Adds a reference to a packet buffer
+    @param  The buffer
+==============================*/
+
+void packetpool_retain(byte* data)
+{
+    PoolBlock* block = ((PoolBlock*)data) - 1;
+    block->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+/*==============================
+    packetpool_release
+    Drops a reference to a packet buffer,
+    returning it to the pool once nobody
+    is using it anymore
+    @param  The buffer, or NULL
+==============================*/
+
+void packetpool_release(byte* data)
+{
+    PoolBlock* block;
+    uint32_t sizeclass;
+    if (data == NULL)
+        return;
+    block = ((PoolBlock*)data) - 1;
+    if (block->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+
+    // Keep it for later, unless the class already has plenty
+    sizeclass = block->sizeclass;
+    if (sizeclass != POOL_UNPOOLED)
+    {
+        uint32_t keep = POOL_CLASSBYTES >> (sizeclass + POOL_MINSHIFT);
+        std::lock_guard<std::mutex> lock(local_poolmutex);
+        if (keep < POOL_MINKEPT)
+            keep = POOL_MINKEPT;
+        if (local_freecount[sizeclass] < keep)
+        {
+            block->next = local_freelist[sizeclass];
+            local_freelist[sizeclass] = block;
+            local_freecount[sizeclass]++;
+            return;
+        }
+    }
+    block->~PoolBlock();
+    free(block);
+}
+
+
+/*==============================
+    packetpool_getstats
+    Gets how well buffers are being reused
+    @param  A pointer to store the stats in
+==============================*/
+
+void packetpool_getstats(PacketPoolStats* stats)
+{
+    std::lock_guard<std::mutex> lock(local_poolmutex);
+    stats->allocs = local_allocs;
+    stats->heapallocs = local_heapallocs;
+    stats->pooled = 0;
+    for (uint32_t i=0; i<POOL_CLASSES; i++)
+        stats->pooled += local_freecount[i];
+}
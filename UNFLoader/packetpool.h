@@ -0,0 +1,27 @@
+#ifndef __PACKETPOOL_HEADER
+#define __PACKETPOOL_HEADER
+
+    #include "device.h"
+
+
+    /*********************************
+                 Typedefs
+    *********************************/
+
+    typedef struct {
+        uint64_t allocs;     // Buffers handed out
+        uint64_t heapallocs; // Of those, how many had to come from the heap
+        uint32_t pooled;     // Buffers currently waiting to be reused
+    } PacketPoolStats;
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    byte* packetpool_alloc(uint32_t size);
+    void  packetpool_retain(byte* data);
+    void  packetpool_release(byte* data);
+    void  packetpool_getstats(PacketPoolStats* stats);
+
+#endif
@@ -0,0 +1,200 @@
+/***************************************************************
+                          packetring.cpp
+
+A bounded, lock-free queue of debug packets, with exactly one
+thread pushing and one thread popping. Debug mode's USB reader
+thread pushes every packet it receives, and the thread that
+handles the packets pops them, so a slow handler doesn't stop
+the cart from being drained until the ring fills up. What to
+do with a packet that doesn't fit is left to the reader, which
+can count it with packetring_drop if it throws it away.
+***************************************************************/
+
+#include "packetring.h"
+#include "packetpool.h"
+#include <stdlib.h>
+#include <atomic>
+
+
+/*********************************
+              Macros
+*********************************/
+
+// Keeps the two threads' counters on separate cache lines
+#define CACHELINE_SIZE 64
+
+
+/*********************************
+            Structures
+*********************************/
+
+struct PacketRing {
+    DebugPacket* slots;
+    uint32_t     mask;
+
+    // Only written by the producer
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> maxdepth;
+    std::atomic<uint64_t> pushed;
+    std::atomic<uint64_t> dropped;
+    char pad[CACHELINE_SIZE];
+
+    // Only written by the consumer
+    std::atomic<uint32_t> tail;
+};
+
+
+/*==============================
+    packetring_create
+    Creates an empty packet ring
+    @param  The number of packets the ring
+            holds, which must be a power of two
+    @return The new ring, or NULL
+==============================*/
+
+PacketRing* packetring_create(uint32_t size)
+{
+    PacketRing* ring;
+    if (size == 0 || (size & (size-1)) != 0)
+        return NULL;
+    ring = new PacketRing();
+    ring->slots = (DebugPacket*)calloc(size, sizeof(DebugPacket));
+    if (ring->slots == NULL)
+    {
+        delete ring;
+        return NULL;
+    }
+    ring->mask = size-1;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->maxdepth = 0;
+    ring->pushed = 0;
+    ring->dropped = 0;
+    return ring;
+}
+
+
+/*==============================
+    packetring_push
+    Adds a packet to the ring. Must only be
+    called from the producer thread.
+    @param  The packet ring
+    @param  The packet's data header
+    @param  The packet's data, which the ring
+            takes ownership of if it was pushed
+    @return Whether there was room for the packet
+==============================*/
+
+bool packetring_push(PacketRing* ring, uint32_t header, byte* data)
+{
+    uint32_t head = ring->head.load(std::memory_order_relaxed);
+    uint32_t depth = head - ring->tail.load(std::memory_order_acquire);
+
+    if (depth > ring->mask)
+        return false;
+    ring->slots[head & ring->mask].header = header;
+    ring->slots[head & ring->mask].data = data;
+    ring->head.store(head+1, std::memory_order_release);
+    ring->pushed.fetch_add(1, std::memory_order_relaxed);
+    if (depth+1 > ring->maxdepth.load(std::memory_order_relaxed))
+        ring->maxdepth.store(depth+1, std::memory_order_relaxed);
+    return true;
+}
+
+
+/*==============================
+    packetring_drop
+    Counts a packet that didn't fit in the
+    ring and was thrown away. Must only be
+    called from the producer thread.
+    @param  The packet ring
+==============================*/
+
+void packetring_drop(PacketRing* ring)
+{
+    ring->dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+/*==============================
+    packetring_pop
+    Takes the oldest packet out of the ring.
+    Must only be called from the consumer thread.
+    @param  The packet ring
+    @param  A pointer to store the packet in.
+            Its data must be released by the caller.
+    @return Whether there was a packet
+==============================*/
+
+bool packetring_pop(PacketRing* ring, DebugPacket* packet)
+{
+    uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+    if (tail == ring->head.load(std::memory_order_acquire))
+        return false;
+    *packet = ring->slots[tail & ring->mask];
+    ring->tail.store(tail+1, std::memory_order_release);
+    return true;
+}
+
+
+/*==============================
+    packetring_isempty
+    Checks whether the ring has no packets
+    @param  The packet ring
+    @return Whether the ring is empty
+==============================*/
+
+bool packetring_isempty(PacketRing* ring)
+{
+    return ring->tail.load(std::memory_order_acquire) == ring->head.load(std::memory_order_acquire);
+}
+
+
+/*==============================
+    packetring_isfull
+    Checks whether the ring has no room for
+    another packet
+    @param  The packet ring
+    @return Whether the ring is full
+==============================*/
+
+bool packetring_isfull(PacketRing* ring)
+{
+    return ring->head.load(std::memory_order_acquire) - ring->tail.load(std::memory_order_acquire) > ring->mask;
+}
+
+
+/*==============================
+    packetring_getstats
+    Gets the ring's counters. Can be called
+    from any thread.
+    @param  The packet ring
+    @param  A pointer to store the stats in
+==============================*/
+
+void packetring_getstats(PacketRing* ring, PacketRingStats* stats)
+{
+    stats->depth = ring->head.load(std::memory_order_acquire) - ring->tail.load(std::memory_order_acquire);
+    stats->maxdepth = ring->maxdepth;
+    stats->pushed = ring->pushed;
+    stats->dropped = ring->dropped;
+}
+
+
+/*==============================
+    packetring_destroy
+    Frees a packet ring, along with any
+    packets left in it
+    @param  The packet ring
+==============================*/
+
+void packetring_destroy(PacketRing* ring)
+{
+    DebugPacket packet;
+    if (ring == NULL)
+        return;
+    while (packetring_pop(ring, &packet))
+        packetpool_release(packet.data);
+    free(ring->slots);
+    delete ring;
+}
@@ -0,0 +1,47 @@
+#ifndef __PACKETRING_HEADER
+#define __PACKETRING_HEADER
+
+    #include "device.h"
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    // How many packets a ring holds by default. Must be a power of two
+    #define PACKETRING_DEFAULT_SIZE 1024
+
+
+    /*********************************
+                 Typedefs
+    *********************************/
+
+    typedef struct PacketRing PacketRing;
+
+    typedef struct {
+        uint32_t header;
+        byte*    data;
+    } DebugPacket;
+
+    typedef struct {
+        uint32_t depth;
+        uint32_t maxdepth;
+        uint64_t pushed;
+        uint64_t dropped;
+    } PacketRingStats;
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    PacketRing* packetring_create(uint32_t size);
+    bool        packetring_push(PacketRing* ring, uint32_t header, byte* data);
+    void        packetring_drop(PacketRing* ring);
+    bool        packetring_pop(PacketRing* ring, DebugPacket* packet);
+    bool        packetring_isempty(PacketRing* ring);
+    bool        packetring_isfull(PacketRing* ring);
+    void        packetring_getstats(PacketRing* ring, PacketRingStats* stats);
+    void        packetring_destroy(PacketRing* ring);
+
+#endif
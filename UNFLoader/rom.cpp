@@ -0,0 +1,960 @@
+/***************************************************************
+                             rom.cpp
+
+Handles the ROM image. The file is opened once and anything
+derived from it (header, CIC, save type, block hashes) is cached
+so that every stage of the upload can share it.
+The ROM is streamed to the flashcart drivers in chunks, so that
+the whole image never needs to be held in memory at once.
+While the driver sends a chunk over USB, a worker thread reads
+and prepares the next one.
+When the ROM changes in listen mode, the next image can also be
+opened and hashed in the background so that the program loop
+can keep servicing the cart until it's ready to be uploaded.
+***************************************************************/
+
+#include "rom.h"
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <vector>
+
+
+/*********************************
+              Macros
+*********************************/
+
+#define BUFFER_COUNT    2
+#define PREPARE_RETRIES 5
+
+
+/*********************************
+            Structures
+*********************************/
+
+typedef struct {
+    byte*       data;
+    uint32_t    capacity;
+    uint32_t    offset;
+    uint32_t    size;
+    bool        queued;
+    bool        ready;
+    DeviceError err;
+    uint64_t    readtime;
+    uint64_t    preparetime;
+} RomBuffer;
+
+typedef struct {
+    uint64_t* hashes;
+    uint32_t  count;
+    uint32_t  size;
+} RomHashes;
+
+struct RomImage {
+    FILE*      file;
+    uint32_t   filesize;
+    ByteOrder  order;
+    std::mutex mutex;
+    byte       header[ROM_HEADER_SIZE];
+
+    // Derived data, worked out when first needed
+    bool       hasipl3hash;
+    uint32_t   ipl3hash;
+    std::mutex hashmutex;
+    std::vector<RomHashes> hashes;
+};
+
+struct RomStream {
+    RomImage* image;
+    uint32_t  size;
+    uint32_t  position;
+    uint32_t  end;
+    uint32_t  chunksize;
+
+    // Prefetching
+    std::thread             thread;
+    std::mutex              mutex;
+    std::condition_variable cond;
+    RomBuffer               buffers[BUFFER_COUNT];
+    int                     current;
+    bool                    quit;
+
+    // Change tracking
+    bool*     dirty;
+    uint32_t  dirtycount;
+    bool      skipclean;
+
+    // Statistics
+    UploadStats stats;
+    std::chrono::steady_clock::time_point lenttime;
+    bool                                  lent;
+};
+
+struct RomPrepare {
+    std::thread       thread;
+    std::atomic<bool> done;
+    char*             path;
+    uint32_t          (*padding)(uint32_t romsize);
+    RomImage*         image;
+    DeviceError       err;
+};
+
+
+/*********************************
+        Function Prototypes
+*********************************/
+
+static void        romstream_thread(RomStream* rom);
+static DeviceError romstream_fill(RomStream* rom, RomBuffer* buffer);
+static bool        romstream_nextrange(RomStream* rom, uint32_t position, uint32_t* offset, uint32_t* size);
+static void        romstream_queue(RomStream* rom, RomBuffer* buffer, uint32_t offset, uint32_t size);
+static void        romprepare_thread(RomPrepare* prep);
+static uint64_t    rom_elapsed(std::chrono::steady_clock::time_point start);
+
+
+/*==============================
+    romimage_open
+    Opens a ROM file and reads its header
+    @param  A pointer to store the image in
+    @param  The path to the ROM file
+    @return The device error, or OK
+==============================*/
+
+DeviceError romimage_open(RomImage** image, const char* path)
+{
+    RomImage* rom;
+    uint32_t  headersize;
+
+    // Open the file
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL)
+        return DEVICEERR_FILEREADFAIL;
+    rom = new RomImage();
+    rom->file = fp;
+    rom->hasipl3hash = false;
+    rom->ipl3hash = 0;
+
+    // Get the filesize
+    // Workaround for https://stackoverflow.com/questions/32452777/visual-c-2015-express-stat-not-working-on-windows-xp
+    fseek(fp, 0, SEEK_END);
+    rom->filesize = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    // Read the header, which is also where we find out the byte order
+    headersize = rom->filesize < ROM_HEADER_SIZE ? rom->filesize : ROM_HEADER_SIZE;
+    memset(rom->header, 0, ROM_HEADER_SIZE);
+    if (headersize < 4 || fread(rom->header, 1, headersize, fp) != headersize)
+    {
+        romimage_close(rom);
+        return DEVICEERR_FILEREADFAIL;
+    }
+    rom->order = byteorder_detect(rom->header);
+    byteorder_normalize(rom->order, rom->header, headersize);
+    (*image) = rom;
+    return DEVICEERR_OK;
+}
+
+
+/*==============================
+    romimage_getsize
+    Gets the size of the ROM file
+    @param  A pointer to the ROM image
+    @return The size of the file in bytes
+==============================*/
+
+uint32_t romimage_getsize(RomImage* image)
+{
+    return image->filesize;
+}
+
+
+/*==============================
+    romimage_getorder
+    Gets the byte order of the ROM file
+    @param  A pointer to the ROM image
+    @return The byte order
+==============================*/
+
+ByteOrder romimage_getorder(RomImage* image)
+{
+    return image->order;
+}
+
+
+/*==============================
+    romimage_getheader
+    Gets the first ROM_HEADER_SIZE bytes of 
+    the ROM (the header and bootcode), in 
+    big endian
+    @param  A pointer to the ROM image
+    @return The header data
+==============================*/
+
+const byte* romimage_getheader(RomImage* image)
+{
+    return image->header;
+}
+
+
+/*==============================
+    romimage_getipl3hash
+    Gets the checksum of the bootcode, which
+    is used to identify the CIC
+    @param  A pointer to the ROM image
+    @return The bootcode checksum
+==============================*/
+
+uint32_t romimage_getipl3hash(RomImage* image)
+{
+    if (!image->hasipl3hash)
+    {
+        image->ipl3hash = romhash(image->header + ROM_BOOTCODE_OFFSET, ROM_BOOTCODE_SIZE);
+        image->hasipl3hash = true;
+    }
+    return image->ipl3hash;
+}
+
+
+/*==============================
+    romimage_getcic
+    Guesses the ROM's CIC from its bootcode
+    @param  A pointer to the ROM image
+    @return The CIC type, or CIC_NONE if
+            the bootcode is not known
+==============================*/
+
+CICType romimage_getcic(RomImage* image)
+{
+    return cic_from_hash(romimage_getipl3hash(image));
+}
+
+
+/*==============================
+    romimage_getsave
+    Gets the save type from the EverDrive
+    ROM header format
+    @param  A pointer to the ROM image
+    @return The save type, or SAVE_NONE if 
+            the header doesn't have one
+==============================*/
+
+SaveType romimage_getsave(RomImage* image)
+{
+    if (image->header[0x3C] != 'E' || image->header[0x3D] != 'D')
+        return SAVE_NONE;
+    switch (image->header[0x3F])
+    {
+        case 0x10: return SAVE_EEPROM4K;
+        case 0x20: return SAVE_EEPROM16K;
+        case 0x30: return SAVE_SRAM256;
+        case 0x50: return SAVE_FLASHRAM;
+        case 0x40: return SAVE_SRAM768;
+        case 0x60: return SAVE_FLASHRAMPKMN;
+        default:   return SAVE_NONE;
+    }
+}
+
+
+/*==============================
+    romimage_gethashes
+    Gets the hashes of every ROM_HASHBLOCK_SIZE
+    block of the ROM, padded to the given size, 
+    so that it can be compared against a 
+    previous upload. They are only calculated
+    the first time they are asked for, and
+    are kept until the image is closed. Safe 
+    to call from any thread.
+    @param  A pointer to the ROM image
+    @param  The padded size of the ROM
+    @param  A pointer to store the hashes in
+    @param  A pointer to store the number 
+            of hashes in
+    @return The device error, or OK
+==============================*/
+
+DeviceError romimage_gethashes(RomImage* image, uint32_t size, const uint64_t** hashes, uint32_t* count)
+{
+    byte* block;
+    RomHashes entry;
+    uint64_t readtime = 0, preparetime = 0;
+    std::lock_guard<std::mutex> lock(image->hashmutex);
+
+    // Return the hashes if we already have them. Carts that pad the ROM differently each get their own
+    for (size_t i=0; i<image->hashes.size(); i++)
+    {
+        if (image->hashes[i].size == size)
+        {
+            (*hashes) = image->hashes[i].hashes;
+            (*count) = image->hashes[i].count;
+            return DEVICEERR_OK;
+        }
+    }
+
+    // Allocate memory for the hashes
+    entry.size = size;
+    entry.count = (size + ROM_HASHBLOCK_SIZE - 1)/ROM_HASHBLOCK_SIZE;
+    entry.hashes = (uint64_t*) malloc(sizeof(uint64_t)*entry.count);
+    block = (byte*) malloc(ROM_HASHBLOCK_SIZE);
+    if (block == NULL || entry.hashes == NULL)
+    {
+        free(block);
+        free(entry.hashes);
+        return DEVICEERR_MALLOCFAIL;
+    }
+
+    // Hash each block exactly as it would be sent to the cart
+    for (uint32_t i=0; i<entry.count; i++)
+    {
+        uint32_t blocksize = size - i*ROM_HASHBLOCK_SIZE;
+        if (blocksize > ROM_HASHBLOCK_SIZE)
+            blocksize = ROM_HASHBLOCK_SIZE;
+        DeviceError err = romimage_read(image, i*ROM_HASHBLOCK_SIZE, blocksize, block, &readtime, &preparetime);
+        if (err != DEVICEERR_OK)
+        {
+            free(block);
+            free(entry.hashes);
+            return err;
+        }
+        entry.hashes[i] = romimage_hashblock(block, blocksize);
+    }
+    free(block);
+    image->hashes.push_back(entry);
+
+    // Return them
+    (*hashes) = entry.hashes;
+    (*count) = entry.count;
+    return DEVICEERR_OK;
+}
+
+
+/*==============================
+    romimage_read
+    Reads part of the ROM into memory, 
+    padding it and converting it to big 
+    endian. Safe to call from any thread.
+    @param  A pointer to the ROM image
+    @param  The offset to read from
+    @param  The number of bytes to read
+    @param  The buffer to read into
+    @param  A pointer to add the disk read time to
+    @param  A pointer to add the preparation time to
+    @return The device error, or OK
+==============================*/
+
+DeviceError romimage_read(RomImage* image, uint32_t offset, uint32_t size, byte* data, uint64_t* readtime, uint64_t* preparetime)
+{
+    uint32_t toread = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // Read the part of the chunk that exists in the file
+    if (offset < image->filesize)
+    {
+        std::lock_guard<std::mutex> lock(image->mutex);
+        toread = image->filesize - offset;
+        if (toread > size)
+            toread = size;
+        fseek(image->file, offset, SEEK_SET);
+        if (fread(data, 1, toread, image->file) != toread)
+            return DEVICEERR_FILEREADFAIL;
+    }
+    (*readtime) += rom_elapsed(start);
+    start = std::chrono::steady_clock::now();
+
+    // Convert the ROM to big endian if needed
+    byteorder_normalize(image->order, data, toread);
+
+    // Anything past the end of the file is padding
+    if (toread < size)
+        memset(data + toread, 0, size - toread);
+    (*preparetime) += rom_elapsed(start);
+    return DEVICEERR_OK;
+}
+
+
+/*==============================
+    romimage_hashblock
+    Calculates a quick 64-bit hash of a
+    block of data. Not cryptographically
+    secure, only used to spot changes.
+    @param  The data to hash
+    @param  The size of the data
+    @return The hash
+==============================*/
+
+uint64_t romimage_hashblock(const byte* data, uint32_t size)
+{
+    uint64_t hash = 0xCBF29CE484222325ull ^ size;
+    uint32_t i = 0;
+
+    // Mix in 8 bytes at a time
+    for (; i+8<=size; i+=8)
+    {
+        uint64_t word;
+        memcpy(&word, data+i, 8);
+        hash ^= word*0x9E3779B97F4A7C15ull;
+        hash = ((hash << 31) | (hash >> 33))*0xBF58476D1CE4E5B9ull;
+    }
+
+    // Then whatever is left
+    for (; i<size; i++)
+        hash = (hash ^ data[i])*0x100000001B3ull;
+
+    // Finalize so that every input bit affects every output bit
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+
+/*==============================
+    romimage_close
+    Closes the ROM file and frees the
+    memory used by the ROM image
+    @param A pointer to the ROM image
+==============================*/
+
+void romimage_close(RomImage* image)
+{
+    if (image == NULL)
+        return;
+    fclose(image->file);
+    for (size_t i=0; i<image->hashes.size(); i++)
+        free(image->hashes[i].hashes);
+    delete image;
+}
+
+
+/*==============================
+    romstream_open
+    Prepares a ROM image for streaming
+    @param  A pointer to store the stream in
+    @param  A pointer to the ROM image
+    @param  The padded size to upload
+    @return The device error, or OK
+==============================*/
+
+DeviceError romstream_open(RomStream** rom, RomImage* image, uint32_t size)
+{
+    RomStream* stream;
+
+    // Initialize the stream
+    stream = new RomStream();
+    stream->image = image;
+    stream->size = size;
+    stream->position = 0;
+    stream->end = 0;
+    stream->chunksize = 0;
+    stream->dirty = NULL;
+    stream->dirtycount = 0;
+    stream->skipclean = false;
+    memset(stream->buffers, 0, sizeof(stream->buffers));
+    stream->current = 0;
+    stream->quit = false;
+    memset(&stream->stats, 0, sizeof(UploadStats));
+    stream->lent = false;
+
+    // Start the prefetch thread
+    stream->thread = std::thread(romstream_thread, stream);
+    (*rom) = stream;
+    return DEVICEERR_OK;
+}
+
+
+/*==============================
+    romstream_begin
+    Starts iterating over a region of the ROM
+    @param A pointer to the ROM stream
+    @param The offset to start at
+    @param The offset to stop at
+    @param The maximum size of each chunk
+    @param Whether to skip over blocks that 
+           have not changed since the last upload
+==============================*/
+
+void romstream_begin(RomStream* rom, uint32_t start, uint32_t end, uint32_t chunksize, bool skipclean)
+{
+    std::unique_lock<std::mutex> lock(rom->mutex);
+
+    // Let any prefetch in progress finish, as its result will be thrown away
+    rom->cond.wait(lock, [rom]{
+        for (int i=0; i<BUFFER_COUNT; i++)
+            if (rom->buffers[i].queued)
+                return false;
+        return true;
+    });
+    for (int i=0; i<BUFFER_COUNT; i++)
+        rom->buffers[i].ready = false;
+
+    // Setup the new region
+    rom->position = start;
+    rom->end = end > rom->size ? rom->size : end;
+    rom->chunksize = chunksize;
+    rom->skipclean = skipclean;
+}
+
+
+/*==============================
+    romstream_next
+    Gets the next chunk of the ROM,
+    padded and byteswapped, ready to
+    be sent to the flashcart, and starts
+    preparing the one after it.
+    The chunk data is only valid until
+    the next call to this function.
+    @param  A pointer to the ROM stream
+    @param  A pointer to the chunk to fill.
+            Its size will be zero once the
+            region has been fully read.
+    @return The device error, or OK
+==============================*/
+
+DeviceError romstream_next(RomStream* rom, RomChunk* chunk)
+{
+    RomBuffer* buffer = NULL;
+    DeviceError err;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(rom->mutex);
+
+    // Whatever happened since the last chunk was handed out was the driver sending it
+    if (rom->lent)
+    {
+        rom->stats.sendtime += rom_elapsed(rom->lenttime);
+        rom->lent = false;
+    }
+    chunk->offset = rom->position;
+    chunk->size = 0;
+    chunk->data = NULL;
+
+    // Check if we finished
+    if (!romstream_nextrange(rom, rom->position, &chunk->offset, &chunk->size))
+    {
+        rom->position = rom->end;
+        return DEVICEERR_OK;
+    }
+
+    // Check if this chunk was already prefetched
+    for (int i=0; i<BUFFER_COUNT; i++)
+    {
+        RomBuffer* check = &rom->buffers[i];
+        if ((check->queued || check->ready) && check->offset == chunk->offset && check->size == chunk->size)
+        {
+            buffer = check;
+            rom->current = i;
+            break;
+        }
+    }
+
+    // If it wasn't, queue it up
+    if (buffer == NULL)
+    {
+        rom->current = (rom->current + 1) % BUFFER_COUNT;
+        buffer = &rom->buffers[rom->current];
+        rom->cond.wait(lock, [buffer]{return !buffer->queued;});
+        romstream_queue(rom, buffer, chunk->offset, chunk->size);
+    }
+
+    // Wait for the chunk to be ready
+    rom->cond.wait(lock, [buffer]{return buffer->ready;});
+    buffer->ready = false;
+    err = buffer->err;
+    if (err != DEVICEERR_OK)
+        return err;
+    chunk->data = buffer->data;
+    rom->position = chunk->offset + chunk->size;
+    rom->stats.stalltime += rom_elapsed(start);
+    rom->stats.chunks++;
+    rom->stats.bytessent += chunk->size;
+
+    // Start preparing the next chunk while this one is being sent
+    uint32_t nextoffset, nextsize;
+    if (romstream_nextrange(rom, rom->position, &nextoffset, &nextsize))
+        romstream_queue(rom, &rom->buffers[(rom->current + 1) % BUFFER_COUNT], nextoffset, nextsize);
+
+    // Mark the time so we know how long the driver took to send it
+    rom->lenttime = std::chrono::steady_clock::now();
+    rom->lent = true;
+    return DEVICEERR_OK;
+}
+
+
+/*==============================
+    romstream_compare
+    Compares the ROM's block hashes against 
+    the ones of a previous upload, so that
+    unchanged blocks can be skipped.
+    @param  A pointer to the ROM stream
+    @param  The hashes of the previous upload,
+            or NULL to mark everything as changed
+    @param  The number of previous hashes
+    @return The device error, or OK
+==============================*/
+
+DeviceError romstream_compare(RomStream* rom, const uint64_t* hashes, uint32_t count)
+{
+    const uint64_t* current;
+    uint32_t blocks;
+    DeviceError err;
+
+    // Without a dirty list, everything is sent, so there's no need to hash the ROM
+    free(rom->dirty);
+    rom->dirty = NULL;
+    rom->dirtycount = 0;
+    if (hashes == NULL)
+        return DEVICEERR_OK;
+    err = romimage_gethashes(rom->image, rom->size, &current, &blocks);
+    if (err != DEVICEERR_OK)
+        return err;
+
+    // Allocate the dirty list
+    rom->dirty = (bool*) malloc(sizeof(bool)*blocks);
+    if (rom->dirty == NULL)
+        return DEVICEERR_MALLOCFAIL;
+    rom->dirtycount = blocks;
+
+    // Mark the blocks that differ
+    for (uint32_t i=0; i<blocks; i++)
+        rom->dirty[i] = (i >= count || hashes[i] != current[i]);
+    return DEVICEERR_OK;
+}
+
+
+/*==============================
+    romstream_ischanged
+    Checks whether any part of a region of
+    the ROM changed since the last upload
+    @param  A pointer to the ROM stream
+    @param  The offset of the region
+    @param  The size of the region
+    @return Whether the region changed, or true
+            if there is nothing to compare with
+==============================*/
+
+bool romstream_ischanged(RomStream* rom, uint32_t offset, uint32_t size)
+{
+    if (rom->dirty == NULL)
+        return true;
+    for (uint32_t i=offset/ROM_HASHBLOCK_SIZE; i*ROM_HASHBLOCK_SIZE < offset + size; i++)
+        if (i >= rom->dirtycount || rom->dirty[i])
+            return true;
+    return false;
+}
+
+
+/*==============================
+    romstream_gethashes
+    Gets the block hashes of the ROM, at
+    the size it is being streamed with
+    @param  A pointer to the ROM stream
+    @param  A pointer to store the hashes in
+    @param  A pointer to store the number
+            of hashes in
+    @return The device error, or OK
+==============================*/
+
+DeviceError romstream_gethashes(RomStream* rom, const uint64_t** hashes, uint32_t* count)
+{
+    return romimage_gethashes(rom->image, rom->size, hashes, count);
+}
+
+
+/*==============================
+    romstream_getstats
+    Gets the timing statistics of the
+    stream so far
+    @param A pointer to the ROM stream
+    @param A pointer to the stats to fill
+==============================*/
+
+void romstream_getstats(RomStream* rom, UploadStats* stats)
+{
+    std::lock_guard<std::mutex> lock(rom->mutex);
+    (*stats) = rom->stats;
+}
+
+
+/*==============================
+    romstream_close
+    Stops the prefetch thread and frees
+    the memory used by a ROM stream.
+    Does not close the ROM image.
+    @param A pointer to the ROM stream
+==============================*/
+
+void romstream_close(RomStream* rom)
+{
+    if (rom == NULL)
+        return;
+
+    // Stop the prefetch thread
+    {
+        std::lock_guard<std::mutex> lock(rom->mutex);
+        rom->quit = true;
+    }
+    rom->cond.notify_all();
+    rom->thread.join();
+
+    // Cleanup
+    for (int i=0; i<BUFFER_COUNT; i++)
+        free(rom->buffers[i].data);
+    free(rom->dirty);
+    delete rom;
+}
+
+
+/*==============================
+    romprepare_start
+    Starts opening a ROM file and working out
+    everything the upload needs from it on a
+    separate thread
+    @param  A pointer to store the preparation in
+    @param  The path to the ROM file
+    @param  The function that gives the padded
+            size of the ROM
+    @return The device error, or OK
+==============================*/
+
+DeviceError romprepare_start(RomPrepare** prep, const char* path, uint32_t (*padding)(uint32_t romsize))
+{
+    RomPrepare* p = new RomPrepare();
+    p->path = (char*) malloc(strlen(path)+1);
+    if (p->path == NULL)
+    {
+        delete p;
+        return DEVICEERR_MALLOCFAIL;
+    }
+    strcpy(p->path, path);
+    p->padding = padding;
+    p->image = NULL;
+    p->err = DEVICEERR_OK;
+    p->done = false;
+    p->thread = std::thread(romprepare_thread, p);
+    (*prep) = p;
+    return DEVICEERR_OK;
+}
+
+
+/*==============================
+    romprepare_isdone
+    Checks whether a ROM has finished
+    being prepared
+    @param  A pointer to the preparation
+    @return Whether romprepare_finish can be
+            called without waiting
+==============================*/
+
+bool romprepare_isdone(RomPrepare* prep)
+{
+    return prep->done.load();
+}
+
+
+/*==============================
+    romprepare_finish
+    Waits for a ROM to finish being prepared
+    and frees the preparation
+    @param  A pointer to the preparation
+    @param  A pointer to store the ROM image in
+    @return The device error, or OK
+==============================*/
+
+DeviceError romprepare_finish(RomPrepare* prep, RomImage** image)
+{
+    DeviceError err;
+    prep->thread.join();
+    err = prep->err;
+    (*image) = prep->image;
+    free(prep->path);
+    delete prep;
+    return err;
+}
+
+
+/*==============================
+    romstream_queue
+    Asks the prefetch thread to prepare a
+    chunk. Must be called with the stream
+    mutex held.
+    @param A pointer to the ROM stream
+    @param The buffer to prepare the chunk in
+    @param The offset of the chunk
+    @param The size of the chunk
+==============================*/
+
+static void romstream_queue(RomStream* rom, RomBuffer* buffer, uint32_t offset, uint32_t size)
+{
+    buffer->offset = offset;
+    buffer->size = size;
+    buffer->ready = false;
+    buffer->queued = true;
+    rom->cond.notify_all();
+}
+
+
+/*==============================
+    romstream_nextrange
+    Works out where the next chunk starts
+    and how big it is, skipping over blocks
+    that have not changed if requested
+    @param  A pointer to the ROM stream
+    @param  The position to search from
+    @param  A pointer to store the chunk offset
+    @param  A pointer to store the chunk size
+    @return Whether there is another chunk
+==============================*/
+
+static bool romstream_nextrange(RomStream* rom, uint32_t position, uint32_t* offset, uint32_t* size)
+{
+    bool skip = rom->skipclean && rom->dirty != NULL;
+
+    // Skip unchanged blocks
+    if (skip)
+        while (position < rom->end && !rom->dirty[position/ROM_HASHBLOCK_SIZE])
+            position = (position/ROM_HASHBLOCK_SIZE + 1)*ROM_HASHBLOCK_SIZE;
+    if (position >= rom->end)
+        return false;
+
+    // Calculate the chunk size
+    (*offset) = position;
+    (*size) = rom->end - position;
+    if ((*size) > rom->chunksize)
+        (*size) = rom->chunksize;
+
+    // Stop the chunk before the next unchanged block
+    if (skip)
+    {
+        for (uint32_t i=position/ROM_HASHBLOCK_SIZE + 1; i*ROM_HASHBLOCK_SIZE < position + (*size); i++)
+        {
+            if (!rom->dirty[i])
+            {
+                (*size) = i*ROM_HASHBLOCK_SIZE - position;
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+
+/*==============================
+    romstream_thread
+    Prepares queued chunks in the background
+    @param A pointer to the ROM stream
+==============================*/
+
+static void romstream_thread(RomStream* rom)
+{
+    std::unique_lock<std::mutex> lock(rom->mutex);
+    while (true)
+    {
+        RomBuffer* buffer = NULL;
+
+        // Wait for work
+        rom->cond.wait(lock, [rom]{
+            if (rom->quit)
+                return true;
+            for (int i=0; i<BUFFER_COUNT; i++)
+                if (rom->buffers[i].queued)
+                    return true;
+            return false;
+        });
+        if (rom->quit)
+            return;
+
+        // Prepare the chunk without holding the lock, so the driver can keep sending
+        for (int i=0; i<BUFFER_COUNT && buffer == NULL; i++)
+            if (rom->buffers[i].queued)
+                buffer = &rom->buffers[i];
+        lock.unlock();
+        DeviceError err = romstream_fill(rom, buffer);
+        lock.lock();
+        buffer->err = err;
+        rom->stats.readtime += buffer->readtime;
+        rom->stats.preparetime += buffer->preparetime;
+        buffer->queued = false;
+        buffer->ready = true;
+        rom->cond.notify_all();
+    }
+}
+
+
+/*==============================
+    romstream_fill
+    Reads a chunk of the ROM into a buffer.
+    Only called by the prefetch thread.
+    @param  A pointer to the ROM stream
+    @param  The buffer to fill
+    @return The device error, or OK
+==============================*/
+
+static DeviceError romstream_fill(RomStream* rom, RomBuffer* buffer)
+{
+    // Grow the chunk buffer if needed
+    buffer->readtime = 0;
+    buffer->preparetime = 0;
+    if (buffer->size > buffer->capacity)
+    {
+        byte* newbuff = (byte*) realloc(buffer->data, buffer->size);
+        if (newbuff == NULL)
+            return DEVICEERR_MALLOCFAIL;
+        buffer->data = newbuff;
+        buffer->capacity = buffer->size;
+    }
+    return romimage_read(rom->image, buffer->offset, buffer->size, buffer->data, &buffer->readtime, &buffer->preparetime);
+}
+
+
+/*==============================
+    romprepare_thread
+    Opens the ROM and hashes it exactly as it
+    will be sent, so that the upload only has
+    to compare the hashes
+    @param A pointer to the preparation
+==============================*/
+
+static void romprepare_thread(RomPrepare* prep)
+{
+    uint32_t count;
+    const uint64_t* hashes;
+    RomImage* image = NULL;
+
+    // Opening can fail while the file is still being written, so retry a few times
+    for (int i=0; i<PREPARE_RETRIES; i++)
+    {
+        prep->err = romimage_open(&image, prep->path);
+        if (prep->err == DEVICEERR_OK)
+            break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    // Work out the IPL3 hash and the block hashes ahead of time
+    if (prep->err == DEVICEERR_OK)
+    {
+        romimage_getipl3hash(image);
+        prep->err = romimage_gethashes(image, prep->padding(romimage_getsize(image)), &hashes, &count);
+        if (prep->err != DEVICEERR_OK)
+        {
+            romimage_close(image);
+            image = NULL;
+        }
+    }
+    prep->image = image;
+    prep->done = true;
+}
+
+
+/*==============================
+    rom_elapsed
+    Gets the time since a given point
+    @param  The starting time point
+    @return The elapsed time in microseconds
+==============================*/
+
+static uint64_t rom_elapsed(std::chrono::steady_clock::time_point start)
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
@@ -0,0 +1,66 @@
+#ifndef __ROM_HEADER
+#define __ROM_HEADER
+
+    #include "device.h"
+    #include "byteorder.h"
+    #include <stdio.h>
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    #define ROM_HEADER_SIZE     0x1000
+    #define ROM_BOOTCODE_OFFSET 0x40
+    #define ROM_BOOTCODE_SIZE   4032
+    #define ROM_HASHBLOCK_SIZE  (64*1024)
+
+
+    /*********************************
+                 Typedefs
+    *********************************/
+
+    typedef struct RomImage RomImage;
+    typedef struct RomStream RomStream;
+    typedef struct RomPrepare RomPrepare;
+
+    typedef struct {
+        uint32_t offset;
+        uint32_t size;
+        byte*    data;
+    } RomChunk;
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    // ROM image
+    DeviceError     romimage_open(RomImage** image, const char* path);
+    uint32_t        romimage_getsize(RomImage* image);
+    ByteOrder       romimage_getorder(RomImage* image);
+    const byte*     romimage_getheader(RomImage* image);
+    uint32_t        romimage_getipl3hash(RomImage* image);
+    CICType         romimage_getcic(RomImage* image);
+    SaveType        romimage_getsave(RomImage* image);
+    DeviceError     romimage_gethashes(RomImage* image, uint32_t size, const uint64_t** hashes, uint32_t* count);
+    DeviceError     romimage_read(RomImage* image, uint32_t offset, uint32_t size, byte* data, uint64_t* readtime, uint64_t* preparetime);
+    uint64_t        romimage_hashblock(const byte* data, uint32_t size);
+    void            romimage_close(RomImage* image);
+
+    // ROM streaming
+    DeviceError     romstream_open(RomStream** rom, RomImage* image, uint32_t size);
+    void            romstream_begin(RomStream* rom, uint32_t start, uint32_t end, uint32_t chunksize, bool skipclean);
+    DeviceError     romstream_next(RomStream* rom, RomChunk* chunk);
+    DeviceError     romstream_compare(RomStream* rom, const uint64_t* hashes, uint32_t count);
+    bool            romstream_ischanged(RomStream* rom, uint32_t offset, uint32_t size);
+    DeviceError     romstream_gethashes(RomStream* rom, const uint64_t** hashes, uint32_t* count);
+    void            romstream_getstats(RomStream* rom, UploadStats* stats);
+    void            romstream_close(RomStream* rom);
+
+    // Background preparation
+    DeviceError     romprepare_start(RomPrepare** prep, const char* path, uint32_t (*padding)(uint32_t romsize));
+    bool            romprepare_isdone(RomPrepare* prep);
+    DeviceError     romprepare_finish(RomPrepare* prep, RomImage** image);
+
+#endif
@@ -0,0 +1,382 @@
+/***************************************************************
+                          scrollback.cpp
+
+Keeps the terminal's output history, so only what's on screen
+needs to be drawn. Text goes into a fixed size arena that is
+written around in a circle, and each line and color change is
+recorded in their own circular index, so finding any line takes
+the same time no matter how much history there is. Newlines
+aren't stored, a line simply ends where the next one begins.
+Once the arena or either index fills up, the oldest lines are
+forgotten to make room.
+***************************************************************/
+
+#include "scrollback.h"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+
+/*********************************
+              Macros
+*********************************/
+
+#define MIN_LINES 64
+
+// A color span is packed into 64 bits, with the color in the bottom byte
+#define SPAN_MAKE(text, col) (((text) << 8) | ((uint64_t)(col) & 0xFF))
+#define SPAN_TEXT(span)      ((span) >> 8)
+#define SPAN_COL(span)       ((short)((span) & 0xFF))
+
+
+/*********************************
+            Structures
+*********************************/
+
+typedef struct {
+    uint64_t text; // Where the line starts in the arena
+    uint64_t span; // The color span the line starts in
+} ScrollLine;
+
+// Every position is counted from when the scrollback was created, and wraps around its array
+struct Scrollback {
+    char*       text;
+    uint64_t    textsize;
+    uint64_t    texthead;  // How many bytes were written
+    uint64_t    textvalid; // The oldest byte that wasn't written over
+
+    ScrollLine* lines;
+    uint64_t    linesize;
+    uint64_t    firstline;
+    uint64_t    lastline;  // The line being written to
+
+    uint64_t*   spans;
+    uint64_t    spansize;
+    uint64_t    spanhead;  // How many color spans were started
+    uint64_t    spanvalid; // The oldest color span that wasn't written over
+};
+
+
+/*********************************
+        Function Prototypes
+*********************************/
+
+static inline ScrollLine* scrollback_line(Scrollback* sb, uint64_t line);
+static inline uint64_t    scrollback_span(Scrollback* sb, uint64_t span);
+static void               scrollback_setcolor(Scrollback* sb, short col);
+static void               scrollback_write(Scrollback* sb, const char* str, size_t length);
+static void               scrollback_evict(Scrollback* sb);
+
+
+/*==============================
+    scrollback_create
+    Creates an empty scrollback
+    @param  The number of lines to keep
+    @return The new scrollback, or NULL
+==============================*/
+
+Scrollback* scrollback_create(uint64_t lines)
+{
+    Scrollback* sb = (Scrollback*) calloc(1, sizeof(Scrollback));
+    if (sb == NULL)
+        return NULL;
+    lines = std::max(lines, (uint64_t)MIN_LINES);
+    sb->textsize = lines*SCROLLBACK_LINEBYTES;
+    sb->linesize = lines;
+    sb->spansize = lines;
+    sb->text = (char*) malloc(sb->textsize);
+    sb->lines = (ScrollLine*) malloc(sb->linesize*sizeof(ScrollLine));
+    sb->spans = (uint64_t*) malloc(sb->spansize*sizeof(uint64_t));
+    if (sb->text == NULL || sb->lines == NULL || sb->spans == NULL)
+    {
+        scrollback_destroy(sb);
+        return NULL;
+    }
+
+    // Start off with one empty line, with no color
+    sb->spans[0] = SPAN_MAKE(0, 0);
+    sb->spanhead = 1;
+    sb->lines[0].text = 0;
+    sb->lines[0].span = 0;
+    return sb;
+}
+
+
+/*==============================
+    scrollback_append
+    Adds text to the end of the scrollback
+    @param  The scrollback
+    @param  The color of the text
+    @param  The text
+    @param  The length of the text
+    @return The number of lines that were started
+==============================*/
+
+uint32_t scrollback_append(Scrollback* sb, short col, const char* str, size_t length)
+{
+    uint32_t newlines = 0;
+    while (length > 0)
+    {
+        const char* end = (const char*)memchr(str, '\n', length);
+        size_t size = (end != NULL) ? (size_t)(end - str) : length;
+
+        // Write the text up to the newline
+        if (size > 0)
+        {
+            scrollback_setcolor(sb, col);
+            scrollback_write(sb, str, size);
+        }
+        if (end == NULL)
+            break;
+
+        // Start a new line where the text ends
+        sb->lastline++;
+        scrollback_line(sb, sb->lastline)->text = sb->texthead;
+        scrollback_line(sb, sb->lastline)->span = sb->spanhead-1;
+        newlines++;
+        str += size+1;
+        length -= size+1;
+        scrollback_evict(sb);
+    }
+    return newlines;
+}
+
+
+/*==============================
+    scrollback_rewind
+    Moves back a number of lines, so that
+    they're written over. Whatever was after
+    the same place in the line that's moved
+    to is thrown away.
+    @param  The scrollback
+    @param  How many lines to move back by
+==============================*/
+
+void scrollback_rewind(Scrollback* sb, uint32_t y)
+{
+    uint64_t cursor = sb->texthead - scrollback_line(sb, sb->lastline)->text;
+    uint64_t line = (sb->lastline - sb->firstline > y) ? sb->lastline - y : sb->firstline;
+    uint64_t end = (line < sb->lastline) ? scrollback_line(sb, line+1)->text : sb->texthead;
+    ScrollLine* l = scrollback_line(sb, line);
+
+    // Cut the text off, and forget the colors that started after it
+    sb->texthead = l->text + std::min(cursor, end - l->text);
+    sb->lastline = line;
+    while (sb->spanhead-1 > l->span && SPAN_TEXT(scrollback_span(sb, sb->spanhead-1)) >= sb->texthead)
+        sb->spanhead--;
+}
+
+
+/*==============================
+    scrollback_firstline
+    Gets the oldest line that is kept
+    @param  The scrollback
+    @return The number of the oldest line
+==============================*/
+
+uint64_t scrollback_firstline(Scrollback* sb)
+{
+    return sb->firstline;
+}
+
+
+/*==============================
+    scrollback_lastline
+    Gets the line that is being written to
+    @param  The scrollback
+    @return The number of the newest line
+==============================*/
+
+uint64_t scrollback_lastline(Scrollback* sb)
+{
+    return sb->lastline;
+}
+
+
+/*==============================
+    scrollback_getline
+    Gets the text of a line, split into
+    pieces that are all one color
+    @param  The scrollback
+    @param  The number of the line
+    @param  A vector to store the pieces in.
+            It's empty if the line isn't kept
+            or has no text.
+==============================*/
+
+void scrollback_getline(Scrollback* sb, uint64_t line, std::vector<ScrollPiece>* pieces)
+{
+    ScrollLine* l;
+    uint64_t start, end, span;
+    pieces->clear();
+    if (line < sb->firstline || line > sb->lastline)
+        return;
+    l = scrollback_line(sb, line);
+    start = l->text;
+    end = (line < sb->lastline) ? scrollback_line(sb, line+1)->text : sb->texthead;
+
+    // Go through each color span in the line
+    for (span = l->span; start < end; span++)
+    {
+        uint64_t stop = end;
+        if (span+1 < sb->spanhead)
+            stop = std::min(end, SPAN_TEXT(scrollback_span(sb, span+1)));
+
+        // The text can also be split by the end of the arena
+        while (start < stop)
+        {
+            uint64_t offset = start % sb->textsize;
+            ScrollPiece piece;
+            piece.text = sb->text + offset;
+            piece.length = (uint32_t)std::min(stop - start, sb->textsize - offset);
+            piece.col = SPAN_COL(scrollback_span(sb, span));
+            pieces->push_back(piece);
+            start += piece.length;
+        }
+    }
+}
+
+
+/*==============================
+    scrollback_destroy
+    Frees a scrollback
+    @param  The scrollback
+==============================*/
+
+void scrollback_destroy(Scrollback* sb)
+{
+    if (sb == NULL)
+        return;
+    free(sb->text);
+    free(sb->lines);
+    free(sb->spans);
+    free(sb);
+}
+
+
+/*==============================
+    scrollback_line
+    Gets the index entry of a line
+    @param  The scrollback
+    @param  The number of the line
+    @return A pointer to the line's entry
+==============================*/
+
+static inline ScrollLine* scrollback_line(Scrollback* sb, uint64_t line)
+{
+    return &sb->lines[line % sb->linesize];
+}
+
+
+/*==============================
+    scrollback_span
+    Gets a color span
+    @param  The scrollback
+    @param  The number of the span
+    @return The packed color span
+==============================*/
+
+static inline uint64_t scrollback_span(Scrollback* sb, uint64_t span)
+{
+    return sb->spans[span % sb->spansize];
+}
+
+
+/*==============================
+    scrollback_setcolor
+    Makes sure text that's written next
+    is in the given color
+    @param  The scrollback
+    @param  The color
+==============================*/
+
+static void scrollback_setcolor(Scrollback* sb, short col)
+{
+    uint64_t* last = &sb->spans[(sb->spanhead-1) % sb->spansize];
+    if (SPAN_COL(*last) == col)
+        return;
+
+    // If nothing was written in the last color, it can just be changed
+    if (SPAN_TEXT(*last) == sb->texthead)
+        *last = SPAN_MAKE(sb->texthead, col);
+    else
+    {
+        sb->spans[sb->spanhead % sb->spansize] = SPAN_MAKE(sb->texthead, col);
+        sb->spanhead++;
+        scrollback_evict(sb);
+    }
+}
+
+
+/*==============================
+    scrollback_write
+    Copies text into the arena
+    @param  The scrollback
+    @param  The text, without any newlines
+    @param  The length of the text
+==============================*/
+
+static void scrollback_write(Scrollback* sb, const char* str, size_t length)
+{
+    // Anything that doesn't fit would be written over straight away
+    if (length > sb->textsize)
+    {
+        sb->texthead += length - sb->textsize;
+        str += length - sb->textsize;
+        length = sb->textsize;
+    }
+    while (length > 0)
+    {
+        uint64_t offset = sb->texthead % sb->textsize;
+        size_t size = (size_t)std::min((uint64_t)length, sb->textsize - offset);
+        memcpy(sb->text + offset, str, size);
+        sb->texthead += size;
+        str += size;
+        length -= size;
+    }
+    scrollback_evict(sb);
+}
+
+
+/*==============================
+    scrollback_evict
+    Forgets the oldest lines, if the text
+    or colors they need were written over
+    @param  The scrollback
+==============================*/
+
+static void scrollback_evict(Scrollback* sb)
+{
+    ScrollLine* last;
+
+    // Work out what's still intact
+    if (sb->texthead > sb->textsize)
+        sb->textvalid = std::max(sb->textvalid, sb->texthead - sb->textsize);
+    if (sb->spanhead > sb->spansize)
+        sb->spanvalid = std::max(sb->spanvalid, sb->spanhead - sb->spansize);
+
+    // Drop lines from the front until they fit
+    if (sb->lastline - sb->firstline >= sb->linesize)
+        sb->firstline = sb->lastline - sb->linesize + 1;
+    while (sb->firstline < sb->lastline)
+    {
+        ScrollLine* first = scrollback_line(sb, sb->firstline);
+        if (first->text >= sb->textvalid && first->span >= sb->spanvalid)
+            return;
+        sb->firstline++;
+    }
+
+    // The line being written to is the only one left, and it doesn't fit either, so drop its beginning instead
+    last = scrollback_line(sb, sb->lastline);
+    if (last->span < sb->spanvalid)
+    {
+        last->span = sb->spanvalid;
+        last->text = std::max(last->text, SPAN_TEXT(scrollback_span(sb, last->span)));
+    }
+    if (last->text < sb->textvalid)
+    {
+        last->text = sb->textvalid;
+        while (last->span+1 < sb->spanhead && SPAN_TEXT(scrollback_span(sb, last->span+1)) <= last->text)
+            last->span++;
+    }
+}
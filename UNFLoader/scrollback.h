@@ -0,0 +1,43 @@
+#ifndef __SCROLLBACK_HEADER
+#define __SCROLLBACK_HEADER
+
+    #include <stdint.h>
+    #include <stddef.h>
+    #include <vector>
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    // How much text is kept for each line of history, on average
+    #define SCROLLBACK_LINEBYTES 48
+
+
+    /*********************************
+                 Typedefs
+    *********************************/
+
+    typedef struct Scrollback Scrollback;
+
+    // A piece of a line that's all one color
+    typedef struct {
+        const char* text;
+        uint32_t    length;
+        short       col;
+    } ScrollPiece;
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    Scrollback* scrollback_create(uint64_t lines);
+    uint32_t    scrollback_append(Scrollback* sb, short col, const char* str, size_t length);
+    void        scrollback_rewind(Scrollback* sb, uint32_t y);
+    uint64_t    scrollback_firstline(Scrollback* sb);
+    uint64_t    scrollback_lastline(Scrollback* sb);
+    void        scrollback_getline(Scrollback* sb, uint64_t line, std::vector<ScrollPiece>* pieces);
+    void        scrollback_destroy(Scrollback* sb);
+
+#endif
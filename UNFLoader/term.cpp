@@ -8,6 +8,8 @@ Handles terminal I/O, both with and without curses.
 #include "helper.h"
 #include "term.h"
 #include "debug.h"
+#include "logring.h"
+#include "scrollback.h"
 #ifndef LINUX
     #include "Include/curses.h"
     #include "Include/curspriv.h"
@@ -16,16 +18,17 @@ Handles terminal I/O, both with and without curses.
     #include <curses.h>
 #endif
 #include <string.h>
+#include <stdarg.h>
 #include <locale.h>
 #include <signal.h>
 #include <thread>
-#include <queue>
 #include <atomic>
 #include <algorithm>
 #include <climits>
 #include <chrono>
 #include <list>
 #include <iterator>
+#include <vector>
 
 
 /*********************************
@@ -34,24 +37,17 @@ Handles terminal I/O, both with and without curses.
 
 #define BLINKRATE   500
 #define MAXINPUT    256
+#define ARENASIZE   1024
+
+#define FRAME_MAXMESSAGES (LOGRING_DEFAULT_SIZE*4) // So a flood of messages can't starve the input
+#define STATUS_INTERVAL   1000
+#define TAB_WIDTH         8
 
 #define CH_ESCAPE    27
 #define CH_ENTER     '\n'
 #define CH_BACKSPACE '\b'
 
 
-/*********************************
-            Structures
-*********************************/
-
-typedef struct {
-    char*   str;
-    short   col;
-    int32_t y;
-    bool    stack;
-} Output;
-
-
 /*********************************
         Function Prototypes
 *********************************/
@@ -61,6 +57,11 @@ static void termthread();
 static void termthread_simple();
 static void handle_input();
 static void scroll_output(int value);
+static void collect_output();
+static int  max_scroll();
+static int  layout_line(int w, int skiprows, uint32_t* piece, uint32_t* offset);
+static int  draw_line(uint64_t line, int y, int skiprows, int w);
+static void draw_status();
 static void refresh_output();
 static void refresh_input();
 static void term_clearinput();
@@ -83,20 +84,36 @@ WINDOW* local_terminal      = NULL;
 WINDOW* local_inputwin      = NULL;
 WINDOW* local_outputwin     = NULL;
 WINDOW* local_scrolltextwin = NULL;
+WINDOW* local_statuswin     = NULL;
 int     local_termwforced   = -1;
 int     local_termhforced   = -1;
 static std::atomic<bool> local_resizesignal (false);
 static std::atomic<bool> local_keypressed (false);
 
 // Output window globals
-static std::atomic<int> local_padbottom (-1);
-static std::atomic<int> local_scrolly (0);
-static std::queue<Output*> local_mesgqueue;
+static std::atomic<int> local_scrolly (0); // How many lines up from the bottom the output is scrolled
+static Scrollback* local_scrollback = NULL;
+static std::vector<ScrollPiece> local_pieces; // The line that's being drawn
+static LogRing* local_logring = NULL;
+static thread_local const char* local_outputtag = NULL;
+static thread_local std::vector<char> local_arena; // Where each thread formats its messages
 static uint32_t local_historysize = DEFAULT_HISTORYSIZE;
 static char* local_laststackable = NULL;
 static int   local_stackcount = 0;
 static bool  local_allowstack = true;
 
+// Frame globals
+static int      local_framerate = DEFAULT_FRAMERATE;
+static bool     local_outputdirty = false;
+static uint32_t local_framelines  = 0; // Lines started since the last frame
+static bool     local_showrenderstats = false;
+static char     local_statustext[64] = "";
+static uint64_t local_statustime   = 0;
+static uint64_t local_rendertime   = 0; // In microseconds, since the status text was last updated
+static uint32_t local_renderframes = 0;
+static uint64_t local_renderlines  = 0;
+static uint64_t local_skippedlines = 0;
+
 // Input window globals
 static std::atomic<bool> local_allowinput(true);
 static char     local_input[MAXINPUT];
@@ -123,6 +140,15 @@ void term_initialize()
     {
         int w, h;
 
+        // Initialize the message ring, which every thread prints to, and the history it's kept in
+        local_logring = logring_create(LOGRING_DEFAULT_SIZE);
+        local_scrollback = scrollback_create(local_historysize);
+        if (local_logring == NULL || local_scrollback == NULL)
+        {
+            fputs("Error: Unable to allocate memory for the terminal.\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+
         // Initialize Curses
         setlocale(LC_ALL, "");
         local_terminal = initscr();
@@ -152,11 +178,9 @@ void term_initialize()
             sigaction(SIGWINCH, &sa, NULL);
         #endif
 
-        // Setup our console windows
-        local_outputwin = newpad(h+local_historysize, w);
+        // Setup our console windows. Only what's on screen is drawn, so the output doesn't need to be any bigger
+        local_outputwin = newwin(h-1, w, 0, 0);
         local_inputwin = newpad(1, MAXINPUT);
-        scrollok(local_outputwin, TRUE);
-        idlok(local_outputwin, TRUE);
         keypad(local_inputwin, TRUE);
         wtimeout(local_inputwin, 0);
         #ifdef LINUX
@@ -218,99 +242,146 @@ void term_end()
 
 static void termthread()
 {
+    uint64_t nextframe = 0;
     while (!global_terminating)
     {
-        bool wroteout = false;
+        uint64_t now = time_miliseconds();
 
         // If a resize message was received, clear the screen to redraw it all again
         if (local_resizesignal)
             refresh();
 
-        // Output stuff
-        while (!local_mesgqueue.empty())
+        // Take whatever was printed out of the ring, and draw what's on screen once it's time for a new frame
+        collect_output();
+        if (now >= nextframe || local_resizesignal)
         {
-            Output* msg = local_mesgqueue.front();
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            bool wroteout = local_outputdirty;
+
+            // Update the render stats every so often
+            if (local_showrenderstats && now - local_statustime >= STATUS_INTERVAL)
+            {
+                if (local_statustime != 0)
+                    snprintf(local_statustext, sizeof(local_statustext), "%.2lf ms/frame, %.0lf lines/s, %llu skipped", 
+                        (local_renderframes > 0) ? ((double)local_rendertime)/1000.0/local_renderframes : 0.0,
+                        ((double)local_renderlines)*1000.0/(now - local_statustime), (unsigned long long)local_skippedlines
+                    );
+                local_statustime = now;
+                local_rendertime = 0;
+                local_renderframes = 0;
+                local_renderlines = 0;
+                local_skippedlines = 0;
+                wroteout = true;
+            }
+
+            // Refresh if needed, and keep track of how long it all took.
+            // Any lines that went past faster than the screen could show them were never drawn
+            if (wroteout || local_resizesignal)
+            {
+                uint32_t rows = getmaxy(local_outputwin);
+                refresh_output();
+                local_rendertime += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+                local_renderframes++;
+                local_renderlines += local_framelines;
+                if (local_framelines > rows)
+                    local_skippedlines += local_framelines - rows;
+                local_framelines = 0;
+            }
+            nextframe = now + 1000/local_framerate;
+        }
 
-            // Disable all the colors
-            for (int i=0; i<TOTAL_COLORS; i++)
-                wattroff(local_outputwin, COLOR_PAIR(i+1));
+        // Deal with input
+        handle_input();
+
+        // Handle the signal flag
+        if (local_resizesignal)
+            local_resizesignal = false;
 
-            // Handle message stacking
-            if (local_allowstack && msg->stack)
+        // Sleep for a bit
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+
+/*==============================
+    collect_output
+    Takes the messages that were printed out
+    of the ring, and adds them to the history
+==============================*/
+
+static void collect_output()
+{
+    LogMessage msg;
+    uint64_t dropped;
+    uint64_t lastline = scrollback_lastline(local_scrollback);
+    for (int i=0; i<FRAME_MAXMESSAGES && logring_pop(local_logring, &msg); i++)
+    {
+        char dupe[64];
+        const char* str = msg.str;
+        short col = msg.col;
+        int32_t y = msg.y;
+
+        // Handle message stacking
+        if (local_allowstack && msg.stack)
+        {
+            if (local_laststackable != NULL && !strcmp(local_laststackable, str))
             {
-                if (local_laststackable != NULL && !strcmp(local_laststackable, msg->str))
+                local_stackcount++;
+                if (local_stackcount == 1)
                 {
-                    local_stackcount++;
-                    free(msg->str);
-                    if (local_stackcount == 1)
-                    {
-                        msg->str = (char*)malloc(snprintf(NULL, 0, "\nPrevious message duplicated 1 time(s)\n") + 1);
-                        sprintf(msg->str, "\nPrevious message duplicated 1 time(s)\n");
-                        msg->y = 0;
-                    }
-                    else
-                    {
-                        msg->str = (char*)malloc(snprintf(NULL, 0, "Previous message duplicated %d time(s)\n", local_stackcount) + 1);
-                        sprintf(msg->str, "Previous message duplicated %d time(s)\n", local_stackcount);
-                        msg->y = 1;
-                    }
-
-                    msg->col = CRDEF_INFO;
+                    snprintf(dupe, sizeof(dupe), "\nPrevious message duplicated 1 time(s)\n");
+                    y = 0;
                 }
                 else
                 {
-                    if (local_laststackable != NULL)
-                        free(local_laststackable);
-                    local_laststackable = (char*)malloc(strlen(msg->str) + 1);
-                    strcpy(local_laststackable, msg->str);
-                    local_stackcount = 0;
+                    snprintf(dupe, sizeof(dupe), "Previous message duplicated %d time(s)\n", local_stackcount);
+                    y = 1;
                 }
+                str = dupe;
+                col = CRDEF_INFO;
             }
             else
             {
                 if (local_laststackable != NULL)
                     free(local_laststackable);
-                local_laststackable = NULL;
+                local_laststackable = (char*)malloc(strlen(str) + 1);
+                strcpy(local_laststackable, str);
                 local_stackcount = 0;
             }
-
-            // If a color is specified, use it
-            if (msg->col != CR_NONE)
-                wattron(local_outputwin, COLOR_PAIR(msg->col));
-
-            // If a y offset is given, then perform a replacement
-            if (msg->y != 0)
-            {
-                int y, x;
-                getyx(local_outputwin, y, x);
-                wmove(local_outputwin, y-msg->y, x);
-                refresh_output();
-            }
-
-            // Print the string and its args
-            wprintw(local_outputwin, "%s", msg->str);
-            wroteout = true;
-
-            // Cleanup
-            local_mesgqueue.pop();
-            free(msg->str);
-            free(msg);
+        }
+        else
+        {
+            if (local_laststackable != NULL)
+                free(local_laststackable);
+            local_laststackable = NULL;
+            local_stackcount = 0;
         }
 
-        // Refresh if needed
-        if (wroteout || local_resizesignal)
-            refresh_output();
+        // If a y offset is given, then perform a replacement
+        if (y > 0)
+            scrollback_rewind(local_scrollback, y);
 
-        // Deal with input
-        handle_input();
+        // Add the text to the history
+        local_framelines += scrollback_append(local_scrollback, col, str, strlen(str));
+        local_outputdirty = true;
 
-        // Handle the signal flag
-        if (local_resizesignal)
-            local_resizesignal = false;
+        // Cleanup
+        logring_release(&msg);
+    }
 
-        // Sleep for a bit
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    // Say if anything couldn't fit in the ring
+    dropped = logring_takedropped(local_logring);
+    if (dropped > 0)
+    {
+        char notice[128];
+        snprintf(notice, sizeof(notice), "%llu message(s) were dropped, as they were printed faster than the terminal could show them.\n", (unsigned long long)dropped);
+        local_framelines += scrollback_append(local_scrollback, CRDEF_ERROR, notice, strlen(notice));
+        local_outputdirty = true;
     }
+
+    // If the output is scrolled up, keep showing the same lines
+    if (local_scrolly != 0)
+        local_scrolly = std::max(0, local_scrolly + (int)(scrollback_lastline(local_scrollback) - lastline));
 }
 
 
@@ -333,23 +404,36 @@ void __log_output(const short color, const int32_t y, const bool allowstack, con
     // Perform the print
     if (local_terminal != NULL)
     {
-        Output* mesg = (Output*)malloc(sizeof(Output));
-        if (mesg == NULL)
-            return;
-        mesg->col = color;
-        mesg->y = y;
-        mesg->stack = allowstack;
-        mesg->str = (char*)malloc(vsnprintf(NULL, 0, str, args) + 1);
-        va_end(args); 
-        if (mesg->str == NULL)
-            return;
+        size_t tagsize = (local_outputtag != NULL) ? strlen(local_outputtag) : 0;
+        va_list copy;
+        int length;
+
+        // Format the message in this thread's arena, growing it if the message doesn't fit
+        if (local_arena.size() < ARENASIZE)
+            local_arena.resize(ARENASIZE);
+        va_copy(copy, args);
+        length = vsnprintf(&local_arena[tagsize], local_arena.size() - tagsize, str, copy);
+        va_end(copy);
+        if (length >= 0 && tagsize + length + 1 > local_arena.size())
+        {
+            local_arena.resize(tagsize + length + 1);
+            va_copy(copy, args);
+            vsnprintf(&local_arena[tagsize], local_arena.size() - tagsize, str, copy);
+            va_end(copy);
+        }
+        if (tagsize > 0)
+            memcpy(&local_arena[0], local_outputtag, tagsize);
 
-        va_start(args, str);
-        vsprintf(mesg->str, str, args);
-        local_mesgqueue.push(mesg);
+        // Hand it to the terminal thread. If it's too far behind, the message is dropped and counted instead
+        if (length >= 0)
+            logring_push(local_logring, color, y, allowstack, &local_arena[0], tagsize + length);
     }
     else
+    {
+        if (local_outputtag != NULL)
+            printf("%s", local_outputtag);
         vprintf(str, args);
+    }
     va_end(args);
 
     // Print to the output debug file if it exists
@@ -376,44 +460,62 @@ void __log_output(const short color, const int32_t y, const bool allowstack, con
         // Clear doesn't do anything until refresh(), which can't be called here because threads
 
         local_resizesignal = true;
-        local_padbottom = -1;
     }
 #endif
 
 
 /*==============================
     refresh_output
-    Refreshes the output pad to
-    deal with scrolling
+    Draws the part of the output
+    history that's on screen
 ==============================*/
 
 static void refresh_output()
 {
-    int w, h, x, y;
+    int w, h, rows, used, skip, y, maxscroll;
+    uint64_t first = scrollback_firstline(local_scrollback);
+    uint64_t top, bottom;
     static int scrolltextlen = 0;
     static int scrolltextlen_old = 0;
 
-    // Get the terminal size
+    // Get the terminal size, and keep the output window the size of the screen
     getmaxyx(local_terminal, h, w);
+    if (local_resizesignal)
+        wresize(local_outputwin, h-1, w);
+    getmaxyx(local_outputwin, rows, w);
+    maxscroll = max_scroll();
+    if (local_scrolly > maxscroll)
+        local_scrolly = maxscroll;
+
+    // Go up from the bottom line until the screen is full, to find the line at the top.
+    // When scrolled all the way up, start from the oldest line instead, so that it's shown whole even if lines wrap
+    bottom = scrollback_lastline(local_scrollback) - local_scrolly;
+    top = bottom;
+    used = draw_line(top, -1, 0, w);
+    while (used < rows && top > first)
+    {
+        top--;
+        used += draw_line(top, -1, 0, w);
+    }
+    if (local_scrolly > 0 && local_scrolly == maxscroll)
+    {
+        top = first;
+        used = rows;
+    }
 
-    // Initialize padbottom if it hasn't been yet
-    if (local_padbottom == -1)
-        local_padbottom = h-2;
-
-    // Get the cursor position
-    getyx(local_outputwin, y, x);
-
-    // Perform scrolling if needed
-    if (y > local_padbottom)
+    // Draw them, leaving out the rows of the top line that don't fit
+    werase(local_outputwin);
+    skip = std::max(0, used - rows);
+    y = 0;
+    for (uint64_t line=top; line<=bottom && y<rows; line++)
     {
-        int newlinecount = y - local_padbottom;
-        local_padbottom += newlinecount;
-        if (local_scrolly != 0)
-            local_scrolly += newlinecount;
+        y += draw_line(line, y, skip, w);
+        skip = 0;
     }
+    local_outputdirty = false;
 
-    // Refresh the output window
-    prefresh(local_outputwin, local_padbottom - (h-2) - local_scrolly, 0, 0, 0, h-2, w-1);
+    // Refresh the output window. Nothing reaches the screen until doupdate, so it's all drawn at once
+    wnoutrefresh(local_outputwin);
 
     // Print scroll text
     if (local_scrolly != 0)
@@ -421,7 +523,7 @@ static void refresh_output()
         char scrolltext[40 + 1];
 
         // Initialize the scroll text and the window to render the text to
-        sprintf(scrolltext, "%d/%d", local_padbottom.load() - local_scrolly.load()-h+2, local_padbottom.load()-h+2);
+        sprintf(scrolltext, "%d/%d", maxscroll - local_scrolly.load(), maxscroll);
         scrolltextlen = strlen(scrolltext);
 
         // Initialize the scroll text window if necessary
@@ -442,7 +544,7 @@ static void refresh_output()
         // Print the scroll text
         wclear(local_scrolltextwin);
         wprintw(local_scrolltextwin, "%s", scrolltext);
-        wrefresh(local_scrolltextwin);
+        wnoutrefresh(local_scrolltextwin);
         scrolltextlen_old = scrolltextlen;
     }
     else if (local_scrolltextwin != NULL)
@@ -452,6 +554,160 @@ static void refresh_output()
         scrolltextlen = 0;
         scrolltextlen_old = 0;
     }
+
+    // Print the render stats, and show it all
+    draw_status();
+    doupdate();
+}
+
+
+/*==============================
+    draw_status
+    Draws the render stats in the top
+    right corner of the output
+==============================*/
+
+static void draw_status()
+{
+    int w, len = strlen(local_statustext);
+    static int len_old = 0;
+
+    if (!local_showrenderstats || len == 0)
+        return;
+
+    // Move the window if the terminal or the text changed size
+    w = getmaxx(local_terminal);
+    if (local_statuswin == NULL || local_resizesignal || len != len_old)
+    {
+        if (local_statuswin != NULL)
+            delwin(local_statuswin);
+        local_statuswin = newwin(1, len, 0, std::max(0, w-len));
+        wattron(local_statuswin, COLOR_PAIR(CRDEF_SPECIAL));
+        len_old = len;
+    }
+
+    // The output window was drawn over it, so it needs to be drawn again
+    wclear(local_statuswin);
+    wprintw(local_statuswin, "%s", local_statustext);
+    wnoutrefresh(local_statuswin);
+}
+
+
+/*==============================
+    max_scroll
+    Gets how far up the output can be
+    scrolled
+    @return The number of lines
+==============================*/
+
+static int max_scroll()
+{
+    int64_t lines = scrollback_lastline(local_scrollback) - scrollback_firstline(local_scrollback) + 1;
+    return (int)std::min((int64_t)INT_MAX, std::max((int64_t)0, lines - getmaxy(local_outputwin)));
+}
+
+
+/*==============================
+    layout_line
+    Works out how the line in local_pieces
+    wraps when it's drawn, the same way
+    curses does it
+    @param  The width of the window
+    @param  The row to find the start of,
+            or -1 to go through the whole line
+    @param  A pointer to store the piece the
+            row starts in, or NULL
+    @param  A pointer to store where in the
+            piece the row starts, or NULL
+    @return The number of rows the line takes
+==============================*/
+
+static int layout_line(int w, int skiprows, uint32_t* piece, uint32_t* offset)
+{
+    int x = 0, row = 0;
+    for (uint32_t i=0; i<local_pieces.size(); i++)
+    {
+        const ScrollPiece* p = &local_pieces[i];
+        for (uint32_t j=0; j<p->length; j++)
+        {
+            unsigned char c = (unsigned char)p->text[j];
+
+            // The rest of a UTF-8 character doesn't take up any more space
+            if ((c & 0xC0) == 0x80)
+                continue;
+
+            // Wrap if the last character filled the row
+            if (x >= w && c != '\r')
+            {
+                x = 0;
+                row++;
+            }
+            if (row == skiprows && piece != NULL)
+            {
+                (*piece) = i;
+                (*offset) = j;
+                return row;
+            }
+
+            // Move the cursor past the character
+            if (c == '\t')
+            {
+                do
+                    x++;
+                while (x % TAB_WIDTH != 0 && x < w);
+            }
+            else if (c == '\r')
+                x = 0;
+            else if (c < 0x20 || c == 0x7F) // Shown like ^C
+                x += 2;
+            else
+                x++;
+        }
+    }
+    if (piece != NULL)
+    {
+        (*piece) = local_pieces.size();
+        (*offset) = 0;
+    }
+    return row+1;
+}
+
+
+/*==============================
+    draw_line
+    Draws a line of the output history
+    @param  The number of the line
+    @param  The row to draw it at, or -1 to
+            only work out its size
+    @param  How many of the line's rows to
+            leave out at the start
+    @param  The width of the window
+    @return The number of rows that were drawn
+==============================*/
+
+static int draw_line(uint64_t line, int y, int skiprows, int w)
+{
+    uint32_t piece = 0, offset = 0;
+    int rows;
+    scrollback_getline(local_scrollback, line, &local_pieces);
+    rows = layout_line(w, -1, NULL, NULL);
+    if (y < 0)
+        return rows;
+
+    // Find where the first row that's shown starts, then draw from there on
+    if (skiprows > 0)
+        layout_line(w, skiprows, &piece, &offset);
+    wmove(local_outputwin, y, 0);
+    for (; piece<local_pieces.size(); piece++, offset=0)
+    {
+        const ScrollPiece* p = &local_pieces[piece];
+        for (int i=0; i<TOTAL_COLORS; i++)
+            wattroff(local_outputwin, COLOR_PAIR(i+1));
+        if (p->col != CR_NONE)
+            wattron(local_outputwin, COLOR_PAIR(p->col));
+        waddnstr(local_outputwin, p->text + offset, p->length - offset);
+    }
+    return rows - skiprows;
 }
 
 
@@ -497,8 +753,8 @@ static void handle_input()
     {
         case KEY_PPAGE: scroll_output(1); break;
         case KEY_NPAGE: scroll_output(-1); break;
-        case KEY_HOME: scroll_output(local_padbottom); break;
-        case KEY_END: scroll_output(-local_padbottom); break;
+        case KEY_HOME: scroll_output(INT_MAX); break;
+        case KEY_END: scroll_output(-INT_MAX); break;
         case KEY_DOWN:
             if (!local_allowinput)
                 break;
@@ -582,7 +838,7 @@ static void handle_input()
             }
             break;
         case CH_ESCAPE:
-            scroll_output(-local_padbottom);
+            scroll_output(-INT_MAX);
             program_event(PEV_ESCAPE);
             local_keypressed = false;
             term_clearinput();
@@ -706,6 +962,8 @@ static void termthread_simple()
             // Cleanup
             memset(local_input, 0, MAXINPUT);
         }
+        else // Input is disabled or stdin was closed, so don't spin
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
     }
 }
 
@@ -721,18 +979,14 @@ static void termthread_simple()
 
 static void scroll_output(int value)
 {
-    int h = getmaxy(local_terminal);
+    int maxscroll = max_scroll();
 
     // Check if we can scroll
-    if (local_padbottom < h)
+    if (maxscroll == 0)
         return;
 
     // Perform the scrolling
-    local_scrolly += value;
-    if (local_scrolly > local_padbottom-(h-2))
-        local_scrolly = local_padbottom.load()-(h-2);
-    else if (local_scrolly < 0)
-        local_scrolly = 0;
+    local_scrolly = (int)std::min((int64_t)maxscroll, std::max((int64_t)0, (int64_t)local_scrolly + value));
 
     // Refresh the output window to see the changes
     refresh_output();
@@ -756,7 +1010,8 @@ static void term_clearinput()
 /*==============================
     term_sethistorysize
     Sets the number of terminal lines
-    to store for scrolling
+    to store for scrolling. Must be
+    called before term_initialize.
     @param The scroll history size
 ==============================*/
 
@@ -837,17 +1092,42 @@ void term_setsize(int h, int w)
         return;
     resize_term(h, w);
     wresize(local_terminal, h, w);
-    wresize(local_outputwin, h + local_historysize, w);
+    wresize(local_outputwin, h-1, w);
     wresize(local_inputwin, 1, w);
     mvwin(local_inputwin, h-1, 0);
     wrefresh(local_terminal);
     refresh_input();
-    local_padbottom = -1;
     local_scrolly = 0;
     local_resizesignal = true;
 }
 
 
+/*==============================
+    term_setframerate
+    Sets how many times a second the
+    output is drawn
+    @param The number of frames per second
+==============================*/
+
+void term_setframerate(int val)
+{
+    local_framerate = val;
+}
+
+
+/*==============================
+    term_showrenderstats
+    Enables/disables showing how long the
+    output takes to draw
+    @param Whether to show the render stats
+==============================*/
+
+void term_showrenderstats(bool val)
+{
+    local_showrenderstats = val;
+}
+
+
 /*==============================
     term_enablestacking
     Enables/disables stacking printf
@@ -893,4 +1173,19 @@ int term_geth()
 bool term_waskeypressed()
 {
     return local_keypressed.load();
+}
+
+
+/*==============================
+    term_setoutputtag
+    Sets the text that is printed before
+    everything the calling thread outputs,
+    so that output from different carts 
+    can be told apart
+    @param The tag, or NULL for none
+==============================*/
+
+void term_setoutputtag(const char* tag)
+{
+    local_outputtag = tag;
 }
\ No newline at end of file
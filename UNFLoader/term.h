@@ -8,7 +8,9 @@
 
     #define DEFAULT_TERMCOLS 80
     #define DEFAULT_TERMROWS 40
-    #define DEFAULT_HISTORYSIZE 1000
+    #define DEFAULT_HISTORYSIZE 100000
+    #define DEFAULT_FRAMERATE   30
+    #define MAX_FRAMERATE       100
 
     // Color macros
     #define TOTAL_COLORS 5
@@ -40,6 +42,9 @@
     void term_usecurses(bool val);
     void term_allowinput(bool val);
     void term_enablestacking(bool val);
+    void term_setframerate(int val);
+    void term_showrenderstats(bool val);
+    void term_setoutputtag(const char* tag);
     void term_end();
 
     // Terminal checking
@@ -1,6 +1,6 @@
-#ifndef __TERM_INTERNAL_HEADER
-#define __TERM_INTERNAL_HEADER
-
-	void __log_output(const short color, const int32_t y, const bool allowstack, const char* str, ...);
-
+#ifndef __TERM_INTERNAL_HEADER
+#define __TERM_INTERNAL_HEADER
+
+	void __log_output(const short color, const int32_t y, const bool allowstack, const char* str, ...);
+
 #endif
\ No newline at end of file
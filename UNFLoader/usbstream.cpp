@@ -0,0 +1,177 @@
+/***************************************************************
+                          usbstream.cpp
+
+Buffers the data received from a flashcart, so that the drivers
+can parse the small pieces of a debug packet (the magic, the
+header, the payload and the completion signal) from memory,
+instead of asking the FTDI driver for each one. Whenever the
+buffer runs dry, everything that is waiting in the USB queue is
+pulled in with a single read.
+***************************************************************/
+
+#include "usbstream.h"
+#include "ftdi.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+/*==============================
+    usbstream_open
+    Sets up a stream for a USB device
+    @param  The stream to set up
+    @param  The device handle
+    @return Whether the buffer could be allocated
+==============================*/
+
+bool usbstream_open(USBStream* stream, FT_HANDLE handle)
+{
+    stream->handle = handle;
+    stream->start = 0;
+    stream->end = 0;
+    if (stream->buffer == NULL)
+        stream->buffer = (byte*)malloc(USBSTREAM_SIZE);
+    return stream->buffer != NULL;
+}
+
+
+/*==============================
+    usbstream_fill
+    Adds everything that is waiting in the
+    USB queue to the stream, without blocking
+    @param  The stream
+    @return The FTDI status
+==============================*/
+
+FT_STATUS usbstream_fill(USBStream* stream)
+{
+    FT_STATUS status;
+    DWORD queued;
+    DWORD bytesread;
+
+    // Make room at the end of the buffer
+    if (stream->start > 0)
+    {
+        memmove(stream->buffer, stream->buffer + stream->start, stream->end - stream->start);
+        stream->end -= stream->start;
+        stream->start = 0;
+    }
+
+    // Read as much of the queue as fits
+    status = ftdi_getqueuestatus(stream->handle, &queued);
+    if (status != FT_OK || queued == 0)
+        return status;
+    if (queued > USBSTREAM_SIZE - stream->end)
+        queued = USBSTREAM_SIZE - stream->end;
+    if (queued == 0)
+        return FT_OK;
+    status = ftdi_read(stream->handle, stream->buffer + stream->end, queued, &bytesread);
+    if (status == FT_OK)
+        stream->end += bytesread;
+    return status;
+}
+
+
+/*==============================
+    usbstream_available
+    Gets how many received bytes the stream
+    holds that haven't been read yet
+    @param  The stream
+    @return The number of bytes
+==============================*/
+
+uint32_t usbstream_available(USBStream* stream)
+{
+    return stream->end - stream->start;
+}
+
+
+/*==============================
+    usbstream_read
+    Reads from the stream, receiving more data
+    from the device if needed. Like FT_Read, this
+    can read less than asked for if the device
+    times out.
+    @param  The stream
+    @param  The buffer to read into
+    @param  The number of bytes to read
+    @param  A pointer to store the number
+            of bytes read in
+    @return The FTDI status
+==============================*/
+
+FT_STATUS usbstream_read(USBStream* stream, LPVOID buffer, DWORD size, LPDWORD bytesread)
+{
+    FT_STATUS status;
+    DWORD queued;
+    DWORD received;
+    byte* dest = (byte*)buffer;
+    uint32_t amount = usbstream_available(stream);
+
+    // Start with what we already have
+    if (amount > size)
+        amount = size;
+    memcpy(dest, stream->buffer + stream->start, amount);
+    stream->start += amount;
+    *bytesread = amount;
+    if (amount == size)
+        return FT_OK;
+    dest += amount;
+    size -= amount;
+
+    // Large reads go straight into the destination
+    if (size >= USBSTREAM_SIZE)
+    {
+        status = ftdi_read(stream->handle, dest, size, &received);
+        *bytesread += received;
+        return status;
+    }
+
+    // Otherwise, receive the rest along with anything else that's waiting
+    stream->start = 0;
+    stream->end = 0;
+    status = ftdi_getqueuestatus(stream->handle, &queued);
+    if (status != FT_OK)
+        return status;
+    if (queued < size)
+        queued = size;
+    if (queued > USBSTREAM_SIZE)
+        queued = USBSTREAM_SIZE;
+    status = ftdi_read(stream->handle, stream->buffer, queued, &received);
+    if (status != FT_OK)
+        return status;
+    stream->end = received;
+    amount = received < size ? received : size;
+    memcpy(dest, stream->buffer, amount);
+    stream->start = amount;
+    *bytesread += amount;
+    return FT_OK;
+}
+
+
+/*==============================
+    usbstream_clear
+    Throws away everything in the stream,
+    for when the device's queue is purged
+    @param  The stream
+==============================*/
+
+void usbstream_clear(USBStream* stream)
+{
+    stream->start = 0;
+    stream->end = 0;
+}
+
+
+/*==============================
+    usbstream_close
+    Frees the stream's buffer
+    @param  The stream
+==============================*/
+
+void usbstream_close(USBStream* stream)
+{
+    free(stream->buffer);
+    stream->buffer = NULL;
+    stream->start = 0;
+    stream->end = 0;
+}
@@ -0,0 +1,39 @@
+#ifndef __USBSTREAM_HEADER
+#define __USBSTREAM_HEADER
+
+    #include "device.h"
+    #include "Include/ftd2xx.h"
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    // How much received data a stream holds on to
+    #define USBSTREAM_SIZE (64*1024)
+
+
+    /*********************************
+                 Typedefs
+    *********************************/
+
+    typedef struct {
+        FT_HANDLE handle;
+        byte*     buffer;
+        uint32_t  start; // The first byte not yet read
+        uint32_t  end;   // One past the last byte received
+    } USBStream;
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    bool      usbstream_open(USBStream* stream, FT_HANDLE handle);
+    FT_STATUS usbstream_fill(USBStream* stream);
+    uint32_t  usbstream_available(USBStream* stream);
+    FT_STATUS usbstream_read(USBStream* stream, LPVOID buffer, DWORD size, LPDWORD bytesread);
+    void      usbstream_clear(USBStream* stream);
+    void      usbstream_close(USBStream* stream);
+
+#endif
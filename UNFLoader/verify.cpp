@@ -0,0 +1,302 @@
+/***************************************************************
+                           verify.cpp
+
+Checks that a ROM landed on the cart intact, by reading it back
+and comparing it against the file. The cart is read in large
+chunks, and while the next chunk comes in over USB, worker
+threads hash the last one block by block and compare it against
+the hashes that were worked out for the upload. Blocks that don't
+match are read again and compared byte by byte, to rule out a
+bad read and find exactly where the difference starts.
+***************************************************************/
+
+#include "verify.h"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+
+
+/*********************************
+              Macros
+*********************************/
+
+#define VERIFY_CHUNK_SIZE  (4*1024*1024) // Must be a multiple of ROM_HASHBLOCK_SIZE
+#define VERIFY_BUFFERS     2
+#define VERIFY_MAXTHREADS  4
+
+
+/*********************************
+            Structures
+*********************************/
+
+typedef struct {
+    byte*    data;
+    uint32_t offset;
+    uint32_t size;
+    uint32_t blocks;
+    uint32_t claimed;  // Blocks handed to a worker
+    uint32_t finished; // Blocks that were hashed
+    bool     busy;
+} VerifyBuffer;
+
+typedef struct {
+    const uint64_t*         hashes;
+    uint32_t                hashcount;
+    std::vector<bool>       bad;
+    VerifyBuffer            buffers[VERIFY_BUFFERS];
+    std::deque<VerifyBuffer*> queue;
+    std::mutex              mutex;
+    std::condition_variable cond;
+    bool                    quit;
+} VerifyState;
+
+
+/*********************************
+        Function Prototypes
+*********************************/
+
+static void        verify_worker(VerifyState* state);
+static DeviceError verify_findmismatch(CartDevice* cart, VerifyReader readrom, RomImage* image, uint32_t start, uint32_t end, uint32_t* offset);
+
+
+/*==============================
+    verify_run
+    Reads the ROM back from the cart and
+    compares it against the ROM image
+    @param  A pointer to the cart context
+    @param  The function to read the cart with
+    @param  A pointer to the ROM image
+    @param  The size the ROM was padded to
+            when it was uploaded
+    @param  A pointer to store the result in
+    @return The device error, or OK
+==============================*/
+
+DeviceError verify_run(CartDevice* cart, VerifyReader readrom, RomImage* image, uint32_t padsize, VerifyResult* result)
+{
+    VerifyState state;
+    std::vector<std::thread> workers;
+    DeviceError err;
+    uint32_t filesize = romimage_getsize(image);
+    uint32_t hashsize = filesize - filesize%ROM_HASHBLOCK_SIZE;
+    uint32_t threads = std::max(1u, std::min((uint32_t)std::thread::hardware_concurrency(), (uint32_t)VERIFY_MAXTHREADS));
+
+    result->matched = true;
+    result->offset = 0;
+    result->size = 0;
+    result->romsize = filesize;
+
+    // The padding isn't checked, as the 64Drive is known to corrupt the end of an upload.
+    // So only whole blocks are compared by hash, and the last partial block byte by byte
+    err = romimage_gethashes(image, padsize, &state.hashes, &state.hashcount);
+    if (err != DEVICEERR_OK)
+        return err;
+    state.bad.assign(state.hashcount, false);
+    state.quit = false;
+    for (int i=0; i<VERIFY_BUFFERS; i++)
+    {
+        state.buffers[i].data = (byte*) malloc(VERIFY_CHUNK_SIZE);
+        state.buffers[i].busy = false;
+        if (state.buffers[i].data == NULL)
+        {
+            for (int j=0; j<i; j++)
+                free(state.buffers[j].data);
+            return DEVICEERR_MALLOCFAIL;
+        }
+    }
+
+    // Read the cart in chunks, and hand each one to the workers
+    for (uint32_t i=0; i<threads; i++)
+        workers.push_back(std::thread(verify_worker, &state));
+    device_setuploadprogress(0.0f);
+    for (uint32_t offset=0, current=0; offset<hashsize; offset+=VERIFY_CHUNK_SIZE, current=(current+1)%VERIFY_BUFFERS)
+    {
+        VerifyBuffer* buffer = &state.buffers[current];
+        uint32_t size = std::min((uint32_t)VERIFY_CHUNK_SIZE, hashsize - offset);
+
+        if (device_uploadcancelled())
+        {
+            err = DEVICEERR_UPLOADCANCELLED;
+            break;
+        }
+
+        // Wait for the workers to be done with this buffer, then fill it
+        {
+            std::unique_lock<std::mutex> lock(state.mutex);
+            state.cond.wait(lock, [buffer]{return !buffer->busy;});
+        }
+        err = readrom(cart, offset, size, buffer->data);
+        if (err != DEVICEERR_OK)
+            break;
+
+        // Queue it up for hashing
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            buffer->offset = offset;
+            buffer->size = size;
+            buffer->blocks = size/ROM_HASHBLOCK_SIZE;
+            buffer->claimed = 0;
+            buffer->finished = 0;
+            buffer->busy = true;
+            state.queue.push_back(buffer);
+        }
+        state.cond.notify_all();
+        device_setuploadprogress((((float)offset + size)/((float)filesize))*100.0f);
+    }
+
+    // Let the workers finish what they were given, then stop them
+    {
+        std::unique_lock<std::mutex> lock(state.mutex);
+        state.cond.wait(lock, [&state]{
+            for (int i=0; i<VERIFY_BUFFERS; i++)
+                if (state.buffers[i].busy)
+                    return false;
+            return true;
+        });
+        state.quit = true;
+    }
+    state.cond.notify_all();
+    for (uint32_t i=0; i<workers.size(); i++)
+        workers[i].join();
+    for (int i=0; i<VERIFY_BUFFERS; i++)
+        free(state.buffers[i].data);
+    if (err != DEVICEERR_OK)
+        return err;
+
+    // Go through the blocks that didn't match, and look for the exact byte the first real difference starts at.
+    // A block can fail to match because of a bad read, so each one is read again before it's reported
+    for (uint32_t i=0; i<hashsize/ROM_HASHBLOCK_SIZE; i++)
+    {
+        uint32_t end = i;
+        if (!state.bad[i])
+            continue;
+        err = verify_findmismatch(cart, readrom, image, i*ROM_HASHBLOCK_SIZE, (i+1)*ROM_HASHBLOCK_SIZE, &result->offset);
+        if (err != DEVICEERR_OK)
+            return err;
+        if (result->offset == (i+1)*ROM_HASHBLOCK_SIZE)
+            continue;
+        while (end < hashsize/ROM_HASHBLOCK_SIZE && state.bad[end])
+            end++;
+        result->matched = false;
+        result->size = end*ROM_HASHBLOCK_SIZE - result->offset;
+        device_setuploadprogress(100.0f);
+        return DEVICEERR_OK;
+    }
+    result->offset = 0;
+
+    // Compare whatever is left over after the last whole block
+    if (hashsize < filesize)
+    {
+        err = verify_findmismatch(cart, readrom, image, hashsize, filesize, &result->offset);
+        if (err != DEVICEERR_OK)
+            return err;
+        if (result->offset < filesize)
+        {
+            result->matched = false;
+            result->size = filesize - result->offset;
+        }
+        else
+            result->offset = 0;
+    }
+    device_setuploadprogress(100.0f);
+    return DEVICEERR_OK;
+}
+
+
+/*==============================
+    verify_worker
+    Hashes blocks of the chunks that were
+    read back, and marks the ones that don't
+    match the ROM
+    @param  A pointer to the verification state
+==============================*/
+
+static void verify_worker(VerifyState* state)
+{
+    std::unique_lock<std::mutex> lock(state->mutex);
+    while (true)
+    {
+        VerifyBuffer* buffer;
+        uint32_t index, block;
+        bool bad;
+
+        // Grab the next block that needs hashing
+        state->cond.wait(lock, [state]{return state->quit || !state->queue.empty();});
+        if (state->queue.empty())
+            return;
+        buffer = state->queue.front();
+        index = buffer->claimed++;
+        if (buffer->claimed == buffer->blocks)
+            state->queue.pop_front();
+        lock.unlock();
+
+        // Hash it without holding the lock
+        block = buffer->offset/ROM_HASHBLOCK_SIZE + index;
+        bad = block >= state->hashcount || romimage_hashblock(buffer->data + index*ROM_HASHBLOCK_SIZE, ROM_HASHBLOCK_SIZE) != state->hashes[block];
+
+        // Save the result, and hand the buffer back once all of it was hashed
+        lock.lock();
+        state->bad[block] = bad;
+        buffer->finished++;
+        if (buffer->finished == buffer->blocks)
+        {
+            buffer->busy = false;
+            state->cond.notify_all();
+        }
+    }
+}
+
+
+/*==============================
+    verify_findmismatch
+    Compares part of the cart with the ROM
+    byte by byte, to find the first byte
+    that doesn't match
+    @param  A pointer to the cart context
+    @param  The function to read the cart with
+    @param  A pointer to the ROM image
+    @param  The offset to start comparing at
+    @param  The offset to stop comparing at,
+            at most ROM_HASHBLOCK_SIZE bytes on
+    @param  A pointer to store the offset of the
+            first byte that differs in, or the
+            end offset if they're the same
+    @return The device error, or OK
+==============================*/
+
+static DeviceError verify_findmismatch(CartDevice* cart, VerifyReader readrom, RomImage* image, uint32_t start, uint32_t end, uint32_t* offset)
+{
+    DeviceError err;
+    uint64_t readtime = 0, preparetime = 0;
+    uint32_t size = end - start;
+    byte* cartdata = (byte*) malloc(size);
+    byte* romdata = (byte*) malloc(size);
+    if (cartdata == NULL || romdata == NULL)
+    {
+        free(cartdata);
+        free(romdata);
+        return DEVICEERR_MALLOCFAIL;
+    }
+
+    // Read both sides
+    err = readrom(cart, start, size, cartdata);
+    if (err == DEVICEERR_OK)
+        err = romimage_read(image, start, size, romdata, &readtime, &preparetime);
+
+    // Find the first difference
+    if (err == DEVICEERR_OK)
+    {
+        uint32_t i = 0;
+        while (i < size && cartdata[i] == romdata[i])
+            i++;
+        (*offset) = start + i;
+    }
+    free(cartdata);
+    free(romdata);
+    return err;
+}
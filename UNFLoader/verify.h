@@ -0,0 +1,21 @@
+#ifndef __VERIFY_HEADER
+#define __VERIFY_HEADER
+
+    #include "device.h"
+    #include "rom.h"
+
+
+    /*********************************
+                 Typedefs
+    *********************************/
+
+    typedef DeviceError (*VerifyReader)(CartDevice* cart, uint32_t offset, uint32_t size, byte* buff);
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    DeviceError verify_run(CartDevice* cart, VerifyReader readrom, RomImage* image, uint32_t padsize, VerifyResult* result);
+
+#endif
@@ -0,0 +1,1522 @@
+/***************************************************************
+                         virtualcart.cpp
+
+Emulates flashcarts behind the D2XX API, so that the drivers can
+run without any hardware attached. Each virtual cart speaks the
+USB protocol of a 64Drive, EverDrive or SC64, keeps uploads in a
+sparse model of its SDRAM, and has a console attached to it
+which announces itself with a heartbeat when a ROM is booted,
+and which can echo debug data back to the host.
+The USB link has a configurable bandwidth and latency, and
+faults can be injected into it at random.
+
+Virtual carts are described as type[:option=value...], with
+several carts separated by commas. For instance:
+    sc64:bw=40:lat=125,everdrive:corrupt=0.001:seed=7
+The console takes transfers bigger than its debug area (window=)
+in fragments, reading each one before asking for the next.
+***************************************************************/
+
+#include "virtualcart.h"
+#include "device_64drive.h"
+#include "ftdi.h"
+#include <string.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <random>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+
+/*********************************
+              Macros
+*********************************/
+
+#define MEMORY_PAGE_SIZE (1024*1024)
+#define MEMORY_PAGES     128
+
+#define ED64_ROM_ADDRESS 0x10000000
+
+#define SC64_CMD_IDENTIFIER_GET   'v'
+#define SC64_CMD_VERSION_GET      'V'
+#define SC64_CMD_STATE_RESET      'R'
+#define SC64_CMD_CIC_PARAMS_SET   'B'
+#define SC64_CMD_CONFIG_SET       'C'
+#define SC64_CMD_MEMORY_READ      'm'
+#define SC64_CMD_MEMORY_WRITE     'M'
+#define SC64_CMD_DEBUG_WRITE      'U'
+#define SC64_CMD_FLASH_WAIT_BUSY  'p'
+#define SC64_CMD_FLASH_ERASE_BLOCK 'P'
+#define SC64_FLASH_BLOCK_SIZE     (128*1024)
+#define SC64_FLASH_ERASE_TIME     30 // In milliseconds
+#define SC64_PACKET_DEBUG         'U'
+
+#define MODEM_DSR 0x20
+
+#define USB_PACKET_SIZE       512 // Replies that end on a shorter packet wait for the latency timer
+#define USB_TRANSFER_OVERHEAD 20  // How long the host takes to handle each IN transfer, in microseconds
+
+#define BE32(x) ((uint32_t)((x)[0] << 24 | (x)[1] << 16 | (x)[2] << 8 | (x)[3]))
+
+#define CONSOLE_WINDOW_SIZE  (8*1024*1024) // The USB library's default DEBUG_ADDRESS_SIZE
+#define FRAGMENT_HEADER_SIZE 16
+#define FRAGMENT_CANCEL      0xFFFFFFFF
+
+
+/*********************************
+            Structures
+*********************************/
+
+typedef enum {
+    PHASE_COMMAND,
+    PHASE_MEMORY,
+    PHASE_CONSOLE,
+    PHASE_SKIP
+} VirtualPhase;
+
+typedef struct {
+    std::chrono::steady_clock::time_point arrival;
+    std::vector<byte> data;
+    size_t pos;
+} VirtualTransfer;
+
+typedef struct VirtualCart VirtualCart;
+
+typedef struct {
+    const char* name;
+    const char* description;
+    ULONG       id;
+    uint32_t    (*cmdsize)(VirtualCart* cart);
+    void        (*execute)(VirtualCart* cart);
+    void        (*complete)(VirtualCart* cart, VirtualPhase phase);
+    void        (*frame)(VirtualCart* cart, uint8_t type, const byte* data, uint32_t size);
+} VirtualProtocol;
+
+struct VirtualCart {
+    const VirtualProtocol* protocol;
+    char serial[16];
+    bool isopen;
+    bool dtr;
+
+    // USB link
+    double   bandwidth; // In bytes per microsecond, or 0 for unlimited
+    uint32_t latency;   // In microseconds
+    ULONG    readtimeout;
+    uint32_t latencytimer; // In milliseconds
+    uint32_t transfersize;
+    std::chrono::steady_clock::time_point replyafter;
+    std::chrono::steady_clock::time_point linkfree;
+    std::chrono::steady_clock::time_point flushat;
+    std::deque<VirtualTransfer> outgoing;
+    bool     woken;
+
+    // Fault injection
+    double corruptrate;
+    double droprate;
+    double stallrate;
+    double failrate;
+    std::mt19937 random;
+
+    // Firmware state
+    VirtualPhase phase;
+    byte     cmd[16];
+    uint32_t cmdlen;
+    uint32_t address;
+    uint32_t left;
+    std::unique_ptr<byte[]> memory[MEMORY_PAGES];
+
+    // Console state
+    uint8_t  datatype;
+    uint32_t datasize;
+    std::vector<byte> consolebuff;
+    uint8_t  protocolver;
+    uint8_t  activever;
+    uint32_t window;
+    std::vector<byte> stream; // A fragmented transfer being put back together
+    uint32_t streamid;
+    bool     bootpending;
+    bool     echo;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+};
+
+
+/*********************************
+        Function Prototypes
+*********************************/
+
+static uint32_t virtualcart_cmdsize_64drive(VirtualCart* cart);
+static void     virtualcart_execute_64drive(VirtualCart* cart);
+static void     virtualcart_complete_64drive(VirtualCart* cart, VirtualPhase phase);
+static void     virtualcart_frame_64drive(VirtualCart* cart, uint8_t type, const byte* data, uint32_t size);
+static uint32_t virtualcart_cmdsize_everdrive(VirtualCart* cart);
+static void     virtualcart_execute_everdrive(VirtualCart* cart);
+static void     virtualcart_complete_everdrive(VirtualCart* cart, VirtualPhase phase);
+static void     virtualcart_frame_everdrive(VirtualCart* cart, uint8_t type, const byte* data, uint32_t size);
+static uint32_t virtualcart_cmdsize_sc64(VirtualCart* cart);
+static void     virtualcart_execute_sc64(VirtualCart* cart);
+static void     virtualcart_complete_sc64(VirtualCart* cart, VirtualPhase phase);
+static void     virtualcart_frame_sc64(VirtualCart* cart, uint8_t type, const byte* data, uint32_t size);
+
+
+/*********************************
+             Globals
+*********************************/
+
+static const VirtualProtocol local_protocols[] = {
+    {"64drive1",  "64drive USB device A", 0x04036010, virtualcart_cmdsize_64drive,   virtualcart_execute_64drive,   virtualcart_complete_64drive,   virtualcart_frame_64drive},
+    {"64drive2",  "64drive USB device",   0x04036014, virtualcart_cmdsize_64drive,   virtualcart_execute_64drive,   virtualcart_complete_64drive,   virtualcart_frame_64drive},
+    {"everdrive", "FT245R USB FIFO",      0x04036001, virtualcart_cmdsize_everdrive, virtualcart_execute_everdrive, virtualcart_complete_everdrive, virtualcart_frame_everdrive},
+    {"sc64",      "SC64",                 0x04036014, virtualcart_cmdsize_sc64,      virtualcart_execute_sc64,      virtualcart_complete_sc64,      virtualcart_frame_sc64},
+};
+
+static std::vector<VirtualCart*> local_carts;
+
+
+/*==============================
+    virtualcart_parseoption
+    Applies a single option from a virtual
+    cart spec to the cart
+    @param  A pointer to the virtual cart
+    @param  The option name
+    @param  The option value, or an empty string
+    @return Whether the option was valid
+==============================*/
+
+static bool virtualcart_parseoption(VirtualCart* cart, const std::string& key, const std::string& value)
+{
+    char* end;
+    double number;
+
+    // Options without a value
+    if (key == "echo" && value.empty())
+    {
+        cart->echo = true;
+        return true;
+    }
+
+    // Everything else takes a number
+    if (value.empty())
+        return false;
+    number = strtod(value.c_str(), &end);
+    if (*end != '\0' || number < 0)
+        return false;
+    if (key == "bw")
+        cart->bandwidth = number;
+    else if (key == "lat")
+        cart->latency = (uint32_t)number;
+    else if (key == "corrupt" && number <= 1)
+        cart->corruptrate = number;
+    else if (key == "drop" && number <= 1)
+        cart->droprate = number;
+    else if (key == "stall" && number <= 1)
+        cart->stallrate = number;
+    else if (key == "fail" && number <= 1)
+        cart->failrate = number;
+    else if (key == "seed")
+        cart->random.seed((uint32_t)number);
+    else if (key == "proto" && (number == 1 || number == 2))
+        cart->protocolver = number == 1 ? PROTOCOL_VERSION1 : PROTOCOL_VERSION2;
+    else if (key == "window" && number >= 1024)
+        cart->window = (uint32_t)number;
+    else
+        return false;
+    return true;
+}
+
+
+/*==============================
+    virtualcart_create
+    Creates the virtual carts described
+    by a spec string
+    @param  The virtual cart spec
+    @return Whether the spec was valid
+==============================*/
+
+bool virtualcart_create(const char* spec)
+{
+    std::string list = spec;
+    size_t start = 0;
+
+    while (start <= list.length())
+    {
+        size_t end = list.find(',', start);
+        std::string entry = list.substr(start, end == std::string::npos ? std::string::npos : end-start);
+        size_t pos = entry.find(':');
+        std::string name = entry.substr(0, pos);
+        VirtualCart* cart = NULL;
+
+        if (local_carts.size() >= MAX_CARTS)
+            return false;
+
+        // Find the cart type
+        for (uint32_t i=0; i<sizeof(local_protocols)/sizeof(local_protocols[0]); i++)
+        {
+            if (name == local_protocols[i].name)
+            {
+                cart = new VirtualCart();
+                cart->protocol = &local_protocols[i];
+                break;
+            }
+        }
+        if (cart == NULL)
+            return false;
+        snprintf(cart->serial, sizeof(cart->serial), "VIRTUAL%d", (int)local_carts.size());
+        cart->isopen = false;
+        cart->dtr = false;
+        cart->bandwidth = 0;
+        cart->latency = 0;
+        cart->readtimeout = 0;
+        cart->latencytimer = FTDI_DEFAULT_LATENCY;
+        cart->transfersize = FTDI_DEFAULT_TRANSFERSIZE;
+        cart->woken = false;
+        cart->corruptrate = 0;
+        cart->droprate = 0;
+        cart->stallrate = 0;
+        cart->failrate = 0;
+        cart->phase = PHASE_COMMAND;
+        cart->cmdlen = 0;
+        cart->left = 0;
+        cart->protocolver = PROTOCOL_VERSION2;
+        cart->activever = PROTOCOL_VERSION1;
+        cart->window = CONSOLE_WINDOW_SIZE;
+        cart->streamid = 0;
+        cart->bootpending = false;
+        cart->echo = false;
+        local_carts.push_back(cart);
+
+        // Apply the options
+        while (pos != std::string::npos)
+        {
+            size_t next = entry.find(':', pos+1);
+            std::string option = entry.substr(pos+1, next == std::string::npos ? std::string::npos : next-pos-1);
+            size_t equals = option.find('=');
+            std::string key = option.substr(0, equals);
+            std::string value = equals == std::string::npos ? "" : option.substr(equals+1);
+            if (!virtualcart_parseoption(cart, key, value))
+                return false;
+            pos = next;
+        }
+
+        if (end == std::string::npos)
+            break;
+        start = end+1;
+    }
+    return true;
+}
+
+
+/*==============================
+    virtualcart_getcount
+    Gets the number of virtual carts
+    @return The number of virtual carts
+==============================*/
+
+uint32_t virtualcart_getcount()
+{
+    return local_carts.size();
+}
+
+
+/*==============================
+    virtualcart_chance
+    Rolls the dice for a fault
+    @param  A pointer to the virtual cart
+    @param  The probability of the fault
+    @return Whether the fault should happen
+==============================*/
+
+static bool virtualcart_chance(VirtualCart* cart, double rate)
+{
+    if (rate <= 0)
+        return false;
+    return std::uniform_real_distribution<double>(0, 1)(cart->random) < rate;
+}
+
+
+/*==============================
+    virtualcart_corrupt
+    Flips a random bit in a buffer
+    @param  A pointer to the virtual cart
+    @param  The buffer to corrupt
+    @param  The size of the buffer
+==============================*/
+
+static void virtualcart_corrupt(VirtualCart* cart, byte* data, uint32_t size)
+{
+    uint32_t bit = std::uniform_int_distribution<uint32_t>(0, size*8-1)(cart->random);
+    data[bit/8] ^= 1 << (bit%8);
+}
+
+
+/*==============================
+    virtualcart_linktime
+    Calculates how long a transfer takes
+    on the virtual USB link
+    @param  A pointer to the virtual cart
+    @param  The size of the transfer
+    @return The transfer time
+==============================*/
+
+static std::chrono::microseconds virtualcart_linktime(VirtualCart* cart, uint32_t size)
+{
+    uint64_t time = cart->latency;
+    if (cart->bandwidth > 0)
+        time += (uint64_t)(size/cart->bandwidth);
+    return std::chrono::microseconds(time);
+}
+
+
+/*==============================
+    virtualcart_reply
+    Queues data from the cart to the host.
+    It arrives once the link has had time
+    to carry it. Like on the real USB chip, 
+    a reply that ends on a short packet is 
+    held back until the latency timer runs 
+    out, along with anything sent after it
+    in the meantime.
+    @param  A pointer to the virtual cart
+    @param  The data to send
+    @param  The size of the data
+==============================*/
+
+static void virtualcart_reply(VirtualCart* cart, const byte* data, uint32_t size)
+{
+    VirtualTransfer transfer;
+    uint32_t transfers = (size + cart->transfersize - 1)/cart->transfersize;
+    std::chrono::steady_clock::time_point ready = std::max(cart->replyafter, cart->linkfree) + virtualcart_linktime(cart, size) + std::chrono::microseconds(transfers*USB_TRANSFER_OVERHEAD);
+    if (cart->flushat > ready)
+        transfer.arrival = cart->flushat;
+    else if (size%USB_PACKET_SIZE != 0)
+        transfer.arrival = cart->flushat = ready + std::chrono::milliseconds(cart->latencytimer);
+    else
+        transfer.arrival = ready;
+    transfer.data.assign(data, data+size);
+    transfer.pos = 0;
+    cart->linkfree = ready;
+    cart->outgoing.push_back(std::move(transfer));
+    cart->cond.notify_all();
+}
+
+
+/*==============================
+    virtualcart_writememory
+    Writes to the cart's SDRAM
+    @param  A pointer to the virtual cart
+    @param  The address to write to
+    @param  The data to write, or NULL to fill
+    @param  The value to fill with
+    @param  The size of the data
+==============================*/
+
+static void virtualcart_writememory(VirtualCart* cart, uint32_t address, const byte* data, byte fill, uint32_t size)
+{
+    while (size > 0)
+    {
+        uint32_t page = address/MEMORY_PAGE_SIZE;
+        uint32_t offset = address%MEMORY_PAGE_SIZE;
+        uint32_t amount = std::min(size, (uint32_t)MEMORY_PAGE_SIZE - offset);
+        if (page >= MEMORY_PAGES)
+            return;
+
+        // Pages are only allocated once they are written to
+        if (cart->memory[page] == NULL)
+        {
+            cart->memory[page].reset(new byte[MEMORY_PAGE_SIZE]);
+            memset(cart->memory[page].get(), 0, MEMORY_PAGE_SIZE);
+        }
+        if (data != NULL)
+        {
+            memcpy(cart->memory[page].get() + offset, data, amount);
+            data += amount;
+        }
+        else
+            memset(cart->memory[page].get() + offset, fill, amount);
+        address += amount;
+        size -= amount;
+    }
+}
+
+
+/*==============================
+    virtualcart_readmemory
+    Reads from the cart's SDRAM
+    @param  A pointer to the virtual cart
+    @param  The address to read from
+    @param  The buffer to read into
+    @param  The size of the data
+==============================*/
+
+static void virtualcart_readmemory(VirtualCart* cart, uint32_t address, byte* data, uint32_t size)
+{
+    while (size > 0)
+    {
+        uint32_t page = address/MEMORY_PAGE_SIZE;
+        uint32_t offset = address%MEMORY_PAGE_SIZE;
+        uint32_t amount = std::min(size, (uint32_t)MEMORY_PAGE_SIZE - offset);
+        if (page >= MEMORY_PAGES || cart->memory[page] == NULL)
+            memset(data, 0, amount);
+        else
+            memcpy(data, cart->memory[page].get() + offset, amount);
+        address += amount;
+        data += amount;
+        size -= amount;
+    }
+}
+
+
+/*==============================
+    virtualcart_setphase
+    Makes the next bytes from the host go
+    somewhere other than the command parser
+    @param  A pointer to the virtual cart
+    @param  The phase to enter
+    @param  The SDRAM address, for PHASE_MEMORY
+    @param  The number of bytes the phase takes
+==============================*/
+
+static void virtualcart_setphase(VirtualCart* cart, VirtualPhase phase, uint32_t address, uint32_t size)
+{
+    cart->phase = phase;
+    cart->address = address;
+    cart->left = size;
+    if (phase == PHASE_CONSOLE)
+        cart->consolebuff.clear();
+}
+
+
+/*==============================
+    virtualcart_console
+    Hands the debug data the host sent
+    over to the console
+    @param  A pointer to the virtual cart
+==============================*/
+
+static void virtualcart_console(VirtualCart* cart)
+{
+    uint32_t size = std::min(cart->datasize, (uint32_t)cart->consolebuff.size());
+    const byte* data = cart->consolebuff.data();
+
+    // Put fragments back together, and ask for the next one until the whole transfer arrived
+    if (cart->datatype == DATATYPE_FRAGMENT && size >= FRAGMENT_HEADER_SIZE)
+    {
+        uint8_t  type = (uint8_t)BE32(data);
+        uint32_t total = BE32(data+4);
+        uint32_t offset = BE32(data+8);
+        uint32_t id = BE32(data+12);
+        uint32_t amount = std::min(size-FRAGMENT_HEADER_SIZE, total > offset ? total-offset : 0);
+
+        // The host gave up on the transfer, or this is the rest of one that was given up on
+        if (offset != 0 && (offset == FRAGMENT_CANCEL || id != cart->streamid))
+        {
+            if (id == cart->streamid)
+                cart->stream.clear();
+            cart->consolebuff.clear();
+            return;
+        }
+        if (offset == 0)
+        {
+            cart->stream.clear();
+            cart->streamid = id;
+        }
+        cart->stream.insert(cart->stream.end(), data+FRAGMENT_HEADER_SIZE, data+FRAGMENT_HEADER_SIZE+amount);
+        cart->consolebuff.clear();
+        if (offset+amount < total)
+        {
+            uint32_t read = offset+amount;
+            byte reply[8] = {(byte)(id >> 24), (byte)(id >> 16), (byte)(id >> 8), (byte)id, (byte)(read >> 24), (byte)(read >> 16), (byte)(read >> 8), (byte)read};
+            cart->protocol->frame(cart, DATATYPE_FRAGMENT, reply, sizeof(reply));
+            return;
+        }
+
+        // The echo can only be as big as a single packet
+        if (cart->echo)
+            cart->protocol->frame(cart, type, cart->stream.data(), std::min((uint32_t)cart->stream.size(), (uint32_t)0xFFFFFF));
+        cart->stream.clear();
+        return;
+    }
+    if (cart->echo)
+        cart->protocol->frame(cart, cart->datatype, data, size);
+    cart->consolebuff.clear();
+}
+
+
+/*==============================
+    virtualcart_boot
+    Boots the console, which announces
+    its USB protocol with a heartbeat
+    @param  A pointer to the virtual cart
+==============================*/
+
+static void virtualcart_boot(VirtualCart* cart)
+{
+    cart->bootpending = false;
+    cart->activever = cart->protocolver;
+    if (cart->activever >= PROTOCOL_VERSION2)
+    {
+        byte heartbeat[8] = {0, cart->activever, 0, 2, (byte)(cart->window >> 24), (byte)(cart->window >> 16), (byte)(cart->window >> 8), (byte)cart->window};
+        cart->replyafter = std::chrono::steady_clock::now();
+        cart->protocol->frame(cart, DATATYPE_HEARTBEAT, heartbeat, sizeof(heartbeat));
+    }
+}
+
+
+/*==============================
+    virtualcart_feed
+    Runs data from the host through the
+    cart's firmware
+    @param  A pointer to the virtual cart
+    @param  The data from the host
+    @param  The size of the data
+==============================*/
+
+static void virtualcart_feed(VirtualCart* cart, const byte* data, uint32_t size)
+{
+    while (true)
+    {
+        uint32_t amount;
+
+        // Finish the current phase once all of its data arrived
+        if (cart->phase != PHASE_COMMAND && cart->left == 0)
+        {
+            VirtualPhase phase = cart->phase;
+            cart->phase = PHASE_COMMAND;
+            cart->protocol->complete(cart, phase);
+            continue;
+        }
+        if (size == 0)
+            break;
+
+        // Collect a command, its size can depend on its first few bytes
+        if (cart->phase == PHASE_COMMAND)
+        {
+            uint32_t need = cart->protocol->cmdsize(cart);
+            amount = std::min(need - cart->cmdlen, size);
+            memcpy(cart->cmd + cart->cmdlen, data, amount);
+            cart->cmdlen += amount;
+            data += amount;
+            size -= amount;
+            if (cart->cmdlen == cart->protocol->cmdsize(cart))
+            {
+                cart->protocol->execute(cart);
+                cart->cmdlen = 0;
+            }
+            continue;
+        }
+
+        // Otherwise, the data belongs to the current phase
+        amount = std::min(cart->left, size);
+        if (cart->phase == PHASE_MEMORY)
+            virtualcart_writememory(cart, cart->address, data, 0, amount);
+        else if (cart->phase == PHASE_CONSOLE)
+            cart->consolebuff.insert(cart->consolebuff.end(), data, data+amount);
+        cart->address += amount;
+        cart->left -= amount;
+        data += amount;
+        size -= amount;
+    }
+}
+
+
+/*==============================
+    virtualcart_cmdsize_64drive
+    Gets the size of a 64Drive command
+    @param  A pointer to the virtual cart
+    @return The size of the command so far
+==============================*/
+
+static uint32_t virtualcart_cmdsize_64drive(VirtualCart* cart)
+{
+    if (cart->cmdlen == 0)
+        return 1;
+    switch (cart->cmd[0])
+    {
+        case DEV_CMD_LOADRAM:
+        case DEV_CMD_DUMPRAM:
+            return 12;
+        case DEV_CMD_SETSAVE:
+        case DEV_CMD_SETCIC:
+        case DEV_CMD_USBRECV:
+            return 8;
+        default:
+            return 4;
+    }
+}
+
+
+/*==============================
+    virtualcart_execute_64drive
+    Executes a 64Drive command
+    @param  A pointer to the virtual cart
+==============================*/
+
+static void virtualcart_execute_64drive(VirtualCart* cart)
+{
+    byte     cmp[4] = {'C', 'M', 'P', cart->cmd[0]};
+    uint32_t param1 = BE32(cart->cmd+4);
+    uint32_t param2 = BE32(cart->cmd+8);
+
+    // Ignore anything that isn't framed like a command
+    if (memcmp(cart->cmd+1, "CMD", 3) != 0)
+        return;
+
+    switch (cart->cmd[0])
+    {
+        case DEV_CMD_LOADRAM:
+            virtualcart_setphase(cart, PHASE_MEMORY, param1, param2 & 0xFFFFFF);
+            return;
+        case DEV_CMD_DUMPRAM:
+        {
+            uint32_t size = param2 & 0xFFFFFF;
+            std::vector<byte> reply(size+4);
+            virtualcart_readmemory(cart, param1, reply.data(), size);
+            memcpy(reply.data()+size, cmp, 4);
+            virtualcart_reply(cart, reply.data(), reply.size());
+            return;
+        }
+        case DEV_CMD_USBRECV:
+            cart->datatype = param1 >> 24;
+            cart->datasize = param1 & 0xFFFFFF;
+            virtualcart_setphase(cart, PHASE_CONSOLE, 0, cart->datasize);
+            return;
+        case DEV_CMD_GETVER:
+        {
+            // Hardware variant and firmware 2.06, then the magic word
+            byte reply[12] = {0, 0, 0, 206, 'U', 'D', 'E', 'V', 'C', 'M', 'P', DEV_CMD_GETVER};
+            virtualcart_reply(cart, reply, sizeof(reply));
+            return;
+        }
+        default:
+            virtualcart_reply(cart, cmp, sizeof(cmp));
+            return;
+    }
+}
+
+
+/*==============================
+    virtualcart_complete_64drive
+    Finishes a 64Drive data transfer
+    @param  A pointer to the virtual cart
+    @param  The phase that finished
+==============================*/
+
+static void virtualcart_complete_64drive(VirtualCart* cart, VirtualPhase phase)
+{
+    if (phase == PHASE_MEMORY)
+    {
+        byte cmp[4] = {'C', 'M', 'P', DEV_CMD_LOADRAM};
+        virtualcart_reply(cart, cmp, sizeof(cmp));
+        cart->bootpending = true;
+    }
+    else if (phase == PHASE_CONSOLE)
+    {
+        byte cmp[4] = {'C', 'M', 'P', '@'};
+        virtualcart_reply(cart, cmp, sizeof(cmp));
+        virtualcart_console(cart);
+    }
+}
+
+
+/*==============================
+    virtualcart_frame_64drive
+    Sends debug data from the console to
+    the host through a 64Drive
+    @param  A pointer to the virtual cart
+    @param  The data type
+    @param  The data to send
+    @param  The size of the data
+==============================*/
+
+static void virtualcart_frame_64drive(VirtualCart* cart, uint8_t type, const byte* data, uint32_t size)
+{
+    std::vector<byte> packet(size+12);
+    uint32_t header = (type << 24) | (size & 0xFFFFFF);
+    byte head[8] = {'D', 'M', 'A', '@', (byte)(header >> 24), (byte)(header >> 16), (byte)(header >> 8), (byte)header};
+    memcpy(packet.data(), head, 8);
+    memcpy(packet.data()+8, data, size);
+    memcpy(packet.data()+8+size, "CMPH", 4);
+    virtualcart_reply(cart, packet.data(), packet.size());
+}
+
+
+/*==============================
+    virtualcart_cmdsize_everdrive
+    Gets the size of an EverDrive command
+    @param  A pointer to the virtual cart
+    @return The size of the command so far
+==============================*/
+
+static uint32_t virtualcart_cmdsize_everdrive(VirtualCart* cart)
+{
+    if (cart->cmdlen < 4)
+        return 4;
+    if (memcmp(cart->cmd, "DMA@", 4) == 0)
+        return cart->activever == PROTOCOL_VERSION1 ? 16 : 8;
+    return 16;
+}
+
+
+/*==============================
+    virtualcart_execute_everdrive
+    Executes an EverDrive command
+    @param  A pointer to the virtual cart
+==============================*/
+
+static void virtualcart_execute_everdrive(VirtualCart* cart)
+{
+    uint32_t address = BE32(cart->cmd+4);
+    uint32_t size = BE32(cart->cmd+8)*512;
+    uint32_t arg = BE32(cart->cmd+12);
+
+    // Debug data from the host
+    if (memcmp(cart->cmd, "DMA@", 4) == 0)
+    {
+        uint32_t header = address;
+        cart->datatype = header >> 24;
+        cart->datasize = header & 0xFFFFFF;
+        size = ALIGN(cart->datasize, cart->activever == PROTOCOL_VERSION1 ? 512 : 2);
+        virtualcart_setphase(cart, PHASE_CONSOLE, 0, size);
+        return;
+    }
+
+    // Ignore anything that isn't framed like a command
+    if (memcmp(cart->cmd, "cmd", 3) != 0)
+        return;
+    if (address >= ED64_ROM_ADDRESS)
+        address -= ED64_ROM_ADDRESS;
+    switch (cart->cmd[3])
+    {
+        case 'W':
+            virtualcart_setphase(cart, PHASE_MEMORY, address, size);
+            return;
+        case 'R':
+        {
+            std::vector<byte> reply(size);
+            virtualcart_readmemory(cart, address, reply.data(), size);
+            virtualcart_reply(cart, reply.data(), size);
+            return;
+        }
+        case 'c':
+            virtualcart_writememory(cart, address, NULL, (byte)arg, size);
+            return;
+        case 't':
+        {
+            byte reply[16] = {'c', 'm', 'd', 'r'};
+            virtualcart_reply(cart, reply, sizeof(reply));
+            return;
+        }
+        case 's':
+        {
+            byte header[4];
+
+            // The save file name follows if the ROM header asks for a save type
+            virtualcart_readmemory(cart, 0x3C, header, sizeof(header));
+            if (header[0] == 'E' && header[1] == 'D' && header[3] != 0)
+                virtualcart_setphase(cart, PHASE_SKIP, 0, 256);
+            cart->bootpending = true;
+            return;
+        }
+        default:
+            return;
+    }
+}
+
+
+/*==============================
+    virtualcart_complete_everdrive
+    Finishes an EverDrive data transfer
+    @param  A pointer to the virtual cart
+    @param  The phase that finished
+==============================*/
+
+static void virtualcart_complete_everdrive(VirtualCart* cart, VirtualPhase phase)
+{
+    if (phase == PHASE_CONSOLE)
+    {
+        virtualcart_console(cart);
+
+        // Skip the CMPH, which the old protocol pads to 16 bytes
+        virtualcart_setphase(cart, PHASE_SKIP, 0, cart->activever == PROTOCOL_VERSION1 ? 16 : 4);
+    }
+}
+
+
+/*==============================
+    virtualcart_frame_everdrive
+    Sends debug data from the console to
+    the host through an EverDrive
+    @param  A pointer to the virtual cart
+    @param  The data type
+    @param  The data to send
+    @param  The size of the data
+==============================*/
+
+static void virtualcart_frame_everdrive(VirtualCart* cart, uint8_t type, const byte* data, uint32_t size)
+{
+    uint32_t alignment = cart->activever == PROTOCOL_VERSION1 ? 16 : 2;
+    std::vector<byte> packet(ALIGN(size+12, alignment), 0);
+    uint32_t header = (type << 24) | (size & 0xFFFFFF);
+    byte head[8] = {'D', 'M', 'A', '@', (byte)(header >> 24), (byte)(header >> 16), (byte)(header >> 8), (byte)header};
+    memcpy(packet.data(), head, 8);
+    memcpy(packet.data()+8, data, size);
+    memcpy(packet.data()+8+size, "CMPH", 4);
+    virtualcart_reply(cart, packet.data(), packet.size());
+}
+
+
+/*==============================
+    virtualcart_cmdsize_sc64
+    Gets the size of an SC64 command
+    @param  A pointer to the virtual cart
+    @return The size of the command
+==============================*/
+
+static uint32_t virtualcart_cmdsize_sc64(VirtualCart* cart)
+{
+    (void)cart; // Ignore unused paramater warning
+    return 12;
+}
+
+
+/*==============================
+    virtualcart_respond_sc64
+    Sends an SC64 command response
+    @param  A pointer to the virtual cart
+    @param  Whether the command failed
+    @param  The data to send
+    @param  The size of the data
+==============================*/
+
+static void virtualcart_respond_sc64(VirtualCart* cart, bool failed, const byte* data, uint32_t size)
+{
+    std::vector<byte> packet(size+8);
+    byte head[8] = {'C', 'M', 'P', cart->cmd[3], (byte)(size >> 24), (byte)(size >> 16), (byte)(size >> 8), (byte)size};
+    if (failed)
+        memcpy(head, "ERR", 3);
+    memcpy(packet.data(), head, 8);
+    if (size > 0)
+        memcpy(packet.data()+8, data, size);
+    virtualcart_reply(cart, packet.data(), packet.size());
+}
+
+
+/*==============================
+    virtualcart_execute_sc64
+    Executes an SC64 command
+    @param  A pointer to the virtual cart
+==============================*/
+
+static void virtualcart_execute_sc64(VirtualCart* cart)
+{
+    uint32_t arg1 = BE32(cart->cmd+4);
+    uint32_t arg2 = BE32(cart->cmd+8);
+
+    // Ignore anything that isn't framed like a command
+    if (memcmp(cart->cmd, "CMD", 3) != 0)
+        return;
+
+    switch (cart->cmd[3])
+    {
+        case SC64_CMD_IDENTIFIER_GET:
+            virtualcart_respond_sc64(cart, false, (const byte*)"SCv2", 4);
+            return;
+        case SC64_CMD_VERSION_GET:
+        {
+            byte version[8] = {0, 2, 0, 14, 0, 0, 0, 0};
+            virtualcart_respond_sc64(cart, false, version, sizeof(version));
+            return;
+        }
+        case SC64_CMD_STATE_RESET:
+        case SC64_CMD_CIC_PARAMS_SET:
+        case SC64_CMD_CONFIG_SET:
+            virtualcart_respond_sc64(cart, false, NULL, 0);
+            return;
+        case SC64_CMD_MEMORY_READ:
+        {
+            std::vector<byte> data(arg2);
+            virtualcart_readmemory(cart, arg1, data.data(), arg2);
+            virtualcart_respond_sc64(cart, false, data.data(), arg2);
+            return;
+        }
+        case SC64_CMD_MEMORY_WRITE:
+            virtualcart_setphase(cart, PHASE_MEMORY, arg1, arg2);
+            return;
+        case SC64_CMD_DEBUG_WRITE:
+            cart->datatype = arg1;
+            cart->datasize = arg2;
+            virtualcart_setphase(cart, PHASE_CONSOLE, 0, arg2);
+            return;
+        case SC64_CMD_FLASH_WAIT_BUSY:
+        {
+            byte blocksize[4] = {(byte)(SC64_FLASH_BLOCK_SIZE >> 24), (byte)(SC64_FLASH_BLOCK_SIZE >> 16), (byte)(SC64_FLASH_BLOCK_SIZE >> 8), (byte)SC64_FLASH_BLOCK_SIZE};
+            virtualcart_respond_sc64(cart, false, blocksize, sizeof(blocksize));
+            return;
+        }
+        case SC64_CMD_FLASH_ERASE_BLOCK:
+            // Erasing takes a while, and the cart doesn't answer anything else until it's done
+            virtualcart_writememory(cart, arg1, NULL, 0xFF, SC64_FLASH_BLOCK_SIZE);
+            cart->replyafter = std::max(cart->replyafter, std::chrono::steady_clock::now()) + std::chrono::milliseconds(SC64_FLASH_ERASE_TIME);
+            virtualcart_respond_sc64(cart, false, NULL, 0);
+            return;
+        default:
+            virtualcart_respond_sc64(cart, true, NULL, 0);
+            return;
+    }
+}
+
+
+/*==============================
+    virtualcart_complete_sc64
+    Finishes an SC64 data transfer
+    @param  A pointer to the virtual cart
+    @param  The phase that finished
+==============================*/
+
+static void virtualcart_complete_sc64(VirtualCart* cart, VirtualPhase phase)
+{
+    if (phase == PHASE_MEMORY)
+    {
+        virtualcart_respond_sc64(cart, false, NULL, 0);
+        cart->bootpending = true;
+    }
+    else if (phase == PHASE_CONSOLE)
+        virtualcart_console(cart);
+}
+
+
+/*==============================
+    virtualcart_frame_sc64
+    Sends debug data from the console to
+    the host through an SC64
+    @param  A pointer to the virtual cart
+    @param  The data type
+    @param  The data to send
+    @param  The size of the data
+==============================*/
+
+static void virtualcart_frame_sc64(VirtualCart* cart, uint8_t type, const byte* data, uint32_t size)
+{
+    std::vector<byte> packet(size+12);
+    uint32_t length = size+4;
+    uint32_t header = (type << 24) | (size & 0xFFFFFF);
+    byte head[12] = {
+        'P', 'K', 'T', SC64_PACKET_DEBUG,
+        (byte)(length >> 24), (byte)(length >> 16), (byte)(length >> 8), (byte)length,
+        (byte)(header >> 24), (byte)(header >> 16), (byte)(header >> 8), (byte)header
+    };
+    memcpy(packet.data(), head, 12);
+    memcpy(packet.data()+12, data, size);
+    virtualcart_reply(cart, packet.data(), packet.size());
+}
+
+
+/*==============================
+    virtualcart_consolesend
+    Sends debug data from a virtual cart's
+    console to the host
+    @param  The index of the virtual cart
+    @param  The data type
+    @param  The data to send
+    @param  The size of the data
+    @return The FTDI status
+==============================*/
+
+FT_STATUS virtualcart_consolesend(uint32_t index, USBDataType type, const byte* data, uint32_t size)
+{
+    VirtualCart* cart;
+    if (index >= local_carts.size())
+        return FT_DEVICE_NOT_FOUND;
+    cart = local_carts[index];
+    std::lock_guard<std::mutex> lock(cart->mutex);
+    cart->replyafter = std::chrono::steady_clock::now();
+    cart->protocol->frame(cart, type, data, size);
+    return FT_OK;
+}
+
+
+/*==============================
+    virtualcart_createdeviceinfolist
+    Emulates FT_CreateDeviceInfoList
+    @param  A pointer to store the device count in
+    @return The FTDI status
+==============================*/
+
+FT_STATUS virtualcart_createdeviceinfolist(LPDWORD count)
+{
+    *count = local_carts.size();
+    return FT_OK;
+}
+
+
+/*==============================
+    virtualcart_getdeviceinfolist
+    Emulates FT_GetDeviceInfoList
+    @param  The array to fill in
+    @param  A pointer to the device count
+    @return The FTDI status
+==============================*/
+
+FT_STATUS virtualcart_getdeviceinfolist(FT_DEVICE_LIST_INFO_NODE* dest, LPDWORD count)
+{
+    *count = std::min((uint32_t)*count, (uint32_t)local_carts.size());
+    for (uint32_t i=0; i<*count; i++)
+    {
+        VirtualCart* cart = local_carts[i];
+        memset(&dest[i], 0, sizeof(FT_DEVICE_LIST_INFO_NODE));
+        dest[i].Flags = cart->isopen ? FT_FLAGS_OPENED : 0;
+        dest[i].ID = cart->protocol->id;
+        dest[i].LocId = i+1;
+        snprintf(dest[i].SerialNumber, sizeof(dest[i].SerialNumber), "%s", cart->serial);
+        snprintf(dest[i].Description, sizeof(dest[i].Description), "%s", cart->protocol->description);
+        dest[i].ftHandle = cart->isopen ? cart : NULL;
+    }
+    return FT_OK;
+}
+
+
+/*==============================
+    virtualcart_open
+    Emulates FT_Open
+    @param  The index of the device
+    @param  A pointer to store the handle in
+    @return The FTDI status
+==============================*/
+
+FT_STATUS virtualcart_open(int index, FT_HANDLE* handle)
+{
+    VirtualCart* cart;
+    if (index < 0 || (uint32_t)index >= local_carts.size())
+        return FT_DEVICE_NOT_FOUND;
+    cart = local_carts[index];
+    std::lock_guard<std::mutex> lock(cart->mutex);
+    if (cart->isopen)
+        return FT_DEVICE_NOT_OPENED;
+    cart->isopen = true;
+    cart->readtimeout = 0;
+    cart->latencytimer = FTDI_DEFAULT_LATENCY;
+    cart->transfersize = FTDI_DEFAULT_TRANSFERSIZE;
+    cart->woken = false;
+    *handle = cart;
+    return FT_OK;
+}
+
+
+/*==============================
+    virtualcart_close
+    Emulates FT_Close
+    @param  The device handle
+    @return The FTDI status
+==============================*/
+
+FT_STATUS virtualcart_close(FT_HANDLE handle)
+{
+    VirtualCart* cart = (VirtualCart*)handle;
+    std::lock_guard<std::mutex> lock(cart->mutex);
+    if (!cart->isopen)
+        return FT_INVALID_HANDLE;
+    cart->isopen = false;
+    cart->outgoing.clear();
+    cart->flushat = std::chrono::steady_clock::time_point();
+    return FT_OK;
+}
+
+
+/*==============================
+    virtualcart_read
+    Emulates FT_Read. Blocks until enough
+    data arrived or the read timed out.
+    @param  The device handle
+    @param  The buffer to read into
+    @param  The number of bytes to read
+    @param  A pointer to store the number
+            of bytes read in
+    @return The FTDI status
+==============================*/
+
+FT_STATUS virtualcart_read(FT_HANDLE handle, LPVOID buffer, DWORD size, LPDWORD bytesread)
+{
+    VirtualCart* cart = (VirtualCart*)handle;
+    byte* data = (byte*)buffer;
+    DWORD done = 0;
+    bool stalled;
+    std::chrono::steady_clock::time_point deadline;
+    std::unique_lock<std::mutex> lock(cart->mutex);
+
+    *bytesread = 0;
+    if (!cart->isopen)
+        return FT_INVALID_HANDLE;
+    if (virtualcart_chance(cart, cart->failrate))
+        return FT_IO_ERROR;
+
+    // A stalled read sees nothing until it times out
+    stalled = cart->readtimeout != 0 && virtualcart_chance(cart, cart->stallrate);
+    deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(cart->readtimeout);
+    while (done < size)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        bool ready = !stalled && !cart->outgoing.empty();
+
+        // Take whatever has arrived
+        if (ready && cart->outgoing.front().arrival <= now)
+        {
+            VirtualTransfer* transfer = &cart->outgoing.front();
+            uint32_t amount = std::min((size_t)(size - done), transfer->data.size() - transfer->pos);
+            memcpy(data+done, transfer->data.data() + transfer->pos, amount);
+            transfer->pos += amount;
+            done += amount;
+            if (transfer->pos == transfer->data.size())
+                cart->outgoing.pop_front();
+            continue;
+        }
+
+        // Otherwise, wait for more to arrive
+        if (cart->readtimeout == 0)
+        {
+            if (ready)
+                cart->cond.wait_until(lock, cart->outgoing.front().arrival);
+            else
+                cart->cond.wait(lock);
+        }
+        else
+        {
+            if (now >= deadline)
+                break;
+            if (ready && cart->outgoing.front().arrival < deadline)
+                cart->cond.wait_until(lock, cart->outgoing.front().arrival);
+            else
+                cart->cond.wait_until(lock, deadline);
+        }
+    }
+
+    if (done > 0 && virtualcart_chance(cart, cart->corruptrate))
+        virtualcart_corrupt(cart, data, done);
+    *bytesread = done;
+    return FT_OK;
+}
+
+
+/*==============================
+    virtualcart_write
+    Emulates FT_Write. Blocks for as long
+    as the link takes to carry the data.
+    @param  The device handle
+    @param  The data to write
+    @param  The number of bytes to write
+    @param  A pointer to store the number
+            of bytes written in
+    @return The FTDI status
+==============================*/
+
+FT_STATUS virtualcart_write(FT_HANDLE handle, LPVOID buffer, DWORD size, LPDWORD byteswritten)
+{
+    VirtualCart* cart = (VirtualCart*)handle;
+    std::chrono::steady_clock::time_point end;
+    {
+        std::lock_guard<std::mutex> lock(cart->mutex);
+        *byteswritten = 0;
+        if (!cart->isopen)
+            return FT_INVALID_HANDLE;
+        if (virtualcart_chance(cart, cart->failrate))
+            return FT_IO_ERROR;
+        end = std::chrono::steady_clock::now() + virtualcart_linktime(cart, size);
+        cart->replyafter = end;
+
+        // Dropped data is reported as sent, but the cart never sees it
+        if (size > 0 && !virtualcart_chance(cart, cart->droprate))
+        {
+            if (virtualcart_chance(cart, cart->corruptrate))
+            {
+                std::vector<byte> copy((byte*)buffer, (byte*)buffer + size);
+                virtualcart_corrupt(cart, copy.data(), size);
+                virtualcart_feed(cart, copy.data(), size);
+            }
+            else
+                virtualcart_feed(cart, (const byte*)buffer, size);
+        }
+        *byteswritten = size;
+    }
+    std::this_thread::sleep_until(end);
+    return FT_OK;
+}
+
+
+/*==============================
+    virtualcart_getqueuestatus
+    Emulates FT_GetQueueStatus
+    @param  The device handle
+    @param  A pointer to store the byte count in
+    @return The FTDI status
+==============================*/
+
+FT_STATUS virtualcart_getqueuestatus(FT_HANDLE handle, DWORD* size)
+{
+    VirtualCart* cart = (VirtualCart*)handle;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(cart->mutex);
+
+    *size = 0;
+    if (!cart->isopen)
+        return FT_INVALID_HANDLE;
+    if (virtualcart_chance(cart, cart->failrate))
+        return FT_IO_ERROR;
+
+    // The host polling for data after an upload means the console was booted
+    if (cart->bootpending)
+        virtualcart_boot(cart);
+    for (size_t i=0; i<cart->outgoing.size() && cart->outgoing[i].arrival <= now; i++)
+        *size += cart->outgoing[i].data.size() - cart->outgoing[i].pos;
+    return FT_OK;
+}
+
+
+/*==============================
+    virtualcart_waitrx
+    Emulates waiting on an FT_EVENT_RXCHAR
+    notification
+    @param  The device handle
+    @param  The most time to wait, in milliseconds
+    @return The FTDI status
+==============================*/
+
+FT_STATUS virtualcart_waitrx(FT_HANDLE handle, uint32_t timeout)
+{
+    VirtualCart* cart = (VirtualCart*)handle;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    std::unique_lock<std::mutex> lock(cart->mutex);
+
+    if (!cart->isopen)
+        return FT_INVALID_HANDLE;
+    if (cart->bootpending)
+        virtualcart_boot(cart);
+    while (!cart->woken)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (!cart->outgoing.empty() && cart->outgoing.front().arrival <= now)
+            break;
+        if (now >= deadline)
+            break;
+        if (!cart->outgoing.empty() && cart->outgoing.front().arrival < deadline)
+            cart->cond.wait_until(lock, cart->outgoing.front().arrival);
+        else
+            cart->cond.wait_until(lock, deadline);
+    }
+    cart->woken = false;
+    return FT_OK;
+}
+
+
+/*==============================
+    virtualcart_wakeall
+    Wakes up anything waiting in
+    virtualcart_waitrx
+==============================*/
+
+void virtualcart_wakeall()
+{
+    for (VirtualCart* cart : local_carts)
+    {
+        std::lock_guard<std::mutex> lock(cart->mutex);
+        cart->woken = true;
+        cart->cond.notify_all();
+    }
+}
+
+
+/*==============================
+    virtualcart_resetdevice
+    Emulates FT_ResetDevice
+    @param  The device handle
+    @return The FTDI status
+==============================*/
+
+FT_STATUS virtualcart_resetdevice(FT_HANDLE handle)
+{
+    VirtualCart* cart = (VirtualCart*)handle;
+    std::lock_guard<std::mutex> lock(cart->mutex);
+    if (!cart->isopen)
+        return FT_INVALID_HANDLE;
+    cart->outgoing.clear();
+    cart->flushat = std::chrono::steady_clock::time_point();
+    cart->phase = PHASE_COMMAND;
+    cart->cmdlen = 0;
+    return FT_OK;
+}
+
+
+/*==============================
+    virtualcart_purge
+    Emulates FT_Purge
+    @param  The device handle
+    @param  Which buffers to purge
+    @return The FTDI status
+==============================*/
+
+FT_STATUS virtualcart_purge(FT_HANDLE handle, ULONG mask)
+{
+    VirtualCart* cart = (VirtualCart*)handle;
+    std::lock_guard<std::mutex> lock(cart->mutex);
+    if (!cart->isopen)
+        return FT_INVALID_HANDLE;
+
+    // Data from the host is handed to the cart straight away, so only the receive side has anything to purge
+    if (mask & FT_PURGE_RX)
+    {
+        cart->outgoing.clear();
+        cart->flushat = std::chrono::steady_clock::time_point();
+    }
+    return FT_OK;
+}
+
+
+/*==============================
+    virtualcart_settimeouts
+    Emulates FT_SetTimeouts. Writes never
+    time out on a virtual cart.
+    @param  The device handle
+    @param  The read timeout, in milliseconds
+    @param  The write timeout, in milliseconds
+    @return The FTDI status
+==============================*/
+
+FT_STATUS virtualcart_settimeouts(FT_HANDLE handle, ULONG readtimeout, ULONG writetimeout)
+{
+    VirtualCart* cart = (VirtualCart*)handle;
+    std::lock_guard<std::mutex> lock(cart->mutex);
+    (void)writetimeout; // Ignore unused paramater warning
+    if (!cart->isopen)
+        return FT_INVALID_HANDLE;
+    cart->readtimeout = readtimeout;
+    return FT_OK;
+}
+
+
+/*==============================
+    virtualcart_setbitmode
+    Emulates FT_SetBitMode
+    @param  The device handle
+    @param  The pin mask
+    @param  The bit mode
+    @return The FTDI status
+==============================*/
+
+FT_STATUS virtualcart_setbitmode(FT_HANDLE handle, UCHAR mask, UCHAR mode)
+{
+    VirtualCart* cart = (VirtualCart*)handle;
+    (void)mask; // Ignore unused paramater warnings
+    (void)mode;
+    return cart->isopen ? FT_OK : FT_INVALID_HANDLE;
+}
+
+
+/*==============================
+    virtualcart_setdtr
+    Emulates FT_SetDtr. The SC64 resets
+    itself while DTR is set, and shows
+    it on the DSR line.
+    @param  The device handle
+    @return The FTDI status
+==============================*/
+
+FT_STATUS virtualcart_setdtr(FT_HANDLE handle)
+{
+    VirtualCart* cart = (VirtualCart*)handle;
+    std::lock_guard<std::mutex> lock(cart->mutex);
+    if (!cart->isopen)
+        return FT_INVALID_HANDLE;
+    cart->dtr = true;
+    cart->outgoing.clear();
+    cart->flushat = std::chrono::steady_clock::time_point();
+    cart->phase = PHASE_COMMAND;
+    cart->cmdlen = 0;
+    return FT_OK;
+}
+
+
+/*==============================
+    virtualcart_clrdtr
+    Emulates FT_ClrDtr
+    @param  The device handle
+    @return The FTDI status
+==============================*/
+
+FT_STATUS virtualcart_clrdtr(FT_HANDLE handle)
+{
+    VirtualCart* cart = (VirtualCart*)handle;
+    std::lock_guard<std::mutex> lock(cart->mutex);
+    if (!cart->isopen)
+        return FT_INVALID_HANDLE;
+    cart->dtr = false;
+    return FT_OK;
+}
+
+
+/*==============================
+    virtualcart_getmodemstatus
+    Emulates FT_GetModemStatus
+    @param  The device handle
+    @param  A pointer to store the status in
+    @return The FTDI status
+==============================*/
+
+FT_STATUS virtualcart_getmodemstatus(FT_HANDLE handle, ULONG* status)
+{
+    VirtualCart* cart = (VirtualCart*)handle;
+    std::lock_guard<std::mutex> lock(cart->mutex);
+    if (!cart->isopen)
+        return FT_INVALID_HANDLE;
+    *status = cart->dtr ? MODEM_DSR : 0;
+    return FT_OK;
+}
+
+
+/*==============================
+    virtualcart_setlatencytimer
+    Emulates FT_SetLatencyTimer
+    @param  The device handle
+    @param  The latency, in milliseconds
+    @return The FTDI status
+==============================*/
+
+FT_STATUS virtualcart_setlatencytimer(FT_HANDLE handle, UCHAR latency)
+{
+    VirtualCart* cart = (VirtualCart*)handle;
+    std::lock_guard<std::mutex> lock(cart->mutex);
+    if (!cart->isopen)
+        return FT_INVALID_HANDLE;
+    if (latency < 1)
+        return FT_INVALID_PARAMETER;
+    cart->latencytimer = latency;
+    return FT_OK;
+}
+
+
+/*==============================
+    virtualcart_setusbparameters
+    Emulates FT_SetUSBParameters. Only the
+    IN transfer size matters, as the OUT 
+    one isn't supported by the driver either.
+    @param  The device handle
+    @param  The IN transfer size, in bytes
+    @param  The OUT transfer size, in bytes
+    @return The FTDI status
+==============================*/
+
+FT_STATUS virtualcart_setusbparameters(FT_HANDLE handle, ULONG insize, ULONG outsize)
+{
+    VirtualCart* cart = (VirtualCart*)handle;
+    std::lock_guard<std::mutex> lock(cart->mutex);
+    (void)outsize; // Ignore unused paramater warning
+    if (!cart->isopen)
+        return FT_INVALID_HANDLE;
+    if (insize < 64 || insize > 64*1024 || insize%64 != 0)
+        return FT_INVALID_PARAMETER;
+    cart->transfersize = insize;
+    return FT_OK;
+}
@@ -0,0 +1,37 @@
+#ifndef __VIRTUALCART_HEADER
+#define __VIRTUALCART_HEADER
+
+    #include "device.h"
+    #include "Include/ftd2xx.h"
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    // Setup
+    bool      virtualcart_create(const char* spec);
+    uint32_t  virtualcart_getcount();
+    FT_STATUS virtualcart_consolesend(uint32_t index, USBDataType type, const byte* data, uint32_t size);
+    void      virtualcart_wakeall();
+
+    // Emulated D2XX API
+    FT_STATUS virtualcart_createdeviceinfolist(LPDWORD count);
+    FT_STATUS virtualcart_getdeviceinfolist(FT_DEVICE_LIST_INFO_NODE* dest, LPDWORD count);
+    FT_STATUS virtualcart_open(int index, FT_HANDLE* handle);
+    FT_STATUS virtualcart_close(FT_HANDLE handle);
+    FT_STATUS virtualcart_read(FT_HANDLE handle, LPVOID buffer, DWORD size, LPDWORD bytesread);
+    FT_STATUS virtualcart_write(FT_HANDLE handle, LPVOID buffer, DWORD size, LPDWORD byteswritten);
+    FT_STATUS virtualcart_getqueuestatus(FT_HANDLE handle, DWORD* size);
+    FT_STATUS virtualcart_resetdevice(FT_HANDLE handle);
+    FT_STATUS virtualcart_purge(FT_HANDLE handle, ULONG mask);
+    FT_STATUS virtualcart_settimeouts(FT_HANDLE handle, ULONG readtimeout, ULONG writetimeout);
+    FT_STATUS virtualcart_setbitmode(FT_HANDLE handle, UCHAR mask, UCHAR mode);
+    FT_STATUS virtualcart_setdtr(FT_HANDLE handle);
+    FT_STATUS virtualcart_clrdtr(FT_HANDLE handle);
+    FT_STATUS virtualcart_getmodemstatus(FT_HANDLE handle, ULONG* status);
+    FT_STATUS virtualcart_setlatencytimer(FT_HANDLE handle, UCHAR latency);
+    FT_STATUS virtualcart_setusbparameters(FT_HANDLE handle, ULONG insize, ULONG outsize);
+    FT_STATUS virtualcart_waitrx(FT_HANDLE handle, uint32_t timeout);
+
+#endif
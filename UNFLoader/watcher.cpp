@@ -0,0 +1,374 @@
+/***************************************************************
+                           watcher.cpp
+
+Watches the ROM file for changes in Listen mode. On Linux this
+uses inotify, so a change is noticed as soon as the file is 
+closed after writing. Everywhere else, the file's modification
+time (with sub-second precision) and size are polled. On
+filesystems that only keep whole seconds, the file's contents
+are hashed for a little while after each change too, so a second
+build in the same second isn't missed.
+Changes are debounced, so that a build step which writes the 
+file several times only causes a single reupload.
+***************************************************************/
+
+#include "main.h"
+#include "watcher.h"
+#include "rom.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <string>
+#include <thread>
+#include <chrono>
+#if defined(LINUX) && defined(__linux__)
+    #define WATCHER_INOTIFY
+    #include <sys/inotify.h>
+    #include <poll.h>
+#endif
+
+
+/*********************************
+              Macros
+*********************************/
+
+#define POLL_INTERVAL 100
+#define HASH_WINDOW   2000 // How long to hash the file for after a change, if its timestamps are in whole seconds
+
+
+/*********************************
+            Structures
+*********************************/
+
+typedef struct {
+    uint64_t mtime; // In nanoseconds
+    uint64_t size;
+} FileStamp;
+
+struct FileWatcher {
+    char*     path;
+    char*     filename;
+    uint32_t  debounce;
+    FileStamp stamp;
+    uint64_t  hash;
+    std::chrono::steady_clock::time_point hashuntil;
+
+    // Event driven watching
+    int fd;
+
+    // Debouncing
+    bool pending;
+    std::chrono::steady_clock::time_point lastchange;
+    std::chrono::steady_clock::time_point lastpoll;
+};
+
+
+/*********************************
+        Function Prototypes
+*********************************/
+
+static FileStamp watcher_stamp(const char* path);
+static uint64_t  watcher_hash(const char* path);
+static void      watcher_restamp(FileWatcher* watcher);
+static bool      watcher_poll(FileWatcher* watcher, uint32_t timeout);
+
+
+/*==============================
+    watcher_open
+    Starts watching a file for changes
+    @param  The path of the file to watch
+    @param  How many milliseconds the file must
+            stay untouched before a change is
+            reported
+    @return The file watcher, or NULL if it
+            could not be created
+==============================*/
+
+FileWatcher* watcher_open(const char* path, uint32_t debounce)
+{
+    FileWatcher* watcher = new FileWatcher();
+    const char* slash;
+
+    // Split the path into the directory and filename
+    watcher->path = (char*) malloc(strlen(path)+1);
+    if (watcher->path == NULL)
+    {
+        delete watcher;
+        return NULL;
+    }
+    strcpy(watcher->path, path);
+    slash = strrchr(watcher->path, '/');
+    #ifndef LINUX
+        if (strrchr(watcher->path, '\\') > slash)
+            slash = strrchr(watcher->path, '\\');
+    #endif
+    watcher->filename = watcher->path + (slash != NULL ? (slash - watcher->path) + 1 : 0);
+    watcher->debounce = debounce;
+    watcher->pending = false;
+    watcher->lastpoll = std::chrono::steady_clock::now();
+    watcher->fd = -1;
+
+    // Watch the directory rather than the file, as many linkers replace the file instead of rewriting it
+    #ifdef WATCHER_INOTIFY
+        watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (watcher->fd != -1)
+        {
+            int wd;
+            if (slash == NULL)
+                wd = inotify_add_watch(watcher->fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO);
+            else if (slash == watcher->path)
+                wd = inotify_add_watch(watcher->fd, "/", IN_CLOSE_WRITE | IN_MOVED_TO);
+            else
+            {
+                std::string dir(watcher->path, slash - watcher->path);
+                wd = inotify_add_watch(watcher->fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+            }
+
+            // Fall back to polling if the directory can't be watched
+            if (wd == -1)
+            {
+                close(watcher->fd);
+                watcher->fd = -1;
+            }
+        }
+    #endif
+    watcher_restamp(watcher);
+    return watcher;
+}
+
+
+/*==============================
+    watcher_wait
+    Waits for the file to change. If the
+    time runs out while a change is still
+    settling, the next call carries on
+    from where this one left off.
+    @param  The file watcher
+    @param  The maximum number of milliseconds
+            to wait for
+    @return Whether the file changed and has
+            finished being written to
+==============================*/
+
+bool watcher_wait(FileWatcher* watcher, uint32_t timeout)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (true)
+    {
+        uint32_t elapsed = (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        uint32_t wait = elapsed < timeout ? timeout - elapsed : 0;
+
+        // If a change is pending, only wait until it has settled
+        if (watcher->pending)
+        {
+            uint32_t quiet = (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - watcher->lastchange).count();
+            if (quiet >= watcher->debounce)
+            {
+                watcher->pending = false;
+                watcher_restamp(watcher);
+                return true;
+            }
+            if (watcher->debounce - quiet < wait)
+                wait = watcher->debounce - quiet;
+        }
+
+        // Wait for something to happen
+        if (watcher_poll(watcher, wait))
+        {
+            watcher->pending = true;
+            watcher->lastchange = std::chrono::steady_clock::now();
+        }
+        else if (elapsed >= timeout)
+            return false;
+    }
+}
+
+
+/*==============================
+    watcher_iseventdriven
+    Checks whether the watcher is notified by
+    the OS, rather than polling the file
+    @param  The file watcher
+    @return Whether the watcher is event driven
+==============================*/
+
+bool watcher_iseventdriven(FileWatcher* watcher)
+{
+    return watcher->fd != -1;
+}
+
+
+/*==============================
+    watcher_close
+    Stops watching a file
+    @param The file watcher
+==============================*/
+
+void watcher_close(FileWatcher* watcher)
+{
+    if (watcher == NULL)
+        return;
+    #ifdef WATCHER_INOTIFY
+        if (watcher->fd != -1)
+            close(watcher->fd);
+    #endif
+    free(watcher->path);
+    delete watcher;
+}
+
+
+/*==============================
+    watcher_poll
+    Waits for the file to be written to
+    @param  The file watcher
+    @param  The maximum number of milliseconds
+            to wait for
+    @return Whether the file was written to
+==============================*/
+
+static bool watcher_poll(FileWatcher* watcher, uint32_t timeout)
+{
+    // Let the OS tell us when the file is written to
+    #ifdef WATCHER_INOTIFY
+        if (watcher->fd != -1)
+        {
+            struct pollfd pfd;
+            bool changed = false;
+            char buff[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            pfd.fd = watcher->fd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, timeout) <= 0)
+                return false;
+
+            // Check if any of the events were for our file
+            while (true)
+            {
+                ssize_t len = read(watcher->fd, buff, sizeof(buff));
+                if (len <= 0)
+                    break;
+                for (char* ptr = buff; ptr < buff + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event*)ptr)->len)
+                {
+                    struct inotify_event* event = (struct inotify_event*)ptr;
+                    if (event->len > 0 && !strcmp(event->name, watcher->filename))
+                        changed = true;
+                }
+            }
+            return changed;
+        }
+    #endif
+
+    // Otherwise, check the timestamp and size of the file every POLL_INTERVAL milliseconds
+    std::chrono::steady_clock::time_point nextpoll = watcher->lastpoll + std::chrono::milliseconds(POLL_INTERVAL);
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    if (deadline < nextpoll)
+    {
+        std::this_thread::sleep_until(deadline);
+        return false;
+    }
+    std::this_thread::sleep_until(nextpoll);
+    watcher->lastpoll = std::chrono::steady_clock::now();
+    FileStamp stamp = watcher_stamp(watcher->path);
+    if (stamp.mtime != watcher->stamp.mtime || stamp.size != watcher->stamp.size)
+    {
+        watcher_restamp(watcher);
+        return true;
+    }
+
+    // A write in the same second as the last one doesn't change a whole second timestamp, so look at the contents
+    if (watcher->lastpoll < watcher->hashuntil)
+    {
+        uint64_t hash = watcher_hash(watcher->path);
+        if (hash != watcher->hash)
+        {
+            watcher->hash = hash;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/*==============================
+    watcher_restamp
+    Remembers the file as it is now, so that
+    polling can tell when it changes. If its
+    timestamp is in whole seconds, its
+    contents are hashed as well.
+    @param  The file watcher
+==============================*/
+
+static void watcher_restamp(FileWatcher* watcher)
+{
+    watcher->stamp = watcher_stamp(watcher->path);
+    watcher->hashuntil = std::chrono::steady_clock::now();
+    if (watcher->fd == -1 && watcher->stamp.mtime%1000000000 == 0)
+    {
+        watcher->hash = watcher_hash(watcher->path);
+        watcher->hashuntil += std::chrono::milliseconds(HASH_WINDOW);
+    }
+}
+
+
+/*==============================
+    watcher_hash
+    Hashes the contents of a file
+    @param  The path of the file
+    @return The hash, or 0 if the file
+            couldn't be read
+==============================*/
+
+static uint64_t watcher_hash(const char* path)
+{
+    uint64_t hash = 0;
+    size_t size;
+    byte* buff;
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL)
+        return 0;
+    buff = (byte*) malloc(ROM_HASHBLOCK_SIZE);
+    if (buff == NULL)
+    {
+        fclose(fp);
+        return 0;
+    }
+    while ((size = fread(buff, 1, ROM_HASHBLOCK_SIZE, fp)) > 0)
+        hash = ((hash << 29) | (hash >> 35)) ^ romimage_hashblock(buff, (uint32_t)size);
+    free(buff);
+    fclose(fp);
+    return hash;
+}
+
+
+/*==============================
+    watcher_stamp
+    Gets the modification time and size of
+    a file, to tell if it changed
+    @param  The path of the file
+    @return The file's stamp
+==============================*/
+
+static FileStamp watcher_stamp(const char* path)
+{
+    FileStamp stamp = {0, 0};
+    #ifndef LINUX
+        // Stat is broken on WinXP: https://stackoverflow.com/questions/32452777/visual-c-2015-express-stat-not-working-on-windows-xp
+        WIN32_FILE_ATTRIBUTE_DATA fdata;
+        if (GetFileAttributesExA(path, GetFileExInfoStandard, &fdata))
+        {
+            stamp.mtime = ((((uint64_t)fdata.ftLastWriteTime.dwHighDateTime) << 32) | fdata.ftLastWriteTime.dwLowDateTime)*100;
+            stamp.size = (((uint64_t)fdata.nFileSizeHigh) << 32) | fdata.nFileSizeLow;
+        }
+    #else
+        struct stat finfo;
+        if (stat(path, &finfo) == 0)
+        {
+            #ifdef __APPLE__
+                stamp.mtime = ((uint64_t)finfo.st_mtimespec.tv_sec)*1000000000 + finfo.st_mtimespec.tv_nsec;
+            #else
+                stamp.mtime = ((uint64_t)finfo.st_mtim.tv_sec)*1000000000 + finfo.st_mtim.tv_nsec;
+            #endif
+            stamp.size = finfo.st_size;
+        }
+    #endif
+    return stamp;
+}
@@ -0,0 +1,31 @@
+#ifndef __WATCHER_HEADER
+#define __WATCHER_HEADER
+
+    #include <stdint.h>
+    #include <stdbool.h>
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    #define DEFAULT_DEBOUNCE 50
+
+
+    /*********************************
+                 Typedefs
+    *********************************/
+
+    typedef struct FileWatcher FileWatcher;
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    FileWatcher* watcher_open(const char* path, uint32_t debounce);
+    bool         watcher_wait(FileWatcher* watcher, uint32_t timeout);
+    bool         watcher_iseventdriven(FileWatcher* watcher);
+    void         watcher_close(FileWatcher* watcher);
+
+#endif
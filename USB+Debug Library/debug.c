@@ -147,6 +147,7 @@ https://github.com/buu342/N64-UNFLoader
     static int   debug_command_totaltokens = 0;
     static int   debug_command_incoming_start[COMMAND_TOKENS];
     static int   debug_command_incoming_size[COMMAND_TOKENS];
+    static int   debug_command_streamed = -1; // Bytes read so far of the part being streamed, or -1
     static char* debug_command_error = NULL;
     
     // Assertion globals
@@ -682,6 +683,51 @@ https://github.com/buu342/N64-UNFLoader
     }
     
     
+    /*==============================
+        debug_streamcommand
+        Reads the next part of the incoming command a piece at a time.
+        Use it for parts too big to hold in memory, like large files, 
+        which the PC sends in fragments. Parts after a streamed one 
+        can't be read if it spanned several fragments.
+        @param The buffer to store the data in
+        @param The size of the buffer
+        @return The number of bytes read, or 0 once the part is done
+    ==============================*/
+    
+    int debug_streamcommand(void* buffer, int size)
+    {
+        int read;
+        u8 curr = debug_command_current;
+        
+        // If we're out of commands to read, do nothing
+        if (curr == debug_command_totaltokens)
+            return 0;
+        
+        // Go to the start of this part the first time we read from it
+        if (debug_command_streamed == -1)
+        {
+            usb_skip(debug_command_incoming_start[curr]);
+            debug_command_streamed = 0;
+        }
+        
+        // Read as much as we can, crossing over into the next fragment if needed
+        if (size > debug_command_incoming_size[curr])
+            size = debug_command_incoming_size[curr];
+        read = usb_streamread(buffer, size);
+        debug_command_streamed += read;
+        debug_command_incoming_size[curr] -= read;
+        
+        // Once the part is done (or the transfer stopped), rewind for the next part and move onto it
+        if (debug_command_incoming_size[curr] == 0 || read < size)
+        {
+            usb_rewind(debug_command_streamed+debug_command_incoming_start[curr]);
+            debug_command_streamed = -1;
+            debug_command_current++;
+        }
+        return read;
+    }
+    
+    
     /*==============================
         debug_commands_setup
         Reads the entire incoming string and breaks it into parts for 
@@ -820,6 +866,7 @@ https://github.com/buu342/N64-UNFLoader
                 // Initialize the command trackers
                 debug_command_totaltokens = 0;
                 debug_command_current = 0;
+                debug_command_streamed = -1;
                     
                 // Break the USB command into parts
                 debug_commands_setup();
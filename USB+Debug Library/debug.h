@@ -130,6 +130,20 @@
         extern int debug_sizecommand();
         
         
+        /*==============================
+            debug_streamcommand
+            Reads the next part of the incoming command a piece at a time,
+            for parts too big to hold in memory, such as large files.
+            Call it until it returns 0. Parts after a streamed one can't 
+            be read if it spanned several USB fragments.
+            @param The buffer to store the data in
+            @param The size of the buffer
+            @return The number of bytes read, or 0 once the part is done
+        ==============================*/
+        
+        extern int debug_streamcommand(void* buffer, int size);
+        
+        
         /*==============================
             debug_printcommands
             Prints a list of commands to the developer's command prompt.
@@ -155,6 +169,7 @@
         #define debug_addcommand(a, b, c)
         #define debug_parsecommand(a) NULL
         #define debug_sizecommand() 0
+        #define debug_streamcommand(a, b) 0
         #define debug_printcommands()
         #define debug_64drivebutton(a, b)
         #define usb_initialize() 0
@@ -165,6 +180,8 @@
         #define usb_skip(a)
         #define usb_rewind(a)
         #define usb_purge()
+        #define usb_streamleft() 0
+        #define usb_streamread(a, b) 0
         
     #endif
     
@@ -30,7 +30,12 @@ https://github.com/buu342/N64-UNFLoader
 
 // Protocol related
 #define USBPROTOCOL_VERSION 2
-#define HEARTBEAT_VERSION   1
+#define HEARTBEAT_VERSION   2
+
+// Fragmented transfers
+#define FRAGMENT_HEADER_SIZE 16         // Datatype, total size, offset and transfer ID, before the fragment's data
+#define FRAGMENT_CANCEL      0xFFFFFFFF // Sent by either side instead of an offset to stop the rest of a transfer
+#define FRAGMENT_TIMEOUT     5000       // How long usb_streamread waits for the next fragment
 
 
 /*********************************
@@ -213,6 +218,8 @@ https://github.com/buu342/N64-UNFLoader
 *********************************/
 
 static void usb_findcart(void);
+static void usb_fragment_begin(void);
+static void usb_fragment_done(char cancel);
 
 static void usb_64drive_write(int datatype, const void* data, int size);
 static u32  usb_64drive_poll(void);
@@ -245,6 +252,10 @@ static int usb_datatype = 0;
 static int usb_datasize = 0;
 static int usb_dataleft = 0;
 static int usb_readblock = -1;
+static int usb_fragheader = 0;   // Bytes of fragment header at the start of the current data, or 0
+static u32 usb_streamsize = 0;   // Total size of the fragmented transfer in progress, or 0
+static u32 usb_streampos = 0;    // Offset in the transfer where the current fragment ends
+static u32 usb_streamid = 0;     // ID the PC gave the transfer, which goes back with every reply
 
 #ifndef LIBDRAGON
     // Message globals
@@ -599,6 +610,8 @@ u32 usb_poll(void)
         usb_datatype = 0;
         usb_datasize = 0;
         usb_readblock = -1;
+        if (usb_fragheader != 0)
+            usb_fragment_done(FALSE);
     }
         
     // If there's still data that needs to be read, return the header with the data left
@@ -606,7 +619,17 @@ u32 usb_poll(void)
         return USBHEADER_CREATE(usb_datatype, usb_dataleft);
         
     // Call the correct read function
-    return funcPointer_poll();
+    if (funcPointer_poll() == 0)
+        return 0;
+    
+    // Fragments of a large transfer are handed out as data of the original type
+    if (usb_datatype == DATATYPE_FRAGMENT)
+        usb_fragment_begin();
+    else
+        usb_streamsize = 0;
+    if (usb_dataleft == 0)
+        return 0;
+    return USBHEADER_CREATE(usb_datatype, usb_dataleft);
 }
 
 
@@ -687,10 +710,10 @@ void usb_skip(int nbytes)
 
 void usb_rewind(int nbytes)
 {
-    // Add the amount of bytes to rewind to the data pointers
+    // Add the amount of bytes to rewind to the data pointers, without going back into a fragment header
     usb_dataleft += nbytes;
-    if (usb_dataleft > usb_datasize)
-        usb_dataleft = usb_datasize;
+    if (usb_dataleft > usb_datasize-usb_fragheader)
+        usb_dataleft = usb_datasize-usb_fragheader;
 }
 
 
@@ -705,6 +728,156 @@ void usb_purge(void)
     usb_datatype = 0;
     usb_datasize = 0;
     usb_readblock = -1;
+    if (usb_streamsize != 0)
+        usb_fragment_done(TRUE);
+}
+
+
+/*==============================
+    usb_streamleft
+    Returns how many bytes are left to read from the
+    incoming data, including fragments yet to arrive
+    @return The number of bytes left in the transfer
+==============================*/
+
+u32 usb_streamleft(void)
+{
+    if (usb_streamsize == 0)
+        return usb_dataleft;
+    return (usb_streamsize-usb_streampos) + usb_dataleft;
+}
+
+
+/*==============================
+    usb_streamread
+    Reads bytes from USB into the provided buffer, moving on
+    to the next fragment of a fragmented transfer as needed
+    @param The buffer to put the read data in
+    @param The number of bytes to read
+    @return The number of bytes read
+==============================*/
+
+int usb_streamread(void* buffer, int nbytes)
+{
+    int read = 0;
+    
+    while (read < nbytes)
+    {
+        int block = nbytes-read;
+        
+        // Once this fragment is used up, wait for the next one
+        if (usb_dataleft == 0)
+        {
+            u32 timeout = usb_timeout_start();
+            if (usb_streamsize == 0 || usb_streampos >= usb_streamsize)
+                break;
+            while (usb_poll() == 0)
+            {
+                if (usb_streamsize == 0) // The PC cancelled the transfer
+                    return read;
+                if (usb_timeout_check(timeout, FRAGMENT_TIMEOUT))
+                {
+                    usb_didtimeout = TRUE;
+                    return read;
+                }
+            }
+            if (usb_fragheader == 0)
+                break;
+        }
+        
+        // Read as much as we can from this fragment
+        if (block > usb_dataleft)
+            block = usb_dataleft;
+        usb_read((u8*)buffer+read, block);
+        read += block;
+    }
+    return read;
+}
+
+
+/*==============================
+    usb_fragment_begin
+    Reads the header of an incoming fragment, and sets up
+    the data pointers so that the rest of the library sees
+    the fragment's data as regular data of its original type
+==============================*/
+
+static void usb_fragment_begin(void)
+{
+    u32 header[FRAGMENT_HEADER_SIZE/4];
+    u32 size;
+    
+    // Malformed fragments are thrown away
+    if (usb_datasize < FRAGMENT_HEADER_SIZE)
+    {
+        usb_purge();
+        return;
+    }
+    usb_read(header, FRAGMENT_HEADER_SIZE);
+    
+    // If the PC cancelled the transfer we're reading, stop waiting for the rest
+    if (header[2] == FRAGMENT_CANCEL && usb_streamsize != 0 && header[3] == usb_streamid)
+    {
+        usb_streamsize = 0;
+        usb_streampos = 0;
+    }
+    
+    // If this isn't the start of a transfer, it's a cancel or belongs to one that was cancelled
+    if (header[2] != 0 && (usb_streamsize == 0 || header[3] != usb_streamid))
+    {
+        usb_dataleft = 0;
+        usb_datatype = 0;
+        usb_datasize = 0;
+        usb_readblock = -1;
+        return;
+    }
+    
+    // Work out how much of this fragment is data, as the 64Drive can leave padding at the end
+    size = usb_datasize-FRAGMENT_HEADER_SIZE;
+    if (header[2] > header[1])
+        size = 0;
+    else if (size > header[1]-header[2])
+        size = header[1]-header[2];
+    
+    // Set up the data pointers
+    usb_fragheader = FRAGMENT_HEADER_SIZE;
+    usb_datatype = header[0];
+    usb_datasize = FRAGMENT_HEADER_SIZE + size;
+    usb_dataleft = size;
+    usb_streamsize = header[1];
+    usb_streampos = header[2] + size;
+    usb_streamid = header[3];
+}
+
+
+/*==============================
+    usb_fragment_done
+    Tells the PC that the current fragment has been read, 
+    so that it can send the next one
+    @param Whether to cancel the rest of the transfer instead
+==============================*/
+
+static void usb_fragment_done(char cancel)
+{
+    u32 reply[2];
+    reply[0] = usb_streamid;
+    reply[1] = usb_streampos;
+    
+    // The PC doesn't wait on the last fragment, so there's nothing to tell it
+    usb_fragheader = 0;
+    if (usb_streampos >= usb_streamsize)
+    {
+        usb_streamsize = 0;
+        usb_streampos = 0;
+        return;
+    }
+    if (cancel)
+    {
+        reply[1] = FRAGMENT_CANCEL;
+        usb_streamsize = 0;
+        usb_streampos = 0;
+    }
+    funcPointer_write(DATATYPE_FRAGMENT, reply, sizeof(reply));
 }
 
 
@@ -731,7 +904,7 @@ char usb_timedout()
 
 void usb_sendheartbeat()
 {
-    u8 buffer[4];
+    u8 buffer[8];
 
     // First two bytes describe the USB library protocol version
     buffer[0] = (u8)(((USBPROTOCOL_VERSION)>>8)&0xFF);
@@ -740,6 +913,12 @@ void usb_sendheartbeat()
     // Next two bytes describe the heartbeat packet version
     buffer[2] = (u8)(((HEARTBEAT_VERSION)>>8)&0xFF);
     buffer[3] = (u8)(((HEARTBEAT_VERSION))&0xFF);
+    
+    // Last four bytes say how much data fits in the debug area, so bigger transfers get fragmented
+    buffer[4] = (u8)(((DEBUG_ADDRESS_SIZE)>>24)&0xFF);
+    buffer[5] = (u8)(((DEBUG_ADDRESS_SIZE)>>16)&0xFF);
+    buffer[6] = (u8)(((DEBUG_ADDRESS_SIZE)>>8)&0xFF);
+    buffer[7] = (u8)(((DEBUG_ADDRESS_SIZE))&0xFF);
 
     // Send through USB
     usb_write(DATATYPE_HEARTBEAT, buffer, sizeof(buffer)/sizeof(buffer[0]));
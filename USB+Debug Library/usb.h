@@ -13,6 +13,13 @@
     #define DEBUG_ADDRESS_SIZE 8*1024*1024 // Max size of USB I/O. The bigger this value, the more ROM you lose!
     #define CHECK_EMULATOR     0           // Stops the USB library from working if it detects an emulator to prevent problems
     
+    // For the u32 type
+    #ifndef LIBDRAGON
+        #include <ultra64.h>
+    #else
+        #include <libdragon.h>
+    #endif
+    
     // Cart definitions
     #define CART_NONE      0
     #define CART_64DRIVE   1
@@ -25,6 +32,7 @@
     #define DATATYPE_HEADER     0x03
     #define DATATYPE_SCREENSHOT 0x04
     #define DATATYPE_HEARTBEAT  0x05
+    #define DATATYPE_FRAGMENT   0x06
     
     
     /*********************************
@@ -111,9 +119,39 @@
     /*==============================
         usb_purge
         Purges the incoming USB data
+        If the data is part of a fragmented transfer,
+        the rest of the transfer is cancelled
     ==============================*/
     
     extern void usb_purge();
+    
+    
+    /*==============================
+        usb_streamleft
+        Returns how many bytes are left to read from the
+        incoming data. If the data is too big to fit in
+        DEBUG_ADDRESS_SIZE, the PC sends it in fragments, 
+        and this counts the fragments yet to arrive as well
+        @return The number of bytes left in the transfer
+    ==============================*/
+    
+    extern u32 usb_streamleft(void);
+    
+    
+    /*==============================
+        usb_streamread
+        Reads bytes from USB into the provided buffer, moving on
+        to the next fragment of a fragmented transfer once the
+        current one has been read. Waits for the next fragment
+        to arrive if needed, up to a timeout
+        @param The buffer to put the read data in
+        @param The number of bytes to read
+        @return The number of bytes read, which is less than
+                requested if the transfer ended, timed out, or
+                was cancelled by the PC
+    ==============================*/
+    
+    extern int usb_streamread(void* buffer, int size);
 
 
     /*==============================